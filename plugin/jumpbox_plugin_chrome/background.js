@@ -81,16 +81,33 @@ JumpBox = {
     jb_server           : 'http://127.0.0.1',
     jb_port             : 6543,
     jb_next_path        : '/next/',
+    jb_push_path        : '/push/',
+    jb_ws_path          : '/ws/',
     jb_preferences_path : '/preferences/',
     jb_host             : '',
     jb_next_url         : '',
+    jb_push_url         : '',
+    jb_ws_url           : '',
     jb_preferences_url  : '',
+    jb_native_host      : 'org.jumpbox.djb',
     jb_ext_id           : chrome.i18n.getMessage("@@extension_id"),
+    native_enabled      : false,
+    native_port         : null,
+    native_circuits     : {},
     circuit_count	: 1,
     circuit_count_running : 0,
     circuit_page	: 'circuit.html',
     popup		: null,
 
+    /* Where djb is, from jb_server and jb_port */
+    set_urls : function () {
+        JumpBox.jb_host = JumpBox.jb_server + ':' + JumpBox.jb_port;
+        JumpBox.jb_next_url = JumpBox.jb_host + JumpBox.jb_next_path;
+        JumpBox.jb_push_url = JumpBox.jb_host + JumpBox.jb_push_path;
+        JumpBox.jb_ws_url = JumpBox.jb_host.replace(/^http/, 'ws') + JumpBox.jb_ws_path;
+        JumpBox.jb_preferences_url = JumpBox.jb_host + JumpBox.jb_preferences_path;
+    },
+
     init : function () {
         var port, debug_mode, ccs, cc = 1;
 
@@ -119,9 +136,10 @@ JumpBox = {
 
         Debug.log("circuit_count: " + JumpBox.circuit_count); 
 
-        JumpBox.jb_host = JumpBox.jb_server + ':' + JumpBox.jb_port;
-        JumpBox.jb_next_url = JumpBox.jb_host + JumpBox.jb_next_path;
-        JumpBox.jb_preferences_url = JumpBox.jb_host + JumpBox.jb_preferences_path;
+        JumpBox.native_enabled = (localStorage.plugin_native_messaging === 'true');
+        Debug.log("native_enabled: " + JumpBox.native_enabled);
+
+        JumpBox.set_urls();
 
         Debug.log('JumpBox::init next: ' + JumpBox.jb_next_url);
 
@@ -229,6 +247,99 @@ JumpBox = {
         chrome.tabs.create({ url : page });
     },
 
+    /*
+     * Native messaging: Chrome starts djb itself and all circuits share
+     * that one port, their messages carry the circuit (see nm.c in djb).
+     * Returns false when not enabled; otherwise the circuit hears back
+     * through onmessage, or onclose(opened) when the port goes away.
+     */
+    native_open: function (circuit_id, window_size, onmessage, onclose) {
+        var port;
+
+        if (!JumpBox.native_enabled || !chrome.runtime.connectNative) {
+            return false;
+        }
+
+        if (JumpBox.native_port === null) {
+            Debug.log('native: connecting to ' + JumpBox.jb_native_host);
+
+            port = chrome.runtime.connectNative(JumpBox.jb_native_host);
+            port.onMessage.addListener(JumpBox.native_message);
+            port.onDisconnect.addListener(function () {
+                var circuits = JumpBox.native_circuits, id;
+
+                Debug.log('native: disconnected ' +
+                          (chrome.runtime.lastError ? chrome.runtime.lastError.message : ''));
+
+                JumpBox.native_port = null;
+                JumpBox.native_circuits = {};
+
+                for (id in circuits) {
+                    circuits[id].onclose(circuits[id].opened);
+                }
+            });
+
+            JumpBox.native_port = port;
+        }
+
+        JumpBox.native_circuits[circuit_id] = {
+            onmessage : onmessage,
+            onclose   : onclose,
+            opened    : false
+        };
+
+        JumpBox.native_port.postMessage({ type : 'open', circuit : circuit_id, window : window_size });
+
+        return true;
+    },
+
+    native_message: function (msg) {
+        var circuit = JumpBox.native_circuits[msg.circuit], sep;
+
+        /* djb tells where it listens (DJB_LISTEN), use that from now on */
+        if (msg.type === 'hello') {
+            sep = msg.address.lastIndexOf(':');
+            if (sep > 0) {
+                JumpBox.jb_server = 'http://' + msg.address.substring(0, sep);
+                JumpBox.jb_port = msg.address.substring(sep + 1);
+                localStorage.jumpbox_port = JumpBox.jb_port;
+                JumpBox.set_urls();
+                Debug.log('native: djb at ' + JumpBox.jb_host);
+            }
+            return;
+        }
+
+        if (!circuit) {
+            Debug.log('native: message for unknown circuit ' + msg.circuit);
+            return;
+        }
+
+        if (msg.type === 'opened') {
+            circuit.opened = true;
+            return;
+        }
+
+        circuit.onmessage(msg);
+    },
+
+    native_post: function (msg) {
+        if (JumpBox.native_port === null) {
+            return false;
+        }
+
+        JumpBox.native_port.postMessage(msg);
+        return true;
+    },
+
+    native_close: function (circuit_id) {
+        if (!JumpBox.native_circuits[circuit_id]) {
+            return;
+        }
+
+        delete JumpBox.native_circuits[circuit_id];
+        JumpBox.native_post({ type : 'close', circuit : circuit_id });
+    },
+
 }; /* JumpBox */
 
 Headers = {
@@ -16,6 +16,24 @@ Circuit = {
     id_node: null,
 
     jb_next_url: null,
+    jb_push_url: null,
+    jb_ws_url: null,
+
+    /* The WebSocket channel, null when using pull/push */
+    ws: null,
+    ws_window: 4,
+    ws_unavailable: false,
+
+    /* Native messaging (see JumpBox.native_open), preferred when enabled */
+    native: false,
+    native_unavailable: false,
+
+    /* Answers still to come for the current batch */
+    batch_outstanding: 0,
+
+    /* Answers waiting for the batched push in flight to complete */
+    push_pending: [],
+    push_inflight: false,
 
     cnt_requests_in: 0,
     cnt_requests_out: 0,
@@ -38,9 +56,18 @@ Circuit = {
 
 	/* Set up the URLs */
         Circuit.jb_next_url = Circuit.bkg.JumpBox.jb_next_url;
+        Circuit.jb_push_url = Circuit.bkg.JumpBox.jb_push_url;
+        Circuit.jb_ws_url = Circuit.bkg.JumpBox.jb_ws_url;
 
-	/* First 'next' query */
-        Circuitous.jb_next(Circuit.id);
+	/* Let djb know when this circuit goes away */
+        window.addEventListener('unload', function () {
+            if (Circuit.native) {
+                Circuit.bkg.JumpBox.native_close(parseInt(Circuit.id, 10));
+            }
+        });
+
+	/* A channel when djb has one, otherwise the first 'next' query */
+        Circuitous.start(Circuit.id);
     },
     
     log: function (msg) {
@@ -58,6 +85,12 @@ Circuit = {
         }
     },
 
+    next_url: function (circuit_id) {
+        var d = new Date();
+
+        return Circuit.jb_next_url + circuit_id + '/' + Circuit.cnt_requests_out + '/' + d.getTime();
+    },
+
     getLen: function (txt) {
 	if (txt !== null && typeof txt === 'string') {
 	   len = parseInt(txt, 10);
@@ -96,7 +129,7 @@ Circuit = {
 	w = 2000 + ((Circuit.cnt_restarts % 10) * 1000);
 
 	Circuit.log('Restart: Restarting connection, but first waiting ' + w + ' milliseconds');
-	window.setTimeout(function() { Circuitous.jb_next(circuit_id); }, w);
+	window.setTimeout(function() { Circuitous.start(circuit_id); }, w);
     },
     
     parseQueryParams: function (qs) {
@@ -113,19 +146,173 @@ Circuit = {
 };
 
 Circuitous = {
+    start : function (circuit_id) {
+        if (!Circuit.native_unavailable && Circuitous.native_open(circuit_id)) {
+            return;
+        }
+
+        if (Circuit.ws_unavailable || typeof WebSocket === 'undefined') {
+            Circuitous.jb_next(circuit_id);
+        } else {
+            Circuitous.ws_open(circuit_id);
+        }
+    },
+
+    /*
+     * The WebSocket channel (/ws/<circuit>/<window>/): requests come in
+     * as messages and their answers go back the same way, see ws.c in
+     * djb for the message format. When djb does not take it, we stick
+     * to pull/push.
+     */
+    ws_open : function (circuit_id) {
+        var ws, opened = false;
+
+        Circuit.log('ws_open(' + circuit_id + ')');
+
+        ws = new WebSocket(Circuit.jb_ws_url + circuit_id + '/' + Circuit.ws_window + '/');
+        ws.binaryType = 'arraybuffer';
+
+        ws.onopen = function () {
+            opened = true;
+            Circuit.ws = ws;
+            Circuit.log('ws: open');
+        };
+
+        ws.onmessage = function (ev) {
+            Circuitous.handle_ws_message(ws, ev.data, circuit_id);
+        };
+
+        /* An error is always followed by a close */
+        ws.onclose = function (ev) {
+            Circuit.ws = null;
+
+            if (!opened) {
+                Circuit.log('ws: not available (' + ev.code + '), using pull/push');
+                Circuit.ws_unavailable = true;
+                Circuitous.jb_next(circuit_id);
+                return;
+            }
+
+            /* djb requeues what was outstanding on it */
+            Circuit.log('ws: closed (' + ev.code + ')');
+            Circuit.Restart(circuit_id);
+        };
+    },
+
+    /*
+     * The native messaging channel: like the WebSocket one, but over
+     * the port of the background page, with the messages as JSON (the
+     * parts and records of batched pulls and pushes)
+     */
+    native_open : function (circuit_id) {
+        var id = parseInt(circuit_id, 10), ok;
+
+        ok = Circuit.bkg.JumpBox.native_open(id, Circuit.ws_window,
+            function (msg) {
+                Circuitous.handle_native_message(id, msg);
+            },
+            function (opened) {
+                Circuit.native = false;
+
+                if (!opened) {
+                    Circuit.log('native: not available, trying the others');
+                    Circuit.native_unavailable = true;
+                    Circuitous.start(circuit_id);
+                    return;
+                }
+
+                /* djb requeues what was outstanding on it */
+                Circuit.log('native: closed');
+                Circuit.Restart(circuit_id);
+            });
+
+        if (ok) {
+            Circuit.log('native_open(' + id + ')');
+            Circuit.native = true;
+        }
+
+        return ok;
+    },
+
+    handle_native_message : function (id, msg) {
+        var ss_push_contents, ss_push_request;
+
+        if (msg.type !== 'request') {
+            Circuit.log('native: unexpected message type ' + msg.type);
+            return;
+        }
+
+        ss_push_request = new XMLHttpRequest();
+        ss_push_request.onreadystatechange = function () {
+            if (ss_push_request.readyState === 4) {
+                Circuit.log('nsr: status: ' + ss_push_request.status + ' ' + ss_push_request.statusText);
+                Translator.ss_response2record(ss_push_request, function (record) {
+                    /* Gone meanwhile? Then djb sends it again elsewhere */
+                    if (!Circuit.native) {
+                        return;
+                    }
+
+                    record.type = 'response';
+                    record.circuit = id;
+                    if (Circuit.bkg.JumpBox.native_post(record)) {
+                        Circuit.addRequestOut();
+                    }
+                });
+            }
+        };
+
+        ss_push_contents = Translator.jb_part2request(msg, ss_push_request);
+        ss_push_request.send(ss_push_contents);
+
+        Circuit.addRequestIn();
+    },
+
+    handle_ws_message : function (ws, data, circuit_id) {
+        var msg, ss_push_contents, ss_push_request;
+
+        try {
+            msg = Translator.ws_decode(data);
+        } catch (e) {
+            Circuit.log('ws: malformed message: ' + e);
+            return;
+        }
+
+        if (msg.type !== Translator.ws.REQUEST) {
+            Circuit.log('ws: unexpected message type ' + msg.type);
+            return;
+        }
+
+        ss_push_request = new XMLHttpRequest();
+        ss_push_request.onreadystatechange = function () {
+            if (ss_push_request.readyState === 4) {
+                Circuit.log('wssr: status: ' + ss_push_request.status + ' ' + ss_push_request.statusText);
+                Translator.ss_response2ws(ss_push_request, function (out) {
+                    /* Gone meanwhile? Then djb sends it again elsewhere */
+                    if (ws.readyState === WebSocket.OPEN) {
+                        ws.send(out);
+                        Circuit.addRequestOut();
+                    }
+                });
+            }
+        };
+
+        ss_push_contents = Translator.ws_msg2request(msg, ss_push_request);
+        ss_push_request.send(ss_push_contents);
+
+        Circuit.addRequestIn();
+    },
+
     /* This is the 'initial' /next/ request, thus no content is sent */
     jb_next : function (circuit_id) {
-	var d;
         var jb_next_request;
 
         Circuit.log('jb_next(' + circuit_id + ')');
         
         chrome.browsingData.removeCache({});
 
-	d = new Date();
 	jb_next_request = new XMLHttpRequest();
         jb_next_request.onreadystatechange = function () { Circuitous.handle_jb_next_response(jb_next_request, circuit_id); };
-        jb_next_request.open('POST', Circuit.jb_next_url + circuit_id + '/' + Circuit.cnt_requests_out + '/' + d.getTime());
+        jb_next_request.open('POST', Circuit.next_url(circuit_id));
 
         /* if we get an image we better be ready for it */
         jb_next_request.responseType = 'blob'
@@ -139,7 +326,15 @@ Circuitous = {
 
         if (request.readyState === 4) {
             if (request.status === 200) {
-                var ss_push_contents = null, ss_push_request = new XMLHttpRequest();
+                var ss_push_contents = null, ss_push_request;
+
+                /* Several requests in one go? */
+                if (request.getResponseHeader('DJB-Batch') !== null) {
+                    Circuitous.handle_jb_batch(request, circuit_id);
+                    return;
+                }
+
+                ss_push_request = new XMLHttpRequest();
 
                 Circuit.log('jbnr: ' + request.status + ', sending ss_request');
 
@@ -149,15 +344,103 @@ Circuitous = {
                 ss_push_request.send(ss_push_contents);
 
                 Circuit.addRequestIn();
+            } else if (request.status === 0) {
+                Circuit.log('jbnr: request failed');
+                Circuit.Restart(circuit_id);
             } else {
-                if (request.status === 0) {
-			Circuit.log('jbnr: request failed');
-			Circuit.Restart(circuit_id);
-		}
+                /* Nothing came in time (408) or djb complained, ask again */
+                Circuit.log('jbnr: ' + request.status + ' ' + request.statusText + ', next');
+                Circuitous.jb_next(circuit_id);
             }
         }
     },
 
+    /*
+     * A batched pull (DJB-Batch): a JSON array of requests, which are
+     * all sent at once; the answers are pushed back as they come in,
+     * the last one goes through /next/ to fetch the next batch
+     */
+    handle_jb_batch : function (request, circuit_id) {
+        var reader = new FileReader();
+
+        reader.onload = function () {
+            var parts, index;
+
+            try {
+                parts = JSON.parse(reader.result);
+            } catch (e) {
+                Circuit.log('jbb: malformed batch: ' + e);
+                Circuit.Restart(circuit_id);
+                return;
+            }
+
+            Circuit.log('jbb: batch of ' + parts.length + ' requests');
+
+            if (parts.length === 0) {
+                Circuitous.jb_next(circuit_id);
+                return;
+            }
+
+            Circuit.batch_outstanding = parts.length;
+
+            for (index = 0; index < parts.length; index++) {
+                Circuitous.ss_push_part(parts[index], circuit_id);
+            }
+        };
+
+        reader.readAsText(request.response);
+    },
+
+    ss_push_part : function (part, circuit_id) {
+        var ss_push_contents = null, ss_push_request = new XMLHttpRequest();
+
+        ss_push_request.onreadystatechange = function () { Circuitous.handle_ss_push_response(ss_push_request, circuit_id); };
+        ss_push_contents = Translator.jb_part2request(part, ss_push_request);
+        ss_push_request.send(ss_push_contents);
+
+        Circuit.addRequestIn();
+    },
+
+    /*
+     * Queue an answer for a batched push (DJB-Batch); answers that come
+     * in while a push is in flight are sent together once it completes
+     */
+    push_record : function (record) {
+        Circuit.push_pending.push(record);
+        Circuitous.push_flush();
+    },
+
+    push_flush : function () {
+        var records, jb_push_request;
+
+        if (Circuit.push_inflight || Circuit.push_pending.length === 0) {
+            return;
+        }
+
+        records = Circuit.push_pending;
+        Circuit.push_pending = [];
+        Circuit.push_inflight = true;
+
+        jb_push_request = new XMLHttpRequest();
+        jb_push_request.onreadystatechange = function () { Circuitous.handle_jb_push_response(jb_push_request); };
+        jb_push_request.open('POST', Circuit.jb_push_url);
+        jb_push_request.setRequestHeader('DJB-Batch', records.length);
+        jb_push_request.setRequestHeader('Content-Type', 'application/json');
+        jb_push_request.send(JSON.stringify(records));
+
+        Circuit.addRequestOut();
+    },
+
+    handle_jb_push_response : function (request) {
+        if (request.readyState === 4) {
+            /* One status per record, in order */
+            Circuit.log('jbpr: status: ' + request.status + ' ' + request.statusText + ' ' + request.responseText);
+
+            Circuit.push_inflight = false;
+            Circuitous.push_flush();
+        }
+    },
+
     handle_ss_push_response : function (request, circuit_id) {
         Circuit.log('sspr: state = ' + request.readyState);
 
@@ -166,9 +449,18 @@ Circuitous = {
 
             Circuit.log('sspr: status: ' + request.status + ' ' + request.statusText);
 
+            /* More answers of this batch to come? Then only push this one */
+            if (Circuit.batch_outstanding > 1) {
+                Circuit.batch_outstanding--;
+                Translator.ss_response2record(request, Circuitous.push_record);
+                return;
+            }
+
+            Circuit.batch_outstanding = 0;
+
             // use the server's response in the request to build the jb_next_request, forwarding the error code too
             jb_next_request.onreadystatechange = function () { Circuitous.handle_jb_next_response(jb_next_request, circuit_id); };
-            jb_next_contents = Translator.ss_response2request(request, jb_next_request, circuit_id);
+            jb_next_contents = Translator.ss_response2request(request, jb_next_request, Circuit.next_url(circuit_id));
             jb_next_request.seqno = request.seqno;
             jb_next_request.send(jb_next_contents);
 
@@ -179,6 +471,167 @@ Circuitous = {
 
 
 Translator = {
+
+    /* WebSocket message types and fields (see ws.c in djb) */
+    ws: {
+        REQUEST: 1,
+        RESPONSE: 2,
+
+        SEQNO: 1,
+        URI: 2,
+        METHOD: 3,
+        COOKIE: 4,
+        CTYPE: 5,
+        HTTPCODE: 6,
+        HTTPTEXT: 7,
+        SETCOOKIE: 8
+    },
+
+    /* u8 type, u8 nfields, nfields * (u8 id, u16 len, bytes), body */
+    ws_decode : function (buf) {
+        var view = new DataView(buf), dec = new TextDecoder(),
+            msg = { type: view.getUint8(0), fields: {} },
+            n = view.getUint8(1), o = 2, i, id, len;
+
+        for (i = 0; i < n; i++) {
+            id = view.getUint8(o);
+            len = view.getUint16(o + 1);
+            o += 3;
+            msg.fields[id] = dec.decode(new Uint8Array(buf, o, len));
+            o += len;
+        }
+
+        msg.body = buf.slice(o);
+
+        return msg;
+    },
+
+    ws_encode : function (type, fields, body) {
+        var enc = new TextEncoder(), parts = [], len = 2, id, bytes,
+            out, view, u8, o, index, b;
+
+        for (id in fields) {
+            if (fields.hasOwnProperty(id) && typeof fields[id] === 'string') {
+                bytes = enc.encode(fields[id]);
+                parts.push({ id: parseInt(id, 10), bytes: bytes });
+                len += 3 + bytes.length;
+            }
+        }
+
+        b = body ? new Uint8Array(body) : new Uint8Array(0);
+
+        out = new ArrayBuffer(len + b.length);
+        view = new DataView(out);
+        u8 = new Uint8Array(out);
+
+        view.setUint8(0, type);
+        view.setUint8(1, parts.length);
+        o = 2;
+
+        for (index = 0; index < parts.length; index++) {
+            view.setUint8(o, parts[index].id);
+            view.setUint16(o + 1, parts[index].bytes.length);
+            u8.set(parts[index].bytes, o + 3);
+            o += 3 + parts[index].bytes.length;
+        }
+
+        u8.set(b, o);
+
+        return out;
+    },
+
+    /* WebSocket message -> XHR 2, like jb_part2request */
+    ws_msg2request : function (msg, request) {
+        var djb_contents = null, djb_method, djb_uri, content_type, f = msg.fields, W = Translator.ws;
+
+        djb_uri = f[W.URI];
+        djb_method = f[W.METHOD];
+
+        Circuit.log('wsm2r: DJB-URI: ' + djb_uri);
+        Circuit.log('wsm2r: DJB_SeqNo: ' + f[W.SEQNO]);
+
+        if ((djb_method !== 'GET') && (djb_method !== 'POST')) {
+            throw 'Bad value of DJB-Method: ' + djb_method;
+        }
+
+        if (typeof djb_uri !== 'string') {
+            throw 'Bad value of DJB-URI ' + (typeof djb_uri);
+        }
+
+        request.open(djb_method, djb_uri);
+
+        /* indicate to the Headers handler that this is a stegotorus server request */
+        request.setRequestHeader('DJB-Server', true);
+
+        if (typeof f[W.COOKIE] === 'string') {
+            request.setRequestHeader('DJB-Cookie', f[W.COOKIE]);
+        }
+
+        request.responseType = 'blob';
+
+        if (djb_method === 'POST') {
+            content_type = f[W.CTYPE];
+            if (typeof content_type !== 'string') {
+                throw 'No value for Content-Type';
+            }
+
+            request.setRequestHeader('Content-Type', content_type);
+            djb_contents = new Blob([msg.body], {type: content_type});
+            Circuit.addBytesIn(djb_contents.size);
+        }
+
+        /* Keep the SeqNo */
+        request.djb_seqno = f[W.SEQNO];
+
+        return djb_contents;
+    },
+
+    /* The fields of a response message, as ss_response2record has them */
+    ws_response_fields : function (response) {
+        var fields = {}, W = Translator.ws, value;
+
+        fields[W.SEQNO] = response.djb_seqno;
+
+        /* When it failed, report 555 back to jumpbox */
+        if (response.status == 0) {
+            fields[W.HTTPCODE] = '555';
+            fields[W.HTTPTEXT] = 'Request not made';
+        } else {
+            fields[W.HTTPCODE] = String(response.status);
+            fields[W.HTTPTEXT] = response.statusText;
+        }
+
+        value = response.getResponseHeader('DJB-Set-Cookie');
+        if (typeof value === 'string') {
+            fields[W.SETCOOKIE] = value;
+        }
+
+        value = response.getResponseHeader('Content-Type');
+        if (typeof value === 'string') {
+            fields[W.CTYPE] = value;
+        }
+
+        return fields;
+    },
+
+    /* XHR 2 -> WebSocket response message, callback gets it encoded */
+    ss_response2ws : function (response, callback) {
+        var fields = Translator.ws_response_fields(response), reader;
+
+        if (!response.response || response.response.size === 0) {
+            callback(Translator.ws_encode(Translator.ws.RESPONSE, fields, null));
+            return;
+        }
+
+        Circuit.addBytesOut(response.response.size);
+
+        reader = new FileReader();
+        reader.onload = function () {
+            callback(Translator.ws_encode(Translator.ws.RESPONSE, fields, reader.result));
+        };
+        reader.readAsArrayBuffer(response.response);
+    },
+
     
     response_is_image: function ( content_type ){
         if( content_type == 'image/jpeg' ){
@@ -267,19 +720,79 @@ Translator = {
         return djb_contents;
     },
 
+    /* Decode a base64 body of a batched request into a Blob */
+    base64_to_blob : function (b64, content_type) {
+        var raw, bytes, index;
+
+        raw = atob(b64);
+        bytes = new Uint8Array(raw.length);
+        for (index = 0; index < raw.length; index++) {
+            bytes[index] = raw.charCodeAt(index);
+        }
+
+        return new Blob([bytes], {type: content_type});
+    },
+
+    /* XHR 1 -> 2 (batched)
+     * same as jb_response2request, but for one part of a batch,
+     * which carries the DJB headers as fields and the body in base64
+     */
+    jb_part2request : function (part, request) {
+        var djb_contents = null, djb_method, djb_uri, content_type;
+
+        djb_uri = part['DJB-URI'];
+        djb_method = part['DJB-Method'];
+
+        Circuit.log('jbp2r: DJB-URI: ' + djb_uri);
+        Circuit.log('jbp2r: DJB_SeqNo: ' + part['DJB-SeqNo']);
+
+        if ((djb_method !== 'GET') && (djb_method !== 'POST')) {
+            throw 'Bad value of DJB-Method: ' + djb_method;
+        }
+
+        if (typeof djb_uri !== 'string') {
+            throw 'Bad value of DJB-URI ' + (typeof djb_uri);
+        }
+
+        request.open(djb_method, djb_uri);
+
+        /* indicate to the Headers handler that this is a stegotorus server request */
+        request.setRequestHeader('DJB-Server', true);
+
+        if (typeof part['DJB-Cookie'] === 'string') {
+            Circuit.log('jbp2r: djb_cookie = ' + part['DJB-Cookie']);
+            request.setRequestHeader('DJB-Cookie', part['DJB-Cookie']);
+        }
+
+        request.responseType = 'blob';
+
+        if (djb_method === 'POST') {
+            content_type = part['Content-Type'];
+            if (typeof content_type !== 'string') {
+                throw 'No value for Content-Type';
+            }
+
+            request.setRequestHeader('Content-Type', content_type);
+            djb_contents = Translator.base64_to_blob(part.Body || '', content_type);
+            Circuit.addBytesIn(djb_contents.size);
+        }
+
+        /* Keep the SeqNo */
+        request.djb_seqno = part['DJB-SeqNo'];
+
+        return djb_contents;
+    },
+
     /*  XHR 2 -> 3
      * prepares the request from the ss response to XHR 2.; 
      * returns the content (i.e. the argument to send)  
+     * djb_uri is the /next/ URL
      */
-    ss_response2request : function (response, request, circuit_id) {
-        var djb_contents, djb_uri, djb_set_cookie, djb_content_type, httpcode, httptext, d;
-
-	d = new Date();
+    ss_response2request : function (response, request, djb_uri) {
+        var djb_contents, djb_set_cookie, djb_content_type, httpcode, httptext;
 
         djb_contents = response.response;
 
-        djb_uri = Circuit.jb_next_url + circuit_id + '/' + Circuit.cnt_requests_out + '/' + d.getTime();
-
         /*
          * The response should be converted into a POST
          * no DJB headers will be in the response
@@ -333,6 +846,50 @@ Translator = {
 	Circuit.addBytesOut(contentlen);
 
         return djb_contents;
+    },
+
+    /* XHR 2 -> batched push record
+     * same as ss_response2request, but as a record for a batched push,
+     * callback gets the record once the body has been encoded
+     */
+    ss_response2record : function (response, callback) {
+        var record = {}, reader, djb_set_cookie, djb_content_type;
+
+        record['DJB-SeqNo'] = response.djb_seqno;
+
+        /* When it failed, report 555 back to jumpbox */
+        if (response.status == 0) {
+            record['DJB-HTTPCode'] = '555';
+            record['DJB-HTTPText'] = 'Request not made';
+        } else {
+            record['DJB-HTTPCode'] = String(response.status);
+            record['DJB-HTTPText'] = response.statusText;
+        }
+
+        djb_set_cookie = response.getResponseHeader('DJB-Set-Cookie');
+        if (typeof djb_set_cookie === 'string') {
+            record['DJB-Set-Cookie'] = djb_set_cookie;
+        }
+
+        djb_content_type = response.getResponseHeader('Content-Type');
+        if (typeof djb_content_type === 'string') {
+            record['Content-Type'] = djb_content_type;
+        }
+
+        if (!response.response || response.response.size === 0) {
+            callback(record);
+            return;
+        }
+
+        Circuit.addBytesOut(response.response.size);
+
+        /* A data: URL, the body is what follows the comma */
+        reader = new FileReader();
+        reader.onload = function () {
+            record.Body = reader.result.substr(reader.result.indexOf(',') + 1);
+            callback(record);
+        };
+        reader.readAsDataURL(response.response);
     }
 };
 
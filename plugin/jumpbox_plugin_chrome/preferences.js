@@ -28,6 +28,16 @@ Preferences = {
             setter: function (option_id) { return Preferences.select_setter(option_id); }
         },
 
+        plugin_pull_batch: {
+            getter: function (option_id) { return Preferences.select_getter(option_id); },
+            setter: function (option_id) { return Preferences.select_setter(option_id); }
+        },
+
+        plugin_native_messaging: {
+            getter: function (option_id) { return Preferences.checkbox_getter(option_id); },
+            setter: function (option_id) { return Preferences.checkbox_setter(option_id); }
+        },
+
         stegotorus_executable: {
             getter: function (option_id) { return Preferences.text_getter(option_id); },
             setter: function (option_id) { return Preferences.text_setter(option_id); }
@@ -70,6 +70,8 @@ acs_status(djb_status_t status, const char *format, ...) {
 	/* Log it too, so it is easy to find as a single string */
 	log_dbg("%s", l_message);
 
+	djbm_inc((djbm_counter_t)(DJBM_ACS_ERR + l_status));
+
 	m = (acsmsg_t *)mcalloc(sizeof *m, "acsmsg");
 	if (m == NULL) {
 		log_err("No memory for ACS Message");
@@ -258,24 +260,8 @@ acs_setup(httpsrv_client_t *hcl) {
 	log_dbg("POST, checking for body");
 
 	/* No BODY yet, then we have to start reading */
-	if (hcl->readbody == NULL) {
-		if (hcl->headers.content_length == 0) {
-			djb_error(hcl, 400, "setup requires length");
-			return (true);
-		}
-
-		log_dbg("POST allocating memory for body");
-
-		if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
-			djb_result(hcl, DJB_ERR, "Out of Memory");
-			return (true);
-		}
-		
-		log_dbg("POST let it be read");
-		/* Let httpsrv read it in */
-
-		/* Nothing to do currently */
-		return (false);
+	if (!djb_body_need(hcl, 0, "setup", &ok)) {
+		return (ok);
 	}
 
 	log_dbg("Got a POST body, set the NET");
@@ -351,68 +337,54 @@ acs_request(djb_push_f callback, const char *hostname, const char *uri) {
 	strcpy(hcl->headers.hostname, hostname);
 	strcpy(hcl->headers.rawuri, uri);
 
-	/* Add it to the queue, call back will handle it further */
-	return (djb_proxy_add(hcl));
+	/*
+	 * Add it to the queue, ahead of the bulk traffic
+	 * call back will handle it further
+	 */
+	return (djb_proxy_add(hcl, DJB_PRIO_CONTROL));
 }
 
-static bool
-acs_redirect_answer(httpsrv_client_t *shcl, httpsrv_client_t *hcl);
-static bool
-acs_redirect_answer(httpsrv_client_t *shcl, httpsrv_client_t *hcl) {
-	djb_headers_t	*sdh;
-	unsigned int	i, ans_len;
+static void
+acs_redirect_answer(httpsrv_client_t *hcl, djb_answer_t *res);
+static void
+acs_redirect_answer(httpsrv_client_t *hcl, djb_answer_t *res) {
+	unsigned int	ans_len;
 	char		*ans;
 	bool		ok;
 
 	log_dbg("..");
 
-	sdh = httpsrv_get_userdata(shcl);
-
 	/* Did the request go okay? */
-	i = atoi(sdh->httpcode);
-	if (i != 200) {
+	if (res->httpcode != 200) {
 		acs_status(DJB_ERR,
 			   "ACS Redirect failed: %u %s",
-			   i, sdh->httptext);
+			   res->httpcode, res->httptext);
 		httpsrv_client_destroy(hcl);
 		acs_sitdown();
-		return (true);
+		return;
 	}
 
-	/* No body yet? Then allocate some memory to get it */
-	if (shcl->readbody == NULL) {
-		if (shcl->headers.content_length == 0) {
-			log_dbg("redirect_answer requires length");
-			acs_status(DJB_ERR,
-				   "ACS Redirect failed: no length");
-			acs_sitdown();
-			return (true);
-		}
-
-		if (httpsrv_readbody_alloc(shcl, 2, 0) < 0){
-			log_dbg("httpsrv_readbody_alloc() failed");
-			acs_status(DJB_ERR,
-				   "ACS Redirect failed: no memory");
-			acs_sitdown();
-			return (true);
-		}
-
-		/* I want that body, thus not done yet */
-		return (false);
+	/* We need the body */
+	if (res->body == NULL || res->body_len == 0) {
+		log_dbg("redirect_answer requires length");
+		acs_status(DJB_ERR,
+			   "ACS Redirect failed: no length");
+		acs_sitdown();
+		return;
 	}
 
 	/* Decode the result */
-	if (!steg_decode(shcl->readbody, shcl->readbody_off,
-			 shcl->headers.content_type,
+	if (!steg_decode(res->body, res->body_len,
+			 res->content_type != NULL ? res->content_type : "",
 			 &ans, &ans_len)) {
 		acs_status(DJB_ERR,
 			   "ACS Redirect failed: desteg failed");
 		acs_sitdown();
-		return (true);
+		return;
 	}
 
 	acs_status(DJB_OK, "ACS Redirect success: HTTP %u %s",
-		   i, sdh->httptext);
+		   res->httpcode, res->httptext);
 
 	log_dbg("Bridge Details: %s", ans);
 
@@ -440,9 +412,6 @@ acs_redirect_answer(httpsrv_client_t *shcl, httpsrv_client_t *hcl) {
 
 	/* Done dancing */
 	acs_sitdown();
-
-	/* Done */
-	return (true);
 }
 
 static void
@@ -457,6 +426,8 @@ acs_redirect(void) {
 	if (redirect == NULL)
 		return;
 
+	djbm_inc(DJBM_ACS_REDIRECT);
+
 	/* Inject ACS Redirect into the proxy queue */
 	if (!acs_request(acs_redirect_answer, redirect, "/")) {
 		acs_sitdown();
@@ -481,6 +452,8 @@ acs_wait(void) {
 	w = generate_random_number();
 	w = d_wait + (w % d_window);
 
+	djbm_inc(DJBM_ACS_WAIT);
+
 	acs_status(DJB_OK, "Moonwalking for %" PRIu64 " seconds...", w);
 
 	if (!thread_sleep(w * 1000)) {
@@ -497,43 +470,33 @@ acs_wait(void) {
 	acs_redirect();
 }
 
-static bool
-acs_initial_answer(httpsrv_client_t *shcl, httpsrv_client_t *hcl);
-static bool
-acs_initial_answer(httpsrv_client_t *shcl, httpsrv_client_t *hcl) {
-	djb_headers_t	*sdh;
-	unsigned int	i;
-
+static void
+acs_initial_answer(httpsrv_client_t *hcl, djb_answer_t *res);
+static void
+acs_initial_answer(httpsrv_client_t *hcl, djb_answer_t *res) {
 	log_dbg("..");
 
-	sdh = httpsrv_get_userdata(shcl);
-
 	/* Did the request go okay? */
-	i = atoi(sdh->httpcode);
-	if (i != 200) {
+	if (res->httpcode != 200) {
 		acs_status(DJB_ERR,
 			   "ACS Initial failed: %u %s",
-			   i, sdh->httptext);
+			   res->httpcode, res->httptext);
 		httpsrv_client_destroy(hcl);
 		acs_sitdown();
-
-		/* Done */
-		return (true);
+		return;
 	}
 
-	acs_status(DJB_OK, "ACS Initial success: HTTP %u %s", i, sdh->httptext);
+	acs_status(DJB_OK, "ACS Initial success: HTTP %u %s",
+		   res->httpcode, res->httptext);
 
 	/* Done with this request */
 	httpsrv_client_destroy(hcl);
 
 	if (!acs_keep_running())
-		return (true);
+		return;
 
 	/* Perform Wait stage */
 	acs_wait();
-
-	/* Done */
-	return (true);
 }
 
 static void
@@ -550,6 +513,8 @@ acs_initial(void) {
 
 	log_dbg("Initial Gateway: %s", initial);
 
+	djbm_inc(DJBM_ACS_INITIAL);
+
 	/* Inject ACS Initial into the proxy queue */
 	if (!acs_request(acs_initial_answer, initial, "/")) {
 		acs_sitdown();
@@ -0,0 +1,294 @@
+#include "djb.h"
+
+#include <zlib.h>
+
+/*
+ * Static assets
+ *
+ * What djb serves that never changes while it runs (the CSS of the
+ * status UI) is registered once at startup with djba_add(). Each gets
+ * a strong ETag (a hash of its content) and, when that is smaller, a
+ * gzip compressed copy; both are kept in memory.
+ *
+ * A request then costs a lookup: the gzip copy is for a client that
+ * accepts it, the plain one for the others. The two encodings have
+ * ETags of their own, as a strong ETag names exactly one
+ * representation; If-None-Match with the ETag of the one selected gets
+ * a 304 without a body, a cached copy of the other one does not count.
+ */
+
+#define DJBA_MAX		8
+
+typedef struct {
+	const char	*path;		/* "/djb.css" */
+	const char	*ctype;
+	const char	*data;		/* As given, not copied */
+	size_t		len;
+	char		*gz;		/* NULL when it does not shrink */
+	size_t		gz_len;
+	char		etag[24];	/* "<hash>" */
+	char		etag_gz[28];	/* "<hash>-gz" */
+} djba_asset_t;
+
+static djba_asset_t l_assets[DJBA_MAX];
+static unsigned int l_nassets = 0;
+
+/* Counters (atomic) */
+static uint64_t l_served = 0;		/* Sent with a body */
+static uint64_t l_served_gz = 0;	/* ... of which gzip */
+static uint64_t l_not_modified = 0;	/* Answered with a 304 */
+
+/* FNV-1a, 64 bits */
+static uint64_t
+djba_hash(const char *data, size_t len);
+static uint64_t
+djba_hash(const char *data, size_t len) {
+	uint64_t	h = 14695981039346656037ULL;
+	size_t		i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+
+	return (h);
+}
+
+/* A gzip (RFC 1952) copy of data; NULL on failure */
+static char *
+djba_gzip(const char *data, size_t len, size_t *gz_len);
+static char *
+djba_gzip(const char *data, size_t len, size_t *gz_len) {
+	z_stream	zs;
+	char		*out;
+	uLong		size;
+	int		r;
+
+	memzero(&zs, sizeof zs);
+
+	/* 16 + window bits: a gzip header and trailer instead of zlib's */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		return (NULL);
+	}
+
+	size = deflateBound(&zs, len);
+	out = malloc(size);
+	if (out == NULL) {
+		deflateEnd(&zs);
+		return (NULL);
+	}
+
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = size;
+
+	r = deflate(&zs, Z_FINISH);
+	*gz_len = zs.total_out;
+	deflateEnd(&zs);
+
+	if (r != Z_STREAM_END) {
+		free(out);
+		return (NULL);
+	}
+
+	return (out);
+}
+
+bool
+djba_add(const char *path, const char *ctype, const char *data, size_t len) {
+	djba_asset_t	*a;
+	uint64_t	h;
+
+	if (l_nassets >= DJBA_MAX) {
+		log_crt("Too many static assets, not adding %s", path);
+		return (false);
+	}
+
+	a = &l_assets[l_nassets];
+	memzero(a, sizeof *a);
+
+	a->path = path;
+	a->ctype = ctype;
+	a->data = data;
+	a->len = len;
+
+	h = djba_hash(data, len);
+	snprintf(a->etag, sizeof a->etag, "\"%016" PRIx64 "\"", h);
+	snprintf(a->etag_gz, sizeof a->etag_gz, "\"%016" PRIx64 "-gz\"", h);
+
+	/* Only worth it when it shrinks */
+	a->gz = djba_gzip(data, len, &a->gz_len);
+	if (a->gz != NULL && a->gz_len >= len) {
+		free(a->gz);
+		a->gz = NULL;
+	}
+
+	log_dbg("%s: %zu bytes, gzip %zu", path, len,
+		a->gz != NULL ? a->gz_len : 0);
+
+	l_nassets++;
+
+	return (true);
+}
+
+static djba_asset_t *
+djba_find(const char *path);
+static djba_asset_t *
+djba_find(const char *path) {
+	unsigned int i;
+
+	for (i = 0; i < l_nassets; i++) {
+		if (strcmp(l_assets[i].path, path) == 0) {
+			return (&l_assets[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Accept-Encoding lists gzip, and not with q=0 */
+static bool
+djba_accepts_gzip(const char *ae);
+static bool
+djba_accepts_gzip(const char *ae) {
+	const char *p;
+
+	p = strcasestr(ae, "gzip");
+	if (p == NULL) {
+		return (false);
+	}
+
+	for (p += 4; *p == ' '; p++) {
+		/* Skip whitespace */
+	}
+
+	if (*p != ';') {
+		return (true);
+	}
+
+	for (p++; *p == ' '; p++) {
+		/* Skip whitespace */
+	}
+
+	return (strncasecmp(p, "q=", 2) != 0 || atof(p + 2) > 0);
+}
+
+/*
+ * If-None-Match lists this ETag, or is "*"; compared weakly (a W/
+ * prefix does not matter), as RFC 7232 wants for If-None-Match
+ */
+static bool
+djba_inm_match(const char *inm, const char *etag);
+static bool
+djba_inm_match(const char *inm, const char *etag) {
+	const char	*p, *end;
+	size_t		len = strlen(etag);
+
+	for (p = inm; *p != '\0'; p = end) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++) {
+			/* Skip separators */
+		}
+
+		end = strchr(p, ',');
+		if (end == NULL) {
+			end = p + strlen(p);
+		}
+
+		if (*p == '*') {
+			return (true);
+		}
+
+		if (strncmp(p, "W/", 2) == 0) {
+			p += 2;
+		}
+
+		/* The entry is the ETag, up to trailing whitespace */
+		if ((size_t)(end - p) >= len && strncmp(p, etag, len) == 0) {
+			for (p += len; p < end && (*p == ' ' || *p == '\t');
+			     p++) {
+				/* Skip whitespace */
+			}
+
+			if (p == end) {
+				return (true);
+			}
+		}
+	}
+
+	return (false);
+}
+
+bool
+djba_serve(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djba_asset_t	*a;
+	const char	*etag, *data;
+	size_t		len;
+	bool		gz;
+
+	a = djba_find(hcl->headers.uri);
+	if (a == NULL) {
+		return (false);
+	}
+
+	gz = (a->gz != NULL && djba_accepts_gzip(dh->acceptenc));
+	etag = gz ? a->etag_gz : a->etag;
+
+	/* Can Cache This */
+	httpsrv_expire(hcl, HTTPSRV_EXPIRE_LONG);
+
+	/* The client has it already, in the encoding it gets now */
+	if (djba_inm_match(dh->inm, etag)) {
+		__atomic_add_fetch(&l_not_modified, 1, __ATOMIC_RELAXED);
+
+		httpsrv_answer(hcl, 304, "Not Modified", a->ctype);
+		conn_addheaderf(&hcl->conn, "ETag: %s", etag);
+		conn_addheaderf(&hcl->conn, "Vary: Accept-Encoding");
+		httpsrv_done(hcl);
+		return (true);
+	}
+
+	data = gz ? a->gz : a->data;
+	len = gz ? a->gz_len : a->len;
+
+	__atomic_add_fetch(&l_served, 1, __ATOMIC_RELAXED);
+	if (gz) {
+		__atomic_add_fetch(&l_served_gz, 1, __ATOMIC_RELAXED);
+	}
+
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, a->ctype);
+	conn_addheaderf(&hcl->conn, "ETag: %s", etag);
+	conn_addheaderf(&hcl->conn, "Vary: Accept-Encoding");
+	if (gz) {
+		conn_addheaderf(&hcl->conn, "Content-Encoding: gzip");
+	}
+
+	if (!conn_putn(&hcl->conn, data, len)) {
+		log_wrn(HCL_ID " could not queue %s", hcl->id, a->path);
+	}
+
+	httpsrv_done(hcl);
+
+	return (true);
+}
+
+void
+djba_stats(unsigned int *assets, uint64_t *served, uint64_t *served_gz,
+	   uint64_t *not_modified) {
+	*assets = l_nassets;
+	*served = __atomic_load_n(&l_served, __ATOMIC_RELAXED);
+	*served_gz = __atomic_load_n(&l_served_gz, __ATOMIC_RELAXED);
+	*not_modified = __atomic_load_n(&l_not_modified, __ATOMIC_RELAXED);
+}
+
+void
+djba_exit(void) {
+	unsigned int i;
+
+	for (i = 0; i < l_nassets; i++) {
+		free(l_assets[i].gz);
+	}
+
+	l_nassets = 0;
+}
@@ -1,14 +1,134 @@
 #include "djb.h"
 
-#define DJB_WORKERS	8
-#define DJB_HOST	"localhost"
-#define DJB_PORT	6543
+#ifdef _LINUX
+#include <sched.h>
+#endif
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define DJB_HTTP_WORKERS	8	/* httpsrv threads per shard */
+#define DJB_WORKERS_MIN		0	/* Worker pool bounds, see pool.c */
+#define DJB_WORKERS_MAX		16
+#define DJB_RELAYS		4	/* Body relay threads, see splice.c */
+#define DJB_UNIX_THREADS	2	/* DJB_UNIX pool threads, see unix.c */
+#define DJB_SWEEP_MS	1000
+#define DJB_BATCH_MAX	32
+#define DJB_LISTEN	"localhost:6543"	/* DJB_LISTEN environment */
+
+/*
+ * HTTP servers listening on the same address (DJB_SHARDS environment),
+ * each with its own connections and threads on a core of its own; the
+ * kernel spreads the connections over them (SO_REUSEPORT) and the proxy
+ * queues, being shared, pair requests and pullers across them. The
+ * listeners are ours, handed to httpsrv_start_fd(); without that (an
+ * older libfutil, see the Makefile) there is just the one shard.
+ */
+#define DJB_SHARDS	1
+#define DJB_SHARDS_MAX	64
+#if defined(_LINUX) && defined(SO_REUSEPORT) && defined(DJB_HTTPSRV_FD)
+#define DJB_SHARDING	1
+#endif
+#define DJB_QUEUE_SIZE	4096	/* DJB_QUEUE_BULK, _CONTROL, _PULL */
+#define DJB_QUEUE_MAX	(1024 * 1024)
+#define DJB_ENV_SECS_MAX	(24 * 60 * 60)	/* Deadlines, intervals */
+#define DJB_ENV_THREADS_MAX	256
+
+/* Chrome passes the extension's origin when starting a native host */
+#define DJB_NATIVE_ORIGIN	"chrome-extension://"
+
+/*
+ * Deadlines, in seconds (0 = never), tunable by environment variables
+ * with the same name; see djb_deadlines_init()
+ */
+#define DJB_PULL_TIMEOUT	30	/* Waiting pull, answered with 408 */
+#define DJB_OUT_TIMEOUT		60	/* Outstanding request without push */
+#define DJB_OUT_RETRIES		1	/* Requeues of such a request */
+#define DJB_IDLE_TIMEOUT	300	/* Idle keep-alive connection */
+
+/* Bodies of at least this many bytes are spliced (0 = never) */
+#define DJB_SPLICE_MIN		(16 * 1024)
+
+/* Largest chunked body we read into memory */
+#define DJB_CHUNKED_MAX		(8 * 1024 * 1024)
+
+/*
+ * Fair queuing of bulk requests: bytes per client connection per round
+ * (DJB_FAIR_QUANTUM); a request costs its body plus DJB_REQ_OVERHEAD,
+ * at most DJB_REQ_COST_MAX
+ */
+#define DJB_FAIR_QUANTUM	(16 * 1024)
+#define DJB_REQ_OVERHEAD	512
+#define DJB_REQ_COST_MAX	(1024 * 1024)
+
+/*
+ * Load shedding: requests and their bodies buffered in memory may take
+ * up to DJB_MEM_BUDGET MiB (0 = no limit); bulk requests beyond that or
+ * beyond their queue get a 503 with Retry-After (seconds, DJB_RETRY_AFTER)
+ */
+#define DJB_MEM_BUDGET		64
+#define DJB_RETRY_AFTER		5
+
+/*
+ * Circuit affinity: a request waits this long (ms, DJB_AFFINITY_WAIT)
+ * for a puller of the circuit its connection used before, then any
+ * puller will do (0 = only when one is parked already)
+ */
+#define DJB_AFFINITY_WAIT	250
+#define DJB_CIRCUITS		64
+
+/*
+ * Latency histograms per circuit and stage, the running interval
+ * becomes the last one every DJB_HIST_INTERVAL seconds (0 = never)
+ */
+#define DJB_HIST_INTERVAL	10
+
+typedef enum {
+	DJB_LAT_QUEUED = 0,		/* Enqueue to pair */
+	DJB_LAT_PLUGIN,			/* Pair to push */
+	DJB_LAT_FORWARD,		/* Push to done */
+	DJB_LAT_MAX
+} djb_lat_t;
+
+static const char l_latnames[DJB_LAT_MAX][8] = {
+	"queued",
+	"plugin",
+	"forward"
+};
+
+typedef struct {
+	uint32_t		id;		/* 0 = unused */
+	hlist_t			pending;	/* Requests waiting for it */
+	djb_req_t		*puller;	/* Parked puller (pending lock) */
+	uint64_t		hits;		/* Paired with a parked puller */
+	uint64_t		waits;		/* Requests that had to wait */
+	uint64_t		taken;		/* Of which a puller took */
+	uint64_t		fallbacks;	/* Of which went to any puller */
+	unsigned int		pullers;	/* Waiting now (atomic) */
+	djbh_t			*lat[DJB_LAT_MAX];	/* Latencies */
+} djb_circuit_t;
+
+/*
+ * Hash index over lst_proxy_out
+ *
+ * Every push needs to find its request by DJB-SeqNo and every close
+ * needs to find the request paired with that connection; walking the
+ * list for that does not scale with the number of requests in flight.
+ *
+ * The index is protected by the lock of lst_proxy_out, thus it is
+ * always in step with the list itself.
+ */
+#define DJB_REQIDX_MIN	256
 
 typedef struct {
-	hnode_t			node;		/* List node */
-	httpsrv_client_t	*hcl;		/* Client for this request */
-	uint64_t		phcl_id;	/* Paired HCL */
-} djb_req_t;
+	djb_req_t		**seq;		/* Buckets keyed by id:reqid */
+	djb_req_t		**phcl;		/* Buckets keyed by phcl_id */
+	unsigned int		size;		/* Number of buckets (2^n) */
+	unsigned int		count;		/* Number of indexed requests */
+} djb_reqidx_t;
 
 static const char l_statusnames[DJB_MAX][10] = {
 	"error",
@@ -16,14 +136,110 @@ static const char l_statusnames[DJB_MAX][10] = {
 	"done"
 };
 
-/* New, unforwarded queries (awaiting 'pull') */
-static hlist_t lst_proxy_new;
+/* New, unforwarded control queries (awaiting 'pull'), these go first */
+static djbq_t q_proxy_ctl;
+
+/* One put back, it goes before q_proxy_ctl (see djb_request_push()) */
+static djb_req_t *l_ctl_front = NULL;
+
+/* New, unforwarded bulk queries (awaiting 'pull'), fair per client */
+static djbf_t q_proxy_new;
 
 /* Outstanding queries (answer to a 'pull', awaiting 'push') */
 static hlist_t lst_proxy_out;
 
 /* Requests that want a 'pull', waiting for a 'proxy_new' entry */
-static hlist_t lst_api_pull;
+static djbq_t q_api_pull;
+
+/* Index over lst_proxy_out */
+static djb_reqidx_t l_reqidx;
+
+/* Deadlines in milliseconds (0 = never) and retries */
+static unsigned int l_to_pull = DJB_PULL_TIMEOUT * 1000;
+static unsigned int l_to_out = DJB_OUT_TIMEOUT * 1000;
+static unsigned int l_out_retries = DJB_OUT_RETRIES;
+static unsigned int l_to_idle = DJB_IDLE_TIMEOUT * 1000;
+
+/* Expiry counters (atomic) */
+static uint64_t l_exp_pull = 0;		/* Pulls answered with 408 */
+static uint64_t l_exp_requeue = 0;	/* Outstanding, requeued */
+static uint64_t l_exp_fail = 0;		/* Outstanding, failed with 504 */
+static uint64_t l_exp_idle = 0;		/* Idle connections closed */
+
+/* Body forwarding (see djb_forward()), counters are atomic */
+static unsigned int l_splice_min = DJB_SPLICE_MIN;
+static uint64_t l_fwd_buffered = 0;	/* Bodies via httpsrv_forward() */
+static uint64_t l_fwd_direct = 0;	/* Bodies via djb_splice() */
+static uint64_t l_fwd_spliced = 0;	/* Bytes moved zero-copy */
+static uint64_t l_fwd_copied = 0;	/* Bytes copied as splice failed */
+static uint64_t l_fwd_failed = 0;	/* Bodies that did not make it */
+static uint64_t l_fwd_chunked = 0;	/* Chunked bodies relayed */
+static uint64_t l_body_chunked = 0;	/* Chunked bodies read in */
+
+/* The HTTP servers, see DJB_SHARDS */
+static httpsrv_t *l_shards[DJB_SHARDS_MAX];
+static unsigned int l_nshards = 0;
+static unsigned int l_http_workers = DJB_HTTP_WORKERS;
+
+/* Running as native messaging host (see nm.c) */
+static bool l_native = false;
+
+/* Expired (or stolen) pullers still sitting in q_api_pull (atomic) */
+static uint32_t l_pull_dead = 0;
+
+/* Known circuits, entries are never removed (see djb_circuit_get()) */
+static djb_circuit_t l_circuits[DJB_CIRCUITS];
+static unsigned int l_ncircuits = 0;
+static mutex_t l_circuits_mutex;
+static unsigned int l_affinity_wait = DJB_AFFINITY_WAIT;
+static unsigned int l_fair_quantum = DJB_FAIR_QUANTUM;
+
+/* Latencies of requests without a (known) circuit, see djb_lat_record() */
+static djbh_t *l_lat_none[DJB_LAT_MAX];
+static djbt_timer_t l_lat_timer;
+static unsigned int l_lat_interval = DJB_HIST_INTERVAL;
+
+/* Load shedding, counters are atomic */
+static uint64_t l_mem_budget = (uint64_t)DJB_MEM_BUDGET * 1024 * 1024;
+static unsigned int l_retry_after = DJB_RETRY_AFTER;
+static uint64_t l_mem_used = 0;		/* Bytes charged to requests */
+static uint64_t l_mem_peak = 0;
+static uint64_t l_shed_budget = 0;	/* Refused: over the budget */
+static uint64_t l_shed_queue = 0;	/* Refused: queue full */
+static uint64_t l_shed_pull = 0;	/* Pulls refused: queue full */
+static uint64_t l_shed_other = 0;	/* Refused: out of memory */
+
+/* Matchmaker entry for requests (also used to requeue them) */
+static bool
+djb_match_request(djb_req_t *pr);
+static bool
+djb_match_any(djb_req_t *pr);
+
+/* Another puller for a WebSocket channel */
+static void
+djb_ws_pull(djbw_t *ws);
+
+/* Pullers waiting per circuit, for /metrics */
+static void
+djb_puller_unwait(djb_req_t *ar);
+
+/* Husks in q_api_pull, released once they reach its head */
+static void
+djb_puller_reap(void);
+
+/* Parking a handler for a relay, and the decoding of chunked bodies */
+static void
+djb_relay_park(httpsrv_client_t *hcl, djb_headers_t *dh, djb_relay_t *r);
+static void
+djb_body_decoded(djb_relay_t *r, bool ok);
+
+/* The state of a connection outlives it while requests hold it */
+static void
+djb_dh_put(djb_headers_t *dh);
+
+/* Latency histograms, fed from djb_trace_commit() */
+static void
+djb_lat_record(const djbx_rec_t *r);
 
 /* The exit hostname we use */
 static char *l_exit_hostname = NULL;
@@ -36,26 +252,42 @@ static myprocess_num_t l_tor_pnum = 0;
 
 misc_map_t djb_headers[] = {
 	{ MAPLABEL("DJB-HTTPCode"),	DJBH(httpcode)	},
-	{ MAPLABEL("DJB-HTTPText"),	DJBH(httptext)	},
 	{ MAPLABEL("DJB-SeqNo"),	DJBH(seqno)	},
+	{ MAPLABEL("DJB-Batch"),	DJBH(batch)	},
+	{ MAPLABEL("Transfer-Encoding"),DJBH(te)	},
+	{ MAPLABEL("DJB-Priority"),	DJBH(prio)	},
+	{ MAPLABEL("Upgrade"),		DJBH(upgrade)	},
+	{ MAPLABEL("Sec-WebSocket-Key"),DJBH(wskey)	},
+	{ MAPLABEL("Sec-WebSocket-Version"),DJBH(wsversion)},
+	{ MAPLABEL("Accept-Encoding"),	DJBH(acceptenc)	},
+	{ MAPLABEL("If-None-Match"),	DJBH(inm)	},
+	{ MAPEND }
+};
+
+/* Variable length headers, stored by djb_hdr_set() */
+#define DJBV(h) offsetof(djb_headers_t, h)
+
+static const struct {
+	const char	*label;
+	unsigned int	len;
+	size_t		off;
+} djb_vheaders[] = {
+	{ MAPLABEL("DJB-HTTPText"),	DJBV(httptext)	},
 
 	/* Server -> Client */
-	{ MAPLABEL("DJB-Set-Cookie"),	DJBH(setcookie)	},
+	{ MAPLABEL("DJB-Set-Cookie"),	DJBV(setcookie)	},
 
 	/* Client -> Server */
-	{ MAPLABEL("Cookie"),		DJBH(cookie)	},
-	{ MAPEND }
+	{ MAPLABEL("Cookie"),		DJBV(cookie)	},
+	{ NULL, 0, 0 }
 };
 
-static void
-djb_html_css(httpsrv_client_t *hcl);
-static void
-djb_html_css(httpsrv_client_t *hcl) {
-	/* Can Cache This */
-	httpsrv_expire(hcl, HTTPSRV_EXPIRE_LONG);
+/* Slab pools for djb_req_t and djb_headers_t */
+static djbs_pool_t *l_slab_req = NULL;
+static djbs_pool_t *l_slab_dh = NULL;
 
-	/* HTML header */
-	conn_put(&hcl->conn,
+/* The CSS of the status UI, served from memory by asset.c */
+static const char djb_css[] =
 		"/* JumpBox CSS */\n"
 		"form label\n"
 		"{\n"
@@ -183,15 +415,10 @@ djb_html_css(httpsrv_client_t *hcl) {
 		"	width		: 90%;\n"
 		"	height		: 250px;\n"
 		"}\n"
-		"\n"
-		);
-}
+		"\n";
 
-static void
-djb_html_top(httpsrv_client_t *hcl, void UNUSED *user);
-static void
-djb_html_top(httpsrv_client_t *hcl, void UNUSED *user) {
-	conn_put(&hcl->conn,
+/* Page chrome, constant thus its length is known up front */
+static const char djb_html_head[] =
 		"<!doctype html>\n"
 		"<html lang=\"en\">\n"
 		"<head>\n"
@@ -203,14 +430,9 @@ djb_html_top(httpsrv_client_t *hcl, void UNUSED *user) {
 		"<body>\n"
 		"<div class=\"header\">\n"
 		"SAFER DEFIANCE :: JumpBox\n"
-		"</div>\n");
-}
+		"</div>\n";
 
-static void
-djb_html_tail(httpsrv_client_t *hcl, void UNUSED *user);
-static void
-djb_html_tail(httpsrv_client_t *hcl, void UNUSED *user) {
-	conn_put(&hcl->conn,
+static const char djb_html_foot[] =
 		"<div class=\"footer\">\n"
 		"SAFER DEFIANCE :: Defiance JumpBox (djb) by "
 		"<a href=\"http://www.farsightsecurity.com\">"
@@ -218,7 +440,20 @@ djb_html_tail(httpsrv_client_t *hcl, void UNUSED *user) {
 		"</a>.\n"
 		"</div>\n"
 		"</body>\n"
-		"</html>\n");
+		"</html>\n";
+
+static void
+djb_html_top(httpsrv_client_t *hcl, void UNUSED *user);
+static void
+djb_html_top(httpsrv_client_t *hcl, void UNUSED *user) {
+	conn_putn(&hcl->conn, djb_html_head, sizeof djb_html_head - 1);
+}
+
+static void
+djb_html_tail(httpsrv_client_t *hcl, void UNUSED *user);
+static void
+djb_html_tail(httpsrv_client_t *hcl, void UNUSED *user) {
+	conn_putn(&hcl->conn, djb_html_foot, sizeof djb_html_foot - 1);
 }
 
 void
@@ -228,6 +463,17 @@ djb_error(httpsrv_client_t *hcl, unsigned int code, const char *msg) {
 	httpsrv_done(hcl);
 }
 
+/*
+ * Close a parked client from a thread other than its own: shutting
+ * down the socket and handing it back makes its connset thread close
+ * it, as it does for a client that went away
+ */
+void
+djb_hangup(httpsrv_client_t *hcl) {
+	shutdown(conn_fd(&hcl->conn), SHUT_RDWR);
+	connset_handling_done(&hcl->conn, false);
+}
+
 void
 djb_presult(httpsrv_client_t *hcl, const char *msg) {
 	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_JSON);
@@ -270,222 +516,2693 @@ djb_result(httpsrv_client_t *hcl, djb_status_t status, const char *msg) {
 	}
 }
 
-static djb_req_t *
-djb_find_req(hlist_t *lst, uint64_t id, uint64_t reqid);
-static djb_req_t *
-djb_find_req(hlist_t *lst, uint64_t id, uint64_t reqid) {
-	djb_req_t	*r, *rn, *pr = NULL;
+static uint64_t
+djb_reqidx_hash(uint64_t a, uint64_t b);
+static uint64_t
+djb_reqidx_hash(uint64_t a, uint64_t b) {
+	uint64_t h;
 
-	/* Find this Request-ID in our outstanding proxy requests */
-	list_lock(lst);
-	list_for(lst, r, rn, djb_req_t *) {
-		if (r->hcl->id != id ||
-		    r->hcl->reqid != reqid) {
-			continue;
-		}
+	/* Multiplicative mixing, ids are sequential thus spread them */
+	h = (a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL);
+	h ^= h >> 29;
 
-		/* Gotcha */
-		pr = r;
+	return (h);
+}
 
-		/* Remove it from this list */
-		list_remove(lst, &pr->node);
-		break;
+static bool
+djb_reqidx_alloc(djb_reqidx_t *idx, unsigned int size);
+static bool
+djb_reqidx_alloc(djb_reqidx_t *idx, unsigned int size) {
+	djb_req_t	**seq, **phcl, *r, *rn;
+	unsigned int	i, b;
+
+	seq = mcalloc(size * sizeof *seq, "djb_reqidx seq");
+	phcl = mcalloc(size * sizeof *phcl, "djb_reqidx phcl");
+	if (seq == NULL || phcl == NULL) {
+		if (seq != NULL)
+			mfree(seq, size * sizeof *seq, "djb_reqidx seq");
+		if (phcl != NULL)
+			mfree(phcl, size * sizeof *phcl, "djb_reqidx phcl");
+		return (false);
 	}
-	list_unlock(lst);
 
-	if (pr != NULL) {
-		log_dbg("%" PRIu64 ":%" PRIu64 " = " HCL_ID,
-			id, reqid, pr->hcl->id);
-	} else {
-		log_wrn("No such HCL (%" PRIu64 ":%" PRIu64 " found!?",
-			id, reqid);
+	/* Rehash the existing entries into the new buckets */
+	for (i = 0; i < idx->size; i++) {
+		for (r = idx->seq[i]; r != NULL; r = rn) {
+			rn = r->seq_next;
+			b = djb_reqidx_hash(r->id, r->reqid) & (size - 1);
+			r->seq_next = seq[b];
+			seq[b] = r;
+		}
+
+		for (r = idx->phcl[i]; r != NULL; r = rn) {
+			rn = r->phcl_next;
+			b = djb_reqidx_hash(r->phcl_id, 0) & (size - 1);
+			r->phcl_next = phcl[b];
+			phcl[b] = r;
+		}
 	}
 
-	return (pr);
-}
+	if (idx->size > 0) {
+		mfree(idx->seq, idx->size * sizeof *idx->seq, "djb_reqidx seq");
+		mfree(idx->phcl, idx->size * sizeof *idx->phcl, "djb_reqidx phcl");
+	}
 
-static djb_req_t *
-djb_find_req_dh(httpsrv_client_t *hcl, hlist_t *lst, djb_headers_t *dh);
-static djb_req_t *
-djb_find_req_dh(httpsrv_client_t *hcl, hlist_t *lst, djb_headers_t *dh) {
-	djb_req_t	*pr;
-	uint64_t	id, reqid;
+	idx->seq = seq;
+	idx->phcl = phcl;
+	idx->size = size;
 
-	/* We require a DJB-HTTPCode */
-	if (strlen(dh->httpcode) == 0) {
-		djb_error(hcl, 504, "Missing DJB-HTTPCode");
-		return NULL;
-	}
+	return (true);
+}
 
-	/* We require a DJB-HTTPText */
-	if (strlen(dh->httptext) == 0) {
-		djb_error(hcl, 504, "Missing DJB-HTTPText");
-		return NULL;
-	}
+static bool
+djb_reqidx_init(djb_reqidx_t *idx);
+static bool
+djb_reqidx_init(djb_reqidx_t *idx) {
+	memzero(idx, sizeof *idx);
 
-	/* Convert the Request-ID */
-	if (sscanf(dh->seqno, "%09" PRIx64 "%09" PRIx64, &id, &reqid) != 2) {
-		djb_error(hcl, 504, "Missing or malformed DJB-SeqNo");
-		return NULL;
-	}
+	return (djb_reqidx_alloc(idx, DJB_REQIDX_MIN));
+}
 
-	pr = djb_find_req(lst, id, reqid);
-	if (!pr) {
-		djb_error(hcl, 404, "No such request outstanding");
+static void
+djb_reqidx_exit(djb_reqidx_t *idx);
+static void
+djb_reqidx_exit(djb_reqidx_t *idx) {
+	if (idx->size > 0) {
+		mfree(idx->seq, idx->size * sizeof *idx->seq, "djb_reqidx seq");
+		mfree(idx->phcl, idx->size * sizeof *idx->phcl, "djb_reqidx phcl");
 	}
 
-	return (pr);
+	memzero(idx, sizeof *idx);
 }
 
+/* Caller holds the list lock */
 static void
-djb_pull_post(httpsrv_client_t *hcl);
+djb_reqidx_insert(djb_reqidx_t *idx, djb_req_t *pr);
 static void
-djb_pull_post(httpsrv_client_t *hcl) {
-	djb_req_t		*ar;
-#ifdef DEBUG
-	uint64_t		id = hcl->id;
-#endif
+djb_reqidx_insert(djb_reqidx_t *idx, djb_req_t *pr) {
+	unsigned int b;
+
+	/* Keep chains short: grow when we have more entries than buckets */
+	if (idx->count >= idx->size &&
+	    !djb_reqidx_alloc(idx, idx->size * 2)) {
+		log_wrn("Could not grow request index (%u entries)",
+			idx->count);
+	}
 
-	log_dbg(HCL_ID, id);
+	/* Remember the key, the hcl might move on to another request */
+	pr->id = pr->hcl->id;
+	pr->reqid = pr->hcl->reqid;
 
-	/* Proxy request - add it to the requester list */
-	ar = mcalloc(sizeof *ar, "djb_req_t *");
-	if (!ar) {
-		djb_error(hcl, 500, "Out of memory");
+	b = djb_reqidx_hash(pr->id, pr->reqid) & (idx->size - 1);
+	pr->seq_next = idx->seq[b];
+	idx->seq[b] = pr;
 
-		/* XXX: All is lost here, maybe cleanup hcl? */
-		return;
+	b = djb_reqidx_hash(pr->phcl_id, 0) & (idx->size - 1);
+	pr->phcl_next = idx->phcl[b];
+	idx->phcl[b] = pr;
+
+	idx->count++;
+}
+
+/* Caller holds the list lock */
+static void
+djb_reqidx_remove(djb_reqidx_t *idx, djb_req_t *pr);
+static void
+djb_reqidx_remove(djb_reqidx_t *idx, djb_req_t *pr) {
+	djb_req_t	**rp;
+	unsigned int	b;
+
+	b = djb_reqidx_hash(pr->id, pr->reqid) & (idx->size - 1);
+	for (rp = &idx->seq[b]; *rp != NULL; rp = &(*rp)->seq_next) {
+		if (*rp == pr) {
+			*rp = pr->seq_next;
+			break;
+		}
 	}
 
-	/* Fill in the details */
-	ar->hcl = hcl;
+	b = djb_reqidx_hash(pr->phcl_id, 0) & (idx->size - 1);
+	for (rp = &idx->phcl[b]; *rp != NULL; rp = &(*rp)->phcl_next) {
+		if (*rp == pr) {
+			*rp = pr->phcl_next;
+			break;
+		}
+	}
 
-	list_addtail_l(&lst_api_pull, &ar->node);
+	pr->seq_next = NULL;
+	pr->phcl_next = NULL;
 
-	log_dbg(HCL_ID " done", id);
+	fassert(idx->count > 0);
+	idx->count--;
 }
 
-static bool
-djb_pull(httpsrv_client_t *hcl);
-static bool
-djb_pull(httpsrv_client_t *hcl){
-	log_dbg(HCL_ID " keephandling=yes", hcl->id);
-
-	/*
-	 * Add this request to the queue when the request is handled
-	 * The manager will divide the work
-	 */
-	hcl->keephandling = true;
-	httpsrv_set_posthandle(hcl, djb_pull_post);
+/* Does the request carry a chunked body? */
+bool
+djb_is_chunked(httpsrv_client_t *hcl) {
+	djb_headers_t *dh = httpsrv_get_userdata(hcl);
 
-	/* No need to read from it further for the moment */
-	return (true);
+	/* chunked is always the last coding */
+	return (dh != NULL && strcasestr(dh->te, "chunked") != NULL);
 }
 
-/* Push request, answer to a pull request */
 static bool
-djb_push(httpsrv_client_t *hcl, djb_headers_t *dh);
+djb_has_body(httpsrv_client_t *hcl);
 static bool
-djb_push(httpsrv_client_t *hcl, djb_headers_t *dh) {
-	djb_req_t	*pr;
-	djb_headers_t	*pdh;
+djb_has_body(httpsrv_client_t *hcl) {
+	return (hcl->headers.content_length > 0 || djb_is_chunked(hcl));
+}
 
-	log_dbg(HCL_ID, hcl->id);
+/* Take a decoded chunked body as if it had a length all along */
+static djb_body_t
+djb_readbody_decoded(httpsrv_client_t *hcl, unsigned int extra,
+		     char *body, size_t len);
+static djb_body_t
+djb_readbody_decoded(httpsrv_client_t *hcl, unsigned int extra,
+		     char *body, size_t len) {
+	__atomic_add_fetch(&l_body_chunked, 1, __ATOMIC_RELAXED);
+
+	/* It is consumed completely, thus no longer chunked */
+	((djb_headers_t *)httpsrv_get_userdata(hcl))->te[0] = '\0';
+
+	if (len == 0) {
+		free(body);
+		return (DJB_BODY_NONE);
+	}
 
-	fassert(hcl != NULL);
+	hcl->headers.content_length = len;
 
-	/* Find the request */
-	pr = djb_find_req_dh(hcl, &lst_proxy_out, dh);
-	if (pr == NULL) {
-		/* Can happen if the request timed out etc */
-		log_dbg(HCL_ID " request timed out", hcl->id);
-		httpsrv_done(hcl);
-		return (true);
+	if (httpsrv_readbody_alloc(hcl, extra, 0) < 0) {
+		free(body);
+		return (DJB_BODY_ERROR);
 	}
 
-	fassert(pr->hcl != NULL);
-	pdh = httpsrv_get_userdata(pr->hcl);
-
-	log_dbg(HCL_ID " -> " HCL_ID, hcl->id, pr->hcl->id);
+	memcpy(hcl->readbody, body, len);
+	hcl->readbody_off = len;
+	free(body);
 
-	if (pdh->push != NULL) {
-		log_dbg(HCL_ID " internal proxy request", hcl->id);
+	return (DJB_BODY_READY);
+}
 
-		/* Let the caller handle it */
-		if (!pdh->push(hcl, pr->hcl)) {
-			/*
-			 * Not done yet, likely to read a POST body
-			 * Put it back on the list so we can find
-			 * it in the next loop
-			 */
-			list_addtail_l(&lst_proxy_out, &pr->node);
-			return (false);
+/*
+ * Get the body of a request into hcl->readbody ('extra' bytes more
+ * are allocated, see httpsrv_readbody_alloc())
+ *
+ * A body with a length is read in by httpsrv, which calls the handler
+ * again once it is complete. A chunked body is decoded by a relay
+ * thread, as it can take long; the connection stays parked meanwhile
+ * and the handler runs again on that thread (see djb_body_decoded()).
+ */
+djb_body_t
+djb_readbody(httpsrv_client_t *hcl, unsigned int extra) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	djb_relay_t	*r;
+
+	if (hcl->headers.content_length > 0) {
+		if (httpsrv_readbody_alloc(hcl, extra, 0) < 0) {
+			return (DJB_BODY_ERROR);
 		}
 
-		/* Done */
+		/* Let httpsrv read it in */
+		return (DJB_BODY_LATER);
+	}
 
-		/* Release it */
-		free(pr);
+	if (!djb_is_chunked(hcl)) {
+		return (DJB_BODY_NONE);
+	}
 
-		/* HTTP okay */
-		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+	r = &dh->decode;
+	memzero(r, sizeof *r);
+	r->from = hcl;
+	r->len = DJB_CHUNKED_MAX;
+	r->chunked = true;
+	r->done = djb_body_decoded;
+	dh->decode_extra = extra;
 
-		/* A message as a body (Content-Length is arranged by conn) */
-		conn_printf(&hcl->conn, "Internal Push Proxy successful\r\n");
+	djb_relay_park(hcl, dh, r);
+	return (DJB_BODY_DECODING);
+}
 
-		/* Request is done */
-		httpsrv_done(hcl);
+/*
+ * The handlers' part of djb_readbody(): true when the body is in
+ * hcl->readbody; otherwise the request is answered or parked, and
+ * the handler returns *ret.
+ */
+bool
+djb_body_need(httpsrv_client_t *hcl, unsigned int extra,
+	      const char *what, bool *ret) {
+	char msg[DJB_MSGLEN];
 
+	if (hcl->readbody != NULL) {
 		return (true);
 	}
 
-	log_dbg(HCL_ID " normal proxy request", hcl->id);
+	switch (djb_readbody(hcl, extra)) {
+	case DJB_BODY_READY:
+		return (true);
 
-	/* Connections might close before the answer is returned */
-	if (!conn_is_valid(&pr->hcl->conn)) {
-		log_dbg(HCL_ID " " CONN_ID " closed",
-			pr->hcl->id, conn_id(&pr->hcl->conn));
+	case DJB_BODY_LATER:
+		/* httpsrv calls the handler again with the body */
+		*ret = false;
+		return (false);
 
-		/* HTTP okay */
-		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+	case DJB_BODY_DECODING:
+		/* Parked, the handler runs again once it is decoded */
+		*ret = true;
+		return (false);
 
-		conn_printf(&hcl->conn, "Remote closed connection\r\n");
+	case DJB_BODY_NONE:
+		snprintf(msg, sizeof msg, "%s requires a body", what);
+		djb_error(hcl, 400, msg);
+		break;
 
-		/* Request is done */
-		httpsrv_done(hcl);
-		return (true);
+	case DJB_BODY_ERROR:
+	default:
+		djb_error(hcl, 500, "Could not read body");
+		break;
 	}
 
-	/* Force handling */
-	if (pr->hcl->conn.connset_l != &pr->hcl->conn.connset->handling)
-	{
-		connset_handling_setup(&pr->hcl->conn);
+	*ret = true;
+	return (false);
+}
+
+static djb_req_t *
+djb_req_alloc(httpsrv_client_t *hcl);
+static djb_req_t *
+djb_req_alloc(httpsrv_client_t *hcl) {
+	djb_req_t *r;
+
+	r = djbs_alloc(l_slab_req);
+	if (r != NULL) {
+		r->hcl = hcl;
+		r->dh = hcl != NULL ? httpsrv_get_userdata(hcl) : NULL;
+		if (r->dh != NULL) {
+			__atomic_add_fetch(&r->dh->refs, 1, __ATOMIC_RELAXED);
+		}
 	}
 
-	/* We got an answer, send back what we have already */
-	httpsrv_answer(pr->hcl, atoi(dh->httpcode), dh->httptext, NULL);
+	return (r);
+}
 
-	/* Server to Client */
-	if (strlen(dh->setcookie) > 0) {
-		conn_addheaderf(&pr->hcl->conn, "Set-Cookie: %s",
-				dh->setcookie);
+static void
+djb_req_free(djb_req_t *r);
+static void
+djb_req_free(djb_req_t *r) {
+	/* A WebSocket puller holds on to its channel */
+	if (r != NULL && r->ws != NULL) {
+		djbw_put(r->ws);
 	}
 
-	/* Add all the headers we received */
-	/* XXX: We should scrub DJB-SeqNo */
-	buf_lock(&hcl->the_headers);
-	conn_addheaders(&pr->hcl->conn, buf_buffer(&hcl->the_headers));
-	buf_unlock(&hcl->the_headers);
+	/* What a proxy request took of the memory budget */
+	if (r != NULL && r->mem > 0) {
+		__atomic_sub_fetch(&l_mem_used, r->mem, __ATOMIC_RELAXED);
+	}
 
-	if (hcl->headers.content_length == 0) {
-		/* Send back a 200 OK as we proxied it */
-		log_dbg("API push done (no content)");
+	if (r != NULL && r->dh != NULL) {
+		djb_dh_put(r->dh);
+	}
+
+	djbs_free(l_slab_req, r);
+}
+
+/* Stamp a stage of the proxy request of a client (see trace.c) */
+static void
+djb_trace(djb_headers_t *dh, djbx_stage_t s);
+static void
+djb_trace(djb_headers_t *dh, djbx_stage_t s) {
+	if (dh != NULL) {
+		djbx_mark(&dh->trace, s);
+	}
+}
+
+/* The request is answered: into the ring, ready for the next one */
+static void
+djb_trace_commit(djb_headers_t *dh);
+static void
+djb_trace_commit(djb_headers_t *dh) {
+	uint64_t accept = dh->trace.ts[DJBX_ACCEPT];
+
+	if (dh->trace.ts[DJBX_ENQUEUE] == 0) {
+		return;
+	}
+
+	/* Answered without a body forward that stamped it */
+	if (dh->trace.ts[DJBX_PUSH] != 0 && dh->trace.ts[DJBX_DONE] == 0) {
+		djbx_mark(&dh->trace, DJBX_DONE);
+	}
+
+	djbx_commit(&dh->trace);
+	djb_lat_record(&dh->trace);
+
+	memzero(&dh->trace, sizeof dh->trace);
+	dh->trace.ts[DJBX_ACCEPT] = accept;
+}
+
+/* lst_proxy_out lock held */
+static void
+djb_out_remove(djb_req_t *pr);
+static void
+djb_out_remove(djb_req_t *pr) {
+	djb_reqidx_remove(&l_reqidx, pr);
+	list_remove(&lst_proxy_out, &pr->node);
+	pr->out = false;
+}
+
+/* Make sure a client waiting on another thread gets served */
+static void
+djb_force_handling(httpsrv_client_t *hcl);
+static void
+djb_force_handling(httpsrv_client_t *hcl) {
+	if (hcl->conn.connset_l != &hcl->conn.connset->handling) {
+		connset_handling_setup(&hcl->conn);
+	}
+}
+
+unsigned int
+djb_retry_after(void) {
+	return (l_retry_after);
+}
+
+/*
+ * Refuse a proxy request with a 503 and Retry-After, counting it;
+ * an internal one gets that through its push callback
+ */
+static void
+djb_shed(httpsrv_client_t *hcl, uint64_t *counter, const char *msg);
+static void
+djb_shed(httpsrv_client_t *hcl, uint64_t *counter, const char *msg) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	djb_answer_t	ans;
+
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+
+	log_wrn(HCL_ID " shed: %s", hcl->id, msg);
+
+	if (dh != NULL && dh->push != NULL) {
+		memzero(&ans, sizeof ans);
+		ans.httpcode = 503;
+		ans.httptext = "Service Unavailable";
+		dh->push(hcl, &ans);
+		return;
+	}
+
+	if (!conn_is_valid(&hcl->conn)) {
+		return;
+	}
+
+	djb_force_handling(hcl);
+
+	httpsrv_answer(hcl, 503, "Service Unavailable", HTTPSRV_CTYPE_HTML);
+	conn_addheaderf(&hcl->conn, "Retry-After: %u", l_retry_after);
+	conn_put(&hcl->conn, msg);
+	httpsrv_done(hcl);
+}
+
+/* What a proxy request takes: its headers and its (buffered) body */
+static unsigned int
+djb_req_mem(httpsrv_client_t *hcl);
+static unsigned int
+djb_req_mem(httpsrv_client_t *hcl) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	uint64_t	len;
+
+	len = DJB_REQ_OVERHEAD + strlen(hcl->the_request);
+
+	if (dh != NULL) {
+		len += dh->hbuf_used + dh->spill_used;
+	}
+
+	/*
+	 * Only what is held in memory: a body that goes inline is read in
+	 * before the request is queued (djb_handle_proxy()), one that is
+	 * not stays on the wire until it is relayed, except for what
+	 * httpsrv read along with the headers
+	 */
+	if (hcl->readbody != NULL) {
+		len += hcl->readbody_off;
+	} else if (hcl->method == HTTP_M_POST) {
+		len += conn_pending(&hcl->conn);
+	}
+
+	return (len > UINT32_MAX ? UINT32_MAX : (unsigned int)len);
+}
+
+/* Take 'len' bytes of the budget; unless 'force', only when they fit */
+static bool
+djb_mem_charge(unsigned int len, bool force);
+static bool
+djb_mem_charge(unsigned int len, bool force) {
+	uint64_t used, peak;
+
+	used = __atomic_add_fetch(&l_mem_used, len, __ATOMIC_RELAXED);
+
+	if (!force && l_mem_budget > 0 && used > l_mem_budget) {
+		__atomic_sub_fetch(&l_mem_used, len, __ATOMIC_RELAXED);
+		return (false);
+	}
+
+	peak = __atomic_load_n(&l_mem_peak, __ATOMIC_RELAXED);
+	while (used > peak &&
+	       !__atomic_compare_exchange_n(&l_mem_peak, &peak, used, false,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+		/* Retry with the newer peak */
+	}
+
+	return (true);
+}
+
+/*
+ * For bodies read in outside of httpsrv (unix.c): held from before
+ * they are read until the request that carries them is charged
+ */
+bool
+djb_mem_reserve(unsigned int len) {
+	return (djb_mem_charge(len, false));
+}
+
+void
+djb_mem_release(unsigned int len) {
+	__atomic_sub_fetch(&l_mem_used, len, __ATOMIC_RELAXED);
+}
+
+/* Answer a request that got no answer in time, on its client's thread */
+static void
+djb_out_expired(httpsrv_client_t *hcl);
+static void
+djb_out_expired(httpsrv_client_t *hcl) {
+	djb_error(hcl, 504, "No answer in time");
+	connset_handling_done(&hcl->conn, false);
+}
+
+/*
+ * An outstanding request did not get its push in time (timer thread)
+ *
+ * Sent again while it may be; otherwise its client gets a 504 from its
+ * own connset, as an expired pull gets its 408 (djb_pull_expire()).
+ */
+static void
+djb_out_expire(void *data);
+static void
+djb_out_expire(void *data) {
+	djb_req_t	*pr = (djb_req_t *)data;
+	djb_headers_t	*pdh;
+	djb_answer_t	ans;
+	bool		mine;
+
+	list_lock(&lst_proxy_out);
+	mine = pr->out;
+	if (mine) {
+		djb_out_remove(pr);
+	}
+	list_unlock(&lst_proxy_out);
+
+	/* A push or close took it meanwhile */
+	if (!mine) {
+		return;
+	}
+
+	log_dbg(HCL_ID " no answer in time (retried %u)",
+		pr->hcl->id, pr->retries);
+
+	pdh = pr->dh;
+
+	/* Only requests without a body on the wire can be sent again */
+	if (pr->retries < l_out_retries &&
+	    (pr->hcl->method != HTTP_M_POST || !djb_has_body(pr->hcl)) &&
+	    ((pdh != NULL && pdh->push != NULL) || conn_is_valid(&pr->hcl->conn))) {
+		__atomic_add_fetch(&l_exp_requeue, 1, __ATOMIC_RELAXED);
+
+		pr->retries++;
+		pr->phcl_id = 0;
+		djb_match_request(pr);
+		return;
+	}
+
+	__atomic_add_fetch(&l_exp_fail, 1, __ATOMIC_RELAXED);
+
+	if (pdh != NULL && pdh->push != NULL) {
+		/* Internal proxy request, tell the caller */
+		memzero(&ans, sizeof ans);
+		ans.httpcode = 504;
+		ans.httptext = "Gateway Timeout";
+		pdh->push(pr->hcl, &ans);
+
+	} else if (conn_is_valid(&pr->hcl->conn)) {
+		/* Not ours to answer, its connset runs djb_out_expired() */
+		httpsrv_set_posthandle(pr->hcl, djb_out_expired);
+		djb_force_handling(pr->hcl);
+	}
+
+	djb_req_free(pr);
+}
+
+/*
+ * Put a request on lst_proxy_out, indexed
+ *
+ * The deadline is armed under the list lock: once the lock is dropped
+ * a push or close can find the request, cancel its timer and free it,
+ * thus the timer must be in the wheel by then. djb_out_expire() takes
+ * the list lock itself and arming never waits for a callback, thus this
+ * can not deadlock.
+ */
+static void
+djb_out_add(djb_req_t *pr);
+static void
+djb_out_add(djb_req_t *pr) {
+	list_lock(&lst_proxy_out);
+	if (l_to_out > 0) {
+		djbt_arm(&pr->timer, l_to_out, djb_out_expire, pr);
+	}
+	list_addtail(&lst_proxy_out, &pr->node);
+	djb_reqidx_insert(&l_reqidx, pr);
+	pr->out = true;
+	list_unlock(&lst_proxy_out);
+}
+
+
+/* Base64, for bodies carried in batched pulls and pushes */
+static const char djb_b64[] =	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"abcdefghijklmnopqrstuvwxyz"
+				"0123456789+/";
+
+char *
+djb_base64_encode(const char *src, size_t len) {
+	const uint8_t		*in = (const uint8_t *)src;
+	char			*out, *o;
+	uint32_t		v;
+	size_t			i;
+
+	out = malloc(((len + 2) / 3) * 4 + 1);
+	if (out == NULL) {
+		return (NULL);
+	}
+
+	for (i = 0, o = out; i + 2 < len; i += 3) {
+		v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+		*o++ = djb_b64[(v >> 18) & 0x3f];
+		*o++ = djb_b64[(v >> 12) & 0x3f];
+		*o++ = djb_b64[(v >> 6) & 0x3f];
+		*o++ = djb_b64[v & 0x3f];
+	}
+
+	/* Remaining 1 or 2 bytes, padded */
+	if (i < len) {
+		v = in[i] << 16;
+		if (i + 1 < len) {
+			v |= in[i + 1] << 8;
+		}
+
+		*o++ = djb_b64[(v >> 18) & 0x3f];
+		*o++ = djb_b64[(v >> 12) & 0x3f];
+		*o++ = i + 1 < len ? djb_b64[(v >> 6) & 0x3f] : '=';
+		*o++ = '=';
+	}
+
+	*o = '\0';
+
+	return (out);
+}
+
+/* Decode base64, returns a malloc'd buffer of *len bytes, NULL on error */
+char *
+djb_base64_decode(const char *src, size_t *len) {
+	const char	*p;
+	char		*out;
+	uint32_t	v = 0;
+	unsigned int	bits = 0;
+	size_t		i, o = 0;
+
+	out = malloc((strlen(src) / 4) * 3 + 3);
+	if (out == NULL) {
+		return (NULL);
+	}
+
+	for (i = 0; src[i] != '\0' && src[i] != '='; i++) {
+		p = strchr(djb_b64, src[i]);
+		if (p == NULL) {
+			free(out);
+			return (NULL);
+		}
+
+		v = (v << 6) | (uint32_t)(p - djb_b64);
+		bits += 6;
+
+		if (bits >= 8) {
+			bits -= 8;
+			out[o++] = (char)((v >> bits) & 0xff);
+		}
+	}
+
+	*len = o;
+	return (out);
+}
+
+static djb_req_t *
+djb_find_req(uint64_t id, uint64_t reqid);
+static djb_req_t *
+djb_find_req(uint64_t id, uint64_t reqid) {
+	djb_req_t	*r, *pr = NULL;
+	unsigned int	b;
+
+	/* Find this Request-ID in our outstanding proxy requests */
+	list_lock(&lst_proxy_out);
+	b = djb_reqidx_hash(id, reqid) & (l_reqidx.size - 1);
+	for (r = l_reqidx.seq[b]; r != NULL; r = r->seq_next) {
+		if (r->id != id ||
+		    r->reqid != reqid) {
+			continue;
+		}
+
+		/* Gotcha */
+		pr = r;
+
+		/* Remove it from this list */
+		djb_out_remove(pr);
+		break;
+	}
+	list_unlock(&lst_proxy_out);
+
+	/* Ours now, its deadline is not needed anymore */
+	if (pr != NULL) {
+		djbt_cancel(&pr->timer);
+	}
+
+	if (pr != NULL) {
+		log_dbg("%" PRIu64 ":%" PRIu64 " = " HCL_ID,
+			id, reqid, pr->hcl->id);
+	} else {
+		log_wrn("No such HCL (%" PRIu64 ":%" PRIu64 " found!?",
+			id, reqid);
+	}
+
+	return (pr);
+}
+
+static djb_req_t *
+djb_find_req_dh(httpsrv_client_t *hcl, djb_headers_t *dh);
+static djb_req_t *
+djb_find_req_dh(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djb_req_t	*pr;
+	uint64_t	id, reqid;
+
+	/* We require a DJB-HTTPCode */
+	if (strlen(dh->httpcode) == 0) {
+		djb_error(hcl, 504, "Missing DJB-HTTPCode");
+		return NULL;
+	}
+
+	/* We require a DJB-HTTPText */
+	if (dh->httptext == NULL) {
+		djb_error(hcl, 504, "Missing DJB-HTTPText");
+		return NULL;
+	}
+
+	/* Convert the Request-ID */
+	if (sscanf(dh->seqno, "%09" PRIx64 "%09" PRIx64, &id, &reqid) != 2) {
+		djb_error(hcl, 504, "Missing or malformed DJB-SeqNo");
+		return NULL;
+	}
+
+	pr = djb_find_req(id, reqid);
+	if (!pr) {
+		djb_error(hcl, 404, "No such request outstanding");
+	}
+
+	return (pr);
+}
+
+/*
+ * Batched pulls (preference 'plugin_pull_batch' > 0)
+ *
+ * A pull is then answered with a JSON array of up to that many
+ * requests, each an object carrying the same fields as the DJB
+ * headers of a single pull plus the (base64) body:
+ *
+ *  [ { "DJB-URI": "http://...", "DJB-Method": "POST",
+ *      "DJB-SeqNo": "...", "DJB-Cookie": "...",
+ *      "Content-Type": "...", "Body": "<base64>" }, ... ]
+ *
+ * The response carries a 'DJB-Batch: <count>' header so that the
+ * plugin can tell it apart from a single request.
+ *
+ * As bodies are inline, POST bodies are read in by djb_handle_proxy()
+ * before the request is queued when batching is enabled.
+ */
+static unsigned int
+djb_pull_batch(void);
+static unsigned int
+djb_pull_batch(void) {
+	int n;
+
+	n = atoi(prf_get_value(PRF_PB));
+	if (n <= 0) {
+		return (0);
+	}
+
+	return (n > DJB_BATCH_MAX ? DJB_BATCH_MAX : (unsigned int)n);
+}
+
+/* Can this request be carried inline (no body left to forward)? */
+static bool
+djb_req_inline(djb_req_t *pr);
+static bool
+djb_req_inline(djb_req_t *pr) {
+	return (pr->hcl->method != HTTP_M_POST ||
+		!djb_has_body(pr->hcl) ||
+		pr->hcl->readbody != NULL);
+}
+
+static json_t *
+djb_batch_part(djb_req_t *pr);
+static json_t *
+djb_batch_part(djb_req_t *pr) {
+	httpsrv_client_t	*hcl = pr->hcl;
+	djb_headers_t		*dh;
+	json_t			*part;
+	const char		*uri;
+	char			seqno[32], *body;
+
+	uri = aprintf("http://%s%s", hcl->headers.hostname, hcl->headers.rawuri);
+	if (uri == NULL) {
+		return (NULL);
+	}
+
+	snprintf(seqno, sizeof seqno, "%09" PRIx64 "%09" PRIx64,
+		 hcl->id, hcl->reqid);
+
+	part = json_pack("{s:s, s:s, s:s}",
+			 "DJB-URI", uri,
+			 "DJB-Method", httpsrv_methodname(hcl->method),
+			 "DJB-SeqNo", seqno);
+	aprintf_free(uri);
+
+	if (part == NULL) {
+		return (NULL);
+	}
+
+	/* Client to server */
+	dh = (djb_headers_t *)hcl->user;
+	if (dh != NULL && dh->cookie != NULL) {
+		json_object_set_new(part, "DJB-Cookie", json_string(dh->cookie));
+	}
+
+	if (hcl->method == HTTP_M_POST) {
+		json_object_set_new(part, "Content-Type", json_string(
+				    strlen(hcl->headers.content_type) > 0 ?
+					hcl->headers.content_type :
+					"text/html"));
+
+		if (hcl->readbody != NULL) {
+			body = djb_base64_encode(hcl->readbody,
+						 hcl->readbody_off);
+			if (body == NULL) {
+				json_decref(part);
+				return (NULL);
+			}
+
+			json_object_set_new(part, "Body", json_string(body));
+			free(body);
+
+			/*
+			 * Kept until answered: when the puller goes away the
+			 * request is rescheduled and has to be sent again
+			 */
+		}
+	}
+
+	return (part);
+}
+
+/* What a request costs against the fair share of its client */
+static unsigned int
+djb_req_cost(djb_req_t *pr);
+static unsigned int
+djb_req_cost(djb_req_t *pr) {
+	uint64_t len;
+
+	/* Chunked: unknown, count it as a full quantum */
+	len = djb_is_chunked(pr->hcl) ? l_fair_quantum :
+	      pr->hcl->headers.content_length;
+
+	if (len > DJB_REQ_COST_MAX - DJB_REQ_OVERHEAD) {
+		len = DJB_REQ_COST_MAX - DJB_REQ_OVERHEAD;
+	}
+
+	return (DJB_REQ_OVERHEAD + len);
+}
+
+/* The fair queue flow of a request: its connection, unless set */
+static uint64_t
+djb_req_flow(djb_req_t *pr);
+static uint64_t
+djb_req_flow(djb_req_t *pr) {
+	djb_headers_t *pdh = pr->dh;
+
+	if (pdh != NULL && pdh->flow != 0) {
+		return (pdh->flow);
+	}
+
+	return (conn_id(&pr->hcl->conn));
+}
+
+/* Queue a request by its class ('front' when putting it back) */
+static bool
+djb_request_push(djb_req_t *pr, bool front);
+static bool
+djb_request_push(djb_req_t *pr, bool front) {
+	djb_req_t *none = NULL;
+
+	if (pr->prio == DJB_PRIO_CONTROL) {
+		/*
+		 * The ring only takes new ones at its tail; one put back
+		 * keeps its turn in l_ctl_front, more have to queue again
+		 */
+		if (front &&
+		    __atomic_compare_exchange_n(&l_ctl_front, &none, pr, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			return (true);
+		}
+
+		return (djbq_push(&q_proxy_ctl, pr));
+	}
+
+	return (djbf_push(&q_proxy_new, pr, djb_req_flow(pr),
+			  djb_req_cost(pr), front));
+}
+
+void
+djb_flow_forget(uint64_t flow) {
+	djbf_forget(&q_proxy_new, flow);
+}
+
+/* Did its client go while it was queued? (see djb_close()) */
+static bool
+djb_request_gone(djb_req_t *pr);
+static bool
+djb_request_gone(djb_req_t *pr) {
+	if (pr->dh == NULL ||
+	    !__atomic_load_n(&pr->dh->closed, __ATOMIC_ACQUIRE)) {
+		return (false);
+	}
+
+	log_dbg(HCL_ID " gone, dropping its request", pr->hcl->id);
+	djb_req_free(pr);
+	return (true);
+}
+
+/* The next waiting control request, one put back first */
+static djb_req_t *
+djb_request_pop_ctl(void);
+static djb_req_t *
+djb_request_pop_ctl(void) {
+	djb_req_t *pr;
+
+	do {
+		pr = NULL;
+		if (__atomic_load_n(&l_ctl_front, __ATOMIC_RELAXED) != NULL) {
+			pr = __atomic_exchange_n(&l_ctl_front, NULL,
+						 __ATOMIC_ACQ_REL);
+		}
+
+		if (pr == NULL) {
+			pr = djbq_trypop(&q_proxy_ctl);
+		}
+	} while (pr != NULL && djb_request_gone(pr));
+
+	return (pr);
+}
+
+/* The next waiting request, strictly by priority class */
+static djb_req_t *
+djb_request_pop(void);
+static djb_req_t *
+djb_request_pop(void) {
+	djb_req_t *pr;
+
+	pr = djb_request_pop_ctl();
+	if (pr != NULL) {
+		return (pr);
+	}
+
+	do {
+		pr = djbf_pop(&q_proxy_new);
+	} while (pr != NULL && djb_request_gone(pr));
+
+	return (pr);
+}
+
+/* Ordered after the caller's own push (see djb_match_drain()) */
+static unsigned int
+djb_request_depth(void);
+static unsigned int
+djb_request_depth(void) {
+	unsigned int depth;
+
+	depth = djbq_depth(&q_proxy_ctl) + djbf_depth(&q_proxy_new);
+	if (__atomic_load_n(&l_ctl_front, __ATOMIC_SEQ_CST) != NULL) {
+		depth++;
+	}
+
+	return (depth);
+}
+
+static void
+djb_handle_forward_batch(djb_req_t *pr, djb_req_t *ar, unsigned int max);
+static void
+djb_handle_forward_batch(djb_req_t *pr, djb_req_t *ar, unsigned int max) {
+	djb_req_t	*reqs[DJB_BATCH_MAX], *r;
+	json_t		*arr, *part;
+	char		*j = NULL;
+	unsigned int	n = 0, i;
+
+	fassert(max > 0 && max <= DJB_BATCH_MAX);
+
+	/* Take what is waiting, but never wait for more */
+	reqs[n++] = pr;
+	while (n < max && (r = djb_request_pop()) != NULL) {
+		if (!djb_req_inline(r)) {
+			/*
+			 * Queued before batching was enabled, thus its body
+			 * is still on the wire; let a single pull take it
+			 */
+			djb_match_request(r);
+			break;
+		}
+
+		reqs[n++] = r;
+	}
+
+	log_dbg("puller " HCL_ID " takes %u requests", ar->hcl->id, n);
+
+	arr = json_array();
+	for (i = 0; arr != NULL && i < n; i++) {
+		part = djb_batch_part(reqs[i]);
+		if (part == NULL) {
+			json_decref(arr);
+			arr = NULL;
+			break;
+		}
+
+		json_array_append_new(arr, part);
+	}
+
+	if (arr != NULL) {
+		j = json_dumps(arr, JSON_COMPACT);
+		json_decref(arr);
+	}
+
+	if (j == NULL) {
+		log_crt("Could not format batch for " HCL_ID, ar->hcl->id);
+		djb_error(ar->hcl, 500, "Could not format batch");
+		connset_handling_done(&ar->hcl->conn, false);
+
+		/* Bodies might be gone already, thus fail them */
+		for (i = 0; i < n; i++) {
+			djb_error(reqs[i]->hcl, 500, "Could not format batch");
+			djb_req_free(reqs[i]);
+		}
+		return;
+	}
+
+	/* All of them are now outstanding on this puller */
+	for (i = 0; i < n; i++) {
+		if (reqs[i]->hcl->readbody != NULL) {
+			djbm_add(DJBM_BYTES_UP, reqs[i]->hcl->readbody_off);
+		}
+
+		/* The first one is stamped by djb_match_pair() */
+		if (i > 0) {
+			djb_trace(reqs[i]->dh, DJBX_PAIR);
+		}
+
+		reqs[i]->phcl_id = ar->hcl->id;
+		djb_out_add(reqs[i]);
+	}
+
+	/* The first one is counted by djb_match_pair() */
+	djbm_add(DJBM_PAIRED, n - 1);
+
+	httpsrv_answer(ar->hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_JSON);
+	conn_addheaderf(&ar->hcl->conn, "DJB-Batch: %u", n);
+	conn_put(&ar->hcl->conn, j);
+	free(j);
+
+	/* This request is done (after flushing) */
+	httpsrv_done(ar->hcl);
+
+	/* Done handling this connection */
+	connset_handling_done(&ar->hcl->conn, false);
+}
+
+/*
+ * Forward the body of 'from' to 'to', for request pr
+ *
+ * Bodies of at least l_splice_min bytes are moved socket to socket by
+ * djb_splice(), zero-copy where possible. Chunked bodies are always
+ * relayed, chunk by chunk as they arrive, and stay chunked towards 'to'.
+ * Either blocks while a side stalls, thus it is set up as pr->relay
+ * for a relay thread, which calls 'done' when the body moved; the caller
+ * starts it with djb_relay_start() once both clients are parked.
+ *
+ * Smaller bodies, or ones that httpsrv partially read along with the
+ * headers, go through the buffered httpsrv_forward(), which calls
+ * djb_bodyfwd_done() when it is done.
+ *
+ * Returns true when the body is for the relay, false when handed to
+ * httpsrv_forward(). What moves is counted as 'dir' (DJBM_BYTES_UP or
+ * DJBM_BYTES_DOWN), see djb_forward_count() for the relayed ones.
+ */
+static bool
+djb_relay_able(httpsrv_client_t *from);
+static bool
+djb_relay_able(httpsrv_client_t *from) {
+	/* What httpsrv read along with the headers is not on the socket */
+	return (djb_is_chunked(from) ||
+		(l_splice_min != 0 &&
+		 from->headers.content_length >= l_splice_min &&
+		 conn_pending(&from->conn) == 0));
+}
+
+static bool
+djb_forward(djb_req_t *pr, httpsrv_client_t *from, httpsrv_client_t *to,
+	    bool addlen, djbm_counter_t dir, djb_relay_f done);
+static bool
+djb_forward(djb_req_t *pr, httpsrv_client_t *from, httpsrv_client_t *to,
+	    bool addlen, djbm_counter_t dir, djb_relay_f done) {
+	djb_relay_t	*r = &pr->relay;
+	uint64_t	len;
+
+	memzero(r, sizeof *r);
+	r->from = from;
+	r->to = to;
+	r->done = done;
+	r->data = pr;
+
+	if (djb_is_chunked(from)) {
+		__atomic_add_fetch(&l_fwd_chunked, 1, __ATOMIC_RELAXED);
+
+		if (addlen) {
+			conn_addheaderf(&to->conn,
+					"Transfer-Encoding: chunked");
+		}
+
+		r->chunked = true;
+		return (true);
+	}
+
+	len = from->headers.content_length;
+
+	if (!djb_relay_able(from)) {
+		__atomic_add_fetch(&l_fwd_buffered, 1, __ATOMIC_RELAXED);
+		djbm_add(dir, len);
+		httpsrv_forward(from, to);
+		return (false);
+	}
+
+	__atomic_add_fetch(&l_fwd_direct, 1, __ATOMIC_RELAXED);
+
+	if (addlen) {
+		conn_addheaderf(&to->conn, "Content-Length: %" PRIu64, len);
+	}
+
+	r->len = len;
+	return (true);
+}
+
+/*
+ * Account for a relay that finished (relay thread)
+ *
+ * When it failed halfway the framing is lost on both ends, thus the
+ * caller closes both clients; pr has to be off every list by then.
+ */
+static void
+djb_forward_count(djb_relay_t *r, bool ok, djbm_counter_t dir);
+static void
+djb_forward_count(djb_relay_t *r, bool ok, djbm_counter_t dir) {
+	djbm_add(dir, r->moved);
+	__atomic_add_fetch(&l_fwd_spliced, r->spliced, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l_fwd_copied, r->moved - r->spliced,
+			   __ATOMIC_RELAXED);
+
+	if (ok) {
+		return;
+	}
+
+	if (r->chunked) {
+		log_wrn("Chunked body from " HCL_ID " to " HCL_ID
+			" failed after %" PRIu64 " bytes",
+			r->from->id, r->to->id, r->moved);
+	} else {
+		log_wrn("Moved only %" PRIu64 " of %" PRIu64 " bytes from "
+			HCL_ID " to " HCL_ID, r->moved, r->len,
+			r->from->id, r->to->id);
+	}
+
+	__atomic_add_fetch(&l_fwd_failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Start the relay of this client once its handler returned */
+static void
+djb_relay_post(httpsrv_client_t *hcl);
+static void
+djb_relay_post(httpsrv_client_t *hcl) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	djb_relay_t	*r;
+
+	fassert(dh != NULL && dh->relay != NULL);
+
+	r = dh->relay;
+	dh->relay = NULL;
+
+	djb_relay_start(r);
+}
+
+/*
+ * What runs once the handler returned; a handler run again after its
+ * body got decoded leaves it to djb_body_decoded() instead of httpsrv
+ */
+void
+djb_posthandle(httpsrv_client_t *hcl, djb_post_f post) {
+	djb_headers_t *dh = httpsrv_get_userdata(hcl);
+
+	if (dh != NULL && dh->redo) {
+		dh->post = post;
+		return;
+	}
+
+	httpsrv_set_posthandle(hcl, post);
+}
+
+/* Park this client (the handler returns true) and relay from it */
+static void
+djb_relay_park(httpsrv_client_t *hcl, djb_headers_t *dh, djb_relay_t *r) {
+	dh->relay = r;
+	hcl->keephandling = true;
+	djb_posthandle(hcl, djb_relay_post);
+}
+
+/*
+ * A client request body reached its puller (relay thread)
+ *
+ * Only now is the request outstanding: while the body moves neither a
+ * deadline nor a close of the puller can take it from the relay.
+ */
+static void
+djb_forward_up_done(djb_relay_t *r, bool ok);
+static void
+djb_forward_up_done(djb_relay_t *r, bool ok) {
+	djb_req_t		*pr = (djb_req_t *)r->data;
+	httpsrv_client_t	*from = r->from, *to = r->to;
+
+	djb_forward_count(r, ok, DJBM_BYTES_UP);
+
+	if (!ok) {
+		/* Never put out, thus nobody else can reach it (r goes too) */
+		djb_req_free(pr);
+		djb_hangup(from);
+		djb_hangup(to);
+		return;
+	}
+
+	djb_out_add(pr);
+
+	/* This request is done */
+	httpsrv_done(to);
+
+	/* Done handling this connection */
+	connset_handling_done(&to->conn, false);
+}
+
+/*
+ * pr = client request
+ * ar = /pull/ API request
+ */
+static void
+djb_handle_forward(djb_req_t *pr, djb_req_t *ar);
+static void
+djb_handle_forward(djb_req_t *pr, djb_req_t *ar) {
+	djb_headers_t	*dh;
+	unsigned int	batch;
+
+	fassert(pr->hcl);
+	fassert(ar->hcl);
+
+	log_dbg("request " HCL_ID ", puller " HCL_ID,
+		pr->hcl->id, ar->hcl->id);
+
+	/* Connection might have closed by now */
+	if (!conn_is_valid(&ar->hcl->conn)) {
+		fassert(false);
+		/* This request is done */
+		httpsrv_done(ar->hcl);
+		return;
+	}
+
+	/* Batched pull, or a body that was read in for one */
+	batch = djb_pull_batch();
+	if (djb_req_inline(pr) && (batch > 0 || pr->hcl->readbody != NULL)) {
+		djb_handle_forward_batch(pr, ar, batch > 0 ? batch : 1);
+		return;
+	}
+
+	/* HTTP okay (non-POST gets a short HTML answer) */
+	httpsrv_answer(ar->hcl, HTTPSRV_HTTP_OK,
+			pr->hcl->method != HTTP_M_POST ?
+				HTTPSRV_CTYPE_HTML : NULL);
+
+	/* DJB headers */
+	conn_addheaderf(&ar->hcl->conn, "DJB-URI: http://%s%s",
+			pr->hcl->headers.hostname,
+			pr->hcl->headers.rawuri);
+
+	conn_addheaderf(&ar->hcl->conn, "DJB-Method: %s",
+			httpsrv_methodname(pr->hcl->method));
+
+	conn_addheaderf(&ar->hcl->conn, "DJB-SeqNo: %09" PRIx64 "%09" PRIx64,
+			pr->hcl->id, pr->hcl->reqid);
+
+	assert(pr->hcl->method != HTTP_M_NONE);
+
+	/* pr's headers */
+	dh = (djb_headers_t *)pr->hcl->user;
+
+	/* Client to server */
+	if (dh != NULL && dh->cookie != NULL) {
+		conn_addheaderf(&ar->hcl->conn, "DJB-Cookie: %s",
+				dh->cookie);
+	}
+
+	/* The paired HCL (so we can detect closes and restart this request) */
+	pr->phcl_id = ar->hcl->id;
+
+	if (pr->hcl->method != HTTP_M_POST) {
+		log_dbg("req " HCL_ID " with puller " HCL_ID " is non-POST",
+			pr->hcl->id, ar->hcl->id);
+
+		/* XHR requires a return, thus just give it a blank body */
+		/* Empty-ish body (Content-Length is arranged by conn) */
+		conn_printf(&ar->hcl->conn, "Non-POST JumpBox response\r\n");
+
+		/* Put this on the proxy_out list */
+		djb_out_add(pr);
+
+		/* This request is done */
+		httpsrv_done(ar->hcl);
+
+		/* Done handling this connection */
+		connset_handling_done(&ar->hcl->conn, false);
+
+	} else {
+		/* POST request */
+		log_dbg("req " HCL_ID " with puller " HCL_ID " is POST",
+			pr->hcl->id, ar->hcl->id);
+
+		/* Add the content type of the data to come */
+		conn_addheaderf(&ar->hcl->conn, "Content-Type: %s",
+				strlen(pr->hcl->headers.content_type) > 0 ?
+					pr->hcl->headers.content_type :
+					"text/html");
+
+		/* Is there no body, then nothing further to do */
+		if (!djb_has_body(pr->hcl)) {
+			/* Put this on the proxy_out list */
+			djb_out_add(pr);
+
+			/* This request is done (after flushing) */
+			httpsrv_done(ar->hcl);
+
+			/* Done handling this connection */
+			connset_handling_done(&ar->hcl->conn, false);
+		} else {
+			log_dbg("Forwarding POST body from "
+				HCL_ID " (keephandling=%s) to " HCL_ID " (keephandling=%s)",
+				pr->hcl->id, yesno(pr->hcl->keephandling),
+				ar->hcl->id, yesno(ar->hcl->keephandling));
+
+			/*
+			 * Forward the body from pr->hcl to ar->hcl; both are
+			 * parked, thus a relay can start right away and puts
+			 * it on the proxy_out list when done
+			 */
+			if (djb_forward(pr, pr->hcl, ar->hcl, true,
+					DJBM_BYTES_UP, djb_forward_up_done)) {
+				djb_relay_start(&pr->relay);
+			} else {
+				/* Put this on the proxy_out list */
+				djb_out_add(pr);
+			}
+		}
+	}
+
+	log_dbg("end");
+}
+
+/*
+ * Get the complete body on this thread, it may block (relay thread,
+ * see djb_ws_forward())
+ */
+static bool
+djb_readbody_sync(httpsrv_client_t *hcl);
+static bool
+djb_readbody_sync(httpsrv_client_t *hcl) {
+	char	*body;
+	size_t	len;
+
+	if (hcl->readbody != NULL || !djb_has_body(hcl)) {
+		return (true);
+	}
+
+	if (djb_is_chunked(hcl)) {
+		body = djb_chunked_read(&hcl->conn, DJB_CHUNKED_MAX, &len);
+		if (body == NULL) {
+			log_wrn(HCL_ID " could not read chunked body",
+				hcl->id);
+			return (false);
+		}
+
+		return (djb_readbody_decoded(hcl, 0, body, len) !=
+			DJB_BODY_ERROR);
+	}
+
+	/* Still on the wire, take it from there ourselves */
+	if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
+		return (false);
+	}
+
+	if (!djb_read_full(&hcl->conn, hcl->readbody,
+			   hcl->headers.content_length)) {
+		httpsrv_readbody_free(hcl);
+		return (false);
+	}
+
+	hcl->readbody_off = hcl->headers.content_length;
+	return (true);
+}
+
+/*
+ * pr = client request
+ * ws = the channel of its puller
+ *
+ * The request goes out as one message, the body included. Returns
+ * false when the channel is gone; the request is then not outstanding.
+ */
+static bool
+djb_ws_forward(djb_req_t *pr, djbw_t *ws);
+static bool
+djb_ws_forward(djb_req_t *pr, djbw_t *ws) {
+	httpsrv_client_t	*hcl = pr->hcl;
+	djb_headers_t		*dh = pr->dh;
+	djbw_msg_t		msg;
+	const char		*uri;
+	char			seqno[32];
+	bool			ok;
+
+	if (djbw_closed(ws)) {
+		return (false);
+	}
+
+	log_dbg("request " HCL_ID ", ws " HCL_ID, hcl->id, ws->hcl_id);
+
+	/* Read in on a relay thread when it was still on the wire */
+	if (hcl->method == HTTP_M_POST && !djb_readbody_sync(hcl)) {
+		log_wrn(HCL_ID " could not read body", hcl->id);
+		djb_error(hcl, 500, "Could not read body");
+		djb_req_free(pr);
+		return (true);
+	}
+
+	uri = aprintf("http://%s%s", hcl->headers.hostname,
+		      hcl->headers.rawuri);
+	if (uri == NULL) {
+		djb_error(hcl, 500, "Out of memory");
+		djb_req_free(pr);
+		return (true);
+	}
+
+	snprintf(seqno, sizeof seqno, "%09" PRIx64 "%09" PRIx64,
+		 hcl->id, hcl->reqid);
+
+	memzero(&msg, sizeof msg);
+	msg.type = DJBW_REQUEST;
+	msg.field[DJBW_SEQNO] = seqno;
+	msg.field[DJBW_URI] = uri;
+	msg.field[DJBW_METHOD] = httpsrv_methodname(hcl->method);
+
+	/* Client to server */
+	if (dh != NULL && dh->cookie != NULL) {
+		msg.field[DJBW_COOKIE] = dh->cookie;
+	}
+
+	if (hcl->method == HTTP_M_POST) {
+		msg.field[DJBW_CTYPE] = strlen(hcl->headers.content_type) > 0 ?
+					hcl->headers.content_type : "text/html";
+
+		/* Kept until answered, so that it can be sent again */
+		msg.body = hcl->readbody;
+		msg.body_len = hcl->readbody != NULL ? hcl->readbody_off : 0;
+	}
+
+	/* Outstanding before it is out, the answer can be quick */
+	pr->phcl_id = ws->hcl_id;
+	djb_out_add(pr);
+
+	ok = djbw_send(ws, &msg);
+	aprintf_free(uri);
+
+	if (ok) {
+		djbm_add(DJBM_BYTES_UP, msg.body_len);
+		return (true);
+	}
+
+	/* Take it back, unless a close or deadline did already */
+	if (djb_find_req(hcl->id, hcl->reqid) != pr) {
+		return (true);
+	}
+
+	/* Not the channel, this request cannot be sent */
+	if (!djbw_closed(ws)) {
+		djb_error(hcl, 502, "Could not send request");
+		djb_req_free(pr);
+		djb_ws_pull(ws);
+		return (true);
+	}
+
+	pr->phcl_id = 0;
+	return (false);
+}
+
+/* A request for a channel, its body read in on a relay thread */
+static void
+djb_ws_body_read(djb_relay_t *r, bool ok);
+static void
+djb_ws_body_read(djb_relay_t *r, bool UNUSED ok) {
+	djb_req_t	*pr = (djb_req_t *)r->data;
+	djbw_t		*ws = pr->ws;
+
+	pr->ws = NULL;
+
+	if (!djb_ws_forward(pr, ws)) {
+		/* The channel went away, another puller then */
+		djb_match_any(pr);
+	}
+
+	djbw_put(ws);
+}
+
+/*
+ * Does the body of this request still have to be read in? A channel
+ * sends it along in one message, thus it needs it complete.
+ */
+static bool
+djb_ws_body_pending(httpsrv_client_t *hcl);
+static bool
+djb_ws_body_pending(httpsrv_client_t *hcl) {
+	return (hcl->method == HTTP_M_POST && hcl->readbody == NULL &&
+		djb_has_body(hcl));
+}
+
+/*
+ * Matchmaker
+ *
+ * Requests and pullers meet here. Whichever side arrives second is
+ * paired straight away on the thread that delivered it, so no thread
+ * ever blocks while holding one half of a pair.
+ *
+ * Each side first tries to take a partner from the other queue and
+ * otherwise queues itself; after queueing it checks again, as the
+ * other side might have arrived concurrently and missed us. Both
+ * sides publish first and look second, thus at least one of them
+ * sees the other.
+ */
+static void
+djb_match_pair(djb_req_t *pr, djb_req_t *ar);
+static void
+djb_match_pair(djb_req_t *pr, djb_req_t *ar) {
+	djb_headers_t *pdh;
+
+	log_dbg("request " HCL_ID ", puller " HCL_ID,
+		pr->hcl->id, ar->hcl->id);
+
+	/* The next requests of this connection prefer this circuit */
+	pdh = pr->dh;
+	if (pdh != NULL && ar->circuit != 0) {
+		__atomic_store_n(&pdh->circuit, ar->circuit, __ATOMIC_RELAXED);
+	}
+
+	/* Before it is out, the answer can be quick */
+	if (pdh != NULL) {
+		pdh->trace.circuit = ar->circuit;
+		djbx_mark(&pdh->trace, DJBX_PAIR);
+	}
+
+	if (ar->ws == NULL) {
+		djb_handle_forward(pr, ar);
+	} else if (djb_ws_body_pending(pr->hcl)) {
+		/*
+		 * Reading it in can block, thus a relay thread does that and
+		 * sends it; the request takes over the channel reference
+		 */
+		pr->ws = ar->ws;
+		ar->ws = NULL;
+
+		memzero(&pr->relay, sizeof pr->relay);
+		pr->relay.from = pr->hcl;
+		pr->relay.done = djb_ws_body_read;
+		pr->relay.data = pr;
+		djb_relay_start(&pr->relay);
+	} else if (!djb_ws_forward(pr, ar->ws)) {
+		/* The channel went away, another puller then */
+		djb_req_free(ar);
+		djb_match_any(pr);
+		return;
+	}
+
+	djbm_inc(DJBM_PAIRED);
+
+	/* Release it */
+	djb_req_free(ar);
+
+	/* Served another one */
+	thread_serve();
+}
+
+/* Answer an expired pull, on the puller's own connection thread */
+static void
+djb_pull_expired(httpsrv_client_t *hcl);
+static void
+djb_pull_expired(httpsrv_client_t *hcl) {
+	djb_error(hcl, 408, "No request in time");
+	connset_handling_done(&hcl->conn, false);
+}
+
+/*
+ * A waiting pull ran out of time (timer thread)
+ *
+ * The connection is not ours to answer: flag it and wake its connset,
+ * which then runs djb_pull_expired() for it.
+ */
+static void
+djb_pull_expire(void *data);
+static void
+djb_pull_expire(void *data) {
+	djb_req_t		*ar = (djb_req_t *)data;
+	httpsrv_client_t	*hcl = ar->hcl;
+	uint32_t		st = DJB_REQ_WAIT;
+
+	/* Paired meanwhile? */
+	if (!__atomic_compare_exchange_n(&ar->state, &st, DJB_REQ_EXPIRED,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	log_dbg("puller " HCL_ID " expired", hcl->id);
+
+	djb_puller_unwait(ar);
+	__atomic_add_fetch(&l_exp_pull, 1, __ATOMIC_RELAXED);
+
+	/* It stays queued, djb_puller_pop() releases it: ar is gone now */
+	__atomic_add_fetch(&l_pull_dead, 1, __ATOMIC_RELAXED);
+
+	httpsrv_set_posthandle(hcl, djb_pull_expired);
+	djb_force_handling(hcl);
+}
+
+/* Missing histograms just do not record */
+static void
+djb_lat_create(djbh_t **lat);
+static void
+djb_lat_create(djbh_t **lat) {
+	unsigned int i;
+
+	for (i = 0; i < DJB_LAT_MAX; i++) {
+		lat[i] = djbh_create();
+	}
+}
+
+static void
+djb_lat_free(djbh_t **lat);
+static void
+djb_lat_free(djbh_t **lat) {
+	unsigned int i;
+
+	for (i = 0; i < DJB_LAT_MAX; i++) {
+		djbh_free(lat[i]);
+		lat[i] = NULL;
+	}
+}
+
+/*
+ * Circuit affinity
+ *
+ * Pullers tell their circuit in the URL (/next/<circuit>/..., also
+ * /pull/<circuit>/); a StegoTorus connection remembers the circuit
+ * that took its last request (djb_headers_t circuit) and its next
+ * request prefers that circuit, so that the browser state (cookies,
+ * connections to the exit server) of that circuit gets reused.
+ *
+ * A parked puller is in q_api_pull as always and is also known as
+ * the 'puller' of its circuit. A request for that circuit steals it
+ * (DJB_REQ_STOLEN) and pairs with a copy; the original is left as a
+ * husk in q_api_pull, just like an expired one, which djb_puller_pop()
+ * or djb_puller_reap() releases. Without a parked puller the request waits on the
+ * 'pending' list of the circuit for at most l_affinity_wait ms, where
+ * the next puller of that circuit looks first, before going to
+ * q_proxy_new for any puller. Control requests never wait.
+ */
+static djb_circuit_t *
+djb_circuit_get(uint32_t id, bool create);
+static djb_circuit_t *
+djb_circuit_get(uint32_t id, bool create) {
+	djb_circuit_t	*c = NULL;
+	unsigned int	i, n;
+
+	if (id == 0) {
+		return (NULL);
+	}
+
+	/* Published entries do not change */
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		if (l_circuits[i].id == id) {
+			return (&l_circuits[i]);
+		}
+	}
+
+	if (!create) {
+		return (NULL);
+	}
+
+	mutex_lock(l_circuits_mutex);
+
+	/* Added meanwhile? */
+	for (i = n; i < l_ncircuits; i++) {
+		if (l_circuits[i].id == id) {
+			c = &l_circuits[i];
+			break;
+		}
+	}
+
+	if (c == NULL && l_ncircuits < DJB_CIRCUITS) {
+		c = &l_circuits[l_ncircuits];
+		list_init(&c->pending);
+		djb_lat_create(c->lat);
+		c->id = id;
+		__atomic_store_n(&l_ncircuits, l_ncircuits + 1,
+				 __ATOMIC_RELEASE);
+	} else if (c == NULL) {
+		log_wrn("Too many circuits, no affinity for %u", id);
+	}
+
+	mutex_unlock(l_circuits_mutex);
+
+	return (c);
+}
+
+static void
+djb_circuits_exit(void);
+static void
+djb_circuits_exit(void) {
+	unsigned int i;
+
+	djbt_cancel(&l_lat_timer);
+
+	for (i = 0; i < l_ncircuits; i++) {
+		list_destroy(&l_circuits[i].pending);
+		djb_lat_free(l_circuits[i].lat);
+	}
+
+	djb_lat_free(l_lat_none);
+
+	l_ncircuits = 0;
+	mutex_destroy(l_circuits_mutex);
+}
+
+static void
+djb_lat_record(const djbx_rec_t *r) {
+	const uint64_t	*ts = r->ts;
+	djb_circuit_t	*c;
+	djbh_t		**lat;
+
+	if (r->circuit > UINT32_MAX) {
+		c = NULL;
+	} else {
+		c = djb_circuit_get((uint32_t)r->circuit, false);
+	}
+	lat = c != NULL ? c->lat : l_lat_none;
+
+	if (ts[DJBX_PAIR] == 0) {
+		return;
+	}
+
+	if (lat[DJB_LAT_QUEUED] != NULL) {
+		djbh_record(lat[DJB_LAT_QUEUED],
+			    ts[DJBX_PAIR] - ts[DJBX_ENQUEUE]);
+	}
+
+	if (ts[DJBX_PUSH] == 0) {
+		return;
+	}
+
+	if (lat[DJB_LAT_PLUGIN] != NULL) {
+		djbh_record(lat[DJB_LAT_PLUGIN], ts[DJBX_PUSH] - ts[DJBX_PAIR]);
+	}
+
+	if (ts[DJBX_DONE] != 0 && lat[DJB_LAT_FORWARD] != NULL) {
+		djbh_record(lat[DJB_LAT_FORWARD], ts[DJBX_DONE] - ts[DJBX_PUSH]);
+	}
+}
+
+/* Close the running interval of every histogram, then again later */
+static void
+djb_lat_rotate(void *data);
+static void
+djb_lat_rotate(void *data) {
+	unsigned int i, j, n;
+
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < DJB_LAT_MAX; j++) {
+			if (l_circuits[i].lat[j] != NULL) {
+				djbh_rotate(l_circuits[i].lat[j]);
+			}
+		}
+	}
+
+	for (j = 0; j < DJB_LAT_MAX; j++) {
+		if (l_lat_none[j] != NULL) {
+			djbh_rotate(l_lat_none[j]);
+		}
+	}
+
+	djbt_arm(&l_lat_timer, l_lat_interval * 1000, djb_lat_rotate, data);
+}
+
+/* The circuit a pull/next URL names, 0 for none */
+static uint32_t
+djb_circuit_uri(const char *uri);
+static uint32_t
+djb_circuit_uri(const char *uri) {
+	/* /pull/ and /next/ are both 6 characters */
+	if (strlen(uri) <= 6) {
+		return (0);
+	}
+
+	return ((uint32_t)strtoul(&uri[6], NULL, 10));
+}
+
+/* A puller stopped waiting (paired, stolen, expired or refused) */
+static void
+djb_puller_unwait(djb_req_t *ar) {
+	djb_circuit_t *c = djb_circuit_get(ar->circuit, false);
+
+	if (c != NULL) {
+		__atomic_sub_fetch(&c->pullers, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* The puller is not parked anymore; before it gets released */
+static void
+djb_affinity_unpark(djb_req_t *ar);
+static void
+djb_affinity_unpark(djb_req_t *ar) {
+	djb_circuit_t *c = djb_circuit_get(ar->circuit, false);
+
+	if (c == NULL) {
+		return;
+	}
+
+	list_lock(&c->pending);
+	if (c->puller == ar) {
+		c->puller = NULL;
+	}
+	list_unlock(&c->pending);
+}
+
+/* Take the oldest request waiting for this circuit */
+static djb_req_t *
+djb_affinity_take(djb_circuit_t *c);
+static djb_req_t *
+djb_affinity_take(djb_circuit_t *c) {
+	djb_req_t *pr;
+
+	list_lock(&c->pending);
+	pr = (djb_req_t *)c->pending.head;
+	if (pr != NULL) {
+		list_remove(&c->pending, &pr->node);
+		pr->state = DJB_REQ_NONE;
+	}
+	list_unlock(&c->pending);
+
+	if (pr == NULL) {
+		return (NULL);
+	}
+
+	/* Ours now, the fallback is not needed anymore */
+	djbt_cancel(&pr->timer);
+	__atomic_add_fetch(&c->taken, 1, __ATOMIC_RELAXED);
+
+	return (pr);
+}
+
+/* No puller of its circuit in time, any will do (timer thread) */
+static void
+djb_affinity_expire(void *data);
+static void
+djb_affinity_expire(void *data) {
+	djb_req_t	*pr = (djb_req_t *)data;
+	djb_circuit_t	*c = djb_circuit_get(pr->circuit, false);
+	bool		mine;
+
+	list_lock(&c->pending);
+	mine = (pr->state == DJB_REQ_WAIT);
+	if (mine) {
+		list_remove(&c->pending, &pr->node);
+		pr->state = DJB_REQ_NONE;
+	}
+	list_unlock(&c->pending);
+
+	/* A puller of the circuit took it meanwhile */
+	if (!mine) {
+		return;
+	}
+
+	__atomic_add_fetch(&c->fallbacks, 1, __ATOMIC_RELAXED);
+
+	djb_match_any(pr);
+}
+
+/*
+ * A request that prefers a circuit: pair it with the parked puller of
+ * that circuit or let it wait for one. Returns false when it has no
+ * (known) circuit or should not wait; then any puller can take it.
+ */
+static bool
+djb_affinity_request(djb_req_t *pr);
+static bool
+djb_affinity_request(djb_req_t *pr) {
+	djb_headers_t	*pdh = pr->dh;
+	djb_circuit_t	*c;
+	djb_req_t	*ar, *nar = NULL;
+	uint32_t	st;
+
+	if (pdh == NULL) {
+		return (false);
+	}
+
+	c = djb_circuit_get(__atomic_load_n(&pdh->circuit, __ATOMIC_RELAXED),
+			    false);
+	if (c == NULL) {
+		return (false);
+	}
+
+	list_lock(&c->pending);
+
+	ar = c->puller;
+	if (ar != NULL) {
+		c->puller = NULL;
+
+		/* The copy we pair with, the original stays a husk */
+		nar = djb_req_alloc(ar->hcl);
+
+		st = DJB_REQ_WAIT;
+		if (nar == NULL ||
+		    !__atomic_compare_exchange_n(&ar->state, &st,
+						 DJB_REQ_STOLEN, false,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			/* Expired or taken by anybody meanwhile */
+			djb_req_free(nar);
+			nar = NULL;
+		} else {
+			djb_puller_unwait(ar);
+			nar->circuit = ar->circuit;
+			nar->ws = ar->ws;
+			if (nar->ws != NULL) {
+				djbw_get(nar->ws);
+			}
+		}
+	}
+
+	if (nar == NULL && l_affinity_wait > 0 &&
+	    pr->prio != DJB_PRIO_CONTROL) {
+		pr->circuit = c->id;
+		pr->state = DJB_REQ_WAIT;
+		list_addtail(&c->pending, &pr->node);
+		djbt_arm(&pr->timer, l_affinity_wait,
+			 djb_affinity_expire, pr);
+		list_unlock(&c->pending);
+
+		__atomic_add_fetch(&c->waits, 1, __ATOMIC_RELAXED);
+		return (true);
+	}
+
+	list_unlock(&c->pending);
+
+	if (nar == NULL) {
+		return (false);
+	}
+
+	/* The husk is released by djb_puller_pop() or djb_puller_reap() */
+	__atomic_add_fetch(&l_pull_dead, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+
+	djb_match_pair(pr, nar);
+	djb_puller_reap();
+
+	return (true);
+}
+
+/* An expired or stolen puller, only still queued */
+static bool
+djb_puller_dead(djb_req_t *ar);
+static bool
+djb_puller_dead(djb_req_t *ar) {
+	return (__atomic_load_n(&ar->state, __ATOMIC_ACQUIRE) != DJB_REQ_WAIT);
+}
+
+/* Release a husk taken from q_api_pull */
+static void
+djb_puller_bury(djb_req_t *ar);
+static void
+djb_puller_bury(djb_req_t *ar) {
+	/* Waits for an expiry that is still busy with it */
+	djbt_cancel(&ar->timer);
+	djb_affinity_unpark(ar);
+	__atomic_sub_fetch(&l_pull_dead, 1, __ATOMIC_RELAXED);
+	djb_req_free(ar);
+}
+
+/* Take a puller that did not expire yet */
+static djb_req_t *
+djb_puller_pop(void);
+static djb_req_t *
+djb_puller_pop(void) {
+	djb_req_t	*ar;
+	uint32_t	st;
+
+	while ((ar = djbq_trypop(&q_api_pull)) != NULL) {
+		st = DJB_REQ_WAIT;
+		if (__atomic_compare_exchange_n(&ar->state, &st,
+						DJB_REQ_TAKEN, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			djbt_cancel(&ar->timer);
+			djb_affinity_unpark(ar);
+			djb_puller_unwait(ar);
+
+			/* Its WebSocket channel is gone */
+			if (ar->ws != NULL && djbw_closed(ar->ws)) {
+				djb_req_free(ar);
+				continue;
+			}
+
+			return (ar);
+		}
+
+		/* Already answered with a 408, or stolen by its circuit */
+		djb_puller_bury(ar);
+	}
+
+	return (NULL);
+}
+
+/*
+ * A puller that can not be queued: answer it, unless the deadline beat
+ * us to it, and release it
+ */
+static void
+djb_puller_refuse(djb_req_t *ar);
+static void
+djb_puller_refuse(djb_req_t *ar) {
+	log_wrn(HCL_ID " too many outstanding pulls", ar->hcl->id);
+	__atomic_add_fetch(&l_shed_pull, 1, __ATOMIC_RELAXED);
+
+	if (__atomic_exchange_n(&ar->state, DJB_REQ_TAKEN,
+				__ATOMIC_ACQ_REL) == DJB_REQ_WAIT) {
+		djb_puller_unwait(ar);
+
+		/* A channel parks it again later (djb_ws_retry()) */
+		if (ar->ws == NULL) {
+			djb_error(ar->hcl, 503, "Too many outstanding pulls");
+		} else {
+			__atomic_add_fetch(&ar->ws->owed, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_sub_fetch(&l_pull_dead, 1, __ATOMIC_RELAXED);
+	}
+
+	djbt_cancel(&ar->timer);
+	djb_affinity_unpark(ar);
+	djb_req_free(ar);
+}
+
+/*
+ * Release the husks at the head of q_api_pull
+ *
+ * Otherwise they would only go once a request takes a puller from the
+ * queue, which steady traffic for the circuits of the pullers never
+ * does: every such request steals the parked puller of its circuit.
+ */
+static void
+djb_puller_reap(void) {
+	djb_req_t *ar;
+
+	while (__atomic_load_n(&l_pull_dead, __ATOMIC_RELAXED) > 0 &&
+	       (ar = djbq_trypop_if(&q_api_pull, djb_puller_dead)) != NULL) {
+		djb_puller_bury(ar);
+	}
+}
+
+/*
+ * q_api_pull is full: make a round through it, releasing the husks
+ * that live pullers at the head kept djb_puller_reap() from, and
+ * requeueing those live pullers
+ */
+static void
+djb_puller_compact(void);
+static void
+djb_puller_compact(void) {
+	djb_req_t	*ar;
+	unsigned int	n;
+
+	for (n = djbq_depth(&q_api_pull); n > 0; n--) {
+		ar = djbq_trypop(&q_api_pull);
+		if (ar == NULL) {
+			break;
+		}
+
+		if (djb_puller_dead(ar)) {
+			djb_puller_bury(ar);
+			continue;
+		}
+
+		/* Taken meanwhile it is a husk again, as it should be */
+		if (!djbq_push(&q_api_pull, ar)) {
+			djb_puller_refuse(ar);
+		}
+	}
+}
+
+static void
+djb_match_drain(void);
+static void
+djb_match_drain(void) {
+	djb_req_t *pr, *ar;
+
+	while (djb_request_depth() > 0 && djbq_depth(&q_api_pull) > 0) {
+		pr = djb_request_pop();
+		if (pr == NULL) {
+			/* Somebody else took it (or it is not published yet) */
+			break;
+		}
+
+		ar = djb_puller_pop();
+		if (ar != NULL) {
+			djb_match_pair(pr, ar);
+			continue;
+		}
+
+		/*
+		 * Lost the puller to another thread, or it is still
+		 * being published: put the request back at the head, so
+		 * that it keeps its turn, and look again, the publisher
+		 * might already have checked and missed it
+		 */
+		if (!djb_request_push(pr, true)) {
+			log_err("Could not requeue " HCL_ID, pr->hcl->id);
+			djb_shed(pr->hcl, &l_shed_queue, "Proxy queue full");
+			djb_req_free(pr);
+			break;
+		}
+	}
+}
+
+/* A proxy request that any puller can take */
+static bool
+djb_match_any(djb_req_t *pr) {
+	djb_req_t *ar;
+
+	/* A puller waiting already? */
+	ar = djb_puller_pop();
+	if (ar != NULL) {
+		djb_match_pair(pr, ar);
+		return (true);
+	}
+
+	/* Wait for a puller */
+	if (!djb_request_push(pr, false)) {
+		djb_shed(pr->hcl, &l_shed_queue, "Proxy queue full");
+		djb_req_free(pr);
+		return (false);
+	}
+
+	djb_match_drain();
+
+	return (true);
+}
+
+/* A new (or rescheduled) proxy request */
+static bool
+djb_match_request(djb_req_t *pr) {
+	/* Its circuit first */
+	if (djb_affinity_request(pr)) {
+		return (true);
+	}
+
+	return (djb_match_any(pr));
+}
+
+/* A new puller */
+static void
+djb_match_puller(djb_req_t *ar);
+static void
+djb_match_puller(djb_req_t *ar) {
+	djb_circuit_t	*c;
+	djb_req_t	*pr = NULL;
+	uint32_t	st;
+
+	c = djb_circuit_get(ar->circuit, true);
+
+	/* Control first, then one waiting for this circuit, then any */
+	pr = djb_request_pop_ctl();
+
+	if (pr == NULL && c != NULL) {
+		pr = djb_affinity_take(c);
+	}
+
+	if (pr == NULL) {
+		pr = djb_request_pop();
+	}
+
+	if (pr != NULL) {
+		djb_match_pair(pr, ar);
+		return;
+	}
+
+	/* Wait for a request, but not forever (a channel waits as long) */
+	ar->state = DJB_REQ_WAIT;
+	if (c != NULL) {
+		__atomic_add_fetch(&c->pullers, 1, __ATOMIC_RELAXED);
+	}
+	if (l_to_pull > 0 && ar->ws == NULL) {
+		djbt_arm(&ar->timer, l_to_pull, djb_pull_expire, ar);
+	}
+
+	/* Park it with its circuit, unless a request came in meanwhile */
+	if (c != NULL) {
+		list_lock(&c->pending);
+		pr = (djb_req_t *)c->pending.head;
+		if (pr != NULL) {
+			list_remove(&c->pending, &pr->node);
+			pr->state = DJB_REQ_NONE;
+		} else {
+			c->puller = ar;
+		}
+		list_unlock(&c->pending);
+	}
+
+	if (pr != NULL) {
+		djbt_cancel(&pr->timer);
+		__atomic_add_fetch(&c->taken, 1, __ATOMIC_RELAXED);
+
+		st = DJB_REQ_WAIT;
+		if (__atomic_compare_exchange_n(&ar->state, &st,
+						DJB_REQ_TAKEN, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			djbt_cancel(&ar->timer);
+			djb_puller_unwait(ar);
+			djb_match_pair(pr, ar);
+			return;
+		}
+
+		/* Answered with a 408 already, never queued */
+		djbt_cancel(&ar->timer);
+		__atomic_sub_fetch(&l_pull_dead, 1, __ATOMIC_RELAXED);
+		djb_req_free(ar);
+		djb_match_any(pr);
+		return;
+	}
+
+	/* Husks must not take the room of live pullers */
+	djb_puller_reap();
+
+	if (!djbq_push(&q_api_pull, ar)) {
+		djb_puller_compact();
+
+		if (!djbq_push(&q_api_pull, ar)) {
+			djb_puller_refuse(ar);
+			return;
+		}
+	}
+
+	djb_match_drain();
+}
+
+static void
+djb_pull_post(httpsrv_client_t *hcl);
+static void
+djb_pull_post(httpsrv_client_t *hcl) {
+	djb_req_t		*ar;
+#ifdef DEBUG
+	uint64_t		id = hcl->id;
+#endif
+
+	log_dbg(HCL_ID, id);
+
+	/* Proxy request - add it to the requester list */
+	ar = djb_req_alloc(hcl);
+	if (!ar) {
+		djb_error(hcl, 500, "Out of memory");
+
+		/* XXX: All is lost here, maybe cleanup hcl? */
+		return;
+	}
+
+	/* Its circuit, if it tells */
+	ar->circuit = djb_circuit_uri(hcl->headers.uri);
+
+	/* Pair it with a request, or wait for one */
+	djb_match_puller(ar);
+
+	log_dbg(HCL_ID " done", id);
+}
+
+static bool
+djb_pull(httpsrv_client_t *hcl);
+static bool
+djb_pull(httpsrv_client_t *hcl){
+	log_dbg(HCL_ID " keephandling=yes", hcl->id);
+
+	/*
+	 * Add this request to the queue when the request is handled
+	 * The manager will divide the work
+	 */
+	hcl->keephandling = true;
+	djb_posthandle(hcl, djb_pull_post);
+
+	/* No need to read from it further for the moment */
+	return (true);
+}
+
+/*
+ * Batched push (DJB-Batch header)
+ *
+ * The body is a JSON array of records, each carrying what a single
+ * push carries in its headers and body: DJB-SeqNo, DJB-HTTPCode,
+ * DJB-HTTPText and optionally DJB-Set-Cookie, Content-Type and a
+ * base64 encoded Body. Every record is answered to its waiting client.
+ *
+ * The reply is a JSON array with, in order, an HTTP style status per
+ * record: 200 delivered, 404 not outstanding (timed out etc), 410 the
+ * client went away, 504 malformed record.
+ */
+static void
+djb_put_body(httpsrv_client_t *hcl, const char *body, size_t len);
+static void
+djb_put_body(httpsrv_client_t *hcl, const char *body, size_t len) {
+	if (len > 0 && !conn_putn(&hcl->conn, body, len)) {
+		log_wrn(HCL_ID " could not queue %zu body bytes",
+			hcl->id, len);
+	}
+}
+
+/* The headers the plugin answered with, for the client (see djb_push()) */
+static void
+djb_answer_headers(httpsrv_client_t *to, httpsrv_client_t *from);
+static void
+djb_answer_headers(httpsrv_client_t *to, httpsrv_client_t *from) {
+	/* XXX: We should scrub DJB-SeqNo */
+	buf_lock(&from->the_headers);
+	conn_addheaders(&to->conn, buf_buffer(&from->the_headers));
+	buf_unlock(&from->the_headers);
+}
+
+/*
+ * Answer an outstanding request with a complete answer, releasing pr;
+ * 'from', when not NULL, is the plugin request whose headers go along
+ * Returns 200 when delivered, 410 when its client went away
+ */
+static unsigned int
+djb_answer_deliver(djb_req_t *pr, djb_answer_t *ans, const char *setcookie,
+		   httpsrv_client_t *from);
+static unsigned int
+djb_answer_deliver(djb_req_t *pr, djb_answer_t *ans, const char *setcookie,
+		   httpsrv_client_t *from) {
+	djb_headers_t	*pdh;
+	unsigned int	status = 200;
+
+	fassert(pr->hcl != NULL);
+	pdh = pr->dh;
+
+	if (pdh != NULL && pdh->push != NULL) {
+		/* Internal proxy request, the caller handles it */
+		ans->setcookie = setcookie;
+		djbx_mark(&pdh->trace, DJBX_PUSH);
+		djb_trace_commit(pdh);
+		pdh->push(pr->hcl, ans);
+
+		djbm_inc(DJBM_PUSHED);
+		djbm_add(DJBM_BYTES_DOWN, ans->body_len);
+
+	} else if (!conn_is_valid(&pr->hcl->conn)) {
+		log_dbg(HCL_ID " " CONN_ID " closed",
+			pr->hcl->id, conn_id(&pr->hcl->conn));
+		status = 410;
+
+	} else {
+		djb_force_handling(pr->hcl);
+
+		/* Queued whole, thus forwarded as well */
+		djb_trace(pr->dh, DJBX_PUSH);
+		djb_trace(pr->dh, DJBX_DONE);
+
+		httpsrv_answer(pr->hcl, ans->httpcode, ans->httptext,
+			       ans->content_type);
+
+		/* Server to Client */
+		if (setcookie != NULL && strlen(setcookie) > 0) {
+			conn_addheaderf(&pr->hcl->conn, "Set-Cookie: %s",
+					setcookie);
+		}
+
+		if (from != NULL) {
+			djb_answer_headers(pr->hcl, from);
+		}
+
+		djb_put_body(pr->hcl, ans->body, ans->body_len);
+
+		/* This request is done (after flushing) */
+		httpsrv_done(pr->hcl);
+
+		djbm_inc(DJBM_PUSHED);
+		djbm_add(DJBM_BYTES_DOWN, ans->body_len);
+	}
+
+	djb_req_free(pr);
+
+	return (status);
+}
+
+static unsigned int
+djb_push_record(json_t *rec);
+static unsigned int
+djb_push_record(json_t *rec) {
+	djb_req_t	*pr;
+	djb_answer_t	ans;
+	json_t		*code;
+	const char	*seqno, *setcookie, *b64;
+	uint64_t	id, reqid;
+	unsigned int	status;
+
+	memzero(&ans, sizeof ans);
+
+	seqno = json_string_value(json_object_get(rec, "DJB-SeqNo"));
+	ans.httptext = json_string_value(json_object_get(rec, "DJB-HTTPText"));
+	ans.content_type = json_string_value(json_object_get(rec,
+							     "Content-Type"));
+	setcookie = json_string_value(json_object_get(rec, "DJB-Set-Cookie"));
+	b64 = json_string_value(json_object_get(rec, "Body"));
+
+	/* The plugin sends it as a string, accept a number too */
+	code = json_object_get(rec, "DJB-HTTPCode");
+	if (json_is_integer(code)) {
+		ans.httpcode = (unsigned int)json_integer_value(code);
+	} else if (json_is_string(code)) {
+		ans.httpcode = atoi(json_string_value(code));
+	}
+
+	if (seqno == NULL || ans.httpcode == 0 || ans.httptext == NULL ||
+	    sscanf(seqno, "%09" PRIx64 "%09" PRIx64, &id, &reqid) != 2) {
+		return (504);
+	}
+
+	if (b64 != NULL && strlen(b64) > 0) {
+		ans.body = djb_base64_decode(b64, &ans.body_len);
+		if (ans.body == NULL) {
+			return (504);
+		}
+	}
+
+	pr = djb_find_req(id, reqid);
+	if (pr == NULL) {
+		status = 404;
+	} else {
+		status = djb_answer_deliver(pr, &ans, setcookie, NULL);
+	}
+
+	free(ans.body);
+
+	return (status);
+}
+
+static bool
+djb_push_batch(httpsrv_client_t *hcl);
+static bool
+djb_push_batch(httpsrv_client_t *hcl) {
+	json_t		*root, *res;
+	json_error_t	jerr;
+	char		*out;
+	size_t		i;
+	bool		ret;
+
+	/* Get the complete body first */
+	if (!djb_body_need(hcl, 0, "Batched push", &ret)) {
+		return (ret);
+	}
+
+	root = json_loadb(hcl->readbody, hcl->readbody_off, 0, &jerr);
+	httpsrv_readbody_free(hcl);
+
+	if (root == NULL || !json_is_array(root)) {
+		log_wrn(HCL_ID " malformed batched push", hcl->id);
+		if (root != NULL) {
+			json_decref(root);
+		}
+		djb_error(hcl, 504, "Malformed batched push");
+		return (true);
+	}
+
+	res = json_array();
+	if (res == NULL) {
+		json_decref(root);
+		djb_error(hcl, 500, "Out of memory");
+		return (true);
+	}
+
+	for (i = 0; i < json_array_size(root); i++) {
+		json_array_append_new(res, json_integer(
+				djb_push_record(json_array_get(root, i))));
+	}
+
+	log_dbg(HCL_ID " pushed %zu answers", hcl->id, i);
+
+	json_decref(root);
+
+	out = json_dumps(res, JSON_COMPACT);
+	json_decref(res);
+
+	if (out == NULL) {
+		djb_error(hcl, 500, "Could not format result");
+		return (true);
+	}
+
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_JSON);
+	conn_put(&hcl->conn, out);
+	free(out);
+
+	httpsrv_done(hcl);
+
+	/* Served several */
+	thread_serve();
+
+	return (false);
+}
+
+/* The body of a push reached its client (relay thread) */
+static void
+djb_push_done(djb_relay_t *r, bool ok);
+static void
+djb_push_done(djb_relay_t *r, bool ok) {
+	djb_req_t		*pr = (djb_req_t *)r->data;
+	httpsrv_client_t	*hcl = r->from, *to = r->to;
+
+	djb_forward_count(r, ok, DJBM_BYTES_DOWN);
+
+	/* The answer reached its client */
+	if (ok) {
+		djb_trace(pr->dh, DJBX_DONE);
+	}
+
+	/* r goes with it */
+	djb_req_free(pr);
+
+	if (!ok) {
+		djb_hangup(hcl);
+		djb_hangup(to);
+		return;
+	}
+
+	httpsrv_done(to);
+
+	/* HTTP okay */
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+
+	/* A message as a body (Content-Length is arranged by conn) */
+	conn_printf(&hcl->conn, "Push Body Forward successful\r\n");
+
+	httpsrv_done(hcl);
+
+	/* Done handling this connection */
+	connset_handling_done(&hcl->conn, false);
+}
+
+/* Push request, answer to a pull request */
+static bool
+djb_push(httpsrv_client_t *hcl, djb_headers_t *dh);
+static bool
+djb_push(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djb_req_t	*pr;
+	djb_headers_t	*pdh;
+	djb_answer_t	ans;
+
+	log_dbg(HCL_ID, hcl->id);
+
+	fassert(hcl != NULL);
+
+	/* Several answers in one go? */
+	if (strlen(dh->batch) > 0) {
+		return (djb_push_batch(hcl));
+	}
+
+	/* Find the request */
+	pr = djb_find_req_dh(hcl, dh);
+	if (pr == NULL) {
+		/* Can happen if the request timed out etc */
+		log_dbg(HCL_ID " request timed out", hcl->id);
+		httpsrv_done(hcl);
+		return (true);
+	}
+
+	fassert(pr->hcl != NULL);
+	pdh = pr->dh;
+
+	log_dbg(HCL_ID " -> " HCL_ID, hcl->id, pr->hcl->id);
+
+	if (pdh != NULL && pdh->push != NULL) {
+		log_dbg(HCL_ID " internal proxy request", hcl->id);
+
+		/* The caller wants the complete body, thus read it first */
+		if (hcl->readbody == NULL) {
+			switch (djb_readbody(hcl, 2)) {
+			case DJB_BODY_LATER:
+				/*
+				 * Put it back on the list so we can find
+				 * it again once the body has been read
+				 */
+				djb_out_add(pr);
+				return (false);
+
+			case DJB_BODY_DECODING:
+				/* Likewise, we run again once decoded */
+				djb_out_add(pr);
+				return (true);
+
+			case DJB_BODY_ERROR:
+				log_wrn(HCL_ID " could not read body",
+					hcl->id);
+				break;
+
+			case DJB_BODY_NONE:
+			case DJB_BODY_READY:
+			default:
+				break;
+			}
+		}
+
+		memzero(&ans, sizeof ans);
+		ans.httpcode = atoi(dh->httpcode);
+		ans.httptext = dh->httptext;
+		ans.content_type = hcl->headers.content_type;
+		ans.body = hcl->readbody;
+		ans.body_len = hcl->readbody != NULL ? hcl->readbody_off : 0;
+		ans.setcookie = dh->setcookie;
+
+		/* Let the caller handle it */
+		djbx_mark(&pdh->trace, DJBX_PUSH);
+		djb_trace_commit(pdh);
+		pdh->push(pr->hcl, &ans);
+
+		djbm_inc(DJBM_PUSHED);
+		djbm_add(DJBM_BYTES_DOWN, ans.body_len);
+
+		if (hcl->readbody != NULL) {
+			httpsrv_readbody_free(hcl);
+		}
+
+		/* Release it */
+		djb_req_free(pr);
+
+		/* HTTP okay */
+		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+
+		/* A message as a body (Content-Length is arranged by conn) */
+		conn_printf(&hcl->conn, "Internal Push Proxy successful\r\n");
+
+		/* Request is done */
+		httpsrv_done(hcl);
+
+		return (true);
+	}
+
+	log_dbg(HCL_ID " normal proxy request", hcl->id);
+
+	/* Connections might close before the answer is returned */
+	if (!conn_is_valid(&pr->hcl->conn)) {
+		log_dbg(HCL_ID " " CONN_ID " closed",
+			pr->hcl->id, conn_id(&pr->hcl->conn));
+
+		/* HTTP okay */
+		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+
+		conn_printf(&hcl->conn, "Remote closed connection\r\n");
+
+		/* Request is done */
+		httpsrv_done(hcl);
+		return (true);
+	}
+
+	/* Force handling */
+	if (pr->hcl->conn.connset_l != &pr->hcl->conn.connset->handling)
+	{
+		connset_handling_setup(&pr->hcl->conn);
+	}
+
+	/* We got an answer, send back what we have already */
+	httpsrv_answer(pr->hcl, atoi(dh->httpcode), dh->httptext, NULL);
+	djbm_inc(DJBM_PUSHED);
+	djb_trace(pr->dh, DJBX_PUSH);
+
+	/* Server to Client */
+	if (dh->setcookie != NULL) {
+		conn_addheaderf(&pr->hcl->conn, "Set-Cookie: %s",
+				dh->setcookie);
+	}
+
+	/* Add all the headers we received */
+	djb_answer_headers(pr->hcl, hcl);
+
+	if (!djb_has_body(hcl)) {
+		/* Send back a 200 OK as we proxied it */
+		log_dbg("API push done (no content)");
 
 		/* This request is done (after flushing) */
 		httpsrv_done(pr->hcl);
 
 		/* Release it */
-		free(pr);
+		djb_req_free(pr);
 
 		/* HTTP okay */
 		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
@@ -504,14 +3221,319 @@ djb_push(httpsrv_client_t *hcl, djb_headers_t *dh) {
 	log_dbg("Forwarding body from " HCL_ID " to " HCL_ID,
 		pr->hcl->id, hcl->id);
 
-	/* Forward the body from hcl to pr */
-	httpsrv_forward(hcl, pr->hcl);
+	/* Forward the body from hcl to pr */
+	if (!djb_forward(pr, hcl, pr->hcl, false, DJBM_BYTES_DOWN,
+			 djb_push_done)) {
+		/* Free it up, not tracked anymore */
+		djb_req_free(pr);
+
+		/* No need to read from it further for the moment */
+		return (true);
+	}
+
+	/* A relay thread moves it and answers the push */
+	djb_relay_park(hcl, dh, &pr->relay);
+
+	return (true);
+}
+
+/*
+ * WebSocket channels (see ws.c)
+ *
+ * A channel stands in for 'window' pullers of its circuit; these are
+ * parked as usual, without a deadline, and pair through
+ * djb_ws_forward(). Every response makes room for another one.
+ */
+static void
+djb_ws_pull(djbw_t *ws) {
+	djb_req_t *ar;
+
+	if (djbw_closed(ws)) {
+		return;
+	}
+
+	ar = djb_req_alloc(ws->hcl);
+	if (ar == NULL) {
+		log_crt("No memory for ws puller");
+		__atomic_add_fetch(&ws->owed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	djbw_get(ws);
+	ar->ws = ws;
+	ar->circuit = ws->circuit;
+
+	djb_match_puller(ar);
+}
+
+void
+djb_ws_open(djbw_t *ws) {
+	unsigned int i;
+
+	for (i = 0; i < ws->window; i++) {
+		djb_ws_pull(ws);
+	}
+}
+
+/*
+ * Pullers of a full q_api_pull are refused; for a channel that would
+ * shrink its window for good, thus its reader parks them again once
+ * in a while (channel thread)
+ */
+void
+djb_ws_retry(djbw_t *ws) {
+	unsigned int n;
+
+	n = __atomic_exchange_n(&ws->owed, 0, __ATOMIC_ACQ_REL);
+	while (n-- > 0) {
+		djb_ws_pull(ws);
+	}
+}
+
+/* A message from the plugin (ws thread) */
+void
+djb_ws_message(djbw_t *ws, djbw_msg_t *msg) {
+	djb_req_t	*pr;
+	djb_answer_t	ans;
+	const char	*seqno = msg->field[DJBW_SEQNO];
+	uint64_t	id, reqid;
+
+	if (msg->type != DJBW_RESPONSE) {
+		log_wrn("ws " HCL_ID " unexpected message type %u",
+			ws->hcl_id, msg->type);
+		return;
+	}
+
+	memzero(&ans, sizeof ans);
+	ans.httptext = msg->field[DJBW_HTTPTEXT];
+	ans.content_type = msg->field[DJBW_CTYPE];
+	if (msg->field[DJBW_HTTPCODE] != NULL) {
+		ans.httpcode = atoi(msg->field[DJBW_HTTPCODE]);
+	}
+	if (msg->body_len > 0) {
+		ans.body = msg->body;
+		ans.body_len = msg->body_len;
+	}
+
+	if (seqno == NULL || ans.httpcode == 0 || ans.httptext == NULL ||
+	    sscanf(seqno, "%09" PRIx64 "%09" PRIx64, &id, &reqid) != 2) {
+		log_wrn("ws " HCL_ID " malformed response", ws->hcl_id);
+	} else {
+		pr = djb_find_req(id, reqid);
+		if (pr != NULL) {
+			djb_answer_deliver(pr, &ans,
+					   msg->field[DJBW_SETCOOKIE], NULL);
+		}
+	}
+
+	/* Answered (or not), room for the next one */
+	djb_ws_pull(ws);
+	djb_ws_retry(ws);
+
+	/* Served another one */
+	thread_serve();
+}
+
+/* The request a /next/ answers, NULL when malformed or not found */
+static djb_req_t *
+djb_next_find(httpsrv_client_t *hcl, djb_headers_t *dh);
+static djb_req_t *
+djb_next_find(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	uint64_t id, reqid;
+
+	if (strlen(dh->httpcode) == 0 || dh->httptext == NULL ||
+	    sscanf(dh->seqno, "%09" PRIx64 "%09" PRIx64, &id, &reqid) != 2) {
+		log_wrn(HCL_ID " malformed answer, ignoring it", hcl->id);
+		return (NULL);
+	}
+
+	return (djb_find_req(id, reqid));
+}
+
+/*
+ * The answer of a /next/ reached its client (relay thread)
+ *
+ * Then the /next/ continues as the pull it also is, as its posthandle
+ * would have (see djb_pull()).
+ */
+static void
+djb_next_done(djb_relay_t *r, bool ok);
+static void
+djb_next_done(djb_relay_t *r, bool ok) {
+	djb_req_t		*pr = (djb_req_t *)r->data;
+	httpsrv_client_t	*hcl = r->from, *to = r->to;
+	djb_headers_t		*dh;
+
+	djb_forward_count(r, ok, DJBM_BYTES_DOWN);
+
+	/* The answer reached its client */
+	if (ok) {
+		djb_trace(pr->dh, DJBX_DONE);
+	}
+
+	/* r goes with it */
+	djb_req_free(pr);
+
+	if (!ok) {
+		djb_hangup(hcl);
+		djb_hangup(to);
+		return;
+	}
+
+	httpsrv_done(to);
+
+	/* Delivered, only the pull part remains */
+	dh = httpsrv_get_userdata(hcl);
+	if (dh != NULL) {
+		dh->seqno[0] = '\0';
+	}
+
+	djb_pull_post(hcl);
+}
+
+/*
+ * Stream an answer from 'from' to the StegoTorus client of pr
+ *
+ * Returns false, without touching anything, when the answer can not
+ * be streamed (internal request, client gone, too small or partly read
+ * for a relay). Otherwise 'from' is parked for a relay thread, which
+ * releases pr and then continues with the pull (djb_next_done()).
+ */
+static bool
+djb_answer_stream(djb_req_t *pr, httpsrv_client_t *from, djb_headers_t *dh);
+static bool
+djb_answer_stream(djb_req_t *pr, httpsrv_client_t *from, djb_headers_t *dh) {
+	djb_headers_t *pdh = pr->dh;
+
+	if ((pdh != NULL && pdh->push != NULL) ||
+	    !conn_is_valid(&pr->hcl->conn) || !djb_relay_able(from)) {
+		return (false);
+	}
+
+	djb_force_handling(pr->hcl);
+
+	httpsrv_answer(pr->hcl, atoi(dh->httpcode), dh->httptext,
+		       from->headers.content_type);
+
+	/* Server to Client */
+	if (dh->setcookie != NULL && strlen(dh->setcookie) > 0) {
+		conn_addheaderf(&pr->hcl->conn, "Set-Cookie: %s",
+				dh->setcookie);
+	}
+
+	/* As a /push/ forwards them */
+	djb_answer_headers(pr->hcl, from);
+
+	djbm_inc(DJBM_PUSHED);
+	djb_trace(pr->dh, DJBX_PUSH);
+
+	/* djb_relay_able(), thus never buffered through httpsrv */
+	djb_forward(pr, from, pr->hcl, true, DJBM_BYTES_DOWN, djb_next_done);
+	djb_relay_park(from, dh, &pr->relay);
+
+	return (true);
+}
+
+/*
+ * Combined push + pull (/next/<circuit>/...)
+ *
+ * The plugin returns the answer to its previous request (if any) in
+ * the same way as a push and then waits on the same HTTP transaction
+ * for the next request as a pull does; one localhost hop per cycle.
+ *
+ * An answer that a relay can take (chunked, or at least l_splice_min
+ * bytes) streams through to StegoTorus, as a /push/ does; only smaller
+ * ones are read completely before they are delivered. Either way the
+ * plugin's headers go along, and an answer that can not be read is a
+ * 502 for its client.
+ */
+static bool
+djb_next(httpsrv_client_t *hcl, djb_headers_t *dh);
+static bool
+djb_next(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djb_req_t	*pr;
+	djb_answer_t	ans;
+	char		lost[] = "Could not read answer\r\n";
+
+	log_dbg(HCL_ID, hcl->id);
+
+	/* Only a pull when there is no answer (the initial /next/) */
+	if (strlen(dh->seqno) == 0) {
+		return (djb_pull(hcl));
+	}
+
+	if (hcl->readbody == NULL && djb_relay_able(hcl)) {
+		pr = djb_next_find(hcl, dh);
+
+		if (pr != NULL) {
+			if (djb_answer_stream(pr, hcl, dh)) {
+				/* The relay continues with the pull */
+				return (true);
+			}
+
+			/* Found again once the body is read, we run again */
+			djb_out_add(pr);
+		}
+	}
+
+	/* Get the body of the answer first */
+	if (hcl->readbody == NULL) {
+		switch (djb_readbody(hcl, 2)) {
+		case DJB_BODY_LATER:
+			/* Let httpsrv read it in */
+			return (false);
+
+		case DJB_BODY_DECODING:
+			/* We run again once it is decoded */
+			return (true);
+
+		case DJB_BODY_ERROR:
+			/* The answer is lost: its client gets a 502 */
+			log_wrn(HCL_ID " could not read body", hcl->id);
+
+			pr = djb_next_find(hcl, dh);
+			if (pr != NULL) {
+				memzero(&ans, sizeof ans);
+				ans.httpcode = 502;
+				ans.httptext = "Bad Gateway";
+				ans.body = lost;
+				ans.body_len = sizeof lost - 1;
+
+				djb_answer_deliver(pr, &ans, NULL, NULL);
+			}
+
+			/* The body is still on the wire, hang up */
+			djb_error(hcl, 500, "Could not read body");
+			return (true);
+
+		case DJB_BODY_NONE:
+		case DJB_BODY_READY:
+		default:
+			break;
+		}
+	}
+
+	pr = djb_next_find(hcl, dh);
+	if (pr != NULL) {
+		memzero(&ans, sizeof ans);
+		ans.httpcode = atoi(dh->httpcode);
+		ans.httptext = dh->httptext;
+		ans.content_type = hcl->headers.content_type;
+		ans.body = hcl->readbody;
+		ans.body_len = hcl->readbody != NULL ? hcl->readbody_off : 0;
+
+		/* The same headers as when it streams, or as a /push/ */
+		djb_answer_deliver(pr, &ans, dh->setcookie, hcl);
+	}
+
+	if (hcl->readbody != NULL) {
+		httpsrv_readbody_free(hcl);
+	}
 
-	/* Free it up, not tracked anymore */
-	free(pr);
+	/* Delivered, only the pull part remains */
+	dh->seqno[0] = '\0';
 
-	/* No need to read from it further for the moment */
-	return (true);
+	return (djb_pull(hcl));
 }
 
 /* hcl == the client proxy request, pr->hcl = pull API request */
@@ -531,6 +3553,9 @@ djb_bodyfwd_done(httpsrv_client_t *hcl, httpsrv_client_t *fhcl, void UNUSED *use
 		/* Send back a 200 OK as we proxied it */
 		log_dbg("API push, done with it");
 
+		/* The answer reached its client */
+		djb_trace(httpsrv_get_userdata(fhcl), DJBX_DONE);
+
 		/* HTTP okay */
 		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
 
@@ -541,104 +3566,716 @@ djb_bodyfwd_done(httpsrv_client_t *hcl, httpsrv_client_t *fhcl, void UNUSED *use
 		log_dbg("proxy-POST, adding back to queue");
 	}
 
-	/* Served another one */
-	thread_serve();
+	/* Served another one */
+	thread_serve();
+
+	/* Done for this request is handled by caller: httpsrv_handle_http() */
+	log_dbg("end");
+}
+
+/*
+ * Store a variable length header: in the inline buffer when it fits,
+ * otherwise in a spill chunk that lives until djb_hdr_reset()
+ */
+static void
+djb_hdr_set(djb_headers_t *dh, const char **field, const char *val);
+static void
+djb_hdr_set(djb_headers_t *dh, const char **field, const char *val) {
+	djb_hdr_spill_t	*sp;
+	char		*dst;
+	size_t		len;
+
+	len = strlen(val);
+
+	/* Trailing whitespace is not part of it */
+	while (len > 0 && (val[len - 1] == '\r' || val[len - 1] == '\n' ||
+			   val[len - 1] == ' ')) {
+		len--;
+	}
+
+	if (len >= DJB_HDR_MAX) {
+		log_wrn("Header truncated from %zu bytes", len);
+		len = DJB_HDR_MAX - 1;
+	}
+
+	if (dh->hbuf_used + len + 1 <= sizeof dh->hbuf) {
+		dst = &dh->hbuf[dh->hbuf_used];
+		dh->hbuf_used += len + 1;
+	} else {
+		sp = malloc(sizeof *sp + len + 1);
+		if (sp == NULL) {
+			log_err("No memory for header of %zu bytes", len);
+			return;
+		}
+
+		sp->next = dh->spill;
+		dh->spill = sp;
+		dh->spill_used += len + 1;
+		dst = sp->data;
+	}
+
+	memcpy(dst, val, len);
+	dst[len] = '\0';
+
+	*field = dst;
+}
+
+/* Forget the headers of the previous request */
+static void
+djb_hdr_reset(djb_headers_t *dh);
+static void
+djb_hdr_reset(djb_headers_t *dh) {
+	djb_hdr_spill_t *sp;
+
+	while ((sp = dh->spill) != NULL) {
+		dh->spill = sp->next;
+		free(sp);
+	}
+
+	/* The idle timer is left alone, it spans requests */
+	memzero(dh, offsetof(djb_headers_t, idle));
+}
+
+static void
+djb_dh_put(djb_headers_t *dh) {
+	if (__atomic_sub_fetch(&dh->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	djb_hdr_reset(dh);
+	djbs_free(l_slab_dh, dh);
+}
+
+djb_headers_t *
+djb_create_userdata(httpsrv_client_t *hcl) {
+	djb_headers_t *dh;
+
+	dh = djbs_alloc(l_slab_dh);
+	if (!dh) {
+		return (NULL);
+	}
+
+	log_dbg(HCL_ID " %p", hcl->id, (void *)dh);
+
+	/* The connection's own reference, dropped by djb_close() */
+	dh->refs = 1;
+
+	httpsrv_set_userdata(hcl, dh);
+
+	return (dh);
+}
+
+/* Idle keep-alive connection ran out of time (timer thread) */
+static void
+djb_idle_expire(void *data);
+static void
+djb_idle_expire(void *data) {
+	httpsrv_client_t *hcl = (httpsrv_client_t *)data;
+
+	log_dbg(HCL_ID " idle, closing", hcl->id);
+
+	__atomic_add_fetch(&l_exp_idle, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * The connection belongs to its connset thread, thus it is not
+	 * closed from here: shutting down the socket wakes that thread with
+	 * an end-of-stream and it closes the connection itself. djb_close()
+	 * cancels this timer first, which waits for us, thus the fd is
+	 * still the connection's one.
+	 */
+	shutdown(conn_fd(&hcl->conn), SHUT_RDWR);
+}
+
+/* Only real connections, internal requests (ACS) have none */
+static void
+djb_idle_arm(httpsrv_client_t *hcl, djb_headers_t *dh);
+static void
+djb_idle_arm(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	if (l_to_idle > 0 && conn_is_valid(&hcl->conn)) {
+		djbt_arm(&dh->idle, l_to_idle, djb_idle_expire, hcl);
+	}
+}
+
+static void
+djb_accept(httpsrv_client_t *hcl, void UNUSED *user);
+static void
+djb_accept(httpsrv_client_t *hcl, void UNUSED *user) {
+	djb_headers_t *dh;
+
+	log_dbg(HCL_ID, hcl->id);
+
+	dh = djb_create_userdata(hcl);
+	if (dh == NULL) {
+		djb_error(hcl, 500, "Out of memory");
+		return;
+	}
+
+	djbx_mark(&dh->trace, DJBX_ACCEPT);
+
+	/* Idle until the first request */
+	djb_idle_arm(hcl, dh);
+}
+
+void
+djb_header(httpsrv_client_t UNUSED *hcl, void *user, char *line) {
+	djb_headers_t	*dh = (djb_headers_t *)user;
+	const char	*v;
+	unsigned int	i;
+
+	for (i = 0; djb_vheaders[i].label != NULL; i++) {
+		if (strncasecmp(line, djb_vheaders[i].label,
+				djb_vheaders[i].len) != 0 ||
+		    line[djb_vheaders[i].len] != ':') {
+			continue;
+		}
+
+		for (v = &line[djb_vheaders[i].len + 1];
+		     *v == ' ' || *v == '\t'; v++) {
+			/* Skip leading whitespace */
+		}
+
+		djb_hdr_set(dh, (const char **)((char *)dh +
+						djb_vheaders[i].off), v);
+		return;
+	}
+
+	if (misc_map(line, djb_headers, (char *)dh) == -1) {
+		log_err("misc_map(%s) failed", line);
+	}
+}
+
+static void
+djb_status_list(httpsrv_client_t *hcl, hlist_t *lst,
+		const char *title, const char *desc);
+static void
+djb_status_list(httpsrv_client_t *hcl, hlist_t *lst,
+		const char *title, const char *desc) {
+	djb_req_t	*r, *rn;
+	unsigned int	cnt = 0;
+
+	conn_printf(&hcl->conn,
+		"<h1>List: %s</h1>\n"
+		"<p>\n"
+		"%s.\n"
+		"</p>\n",
+		title,
+		desc);
+
+	list_lock(lst);
+	list_for(lst, r, rn, djb_req_t *) {
+
+		if (cnt == 0) {
+			conn_put(&hcl->conn,
+				"<table>\n"
+				"<tr>\n"
+				"<th>ID</th>\n"
+				"<th>ReqID</th>\n"
+				"<th>Host</th>\n"
+				"<th>Request</th>\n"
+				"</tr>\n");
+		}
+
+		conn_printf(&hcl->conn,
+			"<tr>"
+			"<td>" HCL_IDn "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%s</td>"
+			"<td>%s</td>"
+			"</tr>\n",
+			r->hcl->id,
+			r->hcl->reqid,
+			r->hcl->headers.hostname,
+			r->hcl->the_request);
+		cnt++;
+	}
+	list_unlock(lst);
+
+	if (cnt == 0) {
+		conn_put(&hcl->conn,
+			"No outstanding requests.");
+	} else {
+		conn_put(&hcl->conn,
+			"</table>\n");
+	}
+}
+
+static void
+djb_status_queue_cb(void *cbdata, uint64_t id, uint64_t reqid,
+		    const char *host, const char *request);
+static void
+djb_status_queue_cb(void *cbdata, uint64_t id, uint64_t reqid,
+		    const char *host, const char *request) {
+	httpsrv_client_t *hcl = (httpsrv_client_t *)cbdata;
+
+	conn_printf(&hcl->conn,
+		"<tr>"
+		"<td>" HCL_IDn "</td>"
+		"<td>%" PRIu64 "</td>"
+		"<td>%s</td>"
+		"<td>%s</td>"
+		"</tr>\n",
+		id,
+		reqid,
+		host,
+		request);
+}
+
+static void
+djb_status_queue(httpsrv_client_t *hcl, djbq_t *q,
+		 const char *title, const char *desc);
+static void
+djb_status_queue(httpsrv_client_t *hcl, djbq_t *q,
+		 const char *title, const char *desc) {
+	unsigned int cnt;
+
+	conn_printf(&hcl->conn,
+		"<h1>Queue: %s</h1>\n"
+		"<p>\n"
+		"%s (%u queued).\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>ID</th>\n"
+		"<th>ReqID</th>\n"
+		"<th>Host</th>\n"
+		"<th>Request</th>\n"
+		"</tr>\n",
+		title,
+		desc,
+		djbq_depth(q));
+
+	cnt = djbq_list(q, djb_status_queue_cb, hcl);
+
+	conn_put(&hcl->conn,
+		"</table>\n");
+
+	if (cnt == 0) {
+		conn_put(&hcl->conn,
+			"No outstanding requests.");
+	}
+}
+
+static void
+djb_status_slab(httpsrv_client_t *hcl, djbs_pool_t *p, const char *name);
+static void
+djb_status_slab(httpsrv_client_t *hcl, djbs_pool_t *p, const char *name) {
+	unsigned int	inuse, total;
+	size_t		size;
+
+	djbs_stats(p, &inuse, &total, &size);
+
+	conn_printf(&hcl->conn,
+		"<tr>"
+		"<td>%s</td>"
+		"<td>%zu</td>"
+		"<td>%u</td>"
+		"<td>%u</td>"
+		"</tr>\n",
+		name, size, inuse, total);
+}
+
+static void
+djb_status_forwarding(httpsrv_client_t *hcl);
+static void
+djb_status_forwarding(httpsrv_client_t *hcl) {
+	conn_printf(&hcl->conn,
+		"<h1>Body Forwarding</h1>\n"
+		"<p>\n"
+		"Bodies of %u bytes or more are moved socket to socket "
+		"(0 = never).\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Buffered bodies</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Direct bodies</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Bytes spliced (zero-copy)</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Bytes copied (splice not possible)</th>"
+			"<td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Chunked bodies relayed</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Chunked bodies read in</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Failed direct bodies</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Relays waiting for a thread</th><td>%u</td></tr>\n"
+		"</table>\n",
+		l_splice_min,
+		__atomic_load_n(&l_fwd_buffered, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_fwd_direct, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_fwd_spliced, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_fwd_copied, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_fwd_chunked, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_body_chunked, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_fwd_failed, __ATOMIC_RELAXED),
+		djb_relay_depth());
+}
+
+static void
+djb_status_websocket(httpsrv_client_t *hcl);
+static void
+djb_status_websocket(httpsrv_client_t *hcl) {
+	unsigned int	channels;
+	uint64_t	opened, in, out;
+
+	djbw_stats(&channels, &opened, &in, &out);
+
+	conn_printf(&hcl->conn,
+		"<h1>WebSocket Channels</h1>\n"
+		"<p>\n"
+		"Circuits that get their requests over a WebSocket (/ws/) "
+		"instead of pull/push.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Open channels</th><td>%u</td></tr>\n"
+		"<tr><th>Channels opened</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Native messaging channels</th><td>%u</td></tr>\n"
+		"<tr><th>Requests sent</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Responses received</th><td>%" PRIu64 "</td></tr>\n"
+		"</table>\n",
+		channels, opened, djbn_open_count(), out, in);
+}
+
+static void
+djb_status_unix(httpsrv_client_t *hcl);
+static void
+djb_status_unix(httpsrv_client_t *hcl) {
+	unsigned int	conns;
+	uint64_t	accepted, requests;
+	bool		own;
+
+	own = djbu_stats(&conns, &accepted, &requests);
+
+	conn_printf(&hcl->conn,
+		"<h1>Unix Socket</h1>\n"
+		"<p>\n"
+		"Proxy requests from StegoTorus over a unix domain socket "
+		"(DJB_UNIX) instead of TCP.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Path</th><td>%s</td></tr>\n"
+		"<tr><th>StegoTorus</th><td>%s</td></tr>\n"
+		"<tr><th>Served by</th><td>%s</td></tr>\n",
+		djbu_path() != NULL ? djbu_path() : "(not listening)",
+		djbu_stegotorus_path() != NULL ? "Uses it" :
+			"Uses TCP (DJB_UNIX_STEGOTORUS not set)",
+		own ? "Own thread pool" : "HTTP server");
+
+	if (own) {
+		conn_printf(&hcl->conn,
+			"<tr><th>Open connections</th><td>%u</td></tr>\n"
+			"<tr><th>Connections accepted</th>"
+			"<td>%" PRIu64 "</td></tr>\n"
+			"<tr><th>Requests</th><td>%" PRIu64 "</td></tr>\n",
+			conns, accepted, requests);
+	}
+
+	conn_printf(&hcl->conn, "</table>\n");
+}
+
+static void
+djb_status_assets(httpsrv_client_t *hcl);
+static void
+djb_status_assets(httpsrv_client_t *hcl) {
+	unsigned int	assets;
+	uint64_t	served, served_gz, not_modified;
+
+	djba_stats(&assets, &served, &served_gz, &not_modified);
+
+	conn_printf(&hcl->conn,
+		"<h1>Static Assets</h1>\n"
+		"<p>\n"
+		"Served from memory, gzip compressed when the client accepts "
+		"it, 304 when its ETag still matches.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Assets</th><td>%u</td></tr>\n"
+		"<tr><th>Served</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Served gzip</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Not Modified</th><td>%" PRIu64 "</td></tr>\n"
+		"</table>\n",
+		assets, served, served_gz, not_modified);
+}
+
+static void
+djb_status_memory(httpsrv_client_t *hcl);
+static void
+djb_status_memory(httpsrv_client_t *hcl) {
+	conn_put(&hcl->conn,
+		"<h1>Memory</h1>\n"
+		"<p>\n"
+		"Slab pools for per-request and per-connection state.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>Pool</th>\n"
+		"<th>Object size</th>\n"
+		"<th>In use</th>\n"
+		"<th>Allocated</th>\n"
+		"</tr>\n");
+
+	djb_status_slab(hcl, l_slab_req, "Requests");
+	djb_status_slab(hcl, l_slab_dh, "Connections");
 
-	/* Done for this request is handled by caller: httpsrv_handle_http() */
-	log_dbg("end");
+	conn_put(&hcl->conn,
+		"</table>\n");
 }
 
-djb_headers_t *
-djb_create_userdata(httpsrv_client_t *hcl) {
-	djb_headers_t *dh;
+static void
+djb_status_fair_cb(void *cbdata, uint64_t key, unsigned int depth,
+		   uint64_t deficit, uint64_t bytes, uint64_t served);
+static void
+djb_status_fair_cb(void *cbdata, uint64_t key, unsigned int depth,
+		   uint64_t deficit, uint64_t bytes, uint64_t served) {
+	httpsrv_client_t *hcl = (httpsrv_client_t *)cbdata;
 
-	dh = mcalloc(sizeof *dh, "djb_headers_t *");
-	if (!dh) {
-		return (NULL);
-	}
+	conn_printf(&hcl->conn,
+		"<tr>"
+		"<td>" CONN_ID "</td>"
+		"<td>%u</td>"
+		"<td>%" PRIu64 "</td>"
+		"<td>%" PRIu64 "</td>"
+		"<td>%" PRIu64 "</td>"
+		"</tr>\n",
+		key, depth, deficit, served, bytes);
+}
 
-	log_dbg(HCL_ID " %p", hcl->id, (void *)dh);
+static void
+djb_status_fair(httpsrv_client_t *hcl);
+static void
+djb_status_fair(httpsrv_client_t *hcl) {
+	unsigned int cnt;
 
-	httpsrv_set_userdata(hcl, dh);
+	conn_printf(&hcl->conn,
+		"<h1>Proxy New (bulk)</h1>\n"
+		"<p>\n"
+		"New unforwarded requests, served fairly per client connection "
+		"(deficit round robin, %u bytes per round).\n"
+		"%u requests queued, %u flows, %" PRIu64 " quanta handed out.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>Connection</th>\n"
+		"<th>Queued</th>\n"
+		"<th>Deficit</th>\n"
+		"<th>Served</th>\n"
+		"<th>Bytes served</th>\n"
+		"</tr>\n",
+		q_proxy_new.quantum,
+		djbf_depth(&q_proxy_new),
+		__atomic_load_n(&q_proxy_new.nflows, __ATOMIC_RELAXED),
+		__atomic_load_n(&q_proxy_new.rounds, __ATOMIC_RELAXED));
 
-	return (dh);
+	cnt = djbf_list(&q_proxy_new, djb_status_fair_cb, hcl);
+
+	conn_printf(&hcl->conn,
+		"</table>\n"
+		"<p>\n"
+		"Flows listed: %u\n"
+		"</p>\n",
+		cnt);
 }
 
 static void
-djb_accept(httpsrv_client_t *hcl, void UNUSED *user);
+djb_status_shedding(httpsrv_client_t *hcl);
 static void
-djb_accept(httpsrv_client_t *hcl, void UNUSED *user) {
-	log_dbg(HCL_ID, hcl->id);
-
-	if (djb_create_userdata(hcl) == NULL) {
-		djb_error(hcl, 500, "Out of memory");
-	}
+djb_status_shedding(httpsrv_client_t *hcl) {
+	conn_printf(&hcl->conn,
+		"<h1>Load Shedding</h1>\n"
+		"<p>\n"
+		"Bulk proxy requests beyond their queue or the memory budget "
+		"are answered with a 503 (Retry-After: %u).\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Memory in use</th><td>%" PRIu64 " bytes</td></tr>\n"
+		"<tr><th>Memory peak</th><td>%" PRIu64 " bytes</td></tr>\n"
+		"<tr><th>Memory budget</th><td>%" PRIu64 " bytes</td></tr>\n"
+		"<tr><th>Shed: over budget</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Shed: queue full</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Shed: out of memory</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Pulls refused: queue full</th><td>%" PRIu64 "</td></tr>\n"
+		"<tr><th>Queue limits (bulk, control, pull)</th>"
+		"<td>%u, %" PRIu64 ", %" PRIu64 "</td></tr>\n"
+		"</table>\n",
+		l_retry_after,
+		__atomic_load_n(&l_mem_used, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_mem_peak, __ATOMIC_RELAXED),
+		l_mem_budget,
+		__atomic_load_n(&l_shed_budget, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_shed_queue, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_shed_other, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_shed_pull, __ATOMIC_RELAXED),
+		q_proxy_new.max, q_proxy_ctl.mask + 1, q_api_pull.mask + 1);
 }
 
 static void
-djb_header(httpsrv_client_t UNUSED *hcl, void *user, char *line);
+djb_status_affinity(httpsrv_client_t *hcl);
 static void
-djb_header(httpsrv_client_t UNUSED *hcl, void *user, char *line) {
-	djb_headers_t *dh = (djb_headers_t *)user;
+djb_status_affinity(httpsrv_client_t *hcl) {
+	djb_circuit_t	*c;
+	unsigned int	i, n, pending;
+	bool		parked;
+	hnode_t		*node;
 
-	if (misc_map(line, djb_headers, (char *)dh) == -1) {
-		log_err("misc_map(%s) failed", line);
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+
+	conn_printf(&hcl->conn,
+		"<h1>Circuit Affinity</h1>\n"
+		"<p>\n"
+		"Requests wait up to %u ms for the circuit of their "
+		"connection (0 = only when parked). %u circuits known.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>Circuit</th>\n"
+		"<th>Parked</th>\n"
+		"<th>Pending</th>\n"
+		"<th>Hits</th>\n"
+		"<th>Waited</th>\n"
+		"<th>Taken</th>\n"
+		"<th>Fallbacks</th>\n"
+		"</tr>\n",
+		l_affinity_wait, n);
+
+	for (i = 0; i < n; i++) {
+		c = &l_circuits[i];
+
+		list_lock(&c->pending);
+		parked = (c->puller != NULL);
+		pending = 0;
+		for (node = c->pending.head; node != NULL; node = node->next) {
+			pending++;
+		}
+		list_unlock(&c->pending);
+
+		conn_printf(&hcl->conn,
+			"<tr>"
+			"<td>%u</td>"
+			"<td>%s</td>"
+			"<td>%u</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"</tr>\n",
+			c->id, yesno(parked), pending,
+			__atomic_load_n(&c->hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&c->waits, __ATOMIC_RELAXED),
+			__atomic_load_n(&c->taken, __ATOMIC_RELAXED),
+			__atomic_load_n(&c->fallbacks, __ATOMIC_RELAXED));
 	}
+
+	conn_printf(&hcl->conn, "</table>\n");
 }
 
 static void
-djb_status_list(httpsrv_client_t *hcl, hlist_t *lst,
-		const char *title, const char *desc);
+djb_status_deadlines(httpsrv_client_t *hcl);
 static void
-djb_status_list(httpsrv_client_t *hcl, hlist_t *lst,
-		const char *title, const char *desc) {
-	djb_req_t	*r, *rn;
-	unsigned int	cnt = 0;
-
+djb_status_deadlines(httpsrv_client_t *hcl) {
 	conn_printf(&hcl->conn,
-		"<h1>List: %s</h1>\n"
+		"<h1>Deadlines</h1>\n"
 		"<p>\n"
-		"%s.\n"
+		"Timers armed: %u.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>Deadline</th>\n"
+		"<th>Seconds</th>\n"
+		"<th>Expired</th>\n"
+		"</tr>\n"
+		"<tr><td>Pull (408)</td><td>%u</td><td>%" PRIu64 "</td></tr>\n"
+		"<tr><td>Outstanding, requeued (max %u)</td>"
+			"<td>%u</td><td>%" PRIu64 "</td></tr>\n"
+		"<tr><td>Outstanding, failed (504)</td>"
+			"<td>%u</td><td>%" PRIu64 "</td></tr>\n"
+		"<tr><td>Idle connection</td><td>%u</td><td>%" PRIu64 "</td></tr>\n"
+		"</table>\n"
+		"<p>\n"
+		"Expired or stolen pulls still queued: %u.\n"
 		"</p>\n",
-		title,
-		desc);
+		djbt_armed(),
+		l_to_pull / 1000,
+		__atomic_load_n(&l_exp_pull, __ATOMIC_RELAXED),
+		l_out_retries,
+		l_to_out / 1000,
+		__atomic_load_n(&l_exp_requeue, __ATOMIC_RELAXED),
+		l_to_out / 1000,
+		__atomic_load_n(&l_exp_fail, __ATOMIC_RELAXED),
+		l_to_idle / 1000,
+		__atomic_load_n(&l_exp_idle, __ATOMIC_RELAXED),
+		__atomic_load_n(&l_pull_dead, __ATOMIC_RELAXED));
+}
 
-	list_lock(lst);
-	list_for(lst, r, rn, djb_req_t *) {
+/* One row per stage: the last interval and p99 since the start */
+static void
+djb_status_lat_rows(httpsrv_client_t *hcl, const char *circuit, djbh_t **lat);
+static void
+djb_status_lat_rows(httpsrv_client_t *hcl, const char *circuit, djbh_t **lat) {
+	djbh_summary_t	last, all;
+	unsigned int	i;
 
-		if (cnt == 0) {
-			conn_put(&hcl->conn,
-				"<table>\n"
-				"<tr>\n"
-				"<th>ID</th>\n"
-				"<th>ReqID</th>\n"
-				"<th>Host</th>\n"
-				"<th>Request</th>\n"
-				"</tr>\n");
+	for (i = 0; i < DJB_LAT_MAX; i++) {
+		if (lat[i] == NULL) {
+			continue;
 		}
 
+		djbh_summary(lat[i], DJBH_LAST, &last);
+		djbh_summary(lat[i], DJBH_ALL, &all);
+
 		conn_printf(&hcl->conn,
 			"<tr>"
-			"<td>" HCL_IDn "</td>"
-			"<td>%" PRIu64 "</td>"
 			"<td>%s</td>"
 			"<td>%s</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
+			"<td>%" PRIu64 "</td>"
 			"</tr>\n",
-			r->hcl->id,
-			r->hcl->reqid,
-			r->hcl->headers.hostname,
-			r->hcl->the_request);
-		cnt++;
+			circuit, l_latnames[i],
+			last.count, last.p50, last.p90, last.p99, last.p999,
+			last.max, all.count, all.p99);
 	}
-	list_unlock(lst);
+}
 
-	if (cnt == 0) {
-		conn_put(&hcl->conn,
-			"No outstanding requests.");
-	} else {
-		conn_put(&hcl->conn,
-			"</table>\n");
+static void
+djb_status_latency(httpsrv_client_t *hcl);
+static void
+djb_status_latency(httpsrv_client_t *hcl) {
+	char		id[16];
+	unsigned int	i, n;
+
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+
+	conn_printf(&hcl->conn,
+		"<h1>Latency</h1>\n"
+		"<p>\n"
+		"Microseconds per stage over the last %u seconds; queued is "
+		"enqueue to pair, plugin is pair to push, forward is push "
+		"to done. Also as JSON at <a href=\"/latency/\">"
+		"/latency/</a>.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr>\n"
+		"<th>Circuit</th>\n"
+		"<th>Stage</th>\n"
+		"<th>Count</th>\n"
+		"<th>p50</th>\n"
+		"<th>p90</th>\n"
+		"<th>p99</th>\n"
+		"<th>p99.9</th>\n"
+		"<th>Max</th>\n"
+		"<th>Total</th>\n"
+		"<th>Total p99</th>\n"
+		"</tr>\n",
+		l_lat_interval);
+
+	for (i = 0; i < n; i++) {
+		snprintf(id, sizeof id, "%u", l_circuits[i].id);
+		djb_status_lat_rows(hcl, id, l_circuits[i].lat);
 	}
+
+	djb_status_lat_rows(hcl, "none", l_lat_none);
+
+	conn_printf(&hcl->conn, "</table>\n");
 }
 
 static void
@@ -762,6 +4399,71 @@ djb_status_threads_cb(  void		*cbdata,
 		served);
 }
 
+static void
+djb_status_pool(httpsrv_client_t *hcl);
+static void
+djb_status_pool(httpsrv_client_t *hcl) {
+	djbp_stats_t	st;
+	djbp_event_t	ev[DJBP_EVENTS];
+	unsigned int	i, n;
+	struct tm	tm;
+	char		when[32];
+
+	djbp_stats(&st);
+
+	conn_printf(&hcl->conn,
+		"<h1>Worker Pool</h1>\n"
+		"<p>\n"
+		"DJBWorker threads, sized by the requests and pullers waiting "
+		"and how long their rounds take.\n"
+		"</p>\n"
+		"<table>\n"
+		"<tr><th>Workers</th><td>%u</td></tr>\n"
+		"<tr><th>Wanted</th><td>%u</td></tr>\n"
+		"<tr><th>Bounds</th><td>%u - %u</td></tr>\n"
+		"<tr><th>HTTP server shards</th><td>%u</td></tr>\n"
+		"<tr><th>HTTP threads per shard</th><td>%u</td></tr>\n"
+		"<tr><th>Round time (avg)</th><td>%" PRIu64 " us</td></tr>\n"
+		"<tr><th>Scaling events</th><td>%u</td></tr>\n"
+		"</table>\n",
+		st.size, st.target, st.min, st.max, l_nshards, l_http_workers,
+		st.latency, st.events);
+
+	n = djbp_events(ev, lengthof(ev));
+	if (n == 0) {
+		return;
+	}
+
+	conn_put(&hcl->conn,
+		"<table>\n"
+		"<tr>\n"
+		"<th>When</th>\n"
+		"<th>Workers</th>\n"
+		"<th>Requests waiting</th>\n"
+		"<th>Pullers waiting</th>\n"
+		"<th>Round time (us)</th>\n"
+		"</tr>\n");
+
+	for (i = 0; i < n; i++) {
+		localtime_r(&ev[i].when, &tm);
+		strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tm);
+
+		conn_printf(&hcl->conn,
+			"<tr>"
+			"<td>%s</td>"
+			"<td>%u &rarr; %u</td>"
+			"<td>%u</td>"
+			"<td>%u</td>"
+			"<td>%" PRIu64 "</td>"
+			"</tr>\n",
+			when, ev[i].from, ev[i].to, ev[i].depth,
+			ev[i].pullers, ev[i].latency);
+	}
+
+	conn_put(&hcl->conn,
+		"</table>\n");
+}
+
 static void
 djb_status_threads(httpsrv_client_t *hcl);
 static void
@@ -795,6 +4497,8 @@ djb_status_threads(httpsrv_client_t *hcl) {
 		conn_put(&hcl->conn,
 				"Odd, no threads where found running!?");
 	}
+
+	djb_status_pool(hcl);
 }
 
 static void
@@ -815,6 +4519,9 @@ static void
 djb_status_version(httpsrv_client_t *hcl);
 static void
 djb_status_version(httpsrv_client_t *hcl) {
+	const char	*names[8];
+	unsigned int	i, n;
+
 	conn_put(&hcl->conn,
 		"<h2>JumpBox Information</h2>\n"
 		"<p>\n"
@@ -826,8 +4533,17 @@ djb_status_version(httpsrv_client_t *hcl) {
 		"<tr><th>GIT origin:</th><td>" PROJECT_GIT_ORIG "</td></tr>\n"
 		"<tr><th>GIT branch:</th><td>" PROJECT_GIT_BRCH "</td></tr>\n"
 		"<tr><th>GIT hash:</th><td>" PROJECT_GIT_HASH "</td></tr>\n"
-		"<tr><th>GIT time:</th><td>" PROJECT_GIT_TIME "</td></tr>\n"
-		"</table>\n");
+		"<tr><th>GIT time:</th><td>" PROJECT_GIT_TIME "</td></tr>\n");
+
+	/* Host names that are us, anything else gets proxied */
+	n = djbr_self_list(names, lengthof(names));
+	for (i = 0; i < n; i++) {
+		conn_printf(&hcl->conn,
+			"<tr><th>API host:</th><td>%s</td></tr>\n",
+			names[i]);
+	}
+
+	conn_put(&hcl->conn, "</table>\n");
 }
 
 static void
@@ -843,19 +4559,31 @@ djb_status(httpsrv_client_t *hcl) {
 	djb_status_threads(hcl);
 	djb_status_processes(hcl);
 
-	djb_status_list(hcl, &lst_proxy_new,
-			"Proxy New",
-			"New unforwarded requests");
+	djb_status_queue(hcl, &q_proxy_ctl,
+			 "Proxy New (control)",
+			 "New unforwarded control requests, these go first");
+
+	djb_status_fair(hcl);
+	djb_status_shedding(hcl);
 
 	djb_status_list(hcl, &lst_proxy_out,
 			"Proxy Out",
 			"Outstanding queries "
 			"(answer to pull, waiting for a push)");
 
-	djb_status_list(hcl, &lst_api_pull,
-			"API Pull",
-			"Requests that want a pull, "
-			"waiting for proxy_new entry");
+	djb_status_queue(hcl, &q_api_pull,
+			 "API Pull",
+			 "Requests that want a pull, "
+			 "waiting for proxy_new entry");
+
+	djb_status_affinity(hcl);
+	djb_status_latency(hcl);
+	djb_status_deadlines(hcl);
+	djb_status_forwarding(hcl);
+	djb_status_websocket(hcl);
+	djb_status_unix(hcl);
+	djb_status_assets(hcl);
+	djb_status_memory(hcl);
 
 	djb_status_httpsrv(hcl);
 
@@ -911,91 +4639,329 @@ djb_launch(httpsrv_client_t *hcl, char **argv, myprocess_num_t *num) {
 }
 
 static void
-djb_launch_st(httpsrv_client_t *hcl);
+djb_launch_st(httpsrv_client_t *hcl);
+static void
+djb_launch_st(httpsrv_client_t *hcl) {
+	char		**argv;
+	int		argc;
+
+	/* Convert preferences into argv */
+	argc = prf_get_argv(&argv);
+
+	djb_launch(hcl, argv, &l_st_pnum);
+
+	/* Free argv */
+	prf_free_argv(argc, argv);
+}
+
+static void
+djb_launch_tor(httpsrv_client_t *hcl);
+static void
+djb_launch_tor(httpsrv_client_t *hcl) {
+	const char *const argv[] = {
+				"tor",
+				"-f",
+				"/usr/share/saferdefiance/djb.torrc",
+				NULL};
+
+	djb_launch(hcl, (char **)&argv[0], &l_tor_pnum);
+}
+
+/* API requests that do not fit djbr_handler_f as they are */
+static bool
+djb_api_pull(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_pull(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	return (djb_pull(hcl));
+}
+
+static bool
+djb_api_acs(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_acs(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	return (acs_handle(hcl));
+}
+
+static bool
+djb_api_rendezvous(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_rendezvous(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+#ifdef DJB_RENDEZVOUS
+	return (rdv_handle(hcl));
+#else
+	djb_error(hcl, 500, "Rendezvous module not enabled");
+	return (false);
+#endif
+}
+
+static bool
+djb_api_preferences(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_preferences(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	return (prf_handle(hcl));
+}
+
+static bool
+djb_api_shutdown(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_shutdown(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	djb_error(hcl, 200, "Shutting down");
+	thread_stop_running();
+	return (true);
+}
+
+static bool
+djb_api_launch(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_launch(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	if (strcasecmp(hcl->headers.uri, "/launch/stegotorus/") == 0) {
+		djb_launch_st(hcl);
+	} else if (strcasecmp(hcl->headers.uri, "/launch/tor/") == 0) {
+		djb_launch_tor(hcl);
+	} else {
+		djb_error(hcl, 404, "No such DJB API request");
+	}
+
+	return (false);
+}
+
+static bool
+djb_api_status(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_status(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	djb_status(hcl);
+	return (false);
+}
+
+static bool
+djb_api_asset(httpsrv_client_t *hcl, djb_headers_t *dh);
+static bool
+djb_api_asset(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	if (!djba_serve(hcl, dh)) {
+		djb_error(hcl, 404, "No such DJB API request");
+	}
+
+	return (false);
+}
+
+/*
+ * /metrics: the counters of metrics.c plus what can be read off the
+ * queues and circuits as they are; only atomic loads, no list walks
+ */
+static void
+djb_metrics_expired(httpsrv_client_t *hcl);
+static void
+djb_metrics_expired(httpsrv_client_t *hcl) {
+	djbm_family(hcl, "djb_expired_total", "counter",
+		    "Deadlines that passed, by what expired");
+	djbm_sample(hcl, "djb_expired_total", "kind=\"pull\"",
+		    __atomic_load_n(&l_exp_pull, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_expired_total", "kind=\"requeue\"",
+		    __atomic_load_n(&l_exp_requeue, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_expired_total", "kind=\"fail\"",
+		    __atomic_load_n(&l_exp_fail, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_expired_total", "kind=\"idle\"",
+		    __atomic_load_n(&l_exp_idle, __ATOMIC_RELAXED));
+
+	djbm_family(hcl, "djb_shed_total", "counter",
+		    "Requests and pulls refused with a 503");
+	djbm_sample(hcl, "djb_shed_total", "reason=\"budget\"",
+		    __atomic_load_n(&l_shed_budget, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_shed_total", "reason=\"queue\"",
+		    __atomic_load_n(&l_shed_queue, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_shed_total", "reason=\"memory\"",
+		    __atomic_load_n(&l_shed_other, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_shed_total", "reason=\"pull\"",
+		    __atomic_load_n(&l_shed_pull, __ATOMIC_RELAXED));
+}
+
+static void
+djb_metrics_gauges(httpsrv_client_t *hcl);
 static void
-djb_launch_st(httpsrv_client_t *hcl) {
-	char		**argv;
-	int		argc;
+djb_metrics_gauges(httpsrv_client_t *hcl) {
+	djb_circuit_t	*c;
+	unsigned int	i, n, queued, dead;
+	char		label[32];
+
+	queued = djbq_depth(&q_api_pull);
+	dead = __atomic_load_n(&l_pull_dead, __ATOMIC_RELAXED);
+
+	djbm_family(hcl, "djb_queue_depth", "gauge",
+		    "Entries waiting: new requests, outstanding ones "
+		    "and pullers");
+	djbm_sample(hcl, "djb_queue_depth", "queue=\"new_control\"",
+		    djbq_depth(&q_proxy_ctl));
+	djbm_sample(hcl, "djb_queue_depth", "queue=\"new_bulk\"",
+		    djbf_depth(&q_proxy_new));
+	djbm_sample(hcl, "djb_queue_depth", "queue=\"out\"",
+		    __atomic_load_n(&l_reqidx.count, __ATOMIC_RELAXED));
+	djbm_sample(hcl, "djb_queue_depth", "queue=\"pull\"",
+		    queued > dead ? queued - dead : 0);
+
+	djbm_family(hcl, "djb_circuit_pullers", "gauge",
+		    "Pullers waiting for a request, per circuit");
+
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		c = &l_circuits[i];
+		snprintf(label, sizeof label, "circuit=\"%u\"", c->id);
+		djbm_sample(hcl, "djb_circuit_pullers", label,
+			    __atomic_load_n(&c->pullers, __ATOMIC_RELAXED));
+	}
 
-	/* Convert preferences into argv */
-	argc = prf_get_argv(&argv);
+	djbm_family(hcl, "djb_memory_bytes", "gauge",
+		    "Bytes charged to queued requests");
+	djbm_sample(hcl, "djb_memory_bytes", NULL,
+		    __atomic_load_n(&l_mem_used, __ATOMIC_RELAXED));
 
-	djb_launch(hcl, argv, &l_st_pnum);
+	djbm_family(hcl, "djb_websocket_channels", "gauge",
+		    "Open WebSocket and native messaging channels");
+	djbm_sample(hcl, "djb_websocket_channels", NULL, djbw_open());
+}
 
-	/* Free argv */
-	prf_free_argv(argc, argv);
+static bool
+djb_api_metrics(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_metrics(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	djbm_begin(hcl);
+	djb_metrics_expired(hcl);
+	djb_metrics_gauges(hcl);
+
+	httpsrv_done(hcl);
+	return (false);
 }
 
-static void
-djb_launch_tor(httpsrv_client_t *hcl);
-static void
-djb_launch_tor(httpsrv_client_t *hcl) {
-	const char *const argv[] = {
-				"tor",
-				"-f",
-				"/usr/share/saferdefiance/djb.torrc",
-				NULL};
+static bool
+djb_api_trace(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
+static bool
+djb_api_trace(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	return (djbx_handle(hcl));
+}
 
-	djb_launch(hcl, (char **)&argv[0], &l_tor_pnum);
+/* The histograms as JSON, ?set=now|last|all (default last) */
+static json_t *
+djb_lat_json(uint32_t circuit, djbh_t **lat, djbh_set_t set);
+static json_t *
+djb_lat_json(uint32_t circuit, djbh_t **lat, djbh_set_t set) {
+	djbh_summary_t	sum;
+	json_t		*o, *stages;
+	unsigned int	i;
+
+	stages = json_object();
+	for (i = 0; stages != NULL && i < DJB_LAT_MAX; i++) {
+		if (lat[i] == NULL) {
+			continue;
+		}
+
+		djbh_summary(lat[i], set, &sum);
+		json_object_set_new(stages, l_latnames[i], json_pack(
+			"{s:I, s:I, s:I, s:I, s:I, s:I}",
+			"count", (json_int_t)sum.count,
+			"p50", (json_int_t)sum.p50,
+			"p90", (json_int_t)sum.p90,
+			"p99", (json_int_t)sum.p99,
+			"p999", (json_int_t)sum.p999,
+			"max", (json_int_t)sum.max));
+	}
+
+	o = json_pack("{s:I, s:o}",
+		"circuit", (json_int_t)circuit,
+		"stages", stages);
+
+	return (o);
 }
 
 static bool
-djb_handle_api(httpsrv_client_t *hcl, djb_headers_t *dh);
+djb_api_latency(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh);
 static bool
-djb_handle_api(httpsrv_client_t *hcl, djb_headers_t *dh) {
+djb_api_latency(httpsrv_client_t *hcl, djb_headers_t UNUSED *dh) {
+	djbh_set_t	set = DJBH_LAST;
+	const char	*query;
+	json_t		*arr, *root;
+	char		*out;
+	unsigned int	i, n;
+
+	query = strchr(hcl->headers.rawuri, '?');
+	if (query != NULL && strstr(query, "set=now") != NULL) {
+		set = DJBH_NOW;
+	} else if (query != NULL && strstr(query, "set=all") != NULL) {
+		set = DJBH_ALL;
+	}
 
-	/* A DJB API request */
-	log_dbg(HCL_ID " DJB API request: %s",
-		hcl->id, hcl->headers.uri);
+	n = __atomic_load_n(&l_ncircuits, __ATOMIC_ACQUIRE);
+
+	arr = json_array();
+	for (i = 0; arr != NULL && i < n; i++) {
+		json_array_append_new(arr, djb_lat_json(l_circuits[i].id,
+							l_circuits[i].lat,
+							set));
+	}
 
-	/* Our API URIs                    123456  */
-	if (strncasecmp(hcl->headers.uri, "/pull/", 6) == 0) {
-		return djb_pull(hcl);
+	/* Circuit 0: requests without a known circuit */
+	if (arr != NULL) {
+		json_array_append_new(arr, djb_lat_json(0, l_lat_none, set));
+	}
 
-	} else if (strncasecmp(hcl->headers.uri, "/push/", 6) == 0) {
-		return djb_push(hcl, dh);
+	root = json_pack("{s:I, s:o}",
+		"interval", (json_int_t)l_lat_interval,
+		"circuits", arr);
 
-	/*					  12345 */
-	} else if (strncasecmp(hcl->headers.uri, "/acs/", 5) == 0) {
-		return (acs_handle(hcl));
+	out = root != NULL ? json_dumps(root, JSON_COMPACT) : NULL;
+	if (root != NULL) {
+		json_decref(root);
+	}
 
-	/*					  123456789012 */
-	} else if (strncasecmp(hcl->headers.uri, "/rendezvous/", 12) == 0) {
-#ifdef DJB_RENDEZVOUS
-		rdv_handle(hcl);
-#else
-		djb_error(hcl, 500, "Rendezvous module not enabled");
-#endif
-		return (false);
-	/*					   123456789012 */
-	} else if (strncasecmp(hcl->headers.uri, "/preferences/", 12) == 0) {
-		prf_handle(hcl);
+	if (out == NULL) {
+		djb_error(hcl, 500, "Could not format latencies");
 		return (false);
+	}
 
-	} else if (strcasecmp(hcl->headers.uri, "/shutdown/") == 0) {
-		djb_error(hcl, 200, "Shutting down");
-		thread_stop_running();
-		return (true);
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_JSON);
+	httpsrv_expire(hcl, HTTPSRV_EXPIRE_FORCE);
+	conn_put(&hcl->conn, out);
+	free(out);
 
-	} else if (strcasecmp(hcl->headers.uri, "/launch/stegotorus/") == 0) {
-		djb_launch_st(hcl);
-		return (false);
+	httpsrv_done(hcl);
 
-	} else if (strcasecmp(hcl->headers.uri, "/launch/tor/") == 0) {
-		djb_launch_tor(hcl);
-		return (false);
+	return (false);
+}
 
-	} else if (strcasecmp(hcl->headers.uri, "/") == 0) {
-		djb_status(hcl);
-		return (false);
+/* Our API URIs, hashed on their first path segment (see route.c) */
+#define DJBR(p, exact, fn) { p, sizeof (p) - 1, exact, fn }
+
+static const djbr_route_t djb_api_routes[] = {
+	DJBR("/pull/",		false,	djb_api_pull),
+	DJBR("/push/",		false,	djb_push),
+	DJBR("/next/",		false,	djb_next),
+	DJBR("/ws/",		false,	djbw_handle),
+	DJBR("/acs/",		false,	djb_api_acs),
+	DJBR("/rendezvous/",	false,	djb_api_rendezvous),
+	DJBR("/preferences",	false,	djb_api_preferences),
+	DJBR("/shutdown/",	true,	djb_api_shutdown),
+	DJBR("/launch/",	false,	djb_api_launch),
+	DJBR("/",		true,	djb_api_status),
+	DJBR("/djb.css",	true,	djb_api_asset),
+	DJBR("/metrics",	true,	djb_api_metrics),
+	DJBR("/trace/",		false,	djb_api_trace),
+	DJBR("/latency/",	false,	djb_api_latency),
+	{ NULL, 0, false, NULL }
+};
+
+static djbr_table_t l_api_routes;
 
-	} else if (strcasecmp(hcl->headers.uri, "/djb.css") == 0) {
-		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_CSS);
+static bool
+djb_handle_api(httpsrv_client_t *hcl, djb_headers_t *dh);
+static bool
+djb_handle_api(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	const djbr_route_t *r;
 
-		djb_html_css(hcl);
+	/* A DJB API request */
+	log_dbg(HCL_ID " DJB API request: %s",
+		hcl->id, hcl->headers.uri);
 
-		httpsrv_done(hcl);
-		return (false);
+	r = djbr_find(&l_api_routes, hcl->headers.uri);
+	if (r != NULL) {
+		return (r->handler(hcl, dh));
 	}
 
 	/* Not a valid API request */
@@ -1003,50 +4969,138 @@ djb_handle_api(httpsrv_client_t *hcl, djb_headers_t *dh) {
 	return (false);
 }
 
+/*
+ * Queue a proxy request; when it can not be (over budget, queue full)
+ * it is answered with a 503 already and false is returned
+ */
 bool
-djb_proxy_add(httpsrv_client_t *hcl) {
+djb_proxy_add(httpsrv_client_t *hcl, djb_prio_t prio) {
 	djb_req_t	*pr;
+	djb_headers_t	*pdh;
+	unsigned int	mem;
 #ifdef DEBUG
 	uint64_t	id = hcl->id;
 #endif
 
 	log_dbg(HCL_ID, id);
 
+	/* Control traffic is small and always let in */
+	mem = djb_req_mem(hcl);
+	if (!djb_mem_charge(mem, prio == DJB_PRIO_CONTROL)) {
+		djb_shed(hcl, &l_shed_budget, "Memory budget exhausted");
+		return (false);
+	}
+
 	/* Proxy request - add it to the requester list */
-	pr = mcalloc(sizeof *pr, "djb_req_t *");
+	pr = djb_req_alloc(hcl);
 	if (!pr) {
 		log_crt("Out of memory for proxy request");
-		djb_error(hcl, 500, "Out of memory");
-
-		/* XXX: All is lost here, maybe cleanup hcl? */
+		__atomic_sub_fetch(&l_mem_used, mem, __ATOMIC_RELAXED);
+		djb_shed(hcl, &l_shed_other, "Out of memory");
 		return (false);
 	}
 
-	/* Fill in the details */
-	pr->hcl = hcl;
+	pr->prio = prio;
+	pr->mem = mem;
 
-	/*
-	 * Add this request to the queue
-	 * The manager will divide the work
-	 */
-	list_addtail_l(&lst_proxy_new, &pr->node);
+	djbm_inc(DJBM_ENQUEUED);
+
+	pdh = httpsrv_get_userdata(hcl);
+	if (pdh != NULL) {
+		pdh->trace.id = hcl->id;
+		pdh->trace.reqid = hcl->reqid;
+		djbx_mark(&pdh->trace, DJBX_ENQUEUE);
+	}
+
+	/* Pair it with a puller, or wait for one */
+	if (!djb_match_request(pr)) {
+		return (false);
+	}
 
 	log_dbg(HCL_ID " done", id);
 
 	return (true);
 }
 
+/* djb itself (no connection), or a client on this host */
+static bool
+djb_peer_local(httpsrv_client_t *hcl);
+static bool
+djb_peer_local(httpsrv_client_t *hcl) {
+	struct sockaddr_storage		ss;
+	const struct sockaddr_in	*s4;
+	const struct sockaddr_in6	*s6;
+	socklen_t			len = sizeof ss;
+
+	if (!conn_is_valid(&hcl->conn)) {
+		return (true);
+	}
+
+	if (getpeername(conn_fd(&hcl->conn), (struct sockaddr *)&ss,
+			&len) == -1) {
+		return (false);
+	}
+
+	switch (ss.ss_family) {
+	case AF_UNIX:
+		/* Our socket, mode 0600 (unix.c) */
+		return (true);
+
+	case AF_INET:
+		s4 = (const struct sockaddr_in *)&ss;
+		return ((ntohl(s4->sin_addr.s_addr) >> 24) == 127);
+
+	case AF_INET6:
+		s6 = (const struct sockaddr_in6 *)&ss;
+		return (IN6_IS_ADDR_LOOPBACK(&s6->sin6_addr) ||
+			(IN6_IS_ADDR_V4MAPPED(&s6->sin6_addr) &&
+			 s6->sin6_addr.s6_addr[12] == 127));
+
+	default:
+		return (false);
+	}
+}
+
+/*
+ * The class of a proxy request: bulk, unless it asks for control with
+ * a DJB-Priority header. Control skips the fair queue and the memory
+ * budget, thus only djb itself and clients on this host get it. The
+ * header is used up here and goes no further.
+ */
+static djb_prio_t
+djb_proxy_prio(httpsrv_client_t *hcl, djb_headers_t *dh);
+static djb_prio_t
+djb_proxy_prio(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	bool control;
+
+	if (dh == NULL) {
+		return (DJB_PRIO_BULK);
+	}
+
+	control = (strcasecmp(dh->prio, "control") == 0);
+	dh->prio[0] = '\0';
+
+	if (control && !djb_peer_local(hcl)) {
+		log_wrn(HCL_ID " DJB-Priority: control from a remote "
+			"client, queued as bulk", hcl->id);
+		control = false;
+	}
+
+	return (control ? DJB_PRIO_CONTROL : DJB_PRIO_BULK);
+}
+
 static void
 djb_handle_proxy_post(httpsrv_client_t *hcl);
 static void
 djb_handle_proxy_post(httpsrv_client_t *hcl) {
-	djb_proxy_add(hcl);
+	djb_proxy_add(hcl, djb_proxy_prio(hcl, httpsrv_get_userdata(hcl)));
 }
 
-static bool
-djb_handle_proxy(httpsrv_client_t *hcl);
-static bool
-djb_handle_proxy(httpsrv_client_t *hcl) {
+/* Where proxy requests go: DJB_FORCED_HOSTNAME or the preference */
+static void
+djb_proxy_hostname(httpsrv_client_t *hcl);
+static void
+djb_proxy_hostname(httpsrv_client_t *hcl) {
 	static bool	got_hostname = false;
 	const char	*h;
 
@@ -1084,6 +5138,52 @@ djb_handle_proxy(httpsrv_client_t *hcl) {
 		log_dbg("Forcing Hostname to: %s",
 			hcl->headers.hostname);
 	}
+}
+
+/*
+ * A proxy request that did not come through httpsrv (unix socket):
+ * its body, if any, is in hcl->readbody already
+ */
+bool
+djb_proxy_local(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djb_proxy_hostname(hcl);
+
+	return (djb_proxy_add(hcl, djb_proxy_prio(hcl, dh)));
+}
+
+static bool
+djb_handle_proxy(httpsrv_client_t *hcl);
+static bool
+djb_handle_proxy(httpsrv_client_t *hcl) {
+	djb_proxy_hostname(hcl);
+
+	/*
+	 * Batched pulls carry bodies inline, thus read the body in first
+	 * (we get called again once it is complete). A channel (WebSocket,
+	 * native) does so only for what it gets, see djb_match_pair().
+	 */
+	if (hcl->method == HTTP_M_POST &&
+	    hcl->readbody == NULL &&
+	    djb_pull_batch() > 0) {
+		switch (djb_readbody(hcl, 0)) {
+		case DJB_BODY_ERROR:
+			djb_error(hcl, 500, "Could not read body");
+			return (true);
+
+		case DJB_BODY_LATER:
+			/* Let httpsrv read it */
+			return (false);
+
+		case DJB_BODY_DECODING:
+			/* We run again once it is decoded */
+			return (true);
+
+		case DJB_BODY_NONE:
+		case DJB_BODY_READY:
+		default:
+			break;
+		}
+	}
 
 	/*
 	 * Add this request to the queue when the request is handled
@@ -1092,11 +5192,25 @@ djb_handle_proxy(httpsrv_client_t *hcl) {
 	log_dbg(HCL_ID " keephandling=yes", hcl->id);
 	hcl->keephandling = true;
 
-	httpsrv_set_posthandle(hcl, djb_handle_proxy_post);
+	djb_posthandle(hcl, djb_handle_proxy_post);
 
 	return (true);
 }
 
+/* Is this a DJB API or a proxy request? */
+static bool
+djb_handle_dispatch(httpsrv_client_t *hcl, djb_headers_t *dh);
+static bool
+djb_handle_dispatch(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	if (djbr_is_self(hcl->headers.hostname)) {
+		/* API request */
+		return (djb_handle_api(hcl, dh));
+	}
+
+	/* Proxied request */
+	return (djb_handle_proxy(hcl));
+}
+
 static bool
 djb_handle(httpsrv_client_t *hcl, void *user);
 static bool
@@ -1106,6 +5220,11 @@ djb_handle(httpsrv_client_t *hcl, void *user) {
 
 	log_dbg(HCL_ID " hostname: %s", hcl->id, hcl->headers.hostname);
 
+	/* Busy with a request, not idle */
+	if (dh != NULL) {
+		djbt_cancel(&dh->idle);
+	}
+
 	/* Parse the request */
 	if (httpsrv_parse_request(hcl, NULL) == -1) {
 		/* parse_request will have called httpsrv_error() */
@@ -1114,309 +5233,686 @@ djb_handle(httpsrv_client_t *hcl, void *user) {
 
 	log_dbg(HCL_ID " uri: %s", hcl->id, hcl->headers.uri);
 
-	/* Is this a DJB API or a proxy request? */
-	if (	strcmp(hcl->headers.hostname, "127.0.0.1:6543"	) == 0 ||
-		strcmp(hcl->headers.hostname, "[::1]:6543"	) == 0 ||
-		strcmp(hcl->headers.hostname, "localhost:6543"	) == 0) {
+	done = djb_handle_dispatch(hcl, dh);
 
-		/* API request */
-		done = djb_handle_api(hcl, dh);
-	} else {
-		/* Proxied request */
-		done = djb_handle_proxy(hcl);
+	log_dbg(HCL_ID " end", hcl->id);
+
+	return (done);
+}
+
+/*
+ * A chunked request body got decoded (relay thread): the handler that
+ * asked for it runs again right here, as httpsrv runs it again once it
+ * read a body with a length
+ */
+static void
+djb_body_decoded(djb_relay_t *r, bool ok) {
+	httpsrv_client_t	*hcl = r->from;
+	djb_headers_t		*dh = httpsrv_get_userdata(hcl);
+	djb_post_f		post;
+
+	if (!ok || djb_readbody_decoded(hcl, dh->decode_extra, r->body,
+					r->moved) == DJB_BODY_ERROR) {
+		log_wrn(HCL_ID " could not read chunked body", hcl->id);
+		djb_error(hcl, 500, "Could not read body");
+		connset_handling_done(&hcl->conn, false);
+		return;
+	}
+
+	dh->redo = true;
+	dh->post = NULL;
+	hcl->keephandling = false;
+
+	djb_handle_dispatch(hcl, dh);
+
+	dh->redo = false;
+	post = dh->post;
+	dh->post = NULL;
+
+	if (post != NULL) {
+		/* Parked again, what httpsrv would have run next */
+		post(hcl);
+	} else if (!hcl->keephandling) {
+		connset_handling_done(&hcl->conn, false);
+	}
+}
+
+static void
+djb_done(httpsrv_client_t *hcl, void *user);
+static void
+djb_done(httpsrv_client_t *hcl, void *user) {
+	djb_headers_t  *dh;
+
+	log_dbg(HCL_ID " %p",
+		hcl->id, user);
+
+	dh = (djb_headers_t *)user;
+	if (dh == NULL) {
+		/* Closed already */
+		return;
+	}
+
+	djb_trace_commit(dh);
+	djb_hdr_reset(dh);
+
+	/* Idle until the next request */
+	djb_idle_arm(hcl, dh);
+}
+
+static djb_req_t *
+djb_find_phcl(uint64_t phcl_id);
+static djb_req_t *
+djb_find_phcl(uint64_t phcl_id) {
+	djb_req_t	*pr = NULL, *r;
+	unsigned int	b;
+
+	/* Find the request paired with this HCL */
+	list_lock(&lst_proxy_out);
+	b = djb_reqidx_hash(phcl_id, 0) & (l_reqidx.size - 1);
+	for (r = l_reqidx.phcl[b]; r != NULL; r = r->phcl_next) {
+		if (r->phcl_id != phcl_id) {
+			continue;
+		}
+
+		/* Gotcha */
+		pr = r;
+
+		/* Remove it from this list */
+		djb_out_remove(pr);
+		break;
+	}
+	list_unlock(&lst_proxy_out);
+
+	/* Ours now, its deadline is not needed anymore */
+	if (pr != NULL) {
+		djbt_cancel(&pr->timer);
+	}
+
+	return (pr);
+}
+
+/* What was paired with a client that went away goes to another puller */
+static void
+djb_reschedule(uint64_t phcl_id);
+static void
+djb_reschedule(uint64_t phcl_id) {
+	djb_req_t *pr, *batch = NULL;
+
+	/*
+	 * A batch shares the phcl_id; the index hands it out newest
+	 * first, thus collect it and requeue it in the order it came
+	 */
+	while ((pr = djb_find_phcl(phcl_id)) != NULL) {
+		log_dbg(HCL_ID " found pair: " HCL_ID, phcl_id, pr->hcl->id);
+		pr->fq_next = batch;
+		batch = pr;
+	}
+
+	while ((pr = batch) != NULL) {
+		batch = pr->fq_next;
+		pr->fq_next = NULL;
+		pr->phcl_id = 0;
+
+		/* Reschedule it */
+		log_dbg("Rescheduling " HCL_ID, pr->hcl->id);
+		djbm_inc(DJBM_RESCHEDULED);
+		djb_match_request(pr);
+	}
+}
+
+/* A channel without a connection of its own (native messaging) closed */
+void
+djb_ws_close(djbw_t *ws) {
+	djb_reschedule(ws->hcl_id);
+}
+
+/*
+ * Drop the requests of a closing client that nobody took yet: the one
+ * outstanding and those waiting for their circuit. Queued ones are
+ * dropped once they reach the head (see djb_request_pop()).
+ */
+static void
+djb_drain(httpsrv_client_t *hcl, djb_headers_t *dh);
+static void
+djb_drain(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	djb_circuit_t	*c;
+	djb_req_t	*pr, *r;
+	hnode_t		*node;
+	unsigned int	b;
+
+	pr = NULL;
+	list_lock(&lst_proxy_out);
+	b = djb_reqidx_hash(hcl->id, hcl->reqid) & (l_reqidx.size - 1);
+	for (r = l_reqidx.seq[b]; r != NULL; r = r->seq_next) {
+		if (r->hcl == hcl) {
+			pr = r;
+			djb_out_remove(pr);
+			break;
+		}
+	}
+	list_unlock(&lst_proxy_out);
+
+	if (pr != NULL) {
+		djbt_cancel(&pr->timer);
+		djb_req_free(pr);
+	}
+
+	c = djb_circuit_get(__atomic_load_n(&dh->circuit, __ATOMIC_RELAXED),
+			    false);
+	while (c != NULL) {
+		pr = NULL;
+		list_lock(&c->pending);
+		for (node = c->pending.head; node != NULL; node = node->next) {
+			r = (djb_req_t *)node;
+			if (r->hcl == hcl) {
+				pr = r;
+				list_remove(&c->pending, &pr->node);
+				pr->state = DJB_REQ_NONE;
+				break;
+			}
+		}
+		list_unlock(&c->pending);
+
+		if (pr == NULL) {
+			break;
+		}
+
+		/* djb_affinity_expire() finds it not waiting anymore */
+		djbt_cancel(&pr->timer);
+		djb_req_free(pr);
+	}
+}
+
+static void
+djb_close(httpsrv_client_t *hcl, void *user);
+static void
+djb_close(httpsrv_client_t *hcl, void *user) {
+	djb_headers_t	*dh = (djb_headers_t *)user;
+
+	log_dbg(HCL_ID, hcl->id);
+
+	/*
+	 * Going away, release our state; requests of it that other threads
+	 * still hold keep it until they are done with it
+	 */
+	if (dh != NULL) {
+		djbt_cancel(&dh->idle);
+		__atomic_store_n(&dh->closed, true, __ATOMIC_RELEASE);
+		httpsrv_set_userdata(hcl, NULL);
+		djb_drain(hcl, dh);
+		djb_dh_put(dh);
 	}
 
-	log_dbg(HCL_ID " end", hcl->id);
+	/* Its fair share is not needed anymore */
+	djbf_forget(&q_proxy_new, conn_id(&hcl->conn));
 
-	return (done);
+	/* Was this request paired? (a WebSocket channel: several) */
+	djb_reschedule(hcl->id);
 }
 
-#ifdef DEBUG
+/*
+ * Worker pool (DJB_WORKERS, DJB_WORKERS_MAX environment variables)
+ *
+ * Pairing happens on the thread that delivers either side, thus these
+ * are not needed; they only periodically drain the queues as a safety
+ * net in case both sides ever end up queued. pool.c sizes the pool.
+ */
 static void
-djb_done(httpsrv_client_t *hcl, void *user);
+djb_worker_sweep(void);
 static void
-djb_done(httpsrv_client_t *hcl, void *user) {
-#else
+djb_worker_sweep(void) {
+	djb_match_drain();
+}
+
+/* What the pool bases its size on */
 static void
-djb_done(httpsrv_client_t UNUSED *hcl, void *user);
+djb_worker_load(unsigned int *depth, unsigned int *pullers);
 static void
-djb_done(httpsrv_client_t UNUSED *hcl, void *user) {
-#endif
-	djb_headers_t  *dh;
+djb_worker_load(unsigned int *depth, unsigned int *pullers) {
+	unsigned int queued, dead;
 
-	log_dbg(HCL_ID " %p",
-		hcl->id, user);
+	queued = djbq_depth(&q_api_pull);
+	dead = __atomic_load_n(&l_pull_dead, __ATOMIC_RELAXED);
 
-	dh = (djb_headers_t *)user;
-	assert(dh != NULL);
-	memzero(dh, sizeof *dh);
+	*depth = djb_request_depth();
+	*pullers = queued > dead ? queued - dead : 0;
 }
 
-static djb_req_t *
-djb_find_phcl(hlist_t *lst, uint64_t phcl_id);
-static djb_req_t *
-djb_find_phcl(hlist_t *lst, uint64_t phcl_id) {
-	djb_req_t	*pr = NULL, *r, *rn;
-
-	/* Find this Request-ID in this list of requests */
-	list_lock(lst);
-	list_for(lst, r, rn, djb_req_t *) {
-		if (r->phcl_id != phcl_id) {
-			continue;
-		}
+/*
+ * Environment overrides for tunables
+ *
+ * Only a plain decimal number is taken, anything else (garbage, a sign,
+ * out of range) keeps the default; values above 'max' are clamped to it.
+ */
+static unsigned int
+djb_env_uint(const char *name, unsigned int def, unsigned int max);
+static unsigned int
+djb_env_uint(const char *name, unsigned int def, unsigned int max) {
+	const char	*v;
+	char		*end;
+	unsigned long	n;
+
+	v = getenv(name);
+	if (v == NULL) {
+		return (def);
+	}
 
-		/* Gotcha */
-		pr = r;
+	errno = 0;
+	n = strtoul(v, &end, 10);
+	if (!isdigit((unsigned char)*v) || *end != '\0' || errno != 0) {
+		log_wrn("Ignoring %s = '%s', not a number, using %u",
+			name, v, def);
+		return (def);
+	}
 
-		/* Remove it from this list */
-		list_remove(lst, &pr->node);
-		break;
+	if (n > max) {
+		log_wrn("%s = %s is too large, using %u", name, v, max);
+		return (max);
 	}
-	list_unlock(lst);
 
-	return (pr);
+	log_inf("%s = %lu", name, n);
+	return ((unsigned int)n);
 }
 
 static void
-djb_close(httpsrv_client_t *hcl, void UNUSED *user);
+djb_deadlines_init(void);
 static void
-djb_close(httpsrv_client_t *hcl, void UNUSED *user) {
-	djb_req_t *pr;
-
-	log_dbg(HCL_ID, hcl->id);
-
-	/* Was this request paired? */
-	pr = djb_find_phcl(&lst_proxy_out, hcl->id);
-	if (pr != NULL) {
-		log_dbg(HCL_ID " found pair: " HCL_ID, hcl->id, pr->hcl->id);
-
-		/* Reschedule it */	
-		list_addtail_l(&lst_proxy_new, &pr->node);
-		log_dbg("Rescheduled " HCL_ID, pr->hcl->id);
+djb_deadlines_init(void) {
+	l_to_pull = djb_env_uint("DJB_PULL_TIMEOUT",
+				     DJB_PULL_TIMEOUT, DJB_ENV_SECS_MAX) * 1000;
+	l_to_out = djb_env_uint("DJB_OUT_TIMEOUT",
+				    DJB_OUT_TIMEOUT, DJB_ENV_SECS_MAX) * 1000;
+	l_out_retries = djb_env_uint("DJB_OUT_RETRIES",
+					 DJB_OUT_RETRIES, 100);
+	l_to_idle = djb_env_uint("DJB_IDLE_TIMEOUT",
+				     DJB_IDLE_TIMEOUT, DJB_ENV_SECS_MAX) * 1000;
+	l_affinity_wait = djb_env_uint("DJB_AFFINITY_WAIT",
+				       DJB_AFFINITY_WAIT, 60 * 1000);
+	l_fair_quantum = djb_env_uint("DJB_FAIR_QUANTUM",
+				      DJB_FAIR_QUANTUM, 16 * 1024 * 1024);
+	if (l_fair_quantum == 0) {
+		l_fair_quantum = DJB_FAIR_QUANTUM;
 	}
+	q_proxy_new.quantum = l_fair_quantum;
+
+	l_mem_budget = (uint64_t)djb_env_uint("DJB_MEM_BUDGET",
+					      DJB_MEM_BUDGET, 1024 * 1024) * 1024 * 1024;
+	l_retry_after = djb_env_uint("DJB_RETRY_AFTER", DJB_RETRY_AFTER,
+				     DJB_ENV_SECS_MAX);
+	l_lat_interval = djb_env_uint("DJB_HIST_INTERVAL", DJB_HIST_INTERVAL,
+				      DJB_ENV_SECS_MAX);
 }
 
+#ifdef DJB_SHARDING
 /*
- * pr = client request
- * ar = /pull/ API request
+ * The listener of a shard; only these get SO_REUSEPORT, every shard's
+ * one before it binds, the first one included, else only the first
+ * one gets the address. -1 when it could not listen.
  */
-static void
-djb_handle_forward(djb_req_t *pr, djb_req_t *ar);
-static void
-djb_handle_forward(djb_req_t *pr, djb_req_t *ar) {
-	djb_headers_t	*dh;
+static int
+djb_shard_listen(const char *host, unsigned int port);
+static int
+djb_shard_listen(const char *host, unsigned int port) {
+	struct addrinfo	hints, *res, *ai;
+	char		service[16];
+	int		fd = -1, on = 1, r;
 
-	fassert(pr->hcl);
-	fassert(ar->hcl);
+	memzero(&hints, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
 
-	log_dbg("request " HCL_ID ", puller " HCL_ID,
-		pr->hcl->id, ar->hcl->id);
+	snprintf(service, sizeof service, "%u", port);
 
-	/* Connection might have closed by now */
-	if (!conn_is_valid(&ar->hcl->conn)) {
-		fassert(false);
-		/* This request is done */
-		httpsrv_done(ar->hcl);
-		return;
+	r = getaddrinfo(host, service, &hints, &res);
+	if (r != 0) {
+		log_err("Could not resolve %s: %s", host, gai_strerror(r));
+		return (-1);
 	}
 
-	/* HTTP okay (non-POST gets a short HTML answer) */
-	httpsrv_answer(ar->hcl, HTTPSRV_HTTP_OK,
-			pr->hcl->method != HTTP_M_POST ?
-				HTTPSRV_CTYPE_HTML : NULL);
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
 
-	/* DJB headers */
-	conn_addheaderf(&ar->hcl->conn, "DJB-URI: http://%s%s",
-			pr->hcl->headers.hostname,
-			pr->hcl->headers.rawuri);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-	conn_addheaderf(&ar->hcl->conn, "DJB-Method: %s",
-			httpsrv_methodname(pr->hcl->method));
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+			       &on, sizeof on) == 0 &&
+		    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			       &on, sizeof on) == 0 &&
+		    bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0) {
+			break;
+		}
 
-	conn_addheaderf(&ar->hcl->conn, "DJB-SeqNo: %09" PRIx64 "%09" PRIx64,
-			pr->hcl->id, pr->hcl->reqid);
+		log_wrn("Could not listen on %s:%u: %s",
+			host, port, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
 
-	assert(pr->hcl->method != HTTP_M_NONE);
+	freeaddrinfo(res);
 
-	/* pr's headers */
-	dh = (djb_headers_t *)pr->hcl->user;
+	return (fd);
+}
+#endif
 
-	/* Client to server */
-	if (dh != NULL && strlen(dh->cookie) > 0) {
-		conn_addheaderf(&ar->hcl->conn, "DJB-Cookie: %s",
-				dh->cookie);
+#ifdef _LINUX
+/*
+ * Pin the calling thread to the n-th CPU it may run on; the threads it
+ * creates from now on inherit that. The old set is kept in 'saved'.
+ */
+static bool
+djb_shard_pin(unsigned int n, cpu_set_t *saved);
+static bool
+djb_shard_pin(unsigned int n, cpu_set_t *saved) {
+	cpu_set_t	set;
+	int		cpu, count;
+
+	if (sched_getaffinity(0, sizeof *saved, saved) != 0) {
+		return (false);
 	}
 
-	/* The paired HCL (so we can detect closes and restart this request) */
-	pr->phcl_id = ar->hcl->id;
+	count = CPU_COUNT(saved);
+	if (count <= 1) {
+		return (false);
+	}
 
-	if (pr->hcl->method != HTTP_M_POST) {
-		log_dbg("req " HCL_ID " with puller " HCL_ID " is non-POST",
-			pr->hcl->id, ar->hcl->id);
+	n %= count;
 
-		/* XHR requires a return, thus just give it a blank body */
-		/* Empty-ish body (Content-Length is arranged by conn) */
-		conn_printf(&ar->hcl->conn, "Non-POST JumpBox response\r\n");
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, saved) && n-- == 0) {
+			break;
+		}
+	}
 
-		/* Put this on the proxy_out list */
-		list_addtail_l(&lst_proxy_out, &pr->node);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
 
-		/* This request is done */
-		httpsrv_done(ar->hcl);
+	return (sched_setaffinity(0, sizeof set, &set) == 0);
+}
+#endif
 
-		/* Done handling this connection */
-		connset_handling_done(&ar->hcl->conn, false);
+/* Start shard i, its threads on a core of their own when sharding */
+static bool
+djb_httpsrv_init(httpsrv_t *hs);
+static bool
+djb_httpsrv_init(httpsrv_t *hs) {
+	if (!httpsrv_init(hs, NULL,
+			  djb_html_top,
+			  djb_html_tail,
+			  djb_accept,
+			  djb_header,
+			  djb_handle,
+			  djb_bodyfwd_done,
+			  djb_done,
+			  djb_close)) {
+		log_err("Could not initialize HTTP server");
+		return (false);
+	}
 
-	} else {
-		/* POST request */
-		log_dbg("req " HCL_ID " with puller " HCL_ID " is POST",
-			pr->hcl->id, ar->hcl->id);
+	return (true);
+}
 
-		/* Add the content type of the data to come */
-		conn_addheaderf(&ar->hcl->conn, "Content-Type: %s",
-				strlen(pr->hcl->headers.content_type) > 0 ?
-					pr->hcl->headers.content_type :
-					"text/html");
+#ifdef DJB_HTTPSRV_FD
+/*
+ * One more HTTP server with our handlers on a listener set up by the
+ * caller (the unix socket). On failure hs is not initialized and the
+ * fd is still the caller's.
+ */
+bool
+djb_serve_fd(httpsrv_t *hs, int fd, unsigned int threads) {
+	if (!djb_httpsrv_init(hs)) {
+		return (false);
+	}
 
-		/* Is there no body, then nothing further to do */
-		if (pr->hcl->headers.content_length == 0) {
-			/* Put this on the proxy_out list */
-			list_addtail_l(&lst_proxy_out, &pr->node);
+	if (!httpsrv_start_fd(hs, fd, threads)) {
+		log_err("Could not start HTTP server");
+		httpsrv_exit(hs);
+		return (false);
+	}
 
-			/* This request is done (after flushing) */
-			httpsrv_done(ar->hcl);
+	return (true);
+}
+#endif
 
-			/* Done handling this connection */
-			connset_handling_done(&ar->hcl->conn, false);
-		} else {
-			/* Put this on the proxy_out list */
-			list_addtail_l(&lst_proxy_out, &pr->node);
+static bool
+djb_shard_start(unsigned int i, const char *host, unsigned int port);
+static bool
+djb_shard_start(unsigned int i, const char *host, unsigned int port) {
+	bool		ok;
+#ifdef DJB_SHARDING
+	int		fd;
+#endif
+#ifdef _LINUX
+	cpu_set_t	saved;
+	bool		pinned = false;
 
-			log_dbg("Forwarding POST body from "
-				HCL_ID " (keephandling=%s) to " HCL_ID " (keephandling=%s)",
-				pr->hcl->id, yesno(pr->hcl->keephandling),
-				ar->hcl->id, yesno(ar->hcl->keephandling));
+	if (l_nshards > 1) {
+		pinned = djb_shard_pin(i, &saved);
+	}
+#endif
 
-			/* Forward the body from pr->hcl to ar->hcl */
-			httpsrv_forward(pr->hcl, ar->hcl);
+#ifdef DJB_SHARDING
+	if (l_nshards > 1) {
+		/* httpsrv owns it from here on, closed by httpsrv_exit() */
+		fd = djb_shard_listen(host, port);
+		ok = (fd != -1 &&
+		      httpsrv_start_fd(l_shards[i], fd, l_http_workers));
+		if (!ok && fd != -1) {
+			close(fd);
 		}
+	} else
+#endif
+	ok = httpsrv_start(l_shards[i], host, port, l_http_workers);
+
+#ifdef _LINUX
+	if (pinned) {
+		sched_setaffinity(0, sizeof saved, &saved);
 	}
+#endif
 
-	log_dbg("end");
+	return (ok);
 }
 
-static void *
-djb_worker_thread(void UNUSED *arg);
-static void *
-djb_worker_thread(void UNUSED *arg) {
-	djb_req_t	*pr, *ar;
-
-	log_dbg("...");
+static int
+djb_run(void);
+static int
+djb_run(void) {
+	httpsrv_t	*hs = NULL;
+	int		ret = 0;
+	unsigned int	i, port, shards;
+	const char	*laddr;
+	char		host[256], ja[sizeof host + 16];
+
+	/* Threads of each, fixed once started */
+	l_http_workers = djb_env_uint("DJB_HTTP_WORKERS", DJB_HTTP_WORKERS,
+				      DJB_ENV_THREADS_MAX);
+	if (l_http_workers == 0) {
+		l_http_workers = 1;
+	}
 
-	while (thread_keep_running()) {
-		log_dbg("waiting for proxy request");
+	/* One HTTP server per shard */
+	shards = djb_env_uint("DJB_SHARDS", DJB_SHARDS, DJB_SHARDS_MAX);
+	if (shards == 0) {
+		shards = 1;
+	} else if (shards > DJB_SHARDS_MAX) {
+		shards = DJB_SHARDS_MAX;
+	}
 
-		thread_setmessage("Waiting for Proxy Request");
+#ifndef DJB_SHARDING
+	if (shards > 1) {
+		log_wrn("DJB_SHARDS needs SO_REUSEPORT and a libfutil with "
+			"httpsrv_start_fd(), using 1 shard");
+		shards = 1;
+	}
+#endif
 
-		/* Get a new proxy request */
-		pr = (djb_req_t *)list_getnext(&lst_proxy_new);
-		if (pr == NULL) {
-			if (thread_keep_running()) {
-				log_err("get_next(proxy_new) failed...");
-			}
+	/* Create out DGW structures */
+	for (l_nshards = 0; l_nshards < shards; l_nshards++) {
+		hs = (httpsrv_t *)mcalloc(sizeof *hs, "httpsrv_t");
+		if (hs == NULL) {
+			log_crt("No memory for HTTP Server");
 			break;
 		}
 
-		fassert(pr->hcl);
+		l_shards[l_nshards] = hs;
+	}
 
-		log_dbg("got request " HCL_ID ", getting puller", pr->hcl->id);
-		thread_setmessage("Got Request " HCL_ID, pr->hcl->id);
+	if (l_nshards == 0) {
+		return (-1);
+	}
 
-		/* We got a request, get a puller for it */
-		ar = (djb_req_t *)list_getnext(&lst_api_pull);
+	/* The first one also hosts the internal clients */
+	hs = l_shards[0];
 
-		if (ar == NULL) {
-			if (thread_keep_running()) {
-				log_err(" get_next(api_pull) failed...");
-			}
+	while (true) {
+		/* Initialize Preferences module */
+		prf_init();
+
+		/* Deadlines, driven by the timer thread */
+		djb_deadlines_init();
+
+		/* Smallest body that is spliced instead of buffered */
+		l_splice_min = djb_env_uint("DJB_SPLICE_MIN", DJB_SPLICE_MIN,
+					    1024 * 1024 * 1024);
+
+		/* Threads that move the spliced and chunked bodies */
+		if (!djb_relay_init(djb_env_uint("DJB_RELAYS", DJB_RELAYS,
+						 DJB_ENV_THREADS_MAX))) {
+			ret = -1;
 			break;
 		}
 
-		log_dbg("request " HCL_ID ", puller "HCL_ID,
-			pr->hcl->id, ar->hcl->id);
+		if (!thread_add("DJBTimer", &djbt_thread, NULL)) {
+			log_err("Could not create timer thread");
+			ret = -1;
+			break;
+		}
 
-		thread_setmessage("request " HCL_ID " puller " HCL_ID,
-				  pr->hcl->id, ar->hcl->id);
+		/* Latency histograms move on to the next interval */
+		if (l_lat_interval != 0) {
+			djbt_arm(&l_lat_timer, l_lat_interval * 1000,
+				 djb_lat_rotate, NULL);
+		}
 
-		djb_handle_forward(pr, ar);
+		/* Worker pool, growing and shrinking with the load */
+		if (!djbp_init(djb_env_uint("DJB_WORKERS", DJB_WORKERS_MIN,
+					    DJB_ENV_THREADS_MAX),
+			       djb_env_uint("DJB_WORKERS_MAX", DJB_WORKERS_MAX,
+					    DJB_ENV_THREADS_MAX),
+			       DJB_SWEEP_MS, djb_worker_sweep,
+			       djb_worker_load)) {
+			ret = -1;
+			break;
+		}
 
-		/* Release it */
-		free(ar);
+		/* Where we listen, and thus which Host: is us */
+		laddr = getenv("DJB_LISTEN");
+		if (laddr == NULL) {
+			laddr = DJB_LISTEN;
+		}
 
-		/* Served another one */
-		thread_serve();
+		if (!djbr_listen_parse(laddr, host, sizeof host, &port)) {
+			log_err("Invalid DJB_LISTEN %s, want host:port", laddr);
+			ret = -1;
+			break;
+		}
 
-		log_dbg("end");
-	}
+		/* Anyone who can reach us can /shutdown/ and /launch/ */
+		if (!djbr_is_loopback(host)) {
+			if (djb_env_uint("DJB_LISTEN_REMOTE", 0, 1) == 0) {
+				log_err("DJB_LISTEN %s is not a loopback "
+					"address, set DJB_LISTEN_REMOTE=1 "
+					"to allow it", laddr);
+				ret = -1;
+				break;
+			}
 
-	log_dbg("exit");
+			log_wrn("Listening on %s: /shutdown/ and /launch/ "
+				"are reachable from the network", laddr);
+		}
 
-	return (NULL);
-}
+		/* StegoTorus, and the extension, find us there */
+		if (!djbr_listen_addr(host, port, ja, sizeof ja)) {
+			log_err("DJB_LISTEN %s too long", laddr);
+			ret = -1;
+			break;
+		}
 
-static int
-djb_run(void);
-static int
-djb_run(void) {
-	httpsrv_t	*hs = NULL;
-	int		ret = 0;
-	unsigned int	i;
+		prf_set_default(PRF_JA, ja);
 
-	/* Create out DGW structure */
-	hs = (httpsrv_t *)mcalloc(sizeof *hs, "httpsrv_t");
-	if (hs == NULL) {
-		log_crt("No memory for HTTP Server");
-		return (-1);
-	}
+		if (!djbr_self_init(host, port) ||
+		    !djbr_init(&l_api_routes, djb_api_routes)) {
+			ret = -1;
+			break;
+		}
 
-	while (true) {
-		/* Initialize Preferences module */
-		prf_init();
+		/* Static assets, rendered and compressed once */
+		if (!djba_add("/djb.css", HTTPSRV_CTYPE_CSS,
+			      djb_css, sizeof djb_css - 1)) {
+			ret = -1;
+			break;
+		}
 
-		/* Launch a few worker threads */
-		for (i = 0; i < DJB_WORKERS; i++) {
-			if (!thread_add("DJBWorker", &djb_worker_thread, NULL)) {
-				log_err("Could not create worker thread");
+		/* Initialize the HTTP Servers */
+		for (i = 0; i < l_nshards; i++) {
+			if (!djb_httpsrv_init(l_shards[i])) {
 				ret = -1;
 				break;
 			}
 		}
 
-		/* Initialize a HTTP Server */
-		if (!httpsrv_init(hs, NULL,
-				  djb_html_top,
-				  djb_html_tail,
-				  djb_accept,
-				  djb_header,
-				  djb_handle,
-				  djb_bodyfwd_done,
-				  djb_done,
-				  djb_close)) {
-			log_err("Could not initialize HTTP server");
-			ret = -1;
+		if (ret != 0) {
 			break;
 		}
 
 		/* Initialize ACS */
 		acs_init(hs);
 
-		/* Fire up an HTTP server */
-		if (!httpsrv_start(hs, DJB_HOST, DJB_PORT, DJB_WORKERS)) {
+		/* StegoTorus over a unix socket (DJB_UNIX) */
+		if (!djbu_init(hs, djb_env_uint("DJB_UNIX_THREADS",
+						DJB_UNIX_THREADS,
+						DJB_ENV_THREADS_MAX),
+			       djb_env_uint("DJB_UNIX_STEGOTORUS", 0, 1) != 0)) {
+			ret = -1;
+			break;
+		}
+
+		/* Started by Chrome: talk to the extension over stdio */
+		if (l_native && !djbn_init(hs)) {
+			ret = -1;
+			break;
+		}
+
+		/* Fire up the HTTP servers */
+		log_inf("Listening on %s (%u shards)", laddr, l_nshards);
+
+		if (!djb_shard_start(0, host, port)) {
 			log_err("HTTP Server failed");
 			ret = -1;
 			break;
 		}
 
+		/* The others share the port (SO_REUSEPORT) */
+		for (i = 1; i < l_nshards; i++) {
+			if (!djb_shard_start(i, host, port)) {
+				log_wrn("HTTP Server shard %u failed, using %u",
+					i, i);
+				break;
+			}
+		}
+
+		for (shards = i; i < l_nshards; i++) {
+			httpsrv_exit(l_shards[i]);
+			mfree(l_shards[i], sizeof *l_shards[i], "httpsrv_t");
+			l_shards[i] = NULL;
+		}
+
+		l_nshards = shards;
+
 		/* Nothing more to set up */
 		break;
 	}
@@ -1434,15 +5930,36 @@ djb_run(void) {
 	/* Make sure that our threads are done */
 	thread_stopall(false);
 
+	/* Cleanup the worker pool */
+	djbp_exit();
+
+	/* Cleanup the relays */
+	djb_relay_exit();
+
 	/* Cleanup ACS */
 	acs_exit();
 
+	/* Cleanup the unix socket */
+	djbu_exit();
+
+	/* Cleanup native messaging */
+	if (l_native) {
+		djbn_exit();
+	}
+
 	/* Cleanup Preferences */
-	prf_init();
+	prf_exit();
 
-	/* Clean up the http object */
-	if (hs)
-		httpsrv_exit(hs);
+	/* Cleanup the router */
+	djbr_exit();
+
+	/* Cleanup the static assets */
+	djba_exit();
+
+	/* Clean up the http objects */
+	for (i = 0; i < l_nshards; i++) {
+		httpsrv_exit(l_shards[i]);
+	}
 
 	return (ret);
 }
@@ -1459,6 +5976,9 @@ djb_usage(const char *progname) {
 				  "[<username>]\n");
 	fprintf(stderr, "           = daemonize the server into\n");
 	fprintf(stderr, "             the background\n");
+	fprintf(stderr, "%s...   = run as native messaging host\n",
+		DJB_NATIVE_ORIGIN);
+	fprintf(stderr, "             (started by Chrome)\n");
 }
 
 int
@@ -1471,9 +5991,29 @@ main(int argc, const char *argv[]) {
 	if (!thread_init())
 		return (-1);
 
-	list_init(&lst_proxy_new);
 	list_init(&lst_proxy_out);
-	list_init(&lst_api_pull);
+	mutex_init(l_circuits_mutex);
+	djb_lat_create(l_lat_none);
+
+	if (!djbq_init(&q_proxy_ctl,
+		       djb_env_uint("DJB_QUEUE_CONTROL", DJB_QUEUE_SIZE,
+				    DJB_QUEUE_MAX)) ||
+	    !djbf_init(&q_proxy_new, DJB_FAIR_QUANTUM,
+		       djb_env_uint("DJB_QUEUE_BULK", DJB_QUEUE_SIZE,
+				    DJB_QUEUE_MAX)) ||
+	    !djbq_init(&q_api_pull,
+		       djb_env_uint("DJB_QUEUE_PULL", DJB_QUEUE_SIZE,
+				    DJB_QUEUE_MAX)) ||
+	    !djb_reqidx_init(&l_reqidx) ||
+	    !djbt_init() ||
+	    (l_slab_req = djbs_create("djb_req_t",
+				      sizeof (djb_req_t))) == NULL ||
+	    (l_slab_dh = djbs_create("djb_headers_t",
+				     sizeof (djb_headers_t))) == NULL) {
+		log_crt("Could not initialize queues");
+		thread_exit();
+		return (-1);
+	}
 
 	if (argc < 2) {
 		djb_usage(argv[0]);
@@ -1498,6 +6038,15 @@ main(int argc, const char *argv[]) {
 		}
 	} else if (strcasecmp(argv[1], "run") == 0 && argc == 2) {
 		ret = djb_run();
+	} else if (strncmp(argv[1], DJB_NATIVE_ORIGIN,
+			   strlen(DJB_NATIVE_ORIGIN)) == 0) {
+		/* Chrome starts us as native messaging host of the extension */
+		if (djbn_setup()) {
+			l_native = true;
+			ret = djb_run();
+		} else {
+			ret = -1;
+		}
 	} else {
 		djb_usage(argv[0]);
 		ret = -1;
@@ -1509,6 +6058,14 @@ main(int argc, const char *argv[]) {
 		mfreestrdup(l_exit_hostname, "exit_hostname");
 	}
 
+	djb_circuits_exit();
+	djbt_exit();
+	djbs_exit();
+	djb_reqidx_exit(&l_reqidx);
+	djbq_exit(&q_api_pull);
+	djbq_exit(&q_proxy_ctl);
+	djbf_exit(&q_proxy_new);
+
 	thread_exit();
 
 	/* All okay */
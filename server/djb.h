@@ -13,19 +13,186 @@
 /* Jansson - the JSON parser */
 #include <jansson.h>
 
-typedef bool (*djb_push_f)(httpsrv_client_t *shcl, httpsrv_client_t *hcl);
+/* Timer wheel (timer.c) */
+typedef void (*djbt_cb_f)(void *data);
+
+typedef struct djbt_timer {
+	struct djbt_timer	*next;
+	struct djbt_timer	**pprev;	/* NULL when not armed */
+	uint64_t		expires;	/* Tick it fires at */
+	djbt_cb_f		cb;
+	void			*data;
+} djbt_timer_t;
+
+/* The answer to an internal proxy request, as pushed back by the plugin */
+typedef struct {
+	unsigned int	httpcode;
+	const char	*httptext;
+	const char	*content_type;	/* NULL when none given */
+	char		*body;		/* NULL when there is no body */
+	size_t		body_len;
+	const char	*setcookie;	/* NULL when none given */
+} djb_answer_t;
+
+typedef void (*djb_push_f)(httpsrv_client_t *hcl, djb_answer_t *ans);
+
+/* Inline room for variable length headers, more spills to the heap */
+#define DJB_HDR_INLINE	192
+#define DJB_HDR_MAX	8192
+
+typedef struct djb_hdr_spill {
+	struct djb_hdr_spill	*next;
+	char			data[];
+} djb_hdr_spill_t;
+
+/* Stages of a proxy request, as traced (see trace.c) */
+typedef enum {
+	DJBX_ACCEPT = 0,		/* Its connection came in */
+	DJBX_ENQUEUE,			/* djb_proxy_add() */
+	DJBX_PAIR,			/* Handed to a puller */
+	DJBX_PUSH,			/* Its answer arrived */
+	DJBX_DONE,			/* The answer body is forwarded */
+	DJBX_STAGES
+} djbx_stage_t;
 
 typedef struct {
-	/* Push Callback */
+	uint64_t	id, reqid;
+	uint64_t	circuit;
+	uint64_t	ts[DJBX_STAGES];	/* Monotonic us, 0 = not (yet) */
+} djbx_rec_t;
+
+/* A body relay, moved by a relay thread (splice.c) */
+typedef struct djb_relay djb_relay_t;
+
+/* Called on the relay thread once the body moved, or failed to */
+typedef void (*djb_relay_f)(djb_relay_t *r, bool ok);
+
+struct djb_relay {
+	djb_relay_t		*next;		/* Queued */
+	httpsrv_client_t	*from;
+	httpsrv_client_t	*to;		/* NULL: decode, or only 'done' */
+	uint64_t		len;		/* Unless chunked */
+	bool			chunked;
+	char			*body;		/* Decoded, when to is NULL */
+	uint64_t		moved;		/* Outcome */
+	uint64_t		spliced;	/* Of which zero-copy */
+	djb_relay_f		done;
+	void			*data;
+};
+
+/* What runs once the handler returned (httpsrv_set_posthandle()) */
+typedef void (*djb_post_f)(httpsrv_client_t *hcl);
+
+typedef struct {
+	/* Push Callback, and what its caller wants with it */
 	djb_push_f	push;
+	void		*push_data;
+
+	char		httpcode[8];
+	char		seqno[24];
+	char		batch[8];
+	char		te[24];		/* Transfer-Encoding */
+	char		prio[12];	/* DJB-Priority */
+	char		upgrade[16];	/* Upgrade (WebSocket handshake) */
+	char		wskey[32];	/* Sec-WebSocket-Key */
+	char		wsversion[4];	/* Sec-WebSocket-Version */
+	char		acceptenc[64];	/* Accept-Encoding */
+	char		inm[96];	/* If-None-Match */
+
+	/* Variable length headers, NULL when absent (see djb_hdr_set()) */
+	const char	*httptext;
+	const char	*setcookie;
+	const char	*cookie;
+
+	djb_hdr_spill_t	*spill;		/* What did not fit inline */
+	unsigned int	spill_used;	/* Bytes in spill */
+	unsigned int	hbuf_used;
+	char		hbuf[DJB_HDR_INLINE];
+
+	/* Idle keep-alive deadline (survives between requests) */
+	djbt_timer_t	idle;
+
+	/* Held by the connection and by each of its djb_req_t (atomic) */
+	unsigned int	refs;
+	bool		closed;		/* Its connection went (atomic) */
+
+	/* Lifecycle of the current proxy request (see trace.c) */
+	djbx_rec_t	trace;
+
+	/* Circuit this connection's requests prefer (0 = none) */
+	uint32_t	circuit;
+
+	/* Fair queue flow of its requests (0 = its connection) */
+	uint64_t	flow;
+
+	/* Relay to start once the handler returned (see djb_relay_post()) */
+	djb_relay_t	*relay;
 
-	char		httpcode[64];
-	char		httptext[(256-64-32)];
-	char		seqno[32];
-	char		setcookie[8192];
-	char		cookie[8192];
+	/* Chunked request body being decoded (see djb_readbody()) */
+	djb_relay_t	decode;
+	unsigned int	decode_extra;
+	bool		redo;		/* Handler runs again on a relay thread */
+	djb_post_f	post;		/* What it left for after it returned */
 } djb_headers_t;
 
+/* Priority classes of proxy requests, highest last */
+typedef enum {
+	DJB_PRIO_BULK = 0,		/* StegoTorus traffic */
+	DJB_PRIO_CONTROL,		/* ACS, probes: always first */
+	DJB_PRIO_MAX
+} djb_prio_t;
+
+typedef struct djbw djbw_t;
+
+/* A queued request (proxy request or pull) */
+typedef struct djb_req {
+	hnode_t			node;		/* List node */
+	httpsrv_client_t	*hcl;		/* Client for this request */
+	djb_headers_t		*dh;		/* Its state (referenced) */
+	uint64_t		phcl_id;	/* Paired HCL */
+
+	/* Index details (only valid while on lst_proxy_out) */
+	uint64_t		id;		/* hcl->id when indexed */
+	uint64_t		reqid;		/* hcl->reqid when indexed */
+	struct djb_req		*seq_next;	/* Next in DJB-SeqNo bucket */
+	struct djb_req		*phcl_next;	/* Next in phcl_id bucket */
+	bool			out;		/* On lst_proxy_out */
+
+	/* Deadline (waiting pull or outstanding request) */
+	djbt_timer_t		timer;
+	uint32_t		state;		/* DJB_REQ_* (atomic) */
+	unsigned int		retries;	/* Times requeued after expiry */
+
+	/* Puller: its circuit; request: the circuit it waits for */
+	uint32_t		circuit;
+
+	djb_prio_t		prio;		/* Request: its class */
+
+	/* Fair queue (see fair.c) */
+	struct djb_req		*fq_next;	/* Next in its flow */
+	unsigned int		fq_cost;	/* Bytes charged */
+
+	/*
+	 * Puller: the WebSocket channel it stands for; request: the one
+	 * its body is read in for (see djb_match_pair()) (referenced)
+	 */
+	djbw_t			*ws;
+
+	/* Request: bytes charged to the memory budget */
+	unsigned int		mem;
+
+	/* Its body on the way (see djb_forward()) */
+	djb_relay_t		relay;
+} djb_req_t;
+
+/* djb_req_t state of a queued puller (WAIT/NONE also for requests
+ * waiting for their circuit) */
+#define DJB_REQ_NONE	0
+#define DJB_REQ_WAIT	1	/* Queued, deadline armed */
+#define DJB_REQ_TAKEN	2	/* Paired with a request */
+#define DJB_REQ_EXPIRED	3	/* Answered with a 408, still queued */
+#define DJB_REQ_STOLEN	4	/* Taken by its circuit, still queued */
+
 typedef enum
 {
 	DJB_ERR = 0,
@@ -38,12 +205,336 @@ typedef enum
 
 /* DJB provided functions */
 void djb_error(httpsrv_client_t *hcl, unsigned int errcode, const char *msg);
+void djb_hangup(httpsrv_client_t *hcl);
 void djb_presult(httpsrv_client_t *hcl, const char *msg);
 void djb_result(httpsrv_client_t *hcl, djb_status_t status, const char *msg);
 
-bool djb_proxy_add(httpsrv_client_t *hcl);
+bool djb_proxy_add(httpsrv_client_t *hcl, djb_prio_t prio);
+unsigned int djb_retry_after(void);
+bool djb_proxy_local(httpsrv_client_t *hcl, djb_headers_t *dh);
+bool djb_mem_reserve(unsigned int len);
+void djb_mem_release(unsigned int len);
+bool djb_serve_fd(httpsrv_t *hs, int fd, unsigned int threads); /* DJB_HTTPSRV_FD */
+void djb_header(httpsrv_client_t *hcl, void *user, char *line);
+void djb_flow_forget(uint64_t flow);
+char *djb_base64_encode(const char *src, size_t len);
+char *djb_base64_decode(const char *src, size_t *len);
+
+/* Getting a request body (djb_readbody()) */
+typedef enum {
+	DJB_BODY_NONE = 0,		/* There is no body */
+	DJB_BODY_ERROR,			/* Could not get it */
+	DJB_BODY_LATER,			/* httpsrv reads it, call again */
+	DJB_BODY_READY,			/* In hcl->readbody already */
+	DJB_BODY_DECODING		/* Being decoded, the handler runs again */
+} djb_body_t;
+
+bool djb_is_chunked(httpsrv_client_t *hcl);
+djb_body_t djb_readbody(httpsrv_client_t *hcl, unsigned int extra);
+bool djb_body_need(httpsrv_client_t *hcl, unsigned int extra,
+		   const char *what, bool *ret);
+void djb_posthandle(httpsrv_client_t *hcl, djb_post_f post);
 djb_headers_t *djb_create_userdata(httpsrv_client_t *hcl);
 
+/* Queue API (bounded lock-free MPMC, see queue.c) */
+
+/* Listing copies of the hostname and request line, truncated */
+#define DJBQ_HOST_LEN		64
+#define DJBQ_REQUEST_LEN	96
+
+typedef struct {
+	uint64_t		seq;		/* Slot sequence */
+	djb_req_t		*req;		/* The queued request */
+	uint64_t		id;		/* req->hcl->id (for listing) */
+	uint64_t		reqid;		/* req->hcl->reqid (for listing) */
+	uint64_t		host[DJBQ_HOST_LEN / 8];	/* (listing) */
+	uint64_t		request[DJBQ_REQUEST_LEN / 8];	/* (listing) */
+} djbq_slot_t;
+
+typedef struct {
+	djbq_slot_t		*slots;		/* The ring */
+	uint64_t		mask;		/* Number of slots - 1 */
+	char			pad0[64];
+	uint64_t		head;		/* Next position to pop */
+	char			pad1[64];
+	uint64_t		tail;		/* Next position to push */
+	char			pad2[64];
+	uint32_t		park_seq;	/* Futex word, bumped on wake */
+	uint32_t		parked;		/* Number of parked consumers */
+#ifndef _LINUX
+	mutex_t			park_mutex;
+	cond_t			park_cond;
+#endif
+} djbq_t;
+
+typedef void (*djbq_list_f)(void *cbdata, uint64_t id, uint64_t reqid,
+			    const char *host, const char *request);
+typedef bool (*djbq_pred_f)(djb_req_t *r);
+
+bool djbq_init(djbq_t *q, unsigned int size);
+void djbq_exit(djbq_t *q);
+bool djbq_push(djbq_t *q, djb_req_t *r);
+djb_req_t *djbq_trypop(djbq_t *q);
+djb_req_t *djbq_trypop_if(djbq_t *q, djbq_pred_f pred);
+djb_req_t *djbq_pop(djbq_t *q);
+void djbq_wakeall(djbq_t *q);
+unsigned int djbq_depth(djbq_t *q);
+unsigned int djbq_list(djbq_t *q, djbq_list_f cb, void *cbdata);
+
+/* Fair queue API (deficit round robin over flows, see fair.c) */
+typedef struct djbf_flow djbf_flow_t;
+
+typedef struct {
+	mutex_t			mutex;
+	djbf_flow_t		**flows;	/* Hash buckets, by key */
+	unsigned int		buckets;	/* Number of buckets (2^n) */
+	djbf_flow_t		*active;	/* Flows with requests, in turn */
+	djbf_flow_t		*active_tail;
+	unsigned int		quantum;	/* Bytes per flow per round */
+	unsigned int		max;		/* Most requests queued */
+	unsigned int		depth;		/* Requests queued (atomic) */
+	unsigned int		nflows;		/* Flows known */
+	uint64_t		rounds;		/* Quanta handed out */
+} djbf_t;
+
+typedef void (*djbf_list_f)(void *cbdata, uint64_t key, unsigned int depth,
+			    uint64_t deficit, uint64_t bytes, uint64_t served);
+
+bool djbf_init(djbf_t *f, unsigned int quantum, unsigned int max);
+void djbf_exit(djbf_t *f);
+bool djbf_push(djbf_t *f, djb_req_t *r, uint64_t key, unsigned int cost,
+	       bool front);
+djb_req_t *djbf_pop(djbf_t *f);
+unsigned int djbf_depth(djbf_t *f);
+void djbf_forget(djbf_t *f, uint64_t key);
+unsigned int djbf_list(djbf_t *f, djbf_list_f cb, void *cbdata);
+
+/* Slab API */
+typedef struct djbs_pool djbs_pool_t;
+
+djbs_pool_t *djbs_create(const char *desc, size_t size);
+void djbs_exit(void);
+void *djbs_alloc(djbs_pool_t *p);
+void djbs_free(djbs_pool_t *p, void *obj);
+void djbs_thread_exit(void);
+void djbs_stats(djbs_pool_t *p, unsigned int *inuse, unsigned int *total,
+		size_t *size);
+
+/* Splice API */
+uint64_t djb_splice(int in, int out, uint64_t len, uint64_t *spliced);
+bool djb_chunked_relay(conn_t *in, conn_t *out, uint64_t *bytes,
+		       uint64_t *spliced);
+char *djb_chunked_read(conn_t *in, size_t max, size_t *len);
+bool djb_read_full(conn_t *in, char *buf, size_t len);
+
+/* Body relays (splice.c) */
+bool djb_relay_init(unsigned int threads);
+void djb_relay_exit(void);
+void djb_relay_start(djb_relay_t *r);
+unsigned int djb_relay_depth(void);
+
+/* WebSocket channel API (ws.c) */
+typedef enum {
+	DJBW_REQUEST = 1,		/* djb -> plugin */
+	DJBW_RESPONSE			/* plugin -> djb */
+} djbw_type_t;
+
+/* Fields of a message, the DJB headers of a pull/push */
+typedef enum {
+	DJBW_SEQNO = 1,
+	DJBW_URI,
+	DJBW_METHOD,
+	DJBW_COOKIE,
+	DJBW_CTYPE,
+	DJBW_HTTPCODE,
+	DJBW_HTTPTEXT,
+	DJBW_SETCOOKIE,
+	DJBW_FIELDS
+} djbw_field_t;
+
+typedef struct {
+	djbw_type_t		type;
+	const char		*field[DJBW_FIELDS];	/* NULL when absent */
+	char			*body;
+	size_t			body_len;
+} djbw_msg_t;
+
+struct djbw {
+	httpsrv_client_t	*hcl;		/* Taken over from httpsrv */
+	uint64_t		hcl_id;
+	int			fd;
+	uint32_t		circuit;
+	unsigned int		window;		/* Requests in flight */
+	mutex_t			mutex;		/* Guards the outgoing queue */
+	struct djbw_out		*out;		/* Frames to write, oldest first */
+	struct djbw_out		**out_last;
+	uint64_t		out_progress;	/* Last write (atomic, djbx_now()) */
+	int			wake[2];	/* Pipe: frames queued */
+	unsigned int		refs;		/* Thread + pullers (atomic) */
+	bool			closed;		/* (atomic) */
+	bool			native;		/* Native messaging (nm.c) */
+	unsigned int		owed;		/* Pullers to park again (atomic) */
+};
+
+bool djbw_handle(httpsrv_client_t *hcl, djb_headers_t *dh);
+bool djbw_send(djbw_t *ws, djbw_msg_t *msg);
+bool djbw_closed(djbw_t *ws);
+void djbw_get(djbw_t *ws);
+void djbw_put(djbw_t *ws);
+unsigned int djbw_open(void);
+void djbw_stats(unsigned int *channels, uint64_t *opened, uint64_t *in,
+		uint64_t *out);
+
+/* Provided by djb.c for the channels */
+void djb_ws_open(djbw_t *ws);
+void djb_ws_retry(djbw_t *ws);
+void djb_ws_message(djbw_t *ws, djbw_msg_t *msg);
+void djb_ws_close(djbw_t *ws);
+
+/* Native messaging host API (nm.c) */
+bool djbn_setup(void);
+bool djbn_init(httpsrv_t *hs);
+void djbn_exit(void);
+bool djbn_send(djbw_t *ws, djbw_msg_t *msg);
+unsigned int djbn_open_count(void);
+
+/* Unix domain socket listener API (unix.c) */
+bool djbu_init(httpsrv_t *hs, unsigned int threads, bool stegotorus);
+void djbu_exit(void);
+const char *djbu_path(void);
+const char *djbu_stegotorus_path(void);
+bool djbu_stats(unsigned int *conns, uint64_t *accepted, uint64_t *requests);
+
+/* Static asset API (asset.c) */
+bool djba_add(const char *path, const char *ctype, const char *data,
+	      size_t len);
+bool djba_serve(httpsrv_client_t *hcl, djb_headers_t *dh);
+void djba_stats(unsigned int *assets, uint64_t *served, uint64_t *served_gz,
+		uint64_t *not_modified);
+void djba_exit(void);
+
+/* Metrics API (metrics.c) */
+typedef enum {
+	DJBM_ENQUEUED = 0,
+	DJBM_PAIRED,
+	DJBM_PUSHED,
+	DJBM_RESCHEDULED,
+	DJBM_BYTES_UP,			/* Request bodies, client -> plugin */
+	DJBM_BYTES_DOWN,		/* Answer bodies, plugin -> client */
+	DJBM_ACS_INITIAL,
+	DJBM_ACS_WAIT,
+	DJBM_ACS_REDIRECT,
+	DJBM_ACS_ERR,			/* Same order as djb_status_t */
+	DJBM_ACS_OK,
+	DJBM_ACS_DONE,
+	DJBM_RDV_RESET,
+	DJBM_RDV_GEN_REQUEST,
+	DJBM_RDV_IMAGE,
+	DJBM_RDV_PEEL,
+	DJBM_MAX
+} djbm_counter_t;
+
+void djbm_add(djbm_counter_t c, uint64_t n);
+void djbm_inc(djbm_counter_t c);
+uint64_t djbm_get(djbm_counter_t c);
+void djbm_begin(httpsrv_client_t *hcl);
+void djbm_family(httpsrv_client_t *hcl, const char *name, const char *type,
+		 const char *help);
+void djbm_sample(httpsrv_client_t *hcl, const char *name, const char *labels,
+		 uint64_t value);
+
+/* Lifecycle trace API (trace.c) */
+uint64_t djbx_now(void);
+void djbx_mark(djbx_rec_t *r, djbx_stage_t s);
+void djbx_commit(const djbx_rec_t *r);
+bool djbx_handle(httpsrv_client_t *hcl);
+
+/* Latency histogram API (hist.c) */
+typedef struct djbh djbh_t;
+
+typedef enum {
+	DJBH_NOW = 0,			/* The running interval */
+	DJBH_LAST,			/* The last complete interval */
+	DJBH_ALL,			/* Since the start */
+	DJBH_SETS
+} djbh_set_t;
+
+typedef struct {
+	uint64_t	count;
+	uint64_t	p50, p90, p99, p999;	/* us */
+	uint64_t	max;
+} djbh_summary_t;
+
+djbh_t *djbh_create(void);
+void djbh_free(djbh_t *h);
+void djbh_record(djbh_t *h, uint64_t us);
+void djbh_rotate(djbh_t *h);
+void djbh_summary(djbh_t *h, djbh_set_t set, djbh_summary_t *s);
+
+/* Router API (route.c) */
+typedef bool (*djbr_handler_f)(httpsrv_client_t *hcl, djb_headers_t *dh);
+
+typedef struct {
+	const char		*path;		/* "/pull/" */
+	unsigned int		len;
+	bool			exact;		/* Whole URI, not a prefix */
+	djbr_handler_f		handler;
+} djbr_route_t;
+
+#define DJBR_SLOTS	32
+
+typedef struct {
+	const djbr_route_t	*slot[DJBR_SLOTS];
+} djbr_table_t;
+
+bool djbr_init(djbr_table_t *t, const djbr_route_t *routes);
+const djbr_route_t *djbr_find(djbr_table_t *t, const char *uri);
+bool djbr_listen_parse(const char *addr, char *host, size_t size,
+		       unsigned int *port);
+bool djbr_self_init(const char *host, unsigned int port);
+bool djbr_is_loopback(const char *host);
+bool djbr_listen_addr(const char *host, unsigned int port, char *buf,
+		      size_t size);
+bool djbr_is_self(const char *hostname);
+unsigned int djbr_self_list(const char **names, unsigned int max);
+void djbr_exit(void);
+
+/* Adaptive worker pool API (pool.c) */
+typedef void (*djbp_work_f)(void);
+typedef void (*djbp_load_f)(unsigned int *depth, unsigned int *pullers);
+
+#define DJBP_EVENTS	16
+
+typedef struct {
+	time_t			when;
+	unsigned int		from, to;	/* Workers */
+	unsigned int		depth;		/* Requests waiting */
+	unsigned int		pullers;	/* Pullers waiting */
+	uint64_t		latency;	/* Round average, us */
+} djbp_event_t;
+
+typedef struct {
+	unsigned int		min, max;
+	unsigned int		size;		/* Running */
+	unsigned int		target;		/* Wanted */
+	uint64_t		latency;	/* Round average, us */
+	unsigned int		events;		/* Scaling events so far */
+} djbp_stats_t;
+
+bool djbp_init(unsigned int min, unsigned int max, unsigned int work_ms,
+	       djbp_work_f work, djbp_load_f load);
+void djbp_exit(void);
+void djbp_stats(djbp_stats_t *st);
+unsigned int djbp_events(djbp_event_t *events, unsigned int max);
+
+/* Timer API */
+bool djbt_init(void);
+void djbt_exit(void);
+void djbt_arm(djbt_timer_t *t, unsigned int ms, djbt_cb_f cb, void *data);
+bool djbt_cancel(djbt_timer_t *t);
+unsigned int djbt_armed(void);
+void *djbt_thread(void *arg);
+
 /* ACS API */
 void acs_init(httpsrv_t *hs);
 void acs_exit(void);
@@ -51,7 +542,7 @@ bool acs_handle(httpsrv_client_t *hcl);
 bool acs_set_net(json_t *net_);
 
 /* Rendezvous API */
-void rdv_handle(httpsrv_client_t *hcl);
+bool rdv_handle(httpsrv_client_t *hcl);
 
 /* Preferences API */
 enum prf_v {
@@ -64,15 +555,17 @@ enum prf_v {
 	PRF_PA,
 	PRF_JA,
 	PRF_SA,
+	PRF_PB,
 	PRF_MAX         /* Maximum argument */
 };
 
 void prf_init(void);
 void prf_exit(void);
-void prf_handle(httpsrv_client_t *hcl);
+bool prf_handle(httpsrv_client_t *hcl);
 bool prf_set_bridge_access_list(const char *br);
 int prf_get_argv(char **argv[]);
 void prf_free_argv(unsigned int argc, char *argv[]);
 const char *prf_get_value(enum prf_v i);
+void prf_set_default(enum prf_v i, const char *val);
 
 #endif /* SHARED_H */
@@ -0,0 +1,323 @@
+#include "djb.h"
+
+/*
+ * Fair queue: deficit round robin over flows
+ *
+ * Every flow (a client connection, identified by a key) has its own
+ * FIFO of requests. Flows with requests take turns; a flow may send
+ * requests as long as their cost (bytes) fits in its deficit, and
+ * when the next one does not fit the flow gets another quantum and
+ * goes to the back of the line. A client that queues a lot of (large)
+ * requests thus only gets its share instead of starving the others.
+ *
+ * A single lock protects it all; the work done under it is small.
+ * Flows stay known while they are empty, so that what they were
+ * served remains visible, until djbf_forget() (connection closed).
+ */
+
+#define DJBF_BUCKETS	256
+
+/* Flows reported by djbf_list() at most */
+#define DJBF_LIST_MAX	128
+
+struct djbf_flow {
+	djbf_flow_t		*hnext;		/* Hash chain */
+	djbf_flow_t		*anext;		/* Next active flow */
+	uint64_t		key;
+	djb_req_t		*head;		/* Queued requests */
+	djb_req_t		*tail;
+	unsigned int		depth;
+	bool			active;		/* In the round robin */
+	bool			gone;		/* Release once empty */
+	uint64_t		deficit;	/* Bytes it may still send */
+	uint64_t		bytes;		/* Bytes served */
+	uint64_t		served;		/* Requests served */
+};
+
+typedef struct {
+	uint64_t		key;
+	unsigned int		depth;
+	uint64_t		deficit;
+	uint64_t		bytes;
+	uint64_t		served;
+} djbf_snap_t;
+
+bool
+djbf_init(djbf_t *f, unsigned int quantum, unsigned int max) {
+	memzero(f, sizeof *f);
+
+	f->buckets = DJBF_BUCKETS;
+	f->flows = mcalloc(f->buckets * sizeof *f->flows, "djbf_flows");
+	if (f->flows == NULL) {
+		log_crt("No memory for fair queue");
+		return (false);
+	}
+
+	mutex_init(f->mutex);
+	f->quantum = quantum > 0 ? quantum : 1;
+	f->max = max;
+
+	return (true);
+}
+
+void
+djbf_exit(djbf_t *f) {
+	djbf_flow_t	*fl;
+	unsigned int	i;
+
+	if (f->flows == NULL) {
+		return;
+	}
+
+	for (i = 0; i < f->buckets; i++) {
+		while ((fl = f->flows[i]) != NULL) {
+			f->flows[i] = fl->hnext;
+			mfree(fl, sizeof *fl, "djbf_flow_t");
+		}
+	}
+
+	mfree(f->flows, f->buckets * sizeof *f->flows, "djbf_flows");
+	f->flows = NULL;
+
+	mutex_destroy(f->mutex);
+}
+
+static djbf_flow_t **
+djbf_bucket(djbf_t *f, uint64_t key);
+static djbf_flow_t **
+djbf_bucket(djbf_t *f, uint64_t key) {
+	/* Fibonacci hashing, connection ids are sequential */
+	key *= 0x9e3779b97f4a7c15ULL;
+
+	return (&f->flows[(key >> 32) & (f->buckets - 1)]);
+}
+
+/* Lock held */
+static djbf_flow_t *
+djbf_find(djbf_t *f, uint64_t key);
+static djbf_flow_t *
+djbf_find(djbf_t *f, uint64_t key) {
+	djbf_flow_t *fl;
+
+	for (fl = *djbf_bucket(f, key); fl != NULL; fl = fl->hnext) {
+		if (fl->key == key) {
+			break;
+		}
+	}
+
+	return (fl);
+}
+
+/* Lock held; the flow must be empty and not active */
+static void
+djbf_release(djbf_t *f, djbf_flow_t *fl);
+static void
+djbf_release(djbf_t *f, djbf_flow_t *fl) {
+	djbf_flow_t **p;
+
+	for (p = djbf_bucket(f, fl->key); *p != fl; p = &(*p)->hnext) {
+		/* Nothing */
+	}
+
+	*p = fl->hnext;
+	f->nflows--;
+
+	mfree(fl, sizeof *fl, "djbf_flow_t");
+}
+
+bool
+djbf_push(djbf_t *f, djb_req_t *r, uint64_t key, unsigned int cost,
+	  bool front) {
+	djbf_flow_t *fl;
+
+	mutex_lock(f->mutex);
+
+	/* Requests put back do not count against the limit */
+	if (!front && f->max > 0 && f->depth >= f->max) {
+		mutex_unlock(f->mutex);
+		return (false);
+	}
+
+	fl = djbf_find(f, key);
+	if (fl == NULL) {
+		fl = mcalloc(sizeof *fl, "djbf_flow_t");
+		if (fl == NULL) {
+			mutex_unlock(f->mutex);
+			log_crt("No memory for a flow");
+			return (false);
+		}
+
+		fl->key = key;
+		fl->hnext = *djbf_bucket(f, key);
+		*djbf_bucket(f, key) = fl;
+		f->nflows++;
+	}
+
+	r->fq_cost = cost;
+
+	if (front) {
+		r->fq_next = fl->head;
+		fl->head = r;
+		if (fl->tail == NULL) {
+			fl->tail = r;
+		}
+	} else {
+		r->fq_next = NULL;
+		if (fl->tail != NULL) {
+			fl->tail->fq_next = r;
+		} else {
+			fl->head = r;
+		}
+		fl->tail = r;
+	}
+
+	fl->depth++;
+	__atomic_add_fetch(&f->depth, 1, __ATOMIC_RELAXED);
+
+	/* Joins the round with a fresh quantum */
+	if (!fl->active) {
+		fl->active = true;
+		fl->deficit = f->quantum;
+		fl->anext = NULL;
+
+		if (f->active_tail != NULL) {
+			f->active_tail->anext = fl;
+		} else {
+			f->active = fl;
+		}
+		f->active_tail = fl;
+	}
+
+	/* Put back: it was charged already */
+	if (front) {
+		fl->deficit += cost;
+		fl->bytes -= fl->bytes >= cost ? cost : fl->bytes;
+		fl->served -= fl->served > 0 ? 1 : 0;
+	}
+
+	mutex_unlock(f->mutex);
+
+	return (true);
+}
+
+djb_req_t *
+djbf_pop(djbf_t *f) {
+	djbf_flow_t	*fl;
+	djb_req_t	*r = NULL;
+
+	/* Cheap check first, nothing to do most of the time */
+	if (__atomic_load_n(&f->depth, __ATOMIC_RELAXED) == 0) {
+		return (NULL);
+	}
+
+	mutex_lock(f->mutex);
+
+	while ((fl = f->active) != NULL) {
+		r = fl->head;
+
+		/* Does not fit: another quantum, back of the line */
+		if (fl->deficit < r->fq_cost) {
+			fl->deficit += f->quantum;
+			f->rounds++;
+
+			if (fl->anext != NULL) {
+				f->active = fl->anext;
+				fl->anext = NULL;
+				f->active_tail->anext = fl;
+				f->active_tail = fl;
+			}
+
+			continue;
+		}
+
+		fl->head = r->fq_next;
+		if (fl->head == NULL) {
+			fl->tail = NULL;
+		}
+		r->fq_next = NULL;
+
+		fl->depth--;
+		__atomic_sub_fetch(&f->depth, 1, __ATOMIC_RELAXED);
+
+		fl->deficit -= r->fq_cost;
+		fl->bytes += r->fq_cost;
+		fl->served++;
+
+		/* Empty: out of the round, no credit is kept */
+		if (fl->head == NULL) {
+			f->active = fl->anext;
+			if (f->active == NULL) {
+				f->active_tail = NULL;
+			}
+
+			fl->anext = NULL;
+			fl->active = false;
+			fl->deficit = 0;
+
+			if (fl->gone) {
+				djbf_release(f, fl);
+			}
+		}
+
+		break;
+	}
+
+	mutex_unlock(f->mutex);
+
+	return (r);
+}
+
+unsigned int
+djbf_depth(djbf_t *f) {
+	/* Ordered after the caller's own push, as djbq_depth() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return (__atomic_load_n(&f->depth, __ATOMIC_SEQ_CST));
+}
+
+void
+djbf_forget(djbf_t *f, uint64_t key) {
+	djbf_flow_t *fl;
+
+	mutex_lock(f->mutex);
+
+	fl = djbf_find(f, key);
+	if (fl != NULL) {
+		if (fl->depth == 0) {
+			djbf_release(f, fl);
+		} else {
+			/* Still has requests queued, djbf_pop() releases it */
+			fl->gone = true;
+		}
+	}
+
+	mutex_unlock(f->mutex);
+}
+
+unsigned int
+djbf_list(djbf_t *f, djbf_list_f cb, void *cbdata) {
+	djbf_snap_t	snap[DJBF_LIST_MAX];
+	djbf_flow_t	*fl;
+	unsigned int	i, n = 0;
+
+	/* Copy it out, the callback does not run under our lock */
+	mutex_lock(f->mutex);
+	for (i = 0; i < f->buckets && n < lengthof(snap); i++) {
+		for (fl = f->flows[i]; fl != NULL && n < lengthof(snap);
+		     fl = fl->hnext) {
+			snap[n].key = fl->key;
+			snap[n].depth = fl->depth;
+			snap[n].deficit = fl->deficit;
+			snap[n].bytes = fl->bytes;
+			snap[n].served = fl->served;
+			n++;
+		}
+	}
+	mutex_unlock(f->mutex);
+
+	for (i = 0; i < n; i++) {
+		cb(cbdata, snap[i].key, snap[i].depth, snap[i].deficit,
+		   snap[i].bytes, snap[i].served);
+	}
+
+	return (n);
+}
@@ -0,0 +1,127 @@
+#include "djb.h"
+
+/*
+ * Latency histograms (HDR style)
+ *
+ * Values (microseconds) go into log-linear buckets: exact below
+ * 2 * DJBH_SUB, above that DJBH_SUB buckets per power of two, thus every
+ * value is known within 1/DJBH_SUB (about 6%) of itself however large
+ * it is. Recording is a bucket index and two relaxed atomic adds.
+ *
+ * Each histogram keeps three sets: the running interval, the last
+ * complete interval and everything since the start. djbh_rotate()
+ * closes the running interval; bucket by bucket it is moved over with
+ * an atomic exchange, thus nothing recorded meanwhile gets lost.
+ */
+
+#define DJBH_SUB_BITS	4
+#define DJBH_SUB	(1 << DJBH_SUB_BITS)
+#define DJBH_MAX_BITS	36		/* Values clamp at ~19 hours */
+#define DJBH_BUCKETS	((DJBH_MAX_BITS - DJBH_SUB_BITS + 2) * DJBH_SUB)
+
+struct djbh {
+	uint64_t	counts[DJBH_SETS][DJBH_BUCKETS];
+};
+
+djbh_t *
+djbh_create(void) {
+	return (calloc(1, sizeof (djbh_t)));
+}
+
+void
+djbh_free(djbh_t *h) {
+	free(h);
+}
+
+static unsigned int
+djbh_index(uint64_t v);
+static unsigned int
+djbh_index(uint64_t v) {
+	unsigned int msb;
+
+	if (v >= ((uint64_t)1 << DJBH_MAX_BITS)) {
+		v = ((uint64_t)1 << DJBH_MAX_BITS) - 1;
+	}
+
+	if (v < 2 * DJBH_SUB) {
+		return ((unsigned int)v);
+	}
+
+	msb = 63 - (unsigned int)__builtin_clzll(v);
+
+	/* The top DJBH_SUB_BITS + 1 bits pick the bucket */
+	return (((msb - DJBH_SUB_BITS + 1) * DJBH_SUB) +
+		(unsigned int)((v >> (msb - DJBH_SUB_BITS)) - DJBH_SUB));
+}
+
+/* Highest value that lands in bucket idx */
+static uint64_t
+djbh_value(unsigned int idx);
+static uint64_t
+djbh_value(unsigned int idx) {
+	unsigned int shift;
+
+	if (idx < 2 * DJBH_SUB) {
+		return (idx);
+	}
+
+	shift = (idx / DJBH_SUB) - 1;
+
+	return ((((uint64_t)DJBH_SUB + (idx % DJBH_SUB) + 1) << shift) - 1);
+}
+
+void
+djbh_record(djbh_t *h, uint64_t us) {
+	unsigned int idx = djbh_index(us);
+
+	__atomic_add_fetch(&h->counts[DJBH_NOW][idx], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->counts[DJBH_ALL][idx], 1, __ATOMIC_RELAXED);
+}
+
+void
+djbh_rotate(djbh_t *h) {
+	unsigned int i;
+
+	for (i = 0; i < DJBH_BUCKETS; i++) {
+		h->counts[DJBH_LAST][i] = __atomic_exchange_n(
+						&h->counts[DJBH_NOW][i], 0,
+						__ATOMIC_RELAXED);
+	}
+}
+
+void
+djbh_summary(djbh_t *h, djbh_set_t set, djbh_summary_t *s) {
+	static const unsigned int	pm[] = { 500, 900, 990, 999 };
+	uint64_t			*pv[] = { &s->p50, &s->p90,
+						  &s->p99, &s->p999 };
+	uint64_t			counts[DJBH_BUCKETS], seen = 0;
+	unsigned int			i, p = 0;
+
+	memzero(s, sizeof *s);
+
+	/* A copy, so that all figures agree with each other */
+	for (i = 0; i < DJBH_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&h->counts[set][i],
+					    __ATOMIC_RELAXED);
+		s->count += counts[i];
+	}
+
+	if (s->count == 0) {
+		return;
+	}
+
+	for (i = 0; i < DJBH_BUCKETS; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+
+		seen += counts[i];
+		s->max = djbh_value(i);
+
+		/* Per mille, rounded up: p99 of 10 is the highest */
+		while (p < lengthof(pm) &&
+		       seen * 1000 >= s->count * pm[p]) {
+			*pv[p++] = s->max;
+		}
+	}
+}
@@ -0,0 +1,1446 @@
+/*
+ * djb-loadgen - synthetic StegoTorus clients and headless pullers
+ *
+ * Benchmarks djb on a plain box, without Chrome, StegoTorus or a remote
+ * server. K client threads each keep a connection to djb and send it
+ * proxy requests back to back, like StegoTorus does. M puller threads
+ * do what circuit.js does: take a request with /pull/ (or /next/ with
+ * -n), send it to the exit server and /push/ the answer back.
+ *
+ * The exit server runs in this process: GET /lg/<size>/... returns
+ * <size> bytes, a POST gets its own body back. The clients check the
+ * answers they get, time every request from sending it until the last
+ * byte of its answer and report throughput and latency percentiles.
+ *
+ * Only libc and pthreads are needed, thus no libfutil: this is meant to
+ * compare djb builds, not to be one. Batched pulls are not spoken, set
+ * 'plugin_pull_batch' to 0 for the djb under test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DJBL_DJB		"localhost:6543"
+#define DJBL_EXIT_HOST		"exit.loadgen"	/* Not djb, thus proxied */
+#define DJBL_BUF		(64 * 1024)
+#define DJBL_LINE		1024
+#define DJBL_TIMEOUT		30		/* Seconds a read may block */
+#define DJBL_BACKOFF_US		10000		/* After a 503 or a failure */
+
+/* Body and answer sizes */
+typedef enum {
+	DJBL_FIXED = 0,
+	DJBL_UNIFORM,
+	DJBL_EXP
+} djbl_kind_t;
+
+typedef struct {
+	djbl_kind_t	kind;
+	size_t		a, b;		/* size; min, max; mean, max */
+} djbl_dist_t;
+
+/* Buffered reading from a socket */
+typedef struct {
+	int		fd;
+	size_t		off, len;
+	char		buf[DJBL_BUF];
+} djbl_rd_t;
+
+/* What we care about of a request or answer head */
+typedef struct {
+	unsigned int	code;		/* Answer status, 0 for a request */
+	char		method[8];
+	char		path[256];
+	char		uri[512];	/* DJB-URI */
+	char		djbmethod[8];	/* DJB-Method */
+	char		seqno[32];	/* DJB-SeqNo */
+	bool		batch;		/* DJB-Batch */
+	bool		chunked;
+	bool		close;
+	size_t		length;
+} djbl_head_t;
+
+/* A body, growing as needed */
+typedef struct {
+	char		*data;
+	size_t		len, size;
+} djbl_body_t;
+
+/* Latencies in microseconds */
+typedef struct {
+	uint32_t	*us;
+	size_t		n, size;
+} djbl_lat_t;
+
+typedef enum {
+	DJBL_GET = 0,
+	DJBL_POST,
+	DJBL_METHODS
+} djbl_method_t;
+
+static const char l_methodnames[DJBL_METHODS][8] = {
+	"GET",
+	"POST"
+};
+
+typedef struct {
+	pthread_t	thread;
+	unsigned int	id;
+	uint64_t	rnd;
+	djbl_rd_t	rd;
+	uint64_t	ok, errors, shed, timeouts;
+	uint64_t	up, down;	/* Body bytes */
+	djbl_lat_t	lat[DJBL_METHODS];
+} djbl_client_t;
+
+typedef struct {
+	pthread_t	thread;
+	unsigned int	id;
+	unsigned int	circuit;	/* 0 = none */
+	djbl_rd_t	djb, exit;
+	uint64_t	pulls, empty, pushes, errors;
+} djbl_puller_t;
+
+/* Settings */
+static const char *l_djb = DJBL_DJB;
+static char l_djb_host[256];
+static char l_djb_port[16];
+static unsigned int l_nclients = 8;
+static unsigned int l_npullers = 4;
+static unsigned int l_duration = 10;
+static unsigned int l_warmup = 1;
+static unsigned int l_get_pct = 50;
+static unsigned int l_circuits = 0;
+static bool l_next = false;
+static djbl_dist_t l_body = { DJBL_UNIFORM, 64, 16 * 1024 };
+static djbl_dist_t l_answer = { DJBL_UNIFORM, 64, 16 * 1024 };
+
+/* The in-process exit server */
+static char l_exit_port[16];
+
+/* Filler for bodies and answers */
+static char *l_blob = NULL;
+static size_t l_blob_len = 0;
+
+/* Measuring from l_start (us), clients and pullers stop on their flag */
+static uint64_t l_start = 0;
+static int l_stop = 0;
+static int l_pull_stop = 0;
+static int l_batch_warned = 0;
+
+static uint64_t
+djbl_now(void);
+static uint64_t
+djbl_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000000) + (uint64_t)(ts.tv_nsec / 1000));
+}
+
+/* xorshift64*, per thread */
+static uint64_t
+djbl_rand(uint64_t *s);
+static uint64_t
+djbl_rand(uint64_t *s) {
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return (*s * 2685821657736338717ULL);
+}
+
+static size_t
+djbl_dist_pick(const djbl_dist_t *d, uint64_t *rnd);
+static size_t
+djbl_dist_pick(const djbl_dist_t *d, uint64_t *rnd) {
+	double	u;
+	size_t	v;
+
+	switch (d->kind) {
+	case DJBL_UNIFORM:
+		return (d->a + (size_t)(djbl_rand(rnd) % (d->b - d->a + 1)));
+
+	case DJBL_EXP:
+		u = (double)(djbl_rand(rnd) >> 11) / (double)(1ULL << 53);
+		v = (size_t)(-(double)d->a * log(1.0 - u));
+		return (v < d->b ? v : d->b);
+
+	case DJBL_FIXED:
+	default:
+		return (d->a);
+	}
+}
+
+/* Biggest size a distribution yields */
+static size_t
+djbl_dist_max(const djbl_dist_t *d);
+static size_t
+djbl_dist_max(const djbl_dist_t *d) {
+	return (d->kind == DJBL_FIXED ? d->a : d->b);
+}
+
+/* N, fixed:N, uniform:MIN:MAX or exp:MEAN[:MAX] */
+static bool
+djbl_dist_parse(const char *s, djbl_dist_t *d);
+static bool
+djbl_dist_parse(const char *s, djbl_dist_t *d) {
+	size_t a, b;
+
+	if (sscanf(s, "uniform:%zu:%zu", &a, &b) == 2 && a <= b) {
+		d->kind = DJBL_UNIFORM;
+	} else if (sscanf(s, "exp:%zu:%zu", &a, &b) == 2 && a > 0) {
+		d->kind = DJBL_EXP;
+	} else if (sscanf(s, "exp:%zu", &a) == 1 && a > 0) {
+		d->kind = DJBL_EXP;
+		b = 16 * a;
+	} else if (sscanf(s, "fixed:%zu", &a) == 1 ||
+		   sscanf(s, "%zu", &a) == 1) {
+		d->kind = DJBL_FIXED;
+		b = a;
+	} else {
+		return (false);
+	}
+
+	d->a = a;
+	d->b = b;
+
+	return (true);
+}
+
+/* "host:port" into its parts */
+static bool
+djbl_split(const char *hp, char *host, size_t hlen, char *port, size_t plen);
+static bool
+djbl_split(const char *hp, char *host, size_t hlen, char *port, size_t plen) {
+	const char *c = strrchr(hp, ':');
+
+	if (c == NULL || c == hp || (size_t)(c - hp) >= hlen ||
+	    strlen(c + 1) == 0 || strlen(c + 1) >= plen) {
+		return (false);
+	}
+
+	memcpy(host, hp, (size_t)(c - hp));
+	host[c - hp] = '\0';
+	snprintf(port, plen, "%s", c + 1);
+
+	return (true);
+}
+
+static int
+djbl_connect(const char *host, const char *port);
+static int
+djbl_connect(const char *host, const char *port) {
+	struct addrinfo	hints, *res, *ai;
+	struct timeval	tv;
+	int		fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		return (-1);
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		return (-1);
+	}
+
+	/* Small requests go out at once; reads do not hang forever */
+	tv.tv_sec = DJBL_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	return (fd);
+}
+
+static void
+djbl_rd_open(djbl_rd_t *rd, int fd);
+static void
+djbl_rd_open(djbl_rd_t *rd, int fd) {
+	rd->fd = fd;
+	rd->off = 0;
+	rd->len = 0;
+}
+
+static void
+djbl_rd_close(djbl_rd_t *rd);
+static void
+djbl_rd_close(djbl_rd_t *rd) {
+	if (rd->fd != -1) {
+		close(rd->fd);
+	}
+
+	djbl_rd_open(rd, -1);
+}
+
+/* Head and body in one go */
+static bool
+djbl_send(int fd, const char *head, size_t hlen, const char *body, size_t blen);
+static bool
+djbl_send(int fd, const char *head, size_t hlen, const char *body, size_t blen) {
+	struct iovec	iov[2];
+	struct msghdr	msg;
+	ssize_t		n;
+	size_t		done;
+
+	iov[0].iov_base = (void *)(uintptr_t)head;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = (void *)(uintptr_t)body;
+	iov[1].iov_len = blen;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = blen > 0 ? 2 : 1;
+
+	while (msg.msg_iovlen > 0) {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return (false);
+		}
+
+		/* Skip what went out */
+		done = (size_t)n;
+		while (msg.msg_iovlen > 0 && done >= msg.msg_iov[0].iov_len) {
+			done -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov[0].iov_base =
+				(char *)msg.msg_iov[0].iov_base + done;
+			msg.msg_iov[0].iov_len -= done;
+		}
+	}
+
+	return (true);
+}
+
+/* More bytes into the buffer: > 0 read, 0 closed, -1 error (errno) */
+static ssize_t
+djbl_fill(djbl_rd_t *rd);
+static ssize_t
+djbl_fill(djbl_rd_t *rd) {
+	ssize_t n;
+
+	if (rd->off > 0) {
+		memmove(rd->buf, &rd->buf[rd->off], rd->len - rd->off);
+		rd->len -= rd->off;
+		rd->off = 0;
+	}
+
+	do {
+		n = recv(rd->fd, &rd->buf[rd->len], sizeof rd->buf - rd->len,
+			 0);
+	} while (n == -1 && errno == EINTR);
+
+	if (n > 0) {
+		rd->len += (size_t)n;
+	}
+
+	return (n);
+}
+
+/* One line, without its CRLF; longer ones are cut */
+static bool
+djbl_line(djbl_rd_t *rd, char *line, size_t size);
+static bool
+djbl_line(djbl_rd_t *rd, char *line, size_t size) {
+	char	*nl;
+	size_t	len;
+
+	for (;;) {
+		nl = memchr(&rd->buf[rd->off], '\n', rd->len - rd->off);
+		if (nl != NULL) {
+			break;
+		}
+
+		if (rd->len - rd->off == sizeof rd->buf) {
+			return (false);
+		}
+
+		if (djbl_fill(rd) <= 0) {
+			return (false);
+		}
+	}
+
+	len = (size_t)(nl - &rd->buf[rd->off]);
+	if (len > 0 && nl[-1] == '\r') {
+		len--;
+	}
+
+	if (len >= size) {
+		len = size - 1;
+	}
+
+	memcpy(line, &rd->buf[rd->off], len);
+	line[len] = '\0';
+	rd->off = (size_t)(nl - rd->buf) + 1;
+
+	return (true);
+}
+
+/* Exactly len bytes, into dst unless that is NULL */
+static bool
+djbl_read(djbl_rd_t *rd, char *dst, size_t len);
+static bool
+djbl_read(djbl_rd_t *rd, char *dst, size_t len) {
+	size_t n;
+
+	while (len > 0) {
+		if (rd->off == rd->len && djbl_fill(rd) <= 0) {
+			return (false);
+		}
+
+		n = rd->len - rd->off;
+		if (n > len) {
+			n = len;
+		}
+
+		if (dst != NULL) {
+			memcpy(dst, &rd->buf[rd->off], n);
+			dst += n;
+		}
+
+		rd->off += n;
+		len -= n;
+	}
+
+	return (true);
+}
+
+static void
+djbl_copy(char *dst, size_t size, const char *src);
+static void
+djbl_copy(char *dst, size_t size, const char *src) {
+	snprintf(dst, size, "%s", src);
+}
+
+/* Request line or status line plus the headers we know */
+static bool
+djbl_head(djbl_rd_t *rd, djbl_head_t *h);
+static bool
+djbl_head(djbl_rd_t *rd, djbl_head_t *h) {
+	char line[DJBL_LINE], *v;
+
+	memset(h, 0, sizeof *h);
+
+	if (!djbl_line(rd, line, sizeof line)) {
+		return (false);
+	}
+
+	if (strncmp(line, "HTTP/", 5) == 0) {
+		v = strchr(line, ' ');
+		h->code = v != NULL ? (unsigned int)strtoul(v, NULL, 10) : 0;
+		if (h->code == 0) {
+			return (false);
+		}
+	} else if (sscanf(line, "%7s %255s", h->method, h->path) != 2) {
+		return (false);
+	}
+
+	for (;;) {
+		if (!djbl_line(rd, line, sizeof line)) {
+			return (false);
+		}
+
+		if (line[0] == '\0') {
+			return (true);
+		}
+
+		v = strchr(line, ':');
+		if (v == NULL) {
+			continue;
+		}
+
+		*v++ = '\0';
+		while (*v == ' ' || *v == '\t') {
+			v++;
+		}
+
+		/* The first Content-Length counts */
+		if (strcasecmp(line, "Content-Length") == 0) {
+			if (h->length == 0) {
+				h->length = (size_t)strtoull(v, NULL, 10);
+			}
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			h->chunked = strcasecmp(v, "chunked") == 0;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			h->close = strcasecmp(v, "close") == 0;
+		} else if (strcasecmp(line, "DJB-URI") == 0) {
+			djbl_copy(h->uri, sizeof h->uri, v);
+		} else if (strcasecmp(line, "DJB-Method") == 0) {
+			djbl_copy(h->djbmethod, sizeof h->djbmethod, v);
+		} else if (strcasecmp(line, "DJB-SeqNo") == 0) {
+			djbl_copy(h->seqno, sizeof h->seqno, v);
+		} else if (strcasecmp(line, "DJB-Batch") == 0) {
+			h->batch = true;
+		}
+	}
+}
+
+static bool
+djbl_body_grow(djbl_body_t *b, size_t len);
+static bool
+djbl_body_grow(djbl_body_t *b, size_t len) {
+	char	*d;
+	size_t	size;
+
+	if (b->len + len <= b->size) {
+		return (true);
+	}
+
+	for (size = b->size > 0 ? b->size : 4096; size < b->len + len;) {
+		size *= 2;
+	}
+
+	d = realloc(b->data, size);
+	if (d == NULL) {
+		return (false);
+	}
+
+	b->data = d;
+	b->size = size;
+
+	return (true);
+}
+
+/* The body that goes with h, plain or chunked */
+static bool
+djbl_body(djbl_rd_t *rd, const djbl_head_t *h, djbl_body_t *b);
+static bool
+djbl_body(djbl_rd_t *rd, const djbl_head_t *h, djbl_body_t *b) {
+	char	line[DJBL_LINE];
+	size_t	len;
+
+	b->len = 0;
+
+	if (!h->chunked) {
+		if (!djbl_body_grow(b, h->length) ||
+		    !djbl_read(rd, b->data, h->length)) {
+			return (false);
+		}
+
+		b->len = h->length;
+		return (true);
+	}
+
+	for (;;) {
+		if (!djbl_line(rd, line, sizeof line)) {
+			return (false);
+		}
+
+		len = (size_t)strtoull(line, NULL, 16);
+		if (len == 0) {
+			break;
+		}
+
+		if (!djbl_body_grow(b, len) ||
+		    !djbl_read(rd, &b->data[b->len], len) ||
+		    !djbl_line(rd, line, sizeof line)) {
+			return (false);
+		}
+
+		b->len += len;
+	}
+
+	/* Trailers, up to the empty line */
+	do {
+		if (!djbl_line(rd, line, sizeof line)) {
+			return (false);
+		}
+	} while (line[0] != '\0');
+
+	return (true);
+}
+
+static void
+djbl_lat_add(djbl_lat_t *l, uint64_t us);
+static void
+djbl_lat_add(djbl_lat_t *l, uint64_t us) {
+	uint32_t	*n;
+	size_t		size;
+
+	if (l->n == l->size) {
+		size = l->size > 0 ? l->size * 2 : 4096;
+		n = realloc(l->us, size * sizeof *n);
+		if (n == NULL) {
+			return;
+		}
+
+		l->us = n;
+		l->size = size;
+	}
+
+	l->us[l->n++] = us < UINT32_MAX ? (uint32_t)us : UINT32_MAX;
+}
+
+/*
+ * Exit server
+ *
+ * A thread per connection, as only the pullers connect to it.
+ */
+static void *
+djbl_exit_conn(void *arg);
+static void *
+djbl_exit_conn(void *arg) {
+	djbl_rd_t	*rd = (djbl_rd_t *)arg;
+	djbl_head_t	h;
+	djbl_body_t	b;
+	const char	*out;
+	char		head[256];
+	size_t		len;
+	int		hlen;
+
+	memset(&b, 0, sizeof b);
+
+	while (djbl_head(rd, &h) && djbl_body(rd, &h, &b)) {
+		if (strcmp(h.method, "POST") == 0) {
+			/* Echo */
+			out = b.data;
+			len = b.len;
+		} else {
+			/* GET /lg/<size>/... */
+			len = strncmp(h.path, "/lg/", 4) == 0 ?
+				(size_t)strtoull(&h.path[4], NULL, 10) : 0;
+			if (len > l_blob_len) {
+				len = l_blob_len;
+			}
+			out = l_blob;
+		}
+
+		hlen = snprintf(head, sizeof head,
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %zu\r\n"
+				"\r\n",
+				len);
+
+		if (!djbl_send(rd->fd, head, (size_t)hlen, out, len)) {
+			break;
+		}
+	}
+
+	djbl_rd_close(rd);
+	free(rd);
+	free(b.data);
+
+	return (NULL);
+}
+
+static void *
+djbl_exit_accept(void *arg);
+static void *
+djbl_exit_accept(void *arg) {
+	int		lfd = *(int *)arg, fd;
+	djbl_rd_t	*rd;
+	pthread_t	t;
+	pthread_attr_t	attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		rd = malloc(sizeof *rd);
+		if (rd == NULL) {
+			close(fd);
+			continue;
+		}
+
+		djbl_rd_open(rd, fd);
+		if (pthread_create(&t, &attr, djbl_exit_conn, rd) != 0) {
+			djbl_rd_close(rd);
+			free(rd);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return (NULL);
+}
+
+/* Listen on an ephemeral loopback port */
+static bool
+djbl_exit_init(void);
+static bool
+djbl_exit_init(void) {
+	static int		lfd;
+	struct sockaddr_in	sin;
+	socklen_t		slen = sizeof sin;
+	pthread_t		t;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd == -1) {
+		return (false);
+	}
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof sin) != 0 ||
+	    listen(lfd, 128) != 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &slen) != 0 ||
+	    pthread_create(&t, NULL, djbl_exit_accept, &lfd) != 0) {
+		close(lfd);
+		return (false);
+	}
+
+	pthread_detach(t);
+	snprintf(l_exit_port, sizeof l_exit_port, "%u", ntohs(sin.sin_port));
+
+	return (true);
+}
+
+/*
+ * Clients
+ *
+ * Closed loop: the next request goes out when the answer to the last
+ * one is in. Requests that finish after the stop are not counted.
+ */
+static void *
+djbl_client(void *arg);
+static void *
+djbl_client(void *arg) {
+	djbl_client_t	*c = (djbl_client_t *)arg;
+	djbl_method_t	m;
+	djbl_head_t	h;
+	djbl_body_t	ans;
+	char		head[512];
+	uint64_t	seq = 0, t0, t1;
+	size_t		blen, expect;
+	int		fd, hlen;
+
+	memset(&ans, 0, sizeof ans);
+	djbl_rd_open(&c->rd, -1);
+
+	while (!__atomic_load_n(&l_stop, __ATOMIC_RELAXED)) {
+		if (c->rd.fd == -1) {
+			fd = djbl_connect(l_djb_host, l_djb_port);
+			if (fd == -1) {
+				c->errors++;
+				usleep(DJBL_BACKOFF_US);
+				continue;
+			}
+			djbl_rd_open(&c->rd, fd);
+		}
+
+		seq++;
+		m = (djbl_rand(&c->rnd) % 100) < l_get_pct ?
+			DJBL_GET : DJBL_POST;
+
+		if (m == DJBL_POST) {
+			blen = djbl_dist_pick(&l_body, &c->rnd);
+			expect = blen;
+			hlen = snprintf(head, sizeof head,
+				"POST /lg/post/%u-%" PRIu64 " HTTP/1.1\r\n"
+				"Host: " DJBL_EXIT_HOST "\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %zu\r\n"
+				"\r\n",
+				c->id, seq, blen);
+		} else {
+			blen = 0;
+			expect = djbl_dist_pick(&l_answer, &c->rnd);
+			hlen = snprintf(head, sizeof head,
+				"GET /lg/%zu/%u-%" PRIu64 " HTTP/1.1\r\n"
+				"Host: " DJBL_EXIT_HOST "\r\n"
+				"\r\n",
+				expect, c->id, seq);
+		}
+
+		t0 = djbl_now();
+		errno = 0;
+
+		if (!djbl_send(c->rd.fd, head, (size_t)hlen, l_blob, blen) ||
+		    !djbl_head(&c->rd, &h) ||
+		    !djbl_body(&c->rd, &h, &ans)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				c->timeouts++;
+			} else {
+				c->errors++;
+			}
+			djbl_rd_close(&c->rd);
+			continue;
+		}
+
+		t1 = djbl_now();
+
+		if (h.close) {
+			djbl_rd_close(&c->rd);
+		}
+
+		if (__atomic_load_n(&l_stop, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+		if (h.code == 503) {
+			c->shed++;
+			usleep(DJBL_BACKOFF_US);
+			continue;
+		}
+
+		if (h.code != 200 || ans.len != expect) {
+			c->errors++;
+			continue;
+		}
+
+		/* Warming up */
+		if (t0 < l_start) {
+			continue;
+		}
+
+		c->ok++;
+		c->up += blen;
+		c->down += ans.len;
+		djbl_lat_add(&c->lat[m], t1 - t0);
+	}
+
+	djbl_rd_close(&c->rd);
+	free(ans.data);
+
+	return (NULL);
+}
+
+/*
+ * Pullers
+ *
+ * Like circuit.js: the request djb hands out goes to the exit server,
+ * the answer goes back with the DJB-SeqNo of the request. With /next/
+ * that answer rides along with the next pull.
+ */
+static bool
+djbl_puller_connect(djbl_rd_t *rd, const char *host, const char *port);
+static bool
+djbl_puller_connect(djbl_rd_t *rd, const char *host, const char *port) {
+	int fd;
+
+	if (rd->fd != -1) {
+		return (true);
+	}
+
+	fd = djbl_connect(host, port);
+	if (fd == -1) {
+		return (false);
+	}
+
+	djbl_rd_open(rd, fd);
+
+	return (true);
+}
+
+/* The request djb handed out, through the exit server */
+static bool
+djbl_puller_exit(djbl_puller_t *p, const djbl_head_t *req,
+		 const djbl_body_t *body, djbl_head_t *h, djbl_body_t *ans);
+static bool
+djbl_puller_exit(djbl_puller_t *p, const djbl_head_t *req,
+		 const djbl_body_t *body, djbl_head_t *h, djbl_body_t *ans) {
+	const char	*path;
+	char		head[768];
+	bool		post = strcmp(req->djbmethod, "POST") == 0;
+	int		hlen;
+
+	/* http://<host>/<path> */
+	path = strncmp(req->uri, "http://", 7) == 0 ?
+		strchr(&req->uri[7], '/') : NULL;
+	if (path == NULL) {
+		path = "/";
+	}
+
+	hlen = snprintf(head, sizeof head,
+			"%s %s HTTP/1.1\r\n"
+			"Host: " DJBL_EXIT_HOST "\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n",
+			post ? "POST" : "GET", path,
+			post ? body->len : 0);
+
+	if (!djbl_puller_connect(&p->exit, "127.0.0.1", l_exit_port)) {
+		return (false);
+	}
+
+	if (!djbl_send(p->exit.fd, head, (size_t)hlen,
+		       body->data, post ? body->len : 0) ||
+	    !djbl_head(&p->exit, h) ||
+	    !djbl_body(&p->exit, h, ans)) {
+		djbl_rd_close(&p->exit);
+		return (false);
+	}
+
+	return (true);
+}
+
+static void *
+djbl_puller(void *arg);
+static void *
+djbl_puller(void *arg) {
+	djbl_puller_t	*p = (djbl_puller_t *)arg;
+	djbl_head_t	h, eh, req;
+	djbl_body_t	body, ans;
+	char		head[768];
+	bool		answer = false;
+	int		hlen;
+
+	memset(&eh, 0, sizeof eh);
+	memset(&req, 0, sizeof req);
+	memset(&body, 0, sizeof body);
+	memset(&ans, 0, sizeof ans);
+
+	while (!__atomic_load_n(&l_pull_stop, __ATOMIC_RELAXED)) {
+		if (!djbl_puller_connect(&p->djb, l_djb_host, l_djb_port)) {
+			p->errors++;
+			answer = false;
+			usleep(DJBL_BACKOFF_US);
+			continue;
+		}
+
+		if (l_next && answer) {
+			/* The answer to the last request plus a pull */
+			hlen = snprintf(head, sizeof head,
+				"POST /next/%u/%" PRIu64 "/%" PRIu64
+					" HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"DJB-SeqNo: %s\r\n"
+				"DJB-HTTPCode: %u\r\n"
+				"DJB-HTTPText: OK\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %zu\r\n"
+				"\r\n",
+				p->circuit, p->pulls, djbl_now() / 1000,
+				l_djb, req.seqno, eh.code, ans.len);
+		} else if (l_next) {
+			hlen = snprintf(head, sizeof head,
+				"POST /next/%u/%" PRIu64 "/%" PRIu64
+					" HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"Content-Length: 0\r\n"
+				"\r\n",
+				p->circuit, p->pulls, djbl_now() / 1000,
+				l_djb);
+		} else if (p->circuit != 0) {
+			hlen = snprintf(head, sizeof head,
+				"GET /pull/%u/ HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"\r\n",
+				p->circuit, l_djb);
+		} else {
+			hlen = snprintf(head, sizeof head,
+				"GET /pull/ HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"\r\n",
+				l_djb);
+		}
+
+		if (!djbl_send(p->djb.fd, head, (size_t)hlen, ans.data,
+			       l_next && answer ? ans.len : 0) ||
+		    !djbl_head(&p->djb, &h) ||
+		    !djbl_body(&p->djb, &h, &body)) {
+			if (!__atomic_load_n(&l_pull_stop, __ATOMIC_RELAXED)) {
+				p->errors++;
+			}
+			djbl_rd_close(&p->djb);
+			answer = false;
+			continue;
+		}
+
+		if (l_next && answer) {
+			p->pushes++;
+		}
+		answer = false;
+
+		if (h.close) {
+			djbl_rd_close(&p->djb);
+		}
+
+		/* Nothing in time (408), shed (503) or worse */
+		if (h.code != 200 || h.seqno[0] == '\0') {
+			if (h.code == 408) {
+				p->empty++;
+			} else {
+				p->errors++;
+				usleep(DJBL_BACKOFF_US);
+			}
+			continue;
+		}
+
+		if (h.batch) {
+			if (__atomic_exchange_n(&l_batch_warned, 1,
+						__ATOMIC_RELAXED) == 0) {
+				fprintf(stderr, "djb-loadgen: batched pulls are "
+					"not supported, set plugin_pull_batch "
+					"to 0\n");
+			}
+			p->errors++;
+			continue;
+		}
+
+		p->pulls++;
+		req = h;
+
+		if (!djbl_puller_exit(p, &req, &body, &eh, &ans)) {
+			/* djb requeues it once it times out */
+			p->errors++;
+			continue;
+		}
+
+		if (l_next) {
+			answer = true;
+			continue;
+		}
+
+		hlen = snprintf(head, sizeof head,
+			"POST /push/ HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"DJB-SeqNo: %s\r\n"
+			"DJB-HTTPCode: %u\r\n"
+			"DJB-HTTPText: OK\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n",
+			l_djb, req.seqno, eh.code, ans.len);
+
+		if (!djbl_puller_connect(&p->djb, l_djb_host, l_djb_port) ||
+		    !djbl_send(p->djb.fd, head, (size_t)hlen,
+			       ans.data, ans.len) ||
+		    !djbl_head(&p->djb, &h) ||
+		    !djbl_body(&p->djb, &h, &body)) {
+			p->errors++;
+			djbl_rd_close(&p->djb);
+			continue;
+		}
+
+		if (h.close) {
+			djbl_rd_close(&p->djb);
+		}
+
+		if (h.code == 200) {
+			p->pushes++;
+		} else {
+			p->errors++;
+		}
+	}
+
+	djbl_rd_close(&p->djb);
+	djbl_rd_close(&p->exit);
+	free(body.data);
+	free(ans.data);
+
+	return (NULL);
+}
+
+/*
+ * Report
+ */
+static int
+djbl_cmp_u32(const void *a, const void *b);
+static int
+djbl_cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* Percentile (per mille) of sorted latencies, in ms */
+static double
+djbl_pct(const djbl_lat_t *l, unsigned int pm);
+static double
+djbl_pct(const djbl_lat_t *l, unsigned int pm) {
+	size_t i;
+
+	if (l->n == 0) {
+		return (0.0);
+	}
+
+	/* The smallest that at least pm/1000 of them do not exceed */
+	i = ((l->n * pm) + 999) / 1000;
+	i = i > 0 ? i - 1 : 0;
+
+	return ((double)l->us[i] / 1000.0);
+}
+
+static void
+djbl_report_lat(const char *name, djbl_lat_t *l);
+static void
+djbl_report_lat(const char *name, djbl_lat_t *l) {
+	if (l->n > 0) {
+		qsort(l->us, l->n, sizeof *l->us, djbl_cmp_u32);
+	}
+
+	printf("  %-8s %10zu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+	       name, l->n,
+	       djbl_pct(l, 500), djbl_pct(l, 900), djbl_pct(l, 990),
+	       djbl_pct(l, 999), djbl_pct(l, 1000));
+}
+
+/* Into 'to', which grows as needed */
+static void
+djbl_lat_merge(djbl_lat_t *to, const djbl_lat_t *from);
+static void
+djbl_lat_merge(djbl_lat_t *to, const djbl_lat_t *from) {
+	size_t i;
+
+	for (i = 0; i < from->n; i++) {
+		djbl_lat_add(to, from->us[i]);
+	}
+}
+
+static void
+djbl_report(djbl_client_t *clients, djbl_puller_t *pullers,
+	    uint64_t elapsed);
+static void
+djbl_report(djbl_client_t *clients, djbl_puller_t *pullers,
+	    uint64_t elapsed) {
+	djbl_lat_t	all, per[DJBL_METHODS];
+	uint64_t	ok = 0, errors = 0, shed = 0, timeouts = 0;
+	uint64_t	up = 0, down = 0;
+	uint64_t	pulls = 0, empty = 0, pushes = 0, perrors = 0;
+	double		secs = (double)elapsed / 1000000.0;
+	unsigned int	i, m;
+
+	memset(&all, 0, sizeof all);
+	memset(per, 0, sizeof per);
+
+	for (i = 0; i < l_nclients; i++) {
+		ok += clients[i].ok;
+		errors += clients[i].errors;
+		shed += clients[i].shed;
+		timeouts += clients[i].timeouts;
+		up += clients[i].up;
+		down += clients[i].down;
+
+		for (m = 0; m < DJBL_METHODS; m++) {
+			djbl_lat_merge(&per[m], &clients[i].lat[m]);
+			djbl_lat_merge(&all, &clients[i].lat[m]);
+		}
+	}
+
+	for (i = 0; i < l_npullers; i++) {
+		pulls += pullers[i].pulls;
+		empty += pullers[i].empty;
+		pushes += pullers[i].pushes;
+		perrors += pullers[i].errors;
+	}
+
+	if (secs <= 0.0) {
+		secs = 1.0;
+	}
+
+	printf("djb-loadgen: %u clients, %u pullers (%s%s), %.1f s "
+	       "against %s\n",
+	       l_nclients, l_npullers, l_next ? "/next/" : "/pull/+/push/",
+	       l_circuits > 0 ? ", circuits" : "", secs, l_djb);
+	printf("\n");
+	printf("Requests   : %" PRIu64 " ok, %" PRIu64 " errors, "
+	       "%" PRIu64 " shed (503), %" PRIu64 " timeouts\n",
+	       ok, errors, shed, timeouts);
+	printf("Throughput : %.1f req/s, up %.3f MB/s, down %.3f MB/s\n",
+	       (double)ok / secs,
+	       (double)up / secs / 1000000.0,
+	       (double)down / secs / 1000000.0);
+	printf("Pullers    : %" PRIu64 " pulls, %" PRIu64 " empty (408), "
+	       "%" PRIu64 " pushes, %" PRIu64 " errors\n",
+	       pulls, empty, pushes, perrors);
+	printf("\n");
+	printf("Latency ms %10s %9s %9s %9s %9s %9s\n",
+	       "count", "p50", "p90", "p99", "p99.9", "max");
+
+	djbl_report_lat("all", &all);
+	for (m = 0; m < DJBL_METHODS; m++) {
+		djbl_report_lat(l_methodnames[m], &per[m]);
+	}
+
+	free(all.us);
+	for (m = 0; m < DJBL_METHODS; m++) {
+		free(per[m].us);
+	}
+}
+
+static void
+djbl_usage(const char *progname);
+static void
+djbl_usage(const char *progname) {
+	fprintf(stderr, "Usage: %s [<options>]\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-d <host:port>  djb to test (default %s)\n",
+		DJBL_DJB);
+	fprintf(stderr, "-k <clients>    proxy client connections (8)\n");
+	fprintf(stderr, "-m <pullers>    puller loops (4)\n");
+	fprintf(stderr, "-t <seconds>    measure this long (10)\n");
+	fprintf(stderr, "-w <seconds>    warm up first, not measured (1)\n");
+	fprintf(stderr, "-g <percent>    GET requests, the rest POST (50)\n");
+	fprintf(stderr, "-b <dist>       POST body sizes "
+			"(uniform:64:16384)\n");
+	fprintf(stderr, "-a <dist>       GET answer sizes "
+			"(uniform:64:16384)\n");
+	fprintf(stderr, "-c <circuits>   pullers spread over circuits "
+			"(0 = none, /next/ always has one)\n");
+	fprintf(stderr, "-n              pull with /next/ like circuit.js, "
+			"not /pull/ + /push/\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<dist> is N, fixed:N, uniform:MIN:MAX or "
+			"exp:MEAN[:MAX] (bytes)\n");
+}
+
+static bool
+djbl_uint(const char *s, unsigned int *v);
+static bool
+djbl_uint(const char *s, unsigned int *v) {
+	char		*end;
+	unsigned long	l;
+
+	errno = 0;
+	l = strtoul(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || l > UINT32_MAX) {
+		return (false);
+	}
+
+	*v = (unsigned int)l;
+
+	return (true);
+}
+
+static bool
+djbl_options(int argc, char * const argv[]);
+static bool
+djbl_options(int argc, char * const argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:k:m:t:w:g:b:a:c:nh")) != -1) {
+		switch (opt) {
+		case 'd':
+			l_djb = optarg;
+			break;
+
+		case 'k':
+			if (!djbl_uint(optarg, &l_nclients)) {
+				return (false);
+			}
+			break;
+
+		case 'm':
+			if (!djbl_uint(optarg, &l_npullers)) {
+				return (false);
+			}
+			break;
+
+		case 't':
+			if (!djbl_uint(optarg, &l_duration)) {
+				return (false);
+			}
+			break;
+
+		case 'w':
+			if (!djbl_uint(optarg, &l_warmup)) {
+				return (false);
+			}
+			break;
+
+		case 'g':
+			if (!djbl_uint(optarg, &l_get_pct) || l_get_pct > 100) {
+				return (false);
+			}
+			break;
+
+		case 'b':
+			if (!djbl_dist_parse(optarg, &l_body)) {
+				return (false);
+			}
+			break;
+
+		case 'a':
+			if (!djbl_dist_parse(optarg, &l_answer)) {
+				return (false);
+			}
+			break;
+
+		case 'c':
+			if (!djbl_uint(optarg, &l_circuits)) {
+				return (false);
+			}
+			break;
+
+		case 'n':
+			l_next = true;
+			break;
+
+		case 'h':
+		default:
+			return (false);
+		}
+	}
+
+	return (optind == argc && l_nclients > 0 && l_npullers > 0 &&
+		l_duration > 0 &&
+		djbl_split(l_djb, l_djb_host, sizeof l_djb_host,
+			   l_djb_port, sizeof l_djb_port));
+}
+
+/* Sleep for us microseconds, whatever signals come by */
+static void
+djbl_sleep(uint64_t us);
+static void
+djbl_sleep(uint64_t us) {
+	struct timespec ts, rem;
+
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)((us % 1000000) * 1000);
+
+	while (nanosleep(&ts, &rem) == -1 && errno == EINTR) {
+		ts = rem;
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	djbl_client_t	*clients;
+	djbl_puller_t	*pullers;
+	uint64_t	seed, stop;
+	unsigned int	i, m;
+	int		fd;
+
+	if (!djbl_options(argc, argv)) {
+		djbl_usage(argv[0]);
+		return (1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* One filler for every body and answer */
+	l_blob_len = djbl_dist_max(&l_body);
+	if (djbl_dist_max(&l_answer) > l_blob_len) {
+		l_blob_len = djbl_dist_max(&l_answer);
+	}
+
+	l_blob = malloc(l_blob_len + 1);
+	clients = calloc(l_nclients, sizeof *clients);
+	pullers = calloc(l_npullers, sizeof *pullers);
+	if (l_blob == NULL || clients == NULL || pullers == NULL) {
+		fprintf(stderr, "djb-loadgen: out of memory\n");
+		return (1);
+	}
+
+	for (i = 0; i < l_blob_len; i++) {
+		l_blob[i] = (char)('a' + (i % 26));
+	}
+
+	if (!djbl_exit_init()) {
+		fprintf(stderr, "djb-loadgen: could not start the exit "
+			"server: %s\n", strerror(errno));
+		return (1);
+	}
+
+	l_start = djbl_now() + ((uint64_t)l_warmup * 1000000);
+	seed = djbl_now() | 1;
+
+	/* Pullers first, so that the first requests find them */
+	for (i = 0; i < l_npullers; i++) {
+		pullers[i].id = i;
+		pullers[i].circuit = l_circuits > 0 ? (i % l_circuits) + 1 :
+				     l_next ? i + 1 : 0;
+		djbl_rd_open(&pullers[i].djb, -1);
+		djbl_rd_open(&pullers[i].exit, -1);
+
+		if (pthread_create(&pullers[i].thread, NULL, djbl_puller,
+				   &pullers[i]) != 0) {
+			fprintf(stderr, "djb-loadgen: no puller thread\n");
+			return (1);
+		}
+	}
+
+	for (i = 0; i < l_nclients; i++) {
+		clients[i].id = i;
+		clients[i].rnd = seed + (i * 0x9E3779B97F4A7C15ULL);
+
+		if (pthread_create(&clients[i].thread, NULL, djbl_client,
+				   &clients[i]) != 0) {
+			fprintf(stderr, "djb-loadgen: no client thread\n");
+			return (1);
+		}
+	}
+
+	djbl_sleep(((uint64_t)l_warmup + l_duration) * 1000000);
+
+	__atomic_store_n(&l_stop, 1, __ATOMIC_RELAXED);
+	stop = djbl_now();
+
+	/* The pullers serve what the clients still wait for */
+	for (i = 0; i < l_nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+
+	/* Then wake those parked in a pull */
+	__atomic_store_n(&l_pull_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < l_npullers; i++) {
+		fd = __atomic_load_n(&pullers[i].djb.fd, __ATOMIC_RELAXED);
+		if (fd != -1) {
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+
+	for (i = 0; i < l_npullers; i++) {
+		pthread_join(pullers[i].thread, NULL);
+	}
+
+	djbl_report(clients, pullers, stop - l_start);
+
+	for (i = 0; i < l_nclients; i++) {
+		for (m = 0; m < DJBL_METHODS; m++) {
+			free(clients[i].lat[m].us);
+		}
+	}
+
+	free(clients);
+	free(pullers);
+	free(l_blob);
+
+	return (0);
+}
@@ -0,0 +1,129 @@
+#include "djb.h"
+
+/*
+ * Metrics (/metrics)
+ *
+ * Counters of the proxy pipeline, rendered in the Prometheus text
+ * exposition format. Every counter sits on a cache line of its own and
+ * is only ever touched with relaxed atomics, thus counting costs next
+ * to nothing on the hot paths and a scrape takes no lock at all.
+ *
+ * djb.c adds the gauges (queue depths, pullers per circuit) that it
+ * can read off its own state with djbm_family() and djbm_sample().
+ */
+
+#define DJBM_CTYPE	"text/plain; version=0.0.4"
+#define DJBM_LINE	64
+
+typedef struct {
+	uint64_t	value;
+	char		pad[DJBM_LINE - sizeof (uint64_t)];
+} djbm_slot_t;
+
+static djbm_slot_t l_counters[DJBM_MAX];
+
+/* Families are rendered in this order, samples of one kept together */
+static const struct {
+	const char	*name;
+	const char	*labels;
+	const char	*help;
+} djbm_counters[DJBM_MAX] = {
+	[DJBM_ENQUEUED]		= { "djb_requests_enqueued_total", NULL,
+				    "Proxy requests accepted into the queues" },
+	[DJBM_PAIRED]		= { "djb_requests_paired_total", NULL,
+				    "Proxy requests handed to a puller" },
+	[DJBM_PUSHED]		= { "djb_requests_pushed_total", NULL,
+				    "Answers delivered to their client" },
+	[DJBM_RESCHEDULED]	= { "djb_requests_rescheduled_total", NULL,
+				    "Requests requeued as their puller closed" },
+	[DJBM_BYTES_UP]		= { "djb_forwarded_bytes_total",
+				    "direction=\"up\"",
+				    "Body bytes forwarded, up is client to "
+				    "plugin" },
+	[DJBM_BYTES_DOWN]	= { "djb_forwarded_bytes_total",
+				    "direction=\"down\"", NULL },
+	[DJBM_ACS_INITIAL]	= { "djb_acs_transitions_total",
+				    "state=\"initial\"",
+				    "ACS dance phases entered" },
+	[DJBM_ACS_WAIT]		= { "djb_acs_transitions_total",
+				    "state=\"wait\"", NULL },
+	[DJBM_ACS_REDIRECT]	= { "djb_acs_transitions_total",
+				    "state=\"redirect\"", NULL },
+	[DJBM_ACS_ERR]		= { "djb_acs_status_total",
+				    "status=\"error\"",
+				    "ACS status changes" },
+	[DJBM_ACS_OK]		= { "djb_acs_status_total",
+				    "status=\"ok\"", NULL },
+	[DJBM_ACS_DONE]		= { "djb_acs_status_total",
+				    "status=\"done\"", NULL },
+	[DJBM_RDV_RESET]	= { "djb_rendezvous_transitions_total",
+				    "state=\"reset\"",
+				    "Rendezvous steps requested" },
+	[DJBM_RDV_GEN_REQUEST]	= { "djb_rendezvous_transitions_total",
+				    "state=\"gen_request\"", NULL },
+	[DJBM_RDV_IMAGE]	= { "djb_rendezvous_transitions_total",
+				    "state=\"image\"", NULL },
+	[DJBM_RDV_PEEL]		= { "djb_rendezvous_transitions_total",
+				    "state=\"peel\"", NULL },
+};
+
+void
+djbm_add(djbm_counter_t c, uint64_t n) {
+	fassert(c < DJBM_MAX);
+
+	__atomic_add_fetch(&l_counters[c].value, n, __ATOMIC_RELAXED);
+}
+
+void
+djbm_inc(djbm_counter_t c) {
+	djbm_add(c, 1);
+}
+
+uint64_t
+djbm_get(djbm_counter_t c) {
+	fassert(c < DJBM_MAX);
+
+	return (__atomic_load_n(&l_counters[c].value, __ATOMIC_RELAXED));
+}
+
+void
+djbm_family(httpsrv_client_t *hcl, const char *name, const char *type,
+	    const char *help) {
+	conn_printf(&hcl->conn,
+		"# HELP %s %s\n"
+		"# TYPE %s %s\n",
+		name, help,
+		name, type);
+}
+
+void
+djbm_sample(httpsrv_client_t *hcl, const char *name, const char *labels,
+	    uint64_t value) {
+	if (labels != NULL) {
+		conn_printf(&hcl->conn, "%s{%s} %" PRIu64 "\n",
+			    name, labels, value);
+	} else {
+		conn_printf(&hcl->conn, "%s %" PRIu64 "\n", name, value);
+	}
+}
+
+/* Answer a scrape with the counters; the caller adds gauges and is done */
+void
+djbm_begin(httpsrv_client_t *hcl) {
+	unsigned int i;
+
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, DJBM_CTYPE);
+	httpsrv_expire(hcl, HTTPSRV_EXPIRE_FORCE);
+
+	for (i = 0; i < DJBM_MAX; i++) {
+		/* The first sample of a family carries its help */
+		if (djbm_counters[i].help != NULL) {
+			djbm_family(hcl, djbm_counters[i].name, "counter",
+				    djbm_counters[i].help);
+		}
+
+		djbm_sample(hcl, djbm_counters[i].name,
+			    djbm_counters[i].labels,
+			    djbm_get((djbm_counter_t)i));
+	}
+}
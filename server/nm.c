@@ -0,0 +1,515 @@
+#include "djb.h"
+
+#include <poll.h>
+
+/*
+ * Chrome native messaging host
+ *
+ * When Chrome starts djb as the native messaging host of the extension
+ * (the first argument is then the extension's origin), the extension
+ * and djb talk over stdin/stdout. Every message is a 32-bit length in
+ * native byte order followed by that many bytes of JSON; that is what
+ * Chrome mandates.
+ *
+ * From the extension:
+ *
+ *   { "type": "open", "circuit": 1, "window": 4 }
+ *   { "type": "close", "circuit": 1 }
+ *   { "type": "response", "circuit": 1, "DJB-SeqNo": "...",
+ *     "DJB-HTTPCode": "200", "DJB-HTTPText": "OK",
+ *     "DJB-Set-Cookie": "..." (opt), "Content-Type": "..." (opt),
+ *     "Body": "<base64>" (opt) }
+ *
+ * From djb:
+ *
+ *   { "type": "hello", "address": "127.0.0.1:6543" }
+ *   { "type": "opened", "circuit": 1 }
+ *   { "type": "request", "circuit": 1, "DJB-SeqNo": "...",
+ *     "DJB-URI": "http://...", "DJB-Method": "POST",
+ *     "DJB-Cookie": "..." (opt), "Content-Type": "..." (opt),
+ *     "Body": "<base64>" (opt) }
+ *
+ * An open circuit is a channel exactly like a WebSocket one (see ws.c),
+ * it only sends its requests here instead of as frames; djb_ws_open()
+ * and djb_ws_message() do the rest. A channel has no connection of its
+ * own, thus it gets an internal client (like ACS requests do) to stand
+ * for its pullers.
+ *
+ * stdout belongs to Chrome: we keep a copy of it for ourselves and
+ * point it at stderr, so that nothing else (children, libraries) can
+ * write to it. Chrome closing stdin means the extension is gone, and
+ * so are we.
+ *
+ * The first message tells the extension where djb listens (DJB_LISTEN),
+ * thus it sends its HTTP requests (/next/, /push/, /preferences/, ...)
+ * there instead of to the port it was configured with.
+ */
+
+/* Largest message from the extension we accept */
+#define DJBN_MSG_MAX		(16 * 1024 * 1024)
+
+/* Largest message Chrome accepts from a host */
+#define DJBN_OUT_MAX		(1024 * 1024)
+
+#define DJBN_WINDOW		4
+#define DJBN_WINDOW_MAX		32
+#define DJBN_CIRCUITS		64
+
+/* How often the reader checks whether it should stop */
+#define DJBN_POLL_MS		1000
+
+static httpsrv_t *l_hs = NULL;
+static int l_out = -1;			/* Chrome's stdout */
+static mutex_t l_out_mutex;		/* Serializes writers */
+
+/* Open channels, only the reader thread changes these */
+static djbw_t *l_chans[DJBN_CIRCUITS];
+static unsigned int l_nchans = 0;	/* (atomic for readers) */
+
+/* JSON names of the message fields, by djbw_field_t */
+static const char *djbn_names[DJBW_FIELDS] = {
+	NULL,
+	"DJB-SeqNo",
+	"DJB-URI",
+	"DJB-Method",
+	"DJB-Cookie",
+	"Content-Type",
+	"DJB-HTTPCode",
+	"DJB-HTTPText",
+	"DJB-Set-Cookie"
+};
+
+bool
+djbn_setup(void) {
+	/* Our own copy of stdout, everybody else gets stderr */
+	l_out = dup(STDOUT_FILENO);
+	if (l_out == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+		log_crt("Could not take over stdout: %s", strerror(errno));
+		return (false);
+	}
+
+	mutex_init(l_out_mutex);
+
+	return (true);
+}
+
+/* Output lock held */
+static bool
+djbn_write(const char *buf, size_t len);
+static bool
+djbn_write(const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(l_out, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			log_wrn("native: write failed: %s", strerror(errno));
+			return (false);
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return (true);
+}
+
+/*
+ * Write a message to the extension; with a channel given, only while
+ * that is open
+ */
+static bool
+djbn_post(djbw_t *ws, json_t *root);
+static bool
+djbn_post(djbw_t *ws, json_t *root) {
+	char		*j;
+	uint32_t	len;
+	bool		ok;
+
+	j = json_dumps(root, JSON_COMPACT);
+	if (j == NULL) {
+		return (false);
+	}
+
+	if (strlen(j) > DJBN_OUT_MAX) {
+		log_wrn("native: message of %zu bytes too large for Chrome",
+			strlen(j));
+		free(j);
+		return (false);
+	}
+
+	len = (uint32_t)strlen(j);
+
+	mutex_lock(l_out_mutex);
+	ok = (ws == NULL || !djbw_closed(ws)) &&
+	     djbn_write((const char *)&len, sizeof len) &&
+	     djbn_write(j, len);
+	mutex_unlock(l_out_mutex);
+
+	free(j);
+
+	return (ok);
+}
+
+bool
+djbn_send(djbw_t *ws, djbw_msg_t *msg) {
+	json_t		*root;
+	char		*body;
+	unsigned int	i;
+	bool		ok;
+
+	root = json_pack("{s:s, s:i}", "type", "request",
+			 "circuit", (int)ws->circuit);
+	if (root == NULL) {
+		return (false);
+	}
+
+	for (i = 1; i < DJBW_FIELDS; i++) {
+		if (msg->field[i] != NULL) {
+			json_object_set_new(root, djbn_names[i],
+					    json_string(msg->field[i]));
+		}
+	}
+
+	if (msg->body_len > 0) {
+		body = djb_base64_encode(msg->body, msg->body_len);
+		if (body == NULL) {
+			json_decref(root);
+			return (false);
+		}
+
+		json_object_set_new(root, "Body", json_string(body));
+		free(body);
+	}
+
+	ok = djbn_post(ws, root);
+	json_decref(root);
+
+	return (ok);
+}
+
+/* Park the pullers of the channels that were refused again */
+static void
+djbn_retry(void);
+static void
+djbn_retry(void) {
+	unsigned int i;
+
+	for (i = 0; i < l_nchans; i++) {
+		djb_ws_retry(l_chans[i]);
+	}
+}
+
+/* Read exactly len bytes from Chrome; false on EOF, error or shutdown */
+static bool
+djbn_read(void *buf, size_t len);
+static bool
+djbn_read(void *buf, size_t len) {
+	struct pollfd	pfd;
+	char		*b = buf;
+	ssize_t		n;
+
+	while (len > 0) {
+		/* Wake up now and then to notice a shutdown */
+		pfd.fd = STDIN_FILENO;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, DJBN_POLL_MS) == 0) {
+			if (!thread_keep_running()) {
+				return (false);
+			}
+			djbn_retry();
+			continue;
+		}
+
+		n = read(STDIN_FILENO, b, len);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+
+		if (n <= 0) {
+			log_inf("native: extension went away");
+			return (false);
+		}
+
+		b += n;
+		len -= n;
+	}
+
+	return (true);
+}
+
+static unsigned int
+djbn_find(uint32_t circuit);
+static unsigned int
+djbn_find(uint32_t circuit) {
+	unsigned int i;
+
+	for (i = 0; i < l_nchans; i++) {
+		if (l_chans[i]->circuit == circuit) {
+			break;
+		}
+	}
+
+	return (i);
+}
+
+static void
+djbn_close(unsigned int i);
+static void
+djbn_close(unsigned int i) {
+	djbw_t *ws = l_chans[i];
+
+	log_dbg("native: circuit %u closed", ws->circuit);
+
+	/* No more writes after this */
+	mutex_lock(l_out_mutex);
+	__atomic_store_n(&ws->closed, true, __ATOMIC_RELEASE);
+	mutex_unlock(l_out_mutex);
+
+	/* What it had outstanding goes to other pullers */
+	djb_ws_close(ws);
+
+	l_chans[i] = l_chans[--l_nchans];
+	djbw_put(ws);
+}
+
+static void
+djbn_open(uint32_t circuit, unsigned int window);
+static void
+djbn_open(uint32_t circuit, unsigned int window) {
+	djbw_t		*ws;
+	json_t		*ack;
+	unsigned int	i;
+
+	/* Opened again (tab reloaded): the old one is gone */
+	i = djbn_find(circuit);
+	if (i < l_nchans) {
+		djbn_close(i);
+	}
+
+	if (l_nchans >= DJBN_CIRCUITS) {
+		log_wrn("native: too many circuits, not opening %u", circuit);
+		return;
+	}
+
+	if (window == 0) {
+		window = DJBN_WINDOW;
+	} else if (window > DJBN_WINDOW_MAX) {
+		window = DJBN_WINDOW_MAX;
+	}
+
+	ws = mcalloc(sizeof *ws, "djbw_t");
+	if (ws == NULL) {
+		log_crt("No memory for native channel");
+		return;
+	}
+
+	ws->hcl = httpsrv_newcl(l_hs);
+	if (ws->hcl == NULL) {
+		log_crt("No client for native channel");
+		mfree(ws, sizeof *ws, "djbw_t");
+		return;
+	}
+
+	mutex_init(ws->mutex);
+	ws->hcl_id = ws->hcl->id;
+	ws->fd = -1;
+	ws->native = true;
+	ws->circuit = circuit;
+	ws->window = window;
+	ws->refs = 1;
+
+	l_chans[l_nchans++] = ws;
+
+	log_inf("native: circuit %u open, window %u", circuit, window);
+
+	/* Tell the extension that this host is there and took it */
+	ack = json_pack("{s:s, s:i}", "type", "opened",
+			"circuit", (int)circuit);
+	if (ack != NULL) {
+		djbn_post(ws, ack);
+		json_decref(ack);
+	}
+
+	djb_ws_open(ws);
+}
+
+static void
+djbn_response(djbw_t *ws, json_t *root);
+static void
+djbn_response(djbw_t *ws, json_t *root) {
+	djbw_msg_t	msg;
+	json_t		*code;
+	const char	*b64;
+	char		codebuf[16];
+	unsigned int	i;
+
+	memzero(&msg, sizeof msg);
+	msg.type = DJBW_RESPONSE;
+
+	for (i = 1; i < DJBW_FIELDS; i++) {
+		msg.field[i] = json_string_value(json_object_get(root,
+							djbn_names[i]));
+	}
+
+	/* The extension sends it as a string, accept a number too */
+	code = json_object_get(root, djbn_names[DJBW_HTTPCODE]);
+	if (json_is_integer(code)) {
+		snprintf(codebuf, sizeof codebuf, "%u",
+			 (unsigned int)json_integer_value(code));
+		msg.field[DJBW_HTTPCODE] = codebuf;
+	}
+
+	b64 = json_string_value(json_object_get(root, "Body"));
+	if (b64 != NULL && strlen(b64) > 0) {
+		msg.body = djb_base64_decode(b64, &msg.body_len);
+		if (msg.body == NULL) {
+			log_wrn("native: malformed body");
+		}
+	}
+
+	djb_ws_message(ws, &msg);
+
+	free(msg.body);
+}
+
+static void
+djbn_dispatch(json_t *root);
+static void
+djbn_dispatch(json_t *root) {
+	const char	*type;
+	json_t		*window;
+	uint32_t	circuit;
+	unsigned int	i;
+
+	type = json_string_value(json_object_get(root, "type"));
+	circuit = (uint32_t)json_integer_value(json_object_get(root,
+							      "circuit"));
+
+	if (type == NULL) {
+		log_wrn("native: message without a type");
+		return;
+	}
+
+	if (strcmp(type, "open") == 0) {
+		window = json_object_get(root, "window");
+		djbn_open(circuit, json_is_integer(window) ?
+				(unsigned int)json_integer_value(window) : 0);
+		return;
+	}
+
+	i = djbn_find(circuit);
+	if (i >= l_nchans) {
+		log_wrn("native: %s for circuit %u which is not open",
+			type, circuit);
+		return;
+	}
+
+	if (strcmp(type, "close") == 0) {
+		djbn_close(i);
+	} else if (strcmp(type, "response") == 0) {
+		djbn_response(l_chans[i], root);
+	} else {
+		log_wrn("native: unknown message type %s", type);
+	}
+}
+
+static void *
+djbn_thread(void UNUSED *arg);
+static void *
+djbn_thread(void UNUSED *arg) {
+	json_t		*root;
+	json_error_t	jerr;
+	uint32_t	len;
+	char		*buf;
+
+	/* Where to find us */
+	root = json_pack("{s:s, s:s}", "type", "hello",
+			 "address", prf_get_value(PRF_JA));
+	if (root != NULL) {
+		djbn_post(NULL, root);
+		json_decref(root);
+	}
+
+	while (djbn_read(&len, sizeof len)) {
+		if (len > DJBN_MSG_MAX) {
+			log_err("native: message of %u bytes, giving up", len);
+			break;
+		}
+
+		buf = malloc(len + 1);
+		if (buf == NULL) {
+			log_crt("No memory for native message");
+			break;
+		}
+
+		if (!djbn_read(buf, len)) {
+			free(buf);
+			break;
+		}
+
+		root = json_loadb(buf, len, 0, &jerr);
+		free(buf);
+
+		if (root == NULL || !json_is_object(root)) {
+			log_wrn("native: malformed message");
+			if (root != NULL) {
+				json_decref(root);
+			}
+			continue;
+		}
+
+		djbn_dispatch(root);
+		json_decref(root);
+
+		thread_serve();
+	}
+
+	while (l_nchans > 0) {
+		djbn_close(l_nchans - 1);
+	}
+
+	/* Without the extension there is nothing to do */
+	if (thread_keep_running()) {
+		log_inf("native: stopping");
+		thread_stop_running();
+	}
+
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+bool
+djbn_init(httpsrv_t *hs) {
+	l_hs = hs;
+
+	if (!thread_add("DJBNative", &djbn_thread, NULL)) {
+		log_err("Could not create native messaging thread");
+		return (false);
+	}
+
+	return (true);
+}
+
+void
+djbn_exit(void) {
+	if (l_out != -1) {
+		close(l_out);
+		l_out = -1;
+		mutex_destroy(l_out_mutex);
+	}
+
+	l_hs = NULL;
+}
+
+unsigned int
+djbn_open_count(void) {
+	return (__atomic_load_n(&l_nchans, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,280 @@
+#include "djb.h"
+
+/*
+ * Adaptive worker pool
+ *
+ * The DJBWorker threads drain the proxy queues in case both a request
+ * and a puller ended up queued (pairing normally happens on arrival).
+ * How many of those help depends on the load, thus the pool sizes
+ * itself between a minimum and a maximum.
+ *
+ * Once per DJBP_TICK_MS the timer thread samples the queues (see
+ * djbp_load_f) and how long the workers' rounds take (djbp_latency(),
+ * an exponentially weighted average) and decides:
+ *
+ *  - busy: requests and pullers both waiting, more requests waiting
+ *    than DJBP_DEPTH per worker, or rounds slower than DJBP_SLOW_US
+ *  - idle: none of that, and the requests waiting and the round time
+ *    would also be fine with a worker less at half those limits
+ *
+ * Only the pool's own work counts: the HTTP handlers run on the httpsrv
+ * threads, more workers would not make them any faster.
+ *
+ * Only DJBP_GROW_TICKS busy ticks in a row add a worker and only
+ * DJBP_SHRINK_TICKS idle ticks in a row retire one, so that a burst
+ * or a single slow request does not make the pool flap. A retired
+ * worker exits at its next round. The last scaling events are kept
+ * for the status page.
+ */
+
+#define DJBP_TICK_MS		1000
+#define DJBP_GROW_TICKS		2
+#define DJBP_SHRINK_TICKS	10
+#define DJBP_DEPTH		8	/* Waiting requests per worker */
+#define DJBP_SLOW_US		2000	/* Round time */
+
+/* Weight of a new latency sample, 1/2^n */
+#define DJBP_EWMA_SHIFT		4
+
+static djbt_timer_t l_tick;
+static djbp_work_f l_work = NULL;
+static djbp_load_f l_load = NULL;
+static unsigned int l_min = 0, l_max = 0;
+static unsigned int l_work_ms = 0;
+
+static unsigned int l_size = 0;		/* Workers running (atomic) */
+static unsigned int l_target = 0;	/* Workers wanted (atomic) */
+static uint64_t l_latency = 0;		/* Average, in us (atomic) */
+static unsigned int l_busy = 0;		/* Busy ticks in a row */
+static unsigned int l_idle = 0;		/* Idle ticks in a row */
+
+/* The last scaling events, a ring */
+static mutex_t l_events_mutex;
+static djbp_event_t l_events[DJBP_EVENTS];
+static unsigned int l_nevents = 0;	/* Ever recorded */
+
+/* A worker's round took this long */
+static void
+djbp_latency(uint64_t us);
+static void
+djbp_latency(uint64_t us) {
+	uint64_t avg, n;
+
+	/* Racing updates lose a sample at worst */
+	avg = __atomic_load_n(&l_latency, __ATOMIC_RELAXED);
+	n = avg - (avg >> DJBP_EWMA_SHIFT) + (us >> DJBP_EWMA_SHIFT);
+	__atomic_store_n(&l_latency, n, __ATOMIC_RELAXED);
+}
+
+/* A worker that is not wanted anymore takes itself out */
+static bool
+djbp_retire(void);
+static bool
+djbp_retire(void) {
+	unsigned int n;
+
+	n = __atomic_load_n(&l_size, __ATOMIC_ACQUIRE);
+	while (n > __atomic_load_n(&l_target, __ATOMIC_ACQUIRE)) {
+		if (__atomic_compare_exchange_n(&l_size, &n, n - 1, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+static void *
+djbp_thread(void UNUSED *arg);
+static void *
+djbp_thread(void UNUSED *arg) {
+	struct timespec t0, t1;
+
+	log_dbg("...");
+
+	while (thread_keep_running() && !djbp_retire()) {
+		thread_setmessage("Sweeping");
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		l_work();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		djbp_latency(((uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000) +
+			     ((t1.tv_nsec - t0.tv_nsec) / 1000));
+
+		thread_setmessage("Waiting");
+
+		if (!thread_sleep(l_work_ms)) {
+			break;
+		}
+	}
+
+	log_dbg("exit");
+
+	/* Retired workers come and go, their slab caches stay */
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+/* Timer thread (or init) only */
+static bool
+djbp_start(void);
+static bool
+djbp_start(void) {
+	__atomic_add_fetch(&l_size, 1, __ATOMIC_ACQ_REL);
+
+	if (!thread_add("DJBWorker", &djbp_thread, NULL)) {
+		log_err("Could not create worker thread");
+		__atomic_sub_fetch(&l_size, 1, __ATOMIC_ACQ_REL);
+		return (false);
+	}
+
+	return (true);
+}
+
+static void
+djbp_event(unsigned int from, unsigned int to, unsigned int depth,
+	   unsigned int pullers, uint64_t latency);
+static void
+djbp_event(unsigned int from, unsigned int to, unsigned int depth,
+	   unsigned int pullers, uint64_t latency) {
+	djbp_event_t *e;
+
+	log_inf("Worker pool %u -> %u (requests %u, pullers %u, "
+		"round %" PRIu64 " us)", from, to, depth, pullers, latency);
+
+	mutex_lock(l_events_mutex);
+	e = &l_events[__atomic_fetch_add(&l_nevents, 1, __ATOMIC_RELAXED) %
+		      DJBP_EVENTS];
+	e->when = time(NULL);
+	e->from = from;
+	e->to = to;
+	e->depth = depth;
+	e->pullers = pullers;
+	e->latency = latency;
+	mutex_unlock(l_events_mutex);
+}
+
+static void
+djbp_tick(void UNUSED *data);
+static void
+djbp_tick(void UNUSED *data) {
+	unsigned int	target, depth, pullers;
+	uint64_t	latency;
+	bool		busy, idle;
+
+	l_load(&depth, &pullers);
+	latency = __atomic_load_n(&l_latency, __ATOMIC_RELAXED);
+	target = __atomic_load_n(&l_target, __ATOMIC_RELAXED);
+
+	busy = (depth > 0 && pullers > 0) ||
+	       depth > target * DJBP_DEPTH ||
+	       latency > DJBP_SLOW_US;
+
+	idle = !busy && target > 0 &&
+	       depth <= (target - 1) * DJBP_DEPTH / 2 &&
+	       latency <= DJBP_SLOW_US / 2;
+
+	l_busy = busy ? l_busy + 1 : 0;
+	l_idle = idle ? l_idle + 1 : 0;
+
+	if (l_busy >= DJBP_GROW_TICKS && target < l_max) {
+		__atomic_store_n(&l_target, target + 1, __ATOMIC_RELEASE);
+		if (djbp_start()) {
+			djbp_event(target, target + 1, depth, pullers, latency);
+		} else {
+			__atomic_store_n(&l_target, target, __ATOMIC_RELEASE);
+		}
+		l_busy = 0;
+
+	} else if (l_idle >= DJBP_SHRINK_TICKS && target > l_min) {
+		__atomic_store_n(&l_target, target - 1, __ATOMIC_RELEASE);
+		djbp_event(target, target - 1, depth, pullers, latency);
+		l_idle = 0;
+	}
+
+	djbt_arm(&l_tick, DJBP_TICK_MS, djbp_tick, NULL);
+}
+
+bool
+djbp_init(unsigned int min, unsigned int max, unsigned int work_ms,
+	  djbp_work_f work, djbp_load_f load) {
+	unsigned int i;
+
+	if (max < min) {
+		max = min;
+	}
+
+	l_min = min;
+	l_max = max;
+	l_work_ms = work_ms;
+	l_work = work;
+	l_load = load;
+
+	mutex_init(l_events_mutex);
+
+	log_inf("Worker pool of %u to %u threads", min, max);
+
+	__atomic_store_n(&l_target, min, __ATOMIC_RELEASE);
+	for (i = 0; i < min; i++) {
+		if (!djbp_start()) {
+			return (false);
+		}
+	}
+
+	/* Nothing to decide when it can not change */
+	if (min < max) {
+		djbt_arm(&l_tick, DJBP_TICK_MS, djbp_tick, NULL);
+	}
+
+	return (true);
+}
+
+void
+djbp_exit(void) {
+	if (l_work == NULL) {
+		return;
+	}
+
+	djbt_cancel(&l_tick);
+	mutex_destroy(l_events_mutex);
+	l_work = NULL;
+}
+
+void
+djbp_stats(djbp_stats_t *st) {
+	st->min = l_min;
+	st->max = l_max;
+	st->size = __atomic_load_n(&l_size, __ATOMIC_RELAXED);
+	st->target = __atomic_load_n(&l_target, __ATOMIC_RELAXED);
+	st->latency = __atomic_load_n(&l_latency, __ATOMIC_RELAXED);
+	st->events = __atomic_load_n(&l_nevents, __ATOMIC_RELAXED);
+}
+
+unsigned int
+djbp_events(djbp_event_t *events, unsigned int max) {
+	unsigned int i, n, first;
+
+	if (l_work == NULL) {
+		return (0);
+	}
+
+	mutex_lock(l_events_mutex);
+
+	n = l_nevents < DJBP_EVENTS ? l_nevents : DJBP_EVENTS;
+	if (n > max) {
+		n = max;
+	}
+
+	/* Newest first */
+	first = l_nevents - 1;
+	for (i = 0; i < n; i++) {
+		events[i] = l_events[(first - i) % DJBP_EVENTS];
+	}
+
+	mutex_unlock(l_events_mutex);
+
+	return (n);
+}
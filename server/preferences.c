@@ -19,7 +19,8 @@ static const char *l_keys[PRF_MAX] =  {
 	"shared_secret", 
 	"proxy_address", 
 	"djb_address",
-	"server_address"
+	"server_address",
+	"plugin_pull_batch"
 	};
 
 static char *l_values[PRF_MAX];
@@ -34,8 +35,12 @@ static const char *l_defaults[PRF_MAX] = {
 	"127.0.0.1:1080",
 	"127.0.0.1:6543",
 	"127.0.0.1:8080",
+	"0",
 	};
 
+/* Defaults that depend on how we were started (prf_set_default) */
+static char *l_dynamic[PRF_MAX];
+
 const char *
 prf_get_value(enum prf_v i) {
 	/* Just in case */
@@ -50,6 +55,32 @@ prf_get_value(enum prf_v i) {
 	return ((l_values[i] != NULL) ? l_values[i] : l_defaults[i]);
 }
 
+/* Replace a default, before the values are read */
+void
+prf_set_default(enum prf_v i, const char *val) {
+	char *v;
+
+	fassert(i < PRF_MAX);
+
+	if (i >= PRF_MAX) {
+		return;
+	}
+
+	v = strdup(val);
+	if (v == NULL) {
+		log_crt("No memory for default of %s", l_keys[i]);
+		return;
+	}
+
+	mutex_lock(l_mutex);
+	if (l_dynamic[i] != NULL) {
+		free(l_dynamic[i]);
+	}
+	l_dynamic[i] = v;
+	l_defaults[i] = v;
+	mutex_unlock(l_mutex);
+}
+
 static void
 prf_set_value(enum prf_v i, const char *val);
 static void
@@ -103,7 +134,7 @@ prf_get_argv(char **argvp[]) {
 	bool		trace_packets;
 	unsigned int	circuits, argc, i;
 	int		r;
-	char		scratch[256];
+	char		scratch[256], unixaddr[128];
 	unsigned int	vslot = 0;
 
 	if (argvp == NULL) {
@@ -133,10 +164,15 @@ prf_get_argv(char **argvp[]) {
 
 	/* Override the JumpBox Address? */
 	ja = getenv("DJB_FORCED_JUMPBOXADDRESS");
-	if (ja == NULL) {
-		ja = prf_get_value(PRF_JA);
-	} else {
+	if (ja != NULL) {
 		log_inf("Using Forced JumpBox Address: %s", ja);
+	} else if (djbu_stegotorus_path() != NULL) {
+		/* Our unix socket (DJB_UNIX) spares it the TCP loopback */
+		snprintf(unixaddr, sizeof unixaddr, "unix:%s",
+			 djbu_stegotorus_path());
+		ja = unixaddr;
+	} else {
+		ja = prf_get_value(PRF_JA);
 	}
 
 	/* Override the Steg Method? */
@@ -490,24 +526,14 @@ prf_parse_preferences(void) {
 	return (true);
 }
 
-static void
+static bool
 prf_set(httpsrv_client_t *hcl);
-static void
+static bool
 prf_set(httpsrv_client_t *hcl) {
+	bool ret;
 
-	if (hcl->readbody == NULL) {
-		if (hcl->headers.content_length == 0) {
-			djb_error(hcl, 400,
-				  "Setting preferences requires a length");
-			return;
-		}
-
-		if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
-			log_wrn("httpsrv_readbody_alloc() failed");
-		}
-
-		/* Let httpsrv read */
-		return;
+	if (!djb_body_need(hcl, 0, "Setting preferences", &ret)) {
+		return (ret);
 	}
 
 	log_dbg("prefs = %s", hcl->readbody);
@@ -546,9 +572,12 @@ prf_set(httpsrv_client_t *hcl) {
 	}
 
 	mutex_unlock(l_mutex);
+
+	return (false);
 }
 
-void
+/* Returns true when the request is parked (see djb_body_need()) */
+bool
 prf_handle(httpsrv_client_t *hcl) {
 	/* Skip the /preferences/ portion */
 	const char *uri = &hcl->headers.uri[12];
@@ -556,16 +585,16 @@ prf_handle(httpsrv_client_t *hcl) {
 	log_dbg("URI: %s", uri);
 
 	if (strcasecmp(uri, "/set/") == 0) {
-		prf_set(hcl);
-		return;
+		return (prf_set(hcl));
 
 	} else if (strcasecmp(uri, "/bridge/list/") == 0) {
 		prf_br_list(hcl);
-		return;
+		return (false);
 	}
 
 	/* Not a valid API request */
 	djb_error(hcl, 404, "No such DJB API request (Preferences)");
+	return (false);
 }
 
 void
@@ -579,10 +608,13 @@ prf_init(void) {
 
 	/* No values set yet */
 	memzero(l_values, sizeof l_values);
+	memzero(l_dynamic, sizeof l_dynamic);
 }
 
 void
 prf_exit(void) {
+	unsigned int i;
+
 	log_dbg("...");
 
 	if (l_current_preferences != NULL) {
@@ -590,6 +622,13 @@ prf_exit(void) {
 		l_current_preferences = NULL;
 	}
 
+	for (i = 0; i < PRF_MAX; i++) {
+		if (l_dynamic[i] != NULL) {
+			free(l_dynamic[i]);
+			l_dynamic[i] = NULL;
+		}
+	}
+
 	/* Destroy it */
 	mutex_destroy(l_mutex);
 }
@@ -0,0 +1,376 @@
+#include "djb.h"
+
+#ifdef _LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue
+ *
+ * This is the classic array based queue where every slot carries a
+ * sequence number: a producer may fill slot 'pos' when its sequence is
+ * 'pos', a consumer may empty it when the sequence is 'pos + 1'.
+ * Producers and consumers thus only contend on a single CAS of the
+ * tail or head position respectively, never on a lock.
+ *
+ * Consumers that want to block park on a futex (Linux) or on a
+ * condition (other platforms); producers only touch that when somebody
+ * is actually parked.
+ *
+ * Every slot also keeps a copy of the HCL id + reqid, hostname and
+ * request line of the request it carries, so that the status page can
+ * enumerate the queue without dereferencing requests that a consumer
+ * might be releasing. The strings are copied a word at a time, a lister
+ * that raced a consumer sees the sequence change and skips the slot.
+ */
+
+/* How long a consumer parks before re-checking thread_keep_running() */
+#define DJBQ_PARK_MS	1000
+
+#define djbq_load(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define djbq_loadr(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define djbq_store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define djbq_storer(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define djbq_cas(p, e, v)	__atomic_compare_exchange_n(p, e, v, true, \
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+
+/* Copy the start of str into a slot (producer) */
+static void
+djbq_str_put(uint64_t *words, size_t size, const char *str);
+static void
+djbq_str_put(uint64_t *words, size_t size, const char *str) {
+	char		buf[DJBQ_REQUEST_LEN];
+	uint64_t	w;
+	size_t		i;
+
+	fassert(size <= sizeof buf);
+
+	memzero(buf, size);
+	memcpy(buf, str, strnlen(str, size - 1));
+
+	for (i = 0; i < size / sizeof w; i++) {
+		memcpy(&w, &buf[i * sizeof w], sizeof w);
+		djbq_storer(&words[i], w);
+	}
+}
+
+/* Copy it out of a slot (lister), terminated even when torn */
+static void
+djbq_str_get(uint64_t *words, size_t size, char *str);
+static void
+djbq_str_get(uint64_t *words, size_t size, char *str) {
+	uint64_t	w;
+	size_t		i;
+
+	for (i = 0; i < size / sizeof w; i++) {
+		w = djbq_loadr(&words[i]);
+		memcpy(&str[i * sizeof w], &w, sizeof w);
+	}
+
+	str[size - 1] = '\0';
+}
+
+bool
+djbq_init(djbq_t *q, unsigned int size) {
+	unsigned int i;
+
+	memzero(q, sizeof *q);
+
+	/* Round up to a power of two, so that we can mask */
+	for (i = 2; i < size; i <<= 1) {
+		/* Nothing */
+	}
+
+	q->slots = mcalloc(i * sizeof *q->slots, "djbq_slot_t");
+	if (q->slots == NULL) {
+		log_crt("No memory for queue of %u slots", i);
+		return (false);
+	}
+
+	q->mask = i - 1;
+
+	/* Slot 'n' can be filled at position 'n' */
+	for (i = 0; i <= q->mask; i++) {
+		q->slots[i].seq = i;
+	}
+
+#ifndef _LINUX
+	mutex_init(q->park_mutex);
+	cond_init(q->park_cond);
+#endif
+
+	return (true);
+}
+
+void
+djbq_exit(djbq_t *q) {
+	if (q->slots == NULL) {
+		return;
+	}
+
+#ifndef _LINUX
+	cond_destroy(q->park_cond);
+	mutex_destroy(q->park_mutex);
+#endif
+
+	mfree(q->slots, (q->mask + 1) * sizeof *q->slots, "djbq_slot_t");
+	q->slots = NULL;
+}
+
+static void
+djbq_wake(djbq_t *q, bool all);
+static void
+djbq_wake(djbq_t *q, bool all) {
+	/* Make the new item visible before checking for sleepers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (djbq_loadr(&q->parked) == 0) {
+		return;
+	}
+
+	__atomic_add_fetch(&q->park_seq, 1, __ATOMIC_SEQ_CST);
+
+#ifdef _LINUX
+	syscall(SYS_futex, &q->park_seq, FUTEX_WAKE_PRIVATE,
+		all ? INT32_MAX : 1, NULL, NULL, 0);
+#else
+	mutex_lock(q->park_mutex);
+	cond_trigger(q->park_cond);
+	mutex_unlock(q->park_mutex);
+	(void)all;
+#endif
+}
+
+bool
+djbq_push(djbq_t *q, djb_req_t *r) {
+	djbq_slot_t	*slot;
+	uint64_t	pos, seq;
+	int64_t		dif;
+
+	pos = djbq_loadr(&q->tail);
+
+	while (true) {
+		slot = &q->slots[pos & q->mask];
+		seq = djbq_load(&slot->seq);
+		dif = (int64_t)seq - (int64_t)pos;
+
+		if (dif == 0) {
+			/* Slot is free, try to claim it */
+			if (djbq_cas(&q->tail, &pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* The consumers did not get here yet: full */
+			return (false);
+		} else {
+			/* Another producer got it, retry */
+			pos = djbq_loadr(&q->tail);
+		}
+	}
+
+	/* Listers that see the copies below see the slot taken too */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* Fill it in, then publish it */
+	slot->req = r;
+	djbq_storer(&slot->id, r->hcl->id);
+	djbq_storer(&slot->reqid, r->hcl->reqid);
+	djbq_str_put(slot->host, sizeof slot->host, r->hcl->headers.hostname);
+	djbq_str_put(slot->request, sizeof slot->request,
+		     r->hcl->the_request);
+	djbq_store(&slot->seq, pos + 1);
+
+	djbq_wake(q, false);
+
+	return (true);
+}
+
+djb_req_t *
+djbq_trypop(djbq_t *q) {
+	djbq_slot_t	*slot;
+	djb_req_t	*r;
+	uint64_t	pos, seq;
+	int64_t		dif;
+
+	pos = djbq_loadr(&q->head);
+
+	while (true) {
+		slot = &q->slots[pos & q->mask];
+		seq = djbq_load(&slot->seq);
+		dif = (int64_t)seq - (int64_t)(pos + 1);
+
+		if (dif == 0) {
+			/* Filled, try to claim it */
+			if (djbq_cas(&q->head, &pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* Nothing published here yet: empty */
+			return (NULL);
+		} else {
+			/* Another consumer got it, retry */
+			pos = djbq_loadr(&q->head);
+		}
+	}
+
+	r = slot->req;
+
+	/* Hand the slot back to the producers for the next round */
+	djbq_store(&slot->seq, pos + q->mask + 1);
+
+	return (r);
+}
+
+djb_req_t *
+djbq_pop(djbq_t *q) {
+	djb_req_t	*r;
+	uint32_t	ps;
+#ifdef _LINUX
+	struct timespec	ts;
+#endif
+
+	while (true) {
+		r = djbq_trypop(q);
+		if (r != NULL) {
+			return (r);
+		}
+
+		if (!thread_keep_running()) {
+			return (NULL);
+		}
+
+		/* Announce that we are going to sleep */
+		ps = __atomic_load_n(&q->park_seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&q->parked, 1, __ATOMIC_SEQ_CST);
+
+		/* A producer might have slipped in before it saw us */
+		r = djbq_trypop(q);
+		if (r != NULL) {
+			__atomic_sub_fetch(&q->parked, 1, __ATOMIC_SEQ_CST);
+			return (r);
+		}
+
+#ifdef _LINUX
+		ts.tv_sec = DJBQ_PARK_MS / 1000;
+		ts.tv_nsec = (DJBQ_PARK_MS % 1000) * 1000 * 1000;
+
+		/* Only sleeps when nobody pushed since we read park_seq */
+		syscall(SYS_futex, &q->park_seq, FUTEX_WAIT_PRIVATE,
+			ps, &ts, NULL, 0);
+#else
+		mutex_lock(q->park_mutex);
+		if (__atomic_load_n(&q->park_seq, __ATOMIC_SEQ_CST) == ps) {
+			cond_wait(q->park_cond, q->park_mutex, DJBQ_PARK_MS);
+		}
+		mutex_unlock(q->park_mutex);
+#endif
+
+		__atomic_sub_fetch(&q->parked, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Pop the head, but only when 'pred' agrees
+ *
+ * The predicate sees the request before it is ours: a concurrent
+ * consumer might take (and release) it meanwhile, in which case our
+ * claim fails. It thus may only read from it, and only what stays
+ * readable once released (requests are slab objects).
+ */
+djb_req_t *
+djbq_trypop_if(djbq_t *q, djbq_pred_f pred) {
+	djbq_slot_t	*slot;
+	djb_req_t	*r;
+	uint64_t	pos, seq;
+	int64_t		dif;
+
+	pos = djbq_loadr(&q->head);
+
+	while (true) {
+		slot = &q->slots[pos & q->mask];
+		seq = djbq_load(&slot->seq);
+		dif = (int64_t)seq - (int64_t)(pos + 1);
+
+		if (dif == 0) {
+			r = slot->req;
+			if (!pred(r)) {
+				return (NULL);
+			}
+
+			/* Filled, try to claim it */
+			if (djbq_cas(&q->head, &pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* Nothing published here yet: empty */
+			return (NULL);
+		} else {
+			/* Another consumer got it, retry */
+			pos = djbq_loadr(&q->head);
+		}
+	}
+
+	/* Hand the slot back to the producers for the next round */
+	djbq_store(&slot->seq, pos + q->mask + 1);
+
+	return (r);
+}
+
+void
+djbq_wakeall(djbq_t *q) {
+	djbq_wake(q, true);
+}
+
+unsigned int
+djbq_depth(djbq_t *q) {
+	uint64_t head, tail;
+
+	/*
+	 * The matchmaker pushes to one queue and then looks at the depth
+	 * of the other; without a full fence both sides can miss each
+	 * other's push and leave a request and a puller waiting
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+
+	return (tail > head ? (unsigned int)(tail - head) : 0);
+}
+
+unsigned int
+djbq_list(djbq_t *q, djbq_list_f cb, void *cbdata) {
+	djbq_slot_t	*slot;
+	uint64_t	pos, tail, seq, id, reqid;
+	unsigned int	cnt = 0;
+	char		host[DJBQ_HOST_LEN], request[DJBQ_REQUEST_LEN];
+
+	pos = djbq_load(&q->head);
+	tail = djbq_load(&q->tail);
+
+	for (; pos < tail; pos++) {
+		slot = &q->slots[pos & q->mask];
+
+		/* Only published entries that are still at this position */
+		if (djbq_load(&slot->seq) != pos + 1) {
+			continue;
+		}
+
+		id = djbq_loadr(&slot->id);
+		reqid = djbq_loadr(&slot->reqid);
+		djbq_str_get(slot->host, sizeof host, host);
+		djbq_str_get(slot->request, sizeof request, request);
+
+		/* Consumed while we were copying? */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq = djbq_loadr(&slot->seq);
+		if (seq != pos + 1) {
+			continue;
+		}
+
+		cb(cbdata, id, reqid, host, request);
+		cnt++;
+	}
+
+	return (cnt);
+}
@@ -180,32 +180,24 @@ rdv_gen_request_aux(httpsrv_client_t *hcl, const char *server, bool secure) {
 	}
 }
 
-static void
+static bool
 rdv_gen_request(httpsrv_client_t *hcl);
-static void
+static bool
 rdv_gen_request(httpsrv_client_t *hcl) {
 	json_error_t	error;
 	json_t		*root;
 	const char	*server = NULL;
 	bool		secure = false;
+	bool		ret;
 
 	if (hcl->method != HTTP_M_POST) {
 		djb_error(hcl, 400, "gen_request requires a POST");
-		return;
+		return (false);
 	}
 
 	/* No body yet? Then allocate some memory to get it */
-	if (hcl->readbody == NULL) {
-		if (hcl->headers.content_length == 0) {
-			djb_error(hcl, 400, "gen_request requires length");
-			return;
-		}
-
-		if (httpsrv_readbody_alloc(hcl, 2, 0) < 0) {
-			log_dbg("httpsrv_readbody_alloc() failed");
-		}
-
-		return;
+	if (!djb_body_need(hcl, 2, "gen_request", &ret)) {
+		return (ret);
 	}
 
 	log_dbg("data: %s", hcl->readbody);
@@ -215,7 +207,7 @@ rdv_gen_request(httpsrv_client_t *hcl) {
 
 	if (root == NULL) {
 		log_dbg("JSON load failed");
-		return;
+		return (false);
 
 	} else if (json_is_object(root)) {
 		json_t *server_val, *secure_val;
@@ -244,6 +236,8 @@ rdv_gen_request(httpsrv_client_t *hcl) {
 	}
 
 	json_decref(root);
+
+	return (false);
 }
 
 static const char onion_names[5][10] = {
@@ -272,9 +266,9 @@ rdv_make_image_response(const char *path, int onion_type) {
 			path, rdv_onion_name(onion_type)));
 }
 
-static void
+static bool
 rdv_image(httpsrv_client_t *hcl);
-static void
+static bool
 rdv_image(httpsrv_client_t *hcl) {
 	const char	*response = NULL;
 	char		*image_path = NULL,
@@ -283,26 +277,18 @@ rdv_image(httpsrv_client_t *hcl) {
 			*onion = NULL;
 	size_t		encrypted_onion_sz = 0;
 	int		retcode = DEFIANT_OK;
+	bool		ret;
 
 	if (hcl->method != HTTP_M_POST) {
 		djb_error(hcl, 400, "gen_request requires a POST");
-		return;
+		return (false);
 	}
 
 	log_dbg("readbody: %s", yesno(hcl->readbody == NULL));
 
 	/* No body yet? Then allocate some memory to get it */
-	if (hcl->readbody == NULL) {
-		if (hcl->headers.content_length == 0) {
-			djb_error(hcl, 400, "image requires length");
-			return;
-		}
-
-		if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
-			log_dbg("httpsrv_readbody_alloc() failed");
-		}
-
-		return;
+	if (!djb_body_need(hcl, 0, "image", &ret)) {
+		return (ret);
 	}
 
 	retcode = extract_n_save(l_password, hcl->readbody, hcl->readbody_off,
@@ -379,6 +365,8 @@ rdv_image(httpsrv_client_t *hcl) {
 	if (encrypted_onion != NULL) {
 		free(encrypted_onion);
 	}
+
+	return (false);
 }
 
 static const char *
@@ -692,31 +680,24 @@ rdv_peel_signed(void) {
   return (rdv_make_peel_response("", r));
 }
 
-static void
+static bool
 rdv_peel(httpsrv_client_t *hcl);
-static void
+static bool
 rdv_peel(httpsrv_client_t *hcl) {
 	const char	*response = NULL;
 	json_error_t	error;
 	json_t		*root;
 	int		otype;
+	bool		ret;
 
 	if (hcl->method != HTTP_M_POST) {
 		djb_error(hcl, 400, "peel requires a POST");
-		return;
+		return (false);
 	}
 
 	/* No body yet? Then allocate some memory to get it */
-	if (hcl->readbody == NULL) {
-		if (hcl->headers.content_length == 0) {
-			djb_error(hcl, 400, "peel requires length");
-			return;
-		}
-
-		if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
-			log_dbg("httpsrv_readbody_alloc() failed");
-		}
-		return;
+	if (!djb_body_need(hcl, 0, "peel", &ret)) {
+		return (ret);
 	}
 
 	log_dbg("readbody: %s", hcl->readbody);
@@ -777,6 +758,8 @@ rdv_peel(httpsrv_client_t *hcl) {
 	}
 
 	json_decref(root);
+
+	return (false);
 }
 
 static void
@@ -799,7 +782,8 @@ rdv_file(httpsrv_client_t *hcl, const char *file) {
 }
 
 /* Called from djb */
-void
+/* Returns true when the request is parked (see djb_body_need()) */
+bool
 rdv_handle(httpsrv_client_t *hcl) {
 	const char	*query;
 
@@ -809,16 +793,20 @@ rdv_handle(httpsrv_client_t *hcl) {
 	log_dbg("query = %s", query);
 
 	if (strcasecmp(query, "reset") == 0) {
+		djbm_inc(DJBM_RDV_RESET);
 		rdv_reset(hcl);
 
 	} else if (strcasecmp(query, "gen_request") == 0) {
-		rdv_gen_request(hcl);
+		djbm_inc(DJBM_RDV_GEN_REQUEST);
+		return (rdv_gen_request(hcl));
 
 	} else if (strcasecmp(query, "image") == 0) {
-		rdv_image(hcl);
+		djbm_inc(DJBM_RDV_IMAGE);
+		return (rdv_image(hcl));
 
 	} else if (strcasecmp(query, "peel") == 0) {
-		rdv_peel(hcl);
+		djbm_inc(DJBM_RDV_PEEL);
+		return (rdv_peel(hcl));
 
 	} else if (strncasecmp(query, "file/", 5) == 0) {
 		rdv_file(hcl, &query[4]);
@@ -826,5 +814,7 @@ rdv_handle(httpsrv_client_t *hcl) {
 	} else {
 		djb_error(hcl, 400, "No such DJB API request (Rendezvous)");
 	}
+
+	return (false);
 }
 
@@ -0,0 +1,334 @@
+#include "djb.h"
+
+#include <ctype.h>
+#include <arpa/inet.h>
+
+/*
+ * Request routing
+ *
+ * Every request is either for our API (its Host is one of ours) or to
+ * be proxied (anything else). Proxy requests are the bulk of the work,
+ * thus the set of our own host:port names is a hash table that is
+ * collision free by construction: deciding takes one probe and at most
+ * one string compare.
+ *
+ * API requests are dispatched on the first segment of their path
+ * ("/pull/..." -> "pull") with a fixed hash over its length, first and
+ * last character. The hash is perfect for the routes djb has, which
+ * djbr_init() verifies, thus a lookup also is one probe and a compare.
+ * A route added later that collides makes startup fail loudly; then
+ * adjust djbr_route_hash().
+ */
+
+/* Room in the self set, it grows (up to the max) until collision free */
+#define DJBR_SELF_MIN		8
+#define DJBR_SELF_MAX		256
+
+/* Names of the loopback interface, always ours */
+static const char *djbr_loopback[] = {
+	"localhost",
+	"127.0.0.1",
+	"[::1]",
+	NULL
+};
+
+static const char **l_self = NULL;
+static unsigned int l_self_size = 0;	/* Slots, 2^n */
+
+static unsigned int
+djbr_route_hash(const char *seg, size_t len);
+static unsigned int
+djbr_route_hash(const char *seg, size_t len) {
+	unsigned int first = 0, last = 0;
+
+	if (len > 0) {
+		first = tolower((unsigned char)seg[0]);
+		last = tolower((unsigned char)seg[len - 1]);
+	}
+
+	return ((len + first + (3 * last)) & (DJBR_SLOTS - 1));
+}
+
+/* The first segment of a path: after the leading '/', up to the next */
+static const char *
+djbr_segment(const char *path, size_t *len);
+static const char *
+djbr_segment(const char *path, size_t *len) {
+	if (*path == '/') {
+		path++;
+	}
+
+	*len = strcspn(path, "/?");
+
+	return (path);
+}
+
+bool
+djbr_init(djbr_table_t *t, const djbr_route_t *routes) {
+	const char	*seg;
+	size_t		len;
+	unsigned int	h;
+
+	memzero(t, sizeof *t);
+
+	for (; routes->path != NULL; routes++) {
+		seg = djbr_segment(routes->path, &len);
+		h = djbr_route_hash(seg, len);
+
+		if (t->slot[h] != NULL) {
+			log_crt("Route %s collides with %s, "
+				"adjust djbr_route_hash()",
+				routes->path, t->slot[h]->path);
+			return (false);
+		}
+
+		t->slot[h] = routes;
+	}
+
+	return (true);
+}
+
+const djbr_route_t *
+djbr_find(djbr_table_t *t, const char *uri) {
+	const djbr_route_t	*r;
+	const char		*seg;
+	size_t			len;
+
+	seg = djbr_segment(uri, &len);
+	r = t->slot[djbr_route_hash(seg, len)];
+
+	if (r == NULL) {
+		return (NULL);
+	}
+
+	if (r->exact ? strcasecmp(uri, r->path) != 0 :
+		       strncasecmp(uri, r->path, r->len) != 0) {
+		return (NULL);
+	}
+
+	return (r);
+}
+
+/* FNV-1a, case insensitive as host names are */
+static uint32_t
+djbr_host_hash(const char *s);
+static uint32_t
+djbr_host_hash(const char *s) {
+	uint32_t h = 2166136261U;
+
+	for (; *s != '\0'; s++) {
+		h ^= (uint32_t)tolower((unsigned char)*s);
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+bool
+djbr_is_self(const char *hostname) {
+	const char *s;
+
+	if (l_self == NULL) {
+		return (false);
+	}
+
+	s = l_self[djbr_host_hash(hostname) & (l_self_size - 1)];
+
+	return (s != NULL && strcasecmp(s, hostname) == 0);
+}
+
+/* Place all names in a table of 'size' slots; false on a collision */
+static bool
+djbr_self_place(const char **names, unsigned int count, unsigned int size);
+static bool
+djbr_self_place(const char **names, unsigned int count, unsigned int size) {
+	const char	**tbl;
+	unsigned int	i, h;
+
+	tbl = mcalloc(size * sizeof *tbl, "djbr_self");
+	if (tbl == NULL) {
+		return (false);
+	}
+
+	for (i = 0; i < count; i++) {
+		h = djbr_host_hash(names[i]) & (size - 1);
+		if (tbl[h] != NULL) {
+			mfree(tbl, size * sizeof *tbl, "djbr_self");
+			return (false);
+		}
+
+		tbl[h] = names[i];
+	}
+
+	l_self = tbl;
+	l_self_size = size;
+
+	return (true);
+}
+
+bool
+djbr_self_init(const char *host, unsigned int port) {
+	const char	*names[lengthof(djbr_loopback)];
+	unsigned int	i, n = 0, size;
+	bool		ok = true;
+
+	djbr_exit();
+
+	/* Our loopback names, and the name we listen on */
+	for (i = 0; djbr_loopback[i] != NULL; i++) {
+		names[n++] = aprintf("%s:%u", djbr_loopback[i], port);
+	}
+
+	names[n++] = aprintf(strchr(host, ':') != NULL ? "[%s]:%u" : "%s:%u",
+			     host, port);
+
+	for (i = 0; i < n; i++) {
+		if (names[i] == NULL) {
+			log_crt("No memory for host names");
+			ok = false;
+		}
+	}
+
+	/* That one may well be a loopback one already */
+	for (i = 0; ok && i < n - 1; i++) {
+		if (strcasecmp(names[i], names[n - 1]) == 0) {
+			aprintf_free(names[--n]);
+			break;
+		}
+	}
+
+	for (size = DJBR_SELF_MIN; ok && size <= DJBR_SELF_MAX; size *= 2) {
+		if (djbr_self_place(names, n, size)) {
+			return (true);
+		}
+	}
+
+	if (ok) {
+		log_crt("Could not build the set of our host names");
+	}
+
+	for (i = 0; i < n; i++) {
+		if (names[i] != NULL) {
+			aprintf_free(names[i]);
+		}
+	}
+
+	return (false);
+}
+
+bool
+djbr_listen_parse(const char *addr, char *host, size_t size,
+		  unsigned int *port) {
+	const char	*h = addr, *p;
+	size_t		len;
+	char		*end;
+	unsigned long	v;
+
+	/* [v6 address]:port or host:port */
+	if (*addr == '[') {
+		h = addr + 1;
+		p = strchr(h, ']');
+		if (p == NULL || p[1] != ':') {
+			return (false);
+		}
+		len = p - h;
+		p += 2;
+	} else {
+		p = strrchr(addr, ':');
+		if (p == NULL) {
+			return (false);
+		}
+		len = p - h;
+		p++;
+	}
+
+	if (len == 0 || len >= size) {
+		return (false);
+	}
+
+	v = strtoul(p, &end, 10);
+	if (*p == '\0' || *end != '\0' || v == 0 || v > 65535) {
+		return (false);
+	}
+
+	memcpy(host, h, len);
+	host[len] = '\0';
+	*port = (unsigned int)v;
+
+	return (true);
+}
+
+/* Only reachable from this host: localhost, 127/8 or ::1 */
+bool
+djbr_is_loopback(const char *host) {
+	struct in_addr	a4;
+	struct in6_addr	a6;
+
+	if (strcasecmp(host, "localhost") == 0) {
+		return (true);
+	}
+
+	if (inet_pton(AF_INET, host, &a4) == 1) {
+		return ((ntohl(a4.s_addr) >> 24) == 127);
+	}
+
+	if (inet_pton(AF_INET6, host, &a6) == 1) {
+		return (IN6_IS_ADDR_LOOPBACK(&a6));
+	}
+
+	return (false);
+}
+
+/*
+ * The host:port a local client (StegoTorus) connects to, for the host
+ * we listen on; a wildcard one is reached over loopback
+ */
+bool
+djbr_listen_addr(const char *host, unsigned int port, char *buf,
+		 size_t size) {
+	int r;
+
+	if (strcmp(host, "0.0.0.0") == 0 ||
+	    strcasecmp(host, "localhost") == 0) {
+		host = "127.0.0.1";
+	} else if (strcmp(host, "::") == 0) {
+		host = "::1";
+	}
+
+	r = snprintf(buf, size, strchr(host, ':') != NULL ?
+		     "[%s]:%u" : "%s:%u", host, port);
+
+	return (snprintfok(r, size));
+}
+
+unsigned int
+djbr_self_list(const char **names, unsigned int max) {
+	unsigned int i, n = 0;
+
+	for (i = 0; i < l_self_size && n < max; i++) {
+		if (l_self[i] != NULL) {
+			names[n++] = l_self[i];
+		}
+	}
+
+	return (n);
+}
+
+void
+djbr_exit(void) {
+	unsigned int i;
+
+	if (l_self == NULL) {
+		return;
+	}
+
+	for (i = 0; i < l_self_size; i++) {
+		if (l_self[i] != NULL) {
+			aprintf_free(l_self[i]);
+		}
+	}
+
+	mfree(l_self, l_self_size * sizeof *l_self, "djbr_self");
+	l_self = NULL;
+	l_self_size = 0;
+}
@@ -0,0 +1,230 @@
+#include "djb.h"
+
+/*
+ * Slab pools for fixed size objects
+ *
+ * Objects are carved out of slabs of DJBS_SLAB_OBJS objects and never
+ * returned to the system until djbs_exit(). Every thread keeps a small
+ * cache of free objects per pool, thus the common alloc/free pair does
+ * not take a lock and hands out memory that is likely still in cache.
+ * Caches exchange objects with the pool in batches of DJBS_BATCH.
+ *
+ * Objects can be freed on a different thread than they were allocated
+ * on; they then simply move to that thread's cache. A thread that ends
+ * gives its caches back with djbs_thread_exit(), else what they hold
+ * would be lost to the pools.
+ */
+
+#define DJBS_POOLS	4
+#define DJBS_SLAB_OBJS	64
+#define DJBS_BATCH	32
+#define DJBS_CACHE_MAX	(DJBS_BATCH * 2)
+
+typedef struct djbs_obj {
+	struct djbs_obj		*next;
+} djbs_obj_t;
+
+typedef struct djbs_slab {
+	struct djbs_slab	*next;
+	size_t			len;		/* Bytes allocated */
+} djbs_slab_t;
+
+struct djbs_pool {
+	mutex_t			mutex;
+	const char		*desc;
+	size_t			size;		/* Object size, aligned */
+	djbs_obj_t		*free;		/* Shared free objects */
+	djbs_slab_t		*slabs;
+	unsigned int		total;		/* Objects in all slabs */
+	unsigned int		inuse;		/* Handed out (atomic) */
+};
+
+typedef struct {
+	djbs_obj_t		*free;
+	unsigned int		count;
+} djbs_cache_t;
+
+static djbs_pool_t	l_pools[DJBS_POOLS];
+static unsigned int	l_npools = 0;
+
+/* Per-thread caches, indexed like l_pools */
+static __thread djbs_cache_t l_cache[DJBS_POOLS];
+
+djbs_pool_t *
+djbs_create(const char *desc, size_t size) {
+	djbs_pool_t *p;
+
+	if (l_npools >= DJBS_POOLS) {
+		log_crt("Too many slab pools (%s)", desc);
+		return (NULL);
+	}
+
+	p = &l_pools[l_npools++];
+	memzero(p, sizeof *p);
+
+	mutex_init(p->mutex);
+	p->desc = desc;
+
+	/* Room for the free list link and aligned for anything */
+	if (size < sizeof (djbs_obj_t)) {
+		size = sizeof (djbs_obj_t);
+	}
+	p->size = (size + 15) & ~((size_t)15);
+
+	return (p);
+}
+
+void
+djbs_exit(void) {
+	djbs_pool_t	*p;
+	djbs_slab_t	*s;
+	unsigned int	i;
+
+	for (i = 0; i < l_npools; i++) {
+		p = &l_pools[i];
+
+		while ((s = p->slabs) != NULL) {
+			p->slabs = s->next;
+			mfree(s, s->len, p->desc);
+		}
+
+		mutex_destroy(p->mutex);
+	}
+
+	l_npools = 0;
+}
+
+/* Pool lock held */
+static bool
+djbs_grow(djbs_pool_t *p);
+static bool
+djbs_grow(djbs_pool_t *p) {
+	djbs_slab_t	*s;
+	djbs_obj_t	*o;
+	size_t		hdr, len;
+	unsigned int	i;
+
+	hdr = (sizeof *s + 15) & ~((size_t)15);
+	len = hdr + (p->size * DJBS_SLAB_OBJS);
+
+	s = mcalloc(len, p->desc);
+	if (s == NULL) {
+		return (false);
+	}
+
+	s->len = len;
+	s->next = p->slabs;
+	p->slabs = s;
+
+	for (i = 0; i < DJBS_SLAB_OBJS; i++) {
+		o = (djbs_obj_t *)((char *)s + hdr + (p->size * i));
+		o->next = p->free;
+		p->free = o;
+	}
+
+	__atomic_add_fetch(&p->total, DJBS_SLAB_OBJS, __ATOMIC_RELAXED);
+
+	return (true);
+}
+
+void *
+djbs_alloc(djbs_pool_t *p) {
+	djbs_cache_t	*c = &l_cache[p - l_pools];
+	djbs_obj_t	*o;
+
+	/* Empty cache: take a batch from the pool */
+	if (c->free == NULL) {
+		mutex_lock(p->mutex);
+
+		if (p->free == NULL && !djbs_grow(p)) {
+			mutex_unlock(p->mutex);
+			log_crt("No memory for %s", p->desc);
+			return (NULL);
+		}
+
+		while (p->free != NULL && c->count < DJBS_BATCH) {
+			o = p->free;
+			p->free = o->next;
+			o->next = c->free;
+			c->free = o;
+			c->count++;
+		}
+
+		mutex_unlock(p->mutex);
+	}
+
+	o = c->free;
+	c->free = o->next;
+	c->count--;
+
+	__atomic_add_fetch(&p->inuse, 1, __ATOMIC_RELAXED);
+
+	memzero(o, p->size);
+	return (o);
+}
+
+void
+djbs_free(djbs_pool_t *p, void *obj) {
+	djbs_cache_t	*c = &l_cache[p - l_pools];
+	djbs_obj_t	*o = (djbs_obj_t *)obj;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	__atomic_sub_fetch(&p->inuse, 1, __ATOMIC_RELAXED);
+
+	o->next = c->free;
+	c->free = o;
+	c->count++;
+
+	if (c->count <= DJBS_CACHE_MAX) {
+		return;
+	}
+
+	/* Too many cached here: give a batch back to the pool */
+	mutex_lock(p->mutex);
+	while (c->count > DJBS_CACHE_MAX - DJBS_BATCH) {
+		o = c->free;
+		c->free = o->next;
+		c->count--;
+		o->next = p->free;
+		p->free = o;
+	}
+	mutex_unlock(p->mutex);
+}
+
+/* The calling thread ends: its cached objects go back to the pools */
+void
+djbs_thread_exit(void) {
+	djbs_pool_t	*p;
+	djbs_cache_t	*c;
+	djbs_obj_t	*o;
+	unsigned int	i;
+
+	for (i = 0; i < l_npools; i++) {
+		p = &l_pools[i];
+		c = &l_cache[i];
+
+		if (c->free == NULL) {
+			continue;
+		}
+
+		mutex_lock(p->mutex);
+		while ((o = c->free) != NULL) {
+			c->free = o->next;
+			o->next = p->free;
+			p->free = o;
+		}
+		c->count = 0;
+		mutex_unlock(p->mutex);
+	}
+}
+
+void
+djbs_stats(djbs_pool_t *p, unsigned int *inuse, unsigned int *total,
+	   size_t *size) {
+	*inuse = __atomic_load_n(&p->inuse, __ATOMIC_RELAXED);
+	*total = __atomic_load_n(&p->total, __ATOMIC_RELAXED);
+	*size = p->size;
+}
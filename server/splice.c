@@ -0,0 +1,728 @@
+#include "djb.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifdef _LINUX
+#include <fcntl.h>
+#endif
+
+/*
+ * Zero-copy socket to socket transfer
+ *
+ * The bytes go from the source socket into a pipe and from the pipe
+ * into the destination socket with splice(), thus they never get
+ * copied into userspace. Every thread keeps its own pipe.
+ *
+ * When splice() is not possible (no pipe, not supported for these
+ * descriptors, not Linux) the transfer is done with a plain read/write
+ * loop instead, so that callers never have to undo anything.
+ *
+ * The sockets are non-blocking (they belong to the connection set),
+ * thus we poll() for them when they are not ready. That can take long,
+ * thus relays between two clients, and the decoding of chunked request
+ * bodies, run on threads of their own, see djb_relay_start().
+ */
+
+/* Largest chunk per splice() call (default pipe capacity) */
+#define DJB_SPLICE_CHUNK	(64 * 1024)
+
+/* Give up when a side does not move for this long */
+#define DJB_SPLICE_WAIT_MS	30000
+
+static bool
+djb_splice_wait(int fd, short events);
+static bool
+djb_splice_wait(int fd, short events) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, DJB_SPLICE_WAIT_MS) <= 0) {
+		log_wrn("splice: fd %d not ready in time", fd);
+		return (false);
+	}
+
+	return ((pfd.revents & (POLLERR | POLLNVAL)) == 0);
+}
+
+/* The buffered way */
+static uint64_t
+djb_splice_copy(int in, int out, uint64_t len);
+static uint64_t
+djb_splice_copy(int in, int out, uint64_t len) {
+	char		buf[16 * 1024];
+	uint64_t	moved = 0;
+	size_t		have = 0, off = 0;
+	ssize_t		n;
+
+	while (moved < len) {
+		if (have == 0) {
+			n = read(in, buf, len - moved < sizeof buf ?
+					  len - moved : sizeof buf);
+			if (n == 0) {
+				log_wrn("copy: EOF after %" PRIu64
+					" of %" PRIu64 " bytes", moved, len);
+				break;
+			}
+
+			if (n < 0) {
+				if (errno == EAGAIN &&
+				    djb_splice_wait(in, POLLIN)) {
+					continue;
+				}
+
+				log_wrn("copy: read failed: %s",
+					strerror(errno));
+				break;
+			}
+
+			have = n;
+			off = 0;
+		}
+
+		n = write(out, &buf[off], have);
+		if (n < 0) {
+			if (errno == EAGAIN &&
+			    djb_splice_wait(out, POLLOUT)) {
+				continue;
+			}
+
+			log_wrn("copy: write failed: %s", strerror(errno));
+			break;
+		}
+
+		have -= n;
+		off += n;
+		moved += n;
+	}
+
+	return (moved);
+}
+
+#ifdef _LINUX
+static __thread int l_pipe[2] = { -1, -1 };
+
+static bool
+djb_splice_pipe(void);
+static bool
+djb_splice_pipe(void) {
+	if (l_pipe[0] != -1) {
+		return (true);
+	}
+
+	if (pipe2(l_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		log_wrn("Could not create splice pipe: %s", strerror(errno));
+		l_pipe[0] = l_pipe[1] = -1;
+		return (false);
+	}
+
+	return (true);
+}
+
+/* Returns -1 when nothing could be spliced at all */
+static int64_t
+djb_splice_pipe_move(int in, int out, uint64_t len);
+static int64_t
+djb_splice_pipe_move(int in, int out, uint64_t len) {
+	uint64_t	moved = 0;
+	size_t		inpipe = 0;
+	ssize_t		n;
+
+	if (!djb_splice_pipe()) {
+		return (-1);
+	}
+
+	while (moved < len) {
+		/* Fill the pipe */
+		if (inpipe == 0) {
+			n = splice(in, NULL, l_pipe[1], NULL,
+				   len - moved < DJB_SPLICE_CHUNK ?
+					len - moved : DJB_SPLICE_CHUNK,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+				   SPLICE_F_MORE);
+
+			if (n == 0) {
+				log_wrn("splice: EOF after %" PRIu64
+					" of %" PRIu64 " bytes", moved, len);
+				break;
+			}
+
+			if (n < 0) {
+				if (errno == EAGAIN) {
+					if (!djb_splice_wait(in, POLLIN)) {
+						break;
+					}
+					continue;
+				}
+
+				/* Not possible for these fds at all? */
+				if (moved == 0 &&
+				    (errno == EINVAL || errno == ENOSYS)) {
+					return (-1);
+				}
+
+				log_wrn("splice: in failed: %s",
+					strerror(errno));
+				break;
+			}
+
+			inpipe = n;
+		}
+
+		/* Drain it into the destination */
+		n = splice(l_pipe[0], NULL, out, NULL, inpipe,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+			   (moved + inpipe < len ? SPLICE_F_MORE : 0));
+
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				if (!djb_splice_wait(out, POLLOUT)) {
+					break;
+				}
+				continue;
+			}
+
+			log_wrn("splice: out failed: %s", strerror(errno));
+			break;
+		}
+
+		inpipe -= n;
+		moved += n;
+	}
+
+	/* Leftovers would end up in the next transfer */
+	if (inpipe > 0) {
+		close(l_pipe[0]);
+		close(l_pipe[1]);
+		l_pipe[0] = l_pipe[1] = -1;
+	}
+
+	return ((int64_t)moved);
+}
+#endif
+
+uint64_t
+djb_splice(int in, int out, uint64_t len, uint64_t *spliced) {
+#ifdef _LINUX
+	int64_t moved;
+
+	moved = djb_splice_pipe_move(in, out, len);
+	if (moved >= 0) {
+		*spliced = moved;
+		return (moved);
+	}
+#endif
+
+	/* Not possible here, copy it */
+	*spliced = 0;
+	return (djb_splice_copy(in, out, len));
+}
+
+/*
+ * Chunked bodies (Transfer-Encoding: chunked)
+ *
+ * The framing is parsed only to find where the body ends, so that we
+ * never read into the next request on the connection. A relay passes
+ * everything on as-is (the other side gets a chunked body as well) and
+ * as soon as it arrives, the chunk data itself goes through
+ * djb_splice(). What httpsrv read along with the headers is taken from
+ * the connection first.
+ */
+
+/* Longest chunk-size or trailer line we accept */
+#define DJB_CHUNK_LINE	1024
+
+typedef struct {
+	conn_t		*conn;
+	int		fd;
+	int		out;		/* Relay to, -1 when decoding */
+	char		*body;		/* Decoded body (when decoding) */
+	size_t		body_len;
+	size_t		body_size;	/* Allocated */
+	size_t		body_max;
+	uint64_t	bytes;		/* Total bytes relayed */
+	uint64_t	spliced;	/* Of which zero-copy */
+} djb_chunk_t;
+
+static ssize_t
+djb_chunk_read(djb_chunk_t *c, char *buf, size_t len);
+static ssize_t
+djb_chunk_read(djb_chunk_t *c, char *buf, size_t len) {
+	ssize_t n;
+
+	/* What httpsrv has buffered already goes first */
+	n = conn_take(c->conn, buf, len);
+	if (n > 0) {
+		return (n);
+	}
+
+	while ((n = read(c->fd, buf, len)) < 0) {
+		if (errno != EAGAIN || !djb_splice_wait(c->fd, POLLIN)) {
+			log_wrn("chunked: read failed: %s", strerror(errno));
+			return (-1);
+		}
+	}
+
+	if (n == 0) {
+		log_wrn("chunked: EOF inside body");
+		return (-1);
+	}
+
+	return (n);
+}
+
+static bool
+djb_chunk_write(djb_chunk_t *c, const char *buf, size_t len);
+static bool
+djb_chunk_write(djb_chunk_t *c, const char *buf, size_t len) {
+	ssize_t n;
+
+	if (c->out == -1) {
+		return (true);
+	}
+
+	while (len > 0) {
+		n = write(c->out, buf, len);
+		if (n < 0) {
+			if (errno == EAGAIN &&
+			    djb_splice_wait(c->out, POLLOUT)) {
+				continue;
+			}
+
+			log_wrn("chunked: write failed: %s", strerror(errno));
+			return (false);
+		}
+
+		buf += n;
+		len -= n;
+		c->bytes += n;
+	}
+
+	return (true);
+}
+
+/*
+ * Read up to and including the next LF, but not beyond: the line ends
+ * where the next thing starts. Thus peek at the socket first and take
+ * only what belongs to the line; returns the bytes taken, -1 on error.
+ */
+static ssize_t
+djb_chunk_peekline(djb_chunk_t *c, char *buf, size_t len);
+static ssize_t
+djb_chunk_peekline(djb_chunk_t *c, char *buf, size_t len) {
+	const char	*lf;
+	ssize_t		n;
+
+	/* What httpsrv buffered is in memory already, byte by byte it is */
+	if (conn_pending(c->conn) > 0) {
+		return (djb_chunk_read(c, buf, 1));
+	}
+
+	while ((n = recv(c->fd, buf, len, MSG_PEEK)) < 0) {
+		if (errno != EAGAIN || !djb_splice_wait(c->fd, POLLIN)) {
+			log_wrn("chunked: read failed: %s", strerror(errno));
+			return (-1);
+		}
+	}
+
+	if (n == 0) {
+		log_wrn("chunked: EOF inside body");
+		return (-1);
+	}
+
+	lf = memchr(buf, '\n', n);
+	if (lf != NULL) {
+		n = lf - buf + 1;
+	}
+
+	return (djb_chunk_read(c, buf, n));
+}
+
+/* One line, relayed; returns its length without the CRLF, -1 on error */
+static ssize_t
+djb_chunk_line(djb_chunk_t *c, char *line, size_t size);
+static ssize_t
+djb_chunk_line(djb_chunk_t *c, char *line, size_t size) {
+	size_t	len = 0;
+	ssize_t	n;
+
+	while (len == 0 || line[len - 1] != '\n') {
+		if (len >= size - 1) {
+			log_wrn("chunked: line too long");
+			return (-1);
+		}
+
+		n = djb_chunk_peekline(c, &line[len], size - 1 - len);
+		if (n <= 0) {
+			return (-1);
+		}
+
+		len += n;
+	}
+
+	if (!djb_chunk_write(c, line, len)) {
+		return (-1);
+	}
+
+	line[len] = '\0';
+
+	len--;
+	if (len > 0 && line[len - 1] == '\r') {
+		len--;
+	}
+
+	return (len);
+}
+
+static bool
+djb_chunk_data(djb_chunk_t *c, uint64_t len);
+static bool
+djb_chunk_data(djb_chunk_t *c, uint64_t len) {
+	char		buf[16 * 1024], *b;
+	uint64_t	moved, spliced;
+	size_t		size;
+	ssize_t		n;
+
+	/* Nothing buffered: straight from socket to socket */
+	if (c->out != -1 && conn_pending(c->conn) == 0) {
+		moved = djb_splice(c->fd, c->out, len, &spliced);
+		c->bytes += moved;
+		c->spliced += spliced;
+		return (moved == len);
+	}
+
+	if (c->out == -1) {
+		if (len > c->body_max - c->body_len) {
+			log_wrn("chunked: body exceeds %zu bytes",
+				c->body_max);
+			return (false);
+		}
+
+		/* Grow it, with room for a terminating NUL */
+		size = c->body_size;
+		while (size < c->body_len + len + 1) {
+			size = size == 0 ? 4096 : size * 2;
+		}
+
+		if (size != c->body_size) {
+			b = realloc(c->body, size);
+			if (b == NULL) {
+				log_wrn("chunked: no memory for %zu bytes",
+					size);
+				return (false);
+			}
+
+			c->body = b;
+			c->body_size = size;
+		}
+	}
+
+	while (len > 0) {
+		n = djb_chunk_read(c, buf, len < sizeof buf ? len : sizeof buf);
+		if (n < 0 || !djb_chunk_write(c, buf, n)) {
+			return (false);
+		}
+
+		if (c->out == -1) {
+			memcpy(&c->body[c->body_len], buf, n);
+			c->body_len += n;
+		}
+
+		len -= n;
+	}
+
+	return (true);
+}
+
+static bool
+djb_chunk_body(djb_chunk_t *c);
+static bool
+djb_chunk_body(djb_chunk_t *c) {
+	char		line[DJB_CHUNK_LINE], *end;
+	uint64_t	len;
+	ssize_t		n;
+
+	while (true) {
+		/* chunk-size [; extensions] */
+		if (djb_chunk_line(c, line, sizeof line) < 0) {
+			return (false);
+		}
+
+		errno = 0;
+		len = strtoull(line, &end, 16);
+		if (end == line || errno != 0 ||
+		    (*end != ';' && *end != '\r' && *end != '\n' &&
+		     *end != ' ' && *end != '\t')) {
+			log_wrn("chunked: bad chunk size");
+			return (false);
+		}
+
+		/* Last chunk, then trailers up to an empty line */
+		if (len == 0) {
+			while ((n = djb_chunk_line(c, line, sizeof line)) > 0);
+
+			return (n == 0);
+		}
+
+		if (!djb_chunk_data(c, len)) {
+			return (false);
+		}
+
+		/* The CRLF after the data */
+		if (djb_chunk_line(c, line, sizeof line) != 0) {
+			log_wrn("chunked: missing CRLF after chunk");
+			return (false);
+		}
+	}
+}
+
+bool
+djb_chunked_relay(conn_t *in, conn_t *out, uint64_t *bytes,
+		  uint64_t *spliced) {
+	djb_chunk_t	c;
+	bool		ok;
+
+	memzero(&c, sizeof c);
+	c.conn = in;
+	c.fd = conn_fd(in);
+	c.out = conn_fd(out);
+
+	ok = djb_chunk_body(&c);
+
+	*bytes = c.bytes;
+	*spliced = c.spliced;
+
+	return (ok);
+}
+
+char *
+djb_chunked_read(conn_t *in, size_t max, size_t *len) {
+	djb_chunk_t c;
+
+	memzero(&c, sizeof c);
+	c.conn = in;
+	c.fd = conn_fd(in);
+	c.out = -1;
+	c.body_max = max;
+
+	if (!djb_chunk_body(&c)) {
+		free(c.body);
+		return (NULL);
+	}
+
+	/* An empty body still gets its NUL */
+	if (c.body == NULL) {
+		c.body = malloc(1);
+		if (c.body == NULL) {
+			return (NULL);
+		}
+	}
+
+	c.body[c.body_len] = '\0';
+	*len = c.body_len;
+
+	return (c.body);
+}
+
+/* Read exactly len bytes of a body, for when it has to be had in full */
+bool
+djb_read_full(conn_t *in, char *buf, size_t len) {
+	djb_chunk_t	c;
+	ssize_t		n;
+
+	memzero(&c, sizeof c);
+	c.conn = in;
+	c.fd = conn_fd(in);
+	c.out = -1;
+
+	while (len > 0) {
+		n = djb_chunk_read(&c, buf, len);
+		if (n < 0) {
+			return (false);
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return (true);
+}
+
+/*
+ * Relay threads
+ *
+ * A relay blocks for as long as either side stalls, thus it must not run
+ * on a connection set thread, nor on whatever thread paired the two
+ * clients. djb_relay_start() queues it for one of these threads instead.
+ * Both clients are parked (keephandling) meanwhile, thus the relay
+ * thread owns them until the 'done' callback returns.
+ */
+
+/* How long an idle relay thread sleeps before re-checking */
+#define DJB_RELAY_PARK_MS	1000
+
+static mutex_t		l_relay_mutex;
+static cond_t		l_relay_cond;
+static djb_relay_t	*l_relay_head = NULL;
+static djb_relay_t	*l_relay_tail = NULL;
+static unsigned int	l_relay_queued = 0;
+static bool		l_relay_init = false;
+
+void
+djb_relay_start(djb_relay_t *r) {
+	r->next = NULL;
+
+	mutex_lock(l_relay_mutex);
+	if (l_relay_tail != NULL) {
+		l_relay_tail->next = r;
+	} else {
+		l_relay_head = r;
+	}
+	l_relay_tail = r;
+	l_relay_queued++;
+	mutex_unlock(l_relay_mutex);
+
+	cond_trigger(l_relay_cond);
+}
+
+unsigned int
+djb_relay_depth(void) {
+	unsigned int n;
+
+	mutex_lock(l_relay_mutex);
+	n = l_relay_queued;
+	mutex_unlock(l_relay_mutex);
+
+	return (n);
+}
+
+static djb_relay_t *
+djb_relay_next(void);
+static djb_relay_t *
+djb_relay_next(void) {
+	djb_relay_t *r;
+
+	mutex_lock(l_relay_mutex);
+	r = l_relay_head;
+	if (r == NULL) {
+		cond_wait(l_relay_cond, l_relay_mutex, DJB_RELAY_PARK_MS);
+		r = l_relay_head;
+	}
+
+	if (r != NULL) {
+		l_relay_head = r->next;
+		if (l_relay_head == NULL) {
+			l_relay_tail = NULL;
+		}
+		l_relay_queued--;
+	}
+	mutex_unlock(l_relay_mutex);
+
+	return (r);
+}
+
+static void
+djb_relay_run(djb_relay_t *r);
+static void
+djb_relay_run(djb_relay_t *r) {
+	size_t	len = 0;
+	bool	ok = false;
+
+	if (r->to == NULL && !r->chunked) {
+		/* Nothing to move, 'done' does the work on this thread */
+		ok = true;
+
+	} else if (r->to == NULL) {
+		/* Nowhere to: decode the chunked body into memory */
+		r->body = djb_chunked_read(&r->from->conn, r->len, &len);
+		r->moved = len;
+		ok = (r->body != NULL);
+
+	/* The headers have to be on the wire before the body */
+	} else if (!conn_flush(&r->to->conn)) {
+		log_wrn("relay: could not flush headers");
+	} else if (r->chunked) {
+		ok = djb_chunked_relay(&r->from->conn, &r->to->conn,
+				       &r->moved, &r->spliced);
+	} else {
+		r->moved = djb_splice(conn_fd(&r->from->conn),
+				      conn_fd(&r->to->conn),
+				      r->len, &r->spliced);
+		ok = (r->moved == r->len);
+	}
+
+	/* Might release r */
+	r->done(r, ok);
+}
+
+static void *
+djb_relay_thread(void UNUSED *arg);
+static void *
+djb_relay_thread(void UNUSED *arg) {
+	djb_relay_t *r;
+
+	log_dbg("...");
+
+	while (thread_keep_running()) {
+		thread_setmessage("Waiting");
+
+		r = djb_relay_next();
+		if (r == NULL) {
+			continue;
+		}
+
+		thread_setmessage("Relaying");
+		djb_relay_run(r);
+
+		/* Served another one */
+		thread_serve();
+	}
+
+	log_dbg("exit");
+
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+bool
+djb_relay_init(unsigned int threads) {
+	unsigned int i;
+
+	mutex_init(l_relay_mutex);
+	cond_init(l_relay_cond);
+	l_relay_init = true;
+
+	/* At least one, or nothing would ever move */
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (!thread_add("DJBRelay", &djb_relay_thread, NULL)) {
+			log_err("Could not create relay thread");
+			return (i > 0);
+		}
+	}
+
+	return (true);
+}
+
+/* Relay threads stopped already */
+void
+djb_relay_exit(void) {
+	if (!l_relay_init) {
+		return;
+	}
+
+	/* Never started: the clients are going away with the server */
+	l_relay_head = l_relay_tail = NULL;
+	l_relay_queued = 0;
+
+	cond_destroy(l_relay_cond);
+	mutex_destroy(l_relay_mutex);
+	l_relay_init = false;
+}
@@ -0,0 +1,250 @@
+#include "djb.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Hierarchical timer wheel
+ *
+ * DJBT_LEVELS wheels of DJBT_SLOTS slots each; level 0 has a slot per
+ * tick, every next level a slot per full turn of the level below it.
+ * A timer is put in the lowest level that can hold its deadline and
+ * moves down (cascades) when the level below wraps around, thus arming
+ * and cancelling are O(1) and a tick only touches the timers that are
+ * (nearly) due.
+ *
+ * One thread (djbt_thread) drives the wheel and runs the callbacks,
+ * without holding the wheel lock. djbt_cancel() waits for a callback
+ * that is running, so that the owner can release the memory the timer
+ * is embedded in as soon as it returns.
+ */
+
+#define DJBT_TICK_MS	100
+#define DJBT_BITS	6
+#define DJBT_SLOTS	(1 << DJBT_BITS)
+#define DJBT_MASK	(DJBT_SLOTS - 1)
+#define DJBT_LEVELS	4
+
+typedef struct {
+	mutex_t		mutex;
+	cond_t		done;			/* A callback finished */
+	uint64_t	now;			/* Current tick */
+	uint64_t	start;			/* Monotonic ms at tick 0 */
+	djbt_timer_t	*running;		/* Callback in progress */
+	pthread_t	runner;			/* Thread running it */
+	unsigned int	armed;			/* Timers in the wheel */
+	djbt_timer_t	*slots[DJBT_LEVELS][DJBT_SLOTS];
+} djbt_wheel_t;
+
+static djbt_wheel_t l_wheel;
+
+static uint64_t
+djbt_clock(void);
+static uint64_t
+djbt_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / (1000 * 1000)));
+}
+
+/* Wheel lock held */
+static void
+djbt_link(djbt_timer_t *t);
+static void
+djbt_link(djbt_timer_t *t) {
+	djbt_timer_t	**slot;
+	uint64_t	max;
+	unsigned int	lvl;
+
+	/* Too far out: clamp it to the end of the last level */
+	max = l_wheel.now +
+	      ((uint64_t)DJBT_MASK << (DJBT_BITS * (DJBT_LEVELS - 1)));
+	if (t->expires > max) {
+		t->expires = max;
+	}
+
+	/* The lowest level where it is less than a full turn away */
+	for (lvl = 0; lvl < DJBT_LEVELS - 1; lvl++) {
+		if ((t->expires >> (DJBT_BITS * lvl)) -
+		    (l_wheel.now >> (DJBT_BITS * lvl)) < DJBT_SLOTS) {
+			break;
+		}
+	}
+
+	slot = &l_wheel.slots[lvl][(t->expires >> (DJBT_BITS * lvl)) &
+				   DJBT_MASK];
+
+	t->next = *slot;
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+
+	l_wheel.armed++;
+}
+
+/* Wheel lock held */
+static void
+djbt_unlink(djbt_timer_t *t);
+static void
+djbt_unlink(djbt_timer_t *t) {
+	*t->pprev = t->next;
+	if (t->next != NULL) {
+		t->next->pprev = t->pprev;
+	}
+
+	t->next = NULL;
+	t->pprev = NULL;
+
+	l_wheel.armed--;
+}
+
+bool
+djbt_init(void) {
+	memzero(&l_wheel, sizeof l_wheel);
+
+	mutex_init(l_wheel.mutex);
+	cond_init(l_wheel.done);
+
+	l_wheel.start = djbt_clock();
+
+	return (true);
+}
+
+void
+djbt_exit(void) {
+	cond_destroy(l_wheel.done);
+	mutex_destroy(l_wheel.mutex);
+}
+
+void
+djbt_arm(djbt_timer_t *t, unsigned int ms, djbt_cb_f cb, void *data) {
+	mutex_lock(l_wheel.mutex);
+
+	if (t->pprev != NULL) {
+		djbt_unlink(t);
+	}
+
+	t->cb = cb;
+	t->data = data;
+
+	/* Never in the slot that is being run */
+	t->expires = l_wheel.now + 1 + (ms / DJBT_TICK_MS);
+
+	djbt_link(t);
+
+	mutex_unlock(l_wheel.mutex);
+}
+
+bool
+djbt_cancel(djbt_timer_t *t) {
+	bool armed = false;
+
+	mutex_lock(l_wheel.mutex);
+
+	if (t->pprev != NULL) {
+		djbt_unlink(t);
+		armed = true;
+	}
+
+	/* Firing right now? Wait for it, unless we are that callback */
+	while (l_wheel.running == t &&
+	       !pthread_equal(l_wheel.runner, pthread_self())) {
+		cond_wait(l_wheel.done, l_wheel.mutex, DJBT_TICK_MS);
+	}
+
+	mutex_unlock(l_wheel.mutex);
+
+	return (armed);
+}
+
+unsigned int
+djbt_armed(void) {
+	return (l_wheel.armed);
+}
+
+/* Wheel lock held; move the timers of one upper slot down */
+static void
+djbt_cascade(unsigned int lvl);
+static void
+djbt_cascade(unsigned int lvl) {
+	djbt_timer_t	*t, **slot;
+
+	slot = &l_wheel.slots[lvl][(l_wheel.now >> (DJBT_BITS * lvl)) &
+				   DJBT_MASK];
+
+	while ((t = *slot) != NULL) {
+		djbt_unlink(t);
+		djbt_link(t);
+	}
+}
+
+/* Wheel lock held; advance one tick and run what is due */
+static void
+djbt_tick(void);
+static void
+djbt_tick(void) {
+	djbt_timer_t	*t, **slot;
+	unsigned int	lvl;
+
+	l_wheel.now++;
+
+	/* Wrapped around? Then the next level comes down a slot */
+	for (lvl = 1; lvl < DJBT_LEVELS; lvl++) {
+		if ((l_wheel.now & (((uint64_t)1 << (DJBT_BITS * lvl)) - 1))
+		    != 0) {
+			break;
+		}
+
+		djbt_cascade(lvl);
+	}
+
+	slot = &l_wheel.slots[0][l_wheel.now & DJBT_MASK];
+
+	while ((t = *slot) != NULL) {
+		djbt_unlink(t);
+
+		l_wheel.running = t;
+		l_wheel.runner = pthread_self();
+
+		mutex_unlock(l_wheel.mutex);
+		t->cb(t->data);
+		mutex_lock(l_wheel.mutex);
+
+		/* t might be gone already, only compare it */
+		l_wheel.running = NULL;
+		cond_trigger(l_wheel.done);
+	}
+}
+
+void *
+djbt_thread(void UNUSED *arg) {
+	uint64_t target;
+
+	log_dbg("...");
+
+	while (thread_keep_running()) {
+		thread_setmessage("Waiting");
+
+		if (!thread_sleep(DJBT_TICK_MS)) {
+			break;
+		}
+
+		thread_setmessage("Ticking");
+
+		target = (djbt_clock() - l_wheel.start) / DJBT_TICK_MS;
+
+		/* Catch up on every tick, in case we overslept */
+		mutex_lock(l_wheel.mutex);
+		while (l_wheel.now < target) {
+			djbt_tick();
+		}
+		mutex_unlock(l_wheel.mutex);
+	}
+
+	log_dbg("exit");
+
+	return (NULL);
+}
@@ -0,0 +1,260 @@
+#include "djb.h"
+
+/*
+ * Request lifecycle tracing (/trace/)
+ *
+ * Every proxy request carries a djbx_rec_t in the djb_headers_t of its
+ * client connection, stamped with the monotonic clock as it passes the
+ * stages of djbx_stage_t. Once it is answered the record is committed
+ * to a ring of the last DJBX_RING requests.
+ *
+ * Writers claim a slot with one atomic add on the head and publish it
+ * with a per-slot sequence number (odd while being written), thus
+ * committing never blocks. Readers copy a slot and keep it only when
+ * the sequence did not change meanwhile.
+ *
+ * /trace/ returns the records as JSON, newest first. Filters go in the
+ * query string: 'n' (how many, default DJBX_DEFAULT), 'circuit' (only
+ * that circuit) and 'slowest' (order by total time, longest first).
+ */
+
+#define DJBX_RING	4096		/* 2^n */
+#define DJBX_DEFAULT	100
+
+typedef struct {
+	uint64_t	seq;		/* 2 * pos + 1 writing, + 2 written */
+	uint64_t	id, reqid;
+	uint64_t	circuit;
+	uint64_t	ts[DJBX_STAGES];
+} djbx_slot_t;
+
+static djbx_slot_t l_ring[DJBX_RING];
+static uint64_t l_head = 0;
+
+static const char *djbx_stages[DJBX_STAGES] = {
+	"accept",
+	"enqueue",
+	"pair",
+	"push",
+	"done"
+};
+
+uint64_t
+djbx_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+void
+djbx_mark(djbx_rec_t *r, djbx_stage_t s) {
+	r->ts[s] = djbx_now();
+}
+
+void
+djbx_commit(const djbx_rec_t *r) {
+	djbx_slot_t	*slot;
+	uint64_t	pos;
+	unsigned int	i;
+
+	pos = __atomic_fetch_add(&l_head, 1, __ATOMIC_RELAXED);
+	slot = &l_ring[pos & (DJBX_RING - 1)];
+
+	__atomic_store_n(&slot->seq, (2 * pos) + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&slot->id, r->id, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->reqid, r->reqid, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->circuit, r->circuit, __ATOMIC_RELAXED);
+	for (i = 0; i < DJBX_STAGES; i++) {
+		__atomic_store_n(&slot->ts[i], r->ts[i], __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&slot->seq, (2 * pos) + 2, __ATOMIC_RELEASE);
+}
+
+/* Copy the record at ring position pos; false when gone or in flux */
+static bool
+djbx_read(uint64_t pos, djbx_rec_t *r);
+static bool
+djbx_read(uint64_t pos, djbx_rec_t *r) {
+	djbx_slot_t	*slot = &l_ring[pos & (DJBX_RING - 1)];
+	unsigned int	i;
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (2 * pos) + 2) {
+		return (false);
+	}
+
+	r->id = __atomic_load_n(&slot->id, __ATOMIC_RELAXED);
+	r->reqid = __atomic_load_n(&slot->reqid, __ATOMIC_RELAXED);
+	r->circuit = __atomic_load_n(&slot->circuit, __ATOMIC_RELAXED);
+	for (i = 0; i < DJBX_STAGES; i++) {
+		r->ts[i] = __atomic_load_n(&slot->ts[i], __ATOMIC_RELAXED);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == (2 * pos) + 2);
+}
+
+/* From enqueue to the last stage it reached */
+static uint64_t
+djbx_total(const djbx_rec_t *r);
+static uint64_t
+djbx_total(const djbx_rec_t *r) {
+	unsigned int i;
+
+	for (i = DJBX_STAGES - 1; i > DJBX_ENQUEUE; i--) {
+		if (r->ts[i] != 0) {
+			return (r->ts[i] - r->ts[DJBX_ENQUEUE]);
+		}
+	}
+
+	return (0);
+}
+
+static int
+djbx_cmp_slowest(const void *a, const void *b);
+static int
+djbx_cmp_slowest(const void *a, const void *b) {
+	uint64_t ta = djbx_total((const djbx_rec_t *)a);
+	uint64_t tb = djbx_total((const djbx_rec_t *)b);
+
+	return (ta < tb ? 1 : ta > tb ? -1 : 0);
+}
+
+/* A numeric query parameter, def when absent */
+static uint64_t
+djbx_param(const char *query, const char *name, uint64_t def);
+static uint64_t
+djbx_param(const char *query, const char *name, uint64_t def) {
+	const char	*p;
+	size_t		len = strlen(name);
+
+	for (p = query; p != NULL && *p != '\0'; p = strchr(p, '&')) {
+		if (*p == '&' || *p == '?') {
+			p++;
+		}
+
+		if (strncmp(p, name, len) != 0) {
+			continue;
+		}
+
+		if (p[len] == '=') {
+			return (strtoull(&p[len + 1], NULL, 10));
+		}
+
+		/* A bare flag */
+		if (p[len] == '\0' || p[len] == '&') {
+			return (1);
+		}
+	}
+
+	return (def);
+}
+
+/* One record as JSON: the raw stamps and the time spent per stage */
+static json_t *
+djbx_json(const djbx_rec_t *r);
+static json_t *
+djbx_json(const djbx_rec_t *r) {
+	json_t		*o, *ts;
+	char		seqno[32];
+	unsigned int	i;
+
+	snprintf(seqno, sizeof seqno, "%09" PRIx64 "%09" PRIx64,
+		 r->id, r->reqid);
+
+	ts = json_object();
+	for (i = 0; ts != NULL && i < DJBX_STAGES; i++) {
+		json_object_set_new(ts, djbx_stages[i],
+				    json_integer((json_int_t)r->ts[i]));
+	}
+
+	o = json_pack("{s:s, s:I, s:o, s:I, s:I, s:I, s:I}",
+		"seqno", seqno,
+		"circuit", (json_int_t)r->circuit,
+		"ts", ts,
+		"queued", (json_int_t)(r->ts[DJBX_PAIR] != 0 ?
+			r->ts[DJBX_PAIR] - r->ts[DJBX_ENQUEUE] : 0),
+		"plugin", (json_int_t)(r->ts[DJBX_PUSH] != 0 ?
+			r->ts[DJBX_PUSH] - r->ts[DJBX_PAIR] : 0),
+		"forward", (json_int_t)(r->ts[DJBX_DONE] != 0 &&
+					r->ts[DJBX_PUSH] != 0 ?
+			r->ts[DJBX_DONE] - r->ts[DJBX_PUSH] : 0),
+		"total", (json_int_t)djbx_total(r));
+
+	return (o);
+}
+
+bool
+djbx_handle(httpsrv_client_t *hcl) {
+	djbx_rec_t	*recs;
+	json_t		*arr;
+	const char	*query;
+	char		*out;
+	uint64_t	head, pos, n, circuit;
+	unsigned int	cnt = 0, i;
+	bool		slowest;
+
+	query = strchr(hcl->headers.rawuri, '?');
+	n = djbx_param(query, "n", DJBX_DEFAULT);
+	circuit = djbx_param(query, "circuit", 0);
+	slowest = djbx_param(query, "slowest", 0) != 0;
+
+	recs = malloc(sizeof *recs * DJBX_RING);
+	if (recs == NULL) {
+		djb_error(hcl, 500, "Out of memory");
+		return (false);
+	}
+
+	/* Newest first, what is overwritten meanwhile is skipped */
+	head = __atomic_load_n(&l_head, __ATOMIC_ACQUIRE);
+	for (pos = head; pos > 0 && head - pos < DJBX_RING; pos--) {
+		if (!djbx_read(pos - 1, &recs[cnt])) {
+			continue;
+		}
+
+		if (circuit != 0 && recs[cnt].circuit != circuit) {
+			continue;
+		}
+
+		cnt++;
+
+		/* Only the slowest need all of them */
+		if (!slowest && cnt >= n) {
+			break;
+		}
+	}
+
+	if (slowest) {
+		qsort(recs, cnt, sizeof *recs, djbx_cmp_slowest);
+	}
+
+	arr = json_array();
+	for (i = 0; arr != NULL && i < cnt && i < n; i++) {
+		json_array_append_new(arr, djbx_json(&recs[i]));
+	}
+
+	free(recs);
+
+	out = arr != NULL ? json_dumps(arr, JSON_COMPACT) : NULL;
+	if (arr != NULL) {
+		json_decref(arr);
+	}
+
+	if (out == NULL) {
+		djb_error(hcl, 500, "Could not format trace");
+		return (false);
+	}
+
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_JSON);
+	httpsrv_expire(hcl, HTTPSRV_EXPIRE_FORCE);
+	conn_put(&hcl->conn, out);
+	free(out);
+
+	httpsrv_done(hcl);
+
+	return (false);
+}
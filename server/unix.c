@@ -0,0 +1,1138 @@
+#include "djb.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Unix domain socket listener (DJB_UNIX)
+ *
+ * StegoTorus normally reaches us over TCP on loopback, paying for the
+ * TCP stack and an ephemeral port per chop connection. When DJB_UNIX
+ * names a path, djb also listens there for the very same HTTP proxy
+ * requests. Only with DJB_UNIX_STEGOTORUS does prf_get_argv() hand
+ * StegoTorus "unix:<path>" as the JumpBox address, as that needs a
+ * StegoTorus that accepts those.
+ *
+ * With a libfutil that takes a listener of ours (httpsrv_start_fd(),
+ * DJB_HTTPSRV_FD, see the Makefile) the socket is just one more HTTP
+ * server with djb's handlers and DJB_UNIX_THREADS threads: its requests
+ * go through djb_handle_proxy() exactly like TCP ones.
+ *
+ * Otherwise the connections here are served by a fixed pool of
+ * threads of our own (DJB_UNIX_THREADS). The listener
+ * thread polls the idle connections, one with something to read goes
+ * to the pool, where a thread reads one request (StegoTorus does not
+ * pipeline). Each request becomes an internal proxy request, like
+ * the ACS ones, that djb_proxy_local() queues the way
+ * djb_handle_proxy() does for TCP ones; its answer comes back through
+ * djbu_answer(), which queues the connection for the pool again to
+ * write it out, so that a slow reader never holds up the thread that
+ * delivered it. Then the listener polls it again.
+ *
+ * A connection thus always is in exactly one place: polled, queued for
+ * the pool, on a pool thread or waiting for its answer. Only the one
+ * that has it touches it, apart from the references. Reads and writes
+ * that stall are given up, and a body is charged to the memory budget
+ * before it is read in.
+ *
+ * All requests of a connection share a fair queue flow and prefer the
+ * circuit that answered the previous one, as on a TCP connection.
+ */
+
+#define DJBU_BACKLOG		128
+
+static int l_fd = -1;
+static char *l_path = NULL;
+static bool l_stegotorus = false;	/* Hand StegoTorus the path */
+
+#ifdef DJB_HTTPSRV_FD
+static httpsrv_t *l_srv = NULL;		/* Serving l_fd */
+#else
+/* Counters (atomic) */
+static unsigned int l_conns = 0;	/* Connections open now */
+static uint64_t l_accepted = 0;		/* Connections accepted */
+static uint64_t l_requests = 0;		/* Requests queued */
+
+/* Connections at most, more are refused */
+#define DJBU_CONNS_MAX		1024
+
+/* How often a waiting thread checks whether it should stop */
+#define DJBU_POLL_MS		1000
+
+/* A request that stalls this long is given up, it holds a pool thread */
+#define DJBU_STALL_MS		30000
+
+/* Request line plus headers, and the largest body we take */
+#define DJBU_HDR_MAX		(16 * 1024)
+#define DJBU_BODY_MAX		(8 * 1024 * 1024)
+
+/* Fair queue flows of ours, apart from connection ids */
+#define DJBU_FLOW		(1ULL << 63)
+
+typedef struct djbu_conn djbu_conn_t;
+
+struct djbu_conn {
+	djbu_conn_t	*next;		/* Queued for the pool, or polled */
+	int		fd;		/* -1 once closed */
+	uint64_t	flow;		/* Fair queue flow */
+	uint32_t	circuit;	/* Circuit that answered last */
+	unsigned int	refs;		/* Connection + request (atomic) */
+
+	bool		answered;	/* out is what to write */
+	char		*out;		/* Answer to write, NULL: failed */
+	size_t		out_len;
+	bool		close;		/* Last request on it */
+
+	char		buf[DJBU_HDR_MAX];
+	size_t		off, len;	/* Unconsumed: buf[off..len) */
+};
+
+static httpsrv_t *l_hs = NULL;
+
+/* Connections for the pool, and back from it to be polled */
+static mutex_t		l_mutex;
+static cond_t		l_cond;
+static djbu_conn_t	*l_work_head = NULL;
+static djbu_conn_t	*l_work_tail = NULL;
+static djbu_conn_t	*l_back = NULL;
+static int		l_wake[2] = { -1, -1 };	/* Wakes the listener */
+static bool		l_init = false;
+
+/* Listener thread only: what it polls */
+static djbu_conn_t	*l_watch[DJBU_CONNS_MAX];
+static struct pollfd	l_pfd[2 + DJBU_CONNS_MAX];
+
+static void
+djbu_put(djbu_conn_t *c);
+static void
+djbu_put(djbu_conn_t *c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	free(c->out);
+	mfree(c, sizeof *c, "djbu_conn_t");
+}
+
+/* Done with it, no request of it is out */
+static void
+djbu_close(djbu_conn_t *c);
+static void
+djbu_close(djbu_conn_t *c) {
+	close(c->fd);
+	c->fd = -1;
+
+	djb_flow_forget(c->flow);
+
+	__atomic_sub_fetch(&l_conns, 1, __ATOMIC_RELAXED);
+	djbu_put(c);
+}
+
+/* Hand it to the pool: readable, or answered */
+static void
+djbu_queue(djbu_conn_t *c);
+static void
+djbu_queue(djbu_conn_t *c) {
+	c->next = NULL;
+
+	mutex_lock(l_mutex);
+	if (l_work_tail != NULL) {
+		l_work_tail->next = c;
+	} else {
+		l_work_head = c;
+	}
+	l_work_tail = c;
+	mutex_unlock(l_mutex);
+
+	cond_trigger(l_cond);
+}
+
+static djbu_conn_t *
+djbu_next(void);
+static djbu_conn_t *
+djbu_next(void) {
+	djbu_conn_t *c;
+
+	mutex_lock(l_mutex);
+	c = l_work_head;
+	if (c == NULL) {
+		cond_wait(l_cond, l_mutex, DJBU_POLL_MS);
+		c = l_work_head;
+	}
+
+	if (c != NULL) {
+		l_work_head = c->next;
+		if (l_work_head == NULL) {
+			l_work_tail = NULL;
+		}
+	}
+	mutex_unlock(l_mutex);
+
+	return (c);
+}
+
+/* Back to the listener, to wait for its next request */
+static void
+djbu_watch(djbu_conn_t *c);
+static void
+djbu_watch(djbu_conn_t *c) {
+	mutex_lock(l_mutex);
+	c->next = l_back;
+	l_back = c;
+	mutex_unlock(l_mutex);
+
+	/* Full means it is woken up already */
+	if (write(l_wake[1], "", 1) == -1 && errno != EAGAIN) {
+		log_wrn("unix: wake failed: %s", strerror(errno));
+	}
+}
+
+/* The complete HTTP answer, to be written as is; NULL without memory */
+static char *
+djbu_format(djb_answer_t *ans, size_t *len);
+static char *
+djbu_format(djb_answer_t *ans, size_t *len) {
+	const char	*hdr;
+	char		*out, retry[32] = "";
+	size_t		hlen;
+
+	/* Shed by djb: tell StegoTorus when to come back */
+	if (ans->httpcode == 503) {
+		snprintf(retry, sizeof retry, "Retry-After: %u\r\n",
+			 djb_retry_after());
+	}
+
+	hdr = aprintf("HTTP/1.1 %u %s\r\n"
+		      "%s%s%s"
+		      "%s%s%s"
+		      "%s"
+		      "Content-Length: %zu\r\n"
+		      "\r\n",
+		      ans->httpcode,
+		      ans->httptext != NULL ? ans->httptext : "Unknown",
+		      ans->content_type != NULL ? "Content-Type: " : "",
+		      ans->content_type != NULL ? ans->content_type : "",
+		      ans->content_type != NULL ? "\r\n" : "",
+		      ans->setcookie != NULL ? "Set-Cookie: " : "",
+		      ans->setcookie != NULL ? ans->setcookie : "",
+		      ans->setcookie != NULL ? "\r\n" : "",
+		      retry,
+		      ans->body_len);
+	if (hdr == NULL) {
+		return (NULL);
+	}
+
+	hlen = strlen(hdr);
+
+	out = malloc(hlen + ans->body_len);
+	if (out != NULL) {
+		memcpy(out, hdr, hlen);
+		if (ans->body_len > 0) {
+			memcpy(&out[hlen], ans->body, ans->body_len);
+		}
+		*len = hlen + ans->body_len;
+	}
+
+	aprintf_free(hdr);
+
+	return (out);
+}
+
+/* An answer of our own, the connection is closed after it */
+static void
+djbu_reply(djbu_conn_t *c, unsigned int code, const char *text);
+static void
+djbu_reply(djbu_conn_t *c, unsigned int code, const char *text) {
+	djb_answer_t ans;
+
+	memzero(&ans, sizeof ans);
+	ans.httpcode = code;
+	ans.httptext = text;
+
+	c->out = djbu_format(&ans, &c->out_len);
+	c->answered = true;
+	c->close = true;
+}
+
+/* Push callback of our internal requests (any thread) */
+static void
+djbu_answer(httpsrv_client_t *hcl, djb_answer_t *ans);
+static void
+djbu_answer(httpsrv_client_t *hcl, djb_answer_t *ans) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	djbu_conn_t	*c = dh->push_data;
+	size_t		len = 0;
+
+	/* Nobody else has the connection while its request is out */
+	c->out = djbu_format(ans, &len);
+	if (c->out == NULL) {
+		log_err("No memory for unix answer of " HCL_ID, hcl->id);
+	}
+
+	c->out_len = len;
+	c->answered = true;
+	c->circuit = __atomic_load_n(&dh->circuit, __ATOMIC_RELAXED);
+
+	httpsrv_client_destroy(hcl);
+
+	/* Written out by the pool */
+	djbu_queue(c);
+	djbu_put(c);
+}
+
+/* Wait for data; false on EOF, error or shutdown */
+static bool
+djbu_fill(djbu_conn_t *c, char *buf, size_t size, size_t *got);
+static bool
+djbu_fill(djbu_conn_t *c, char *buf, size_t size, size_t *got) {
+	struct pollfd	pfd;
+	ssize_t		n;
+	unsigned int	waited = 0;
+
+	while (thread_keep_running()) {
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, DJBU_POLL_MS) == 0) {
+			waited += DJBU_POLL_MS;
+			if (waited >= DJBU_STALL_MS) {
+				log_wrn("unix: connection stalled");
+				return (false);
+			}
+			continue;
+		}
+
+		n = read(c->fd, buf, size);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return (false);
+		}
+
+		*got = n;
+		return (true);
+	}
+
+	return (false);
+}
+
+/* The next line, without its CRLF; NULL on EOF, error or a long line */
+static char *
+djbu_line(djbu_conn_t *c);
+static char *
+djbu_line(djbu_conn_t *c) {
+	char	*line, *nl;
+	size_t	got;
+
+	for (;;) {
+		line = &c->buf[c->off];
+		nl = memchr(line, '\n', c->len - c->off);
+		if (nl != NULL) {
+			break;
+		}
+
+		/* Make room at the end */
+		if (c->off > 0) {
+			memmove(c->buf, line, c->len - c->off);
+			c->len -= c->off;
+			c->off = 0;
+		}
+
+		if (c->len == sizeof c->buf) {
+			log_wrn("unix: header line too long");
+			return (NULL);
+		}
+
+		if (!djbu_fill(c, &c->buf[c->len], sizeof c->buf - c->len,
+			       &got)) {
+			return (NULL);
+		}
+
+		c->len += got;
+	}
+
+	c->off = nl - c->buf + 1;
+
+	*nl = '\0';
+	if (nl > line && nl[-1] == '\r') {
+		nl[-1] = '\0';
+	}
+
+	return (line);
+}
+
+/* Exactly len bytes, what was buffered first */
+static bool
+djbu_read(djbu_conn_t *c, char *dst, size_t len);
+static bool
+djbu_read(djbu_conn_t *c, char *dst, size_t len) {
+	size_t n;
+
+	n = c->len - c->off;
+	if (n > len) {
+		n = len;
+	}
+
+	memcpy(dst, &c->buf[c->off], n);
+	c->off += n;
+
+	for (dst += n, len -= n; len > 0; dst += n, len -= n) {
+		if (!djbu_fill(c, dst, len, &n)) {
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/* All of it; false on error, shutdown or a reader that stalls */
+static bool
+djbu_write(int fd, const char *buf, size_t len);
+static bool
+djbu_write(int fd, const char *buf, size_t len) {
+	struct pollfd	pfd;
+	ssize_t		n;
+	unsigned int	waited = 0;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		/* Full: wait, in total at most DJBU_STALL_MS per answer */
+		if (n < 0 && errno == EAGAIN) {
+			if (!thread_keep_running() || waited >= DJBU_STALL_MS) {
+				log_wrn("unix: answer not taken, giving up");
+				return (false);
+			}
+
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+
+			if (poll(&pfd, 1, DJBU_POLL_MS) == 0) {
+				waited += DJBU_POLL_MS;
+			}
+			continue;
+		}
+
+		if (n <= 0) {
+			return (false);
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return (true);
+}
+
+/*
+ * A chunked body, decoded; NULL when malformed, too large (413) or
+ * over the memory budget (503). What it takes of the budget is added
+ * to 'held' as it goes, also when it fails.
+ */
+static char *
+djbu_chunked(djbu_conn_t *c, size_t *len, unsigned int *held,
+	     unsigned int *code);
+static char *
+djbu_chunked(djbu_conn_t *c, size_t *len, unsigned int *held,
+	     unsigned int *code) {
+	char		*body = NULL, *nb, *line, *end;
+	unsigned long	size;
+
+	*len = 0;
+
+	for (;;) {
+		line = djbu_line(c);
+		if (line == NULL) {
+			break;
+		}
+
+		size = strtoul(line, &end, 16);
+		if (end == line) {
+			break;
+		}
+
+		if (size > DJBU_BODY_MAX - *len) {
+			*code = 413;
+			break;
+		}
+
+		/* The last one: skip the trailers */
+		if (size == 0) {
+			while ((line = djbu_line(c)) != NULL && *line != '\0') {
+				/* Not interested */
+			}
+
+			if (line == NULL) {
+				break;
+			}
+
+			/* Callers want something to free, even when empty */
+			return (body != NULL ? body : malloc(1));
+		}
+
+		/* Charged before it is read, not after */
+		if (!djb_mem_reserve(size)) {
+			*code = 503;
+			break;
+		}
+		*held += size;
+
+		nb = realloc(body, *len + size);
+		if (nb == NULL) {
+			*code = 500;
+			break;
+		}
+		body = nb;
+
+		if (!djbu_read(c, &body[*len], size)) {
+			break;
+		}
+		*len += size;
+
+		/* The CRLF after the data */
+		line = djbu_line(c);
+		if (line == NULL || *line != '\0') {
+			break;
+		}
+	}
+
+	free(body);
+	return (NULL);
+}
+
+/* The value of a header line when it is 'name', NULL otherwise */
+static const char *
+djbu_value(const char *line, const char *name);
+static const char *
+djbu_value(const char *line, const char *name) {
+	size_t len = strlen(name);
+
+	if (strncasecmp(line, name, len) != 0 || line[len] != ':') {
+		return (NULL);
+	}
+
+	for (line += len + 1; *line == ' ' || *line == '\t'; line++) {
+		/* Skip leading whitespace */
+	}
+
+	return (line);
+}
+
+/* The request line: method and where it goes */
+static bool
+djbu_request_line(httpsrv_client_t *hcl, char *line);
+static bool
+djbu_request_line(httpsrv_client_t *hcl, char *line) {
+	char		*uri, *ver, *path;
+	size_t		len;
+
+	snprintf(hcl->the_request, sizeof hcl->the_request, "%s", line);
+
+	uri = strchr(line, ' ');
+	ver = strrchr(line, ' ');
+	if (uri == NULL || ver == uri || strncmp(ver, " HTTP/1.", 8) != 0) {
+		return (false);
+	}
+
+	*uri++ = '\0';
+	*ver = '\0';
+
+	if (strcmp(line, "GET") == 0) {
+		hcl->method = HTTP_M_GET;
+	} else if (strcmp(line, "POST") == 0) {
+		hcl->method = HTTP_M_POST;
+	} else if (strcmp(line, "PUT") == 0) {
+		hcl->method = HTTP_M_PUT;
+	} else if (strcmp(line, "HEAD") == 0) {
+		hcl->method = HTTP_M_HEAD;
+	} else {
+		return (false);
+	}
+
+	/* Proxy form: http://host/path */
+	if (strncasecmp(uri, "http://", 7) == 0) {
+		uri += 7;
+		path = strchr(uri, '/');
+		len = path != NULL ? (size_t)(path - uri) : strlen(uri);
+
+		if (len >= sizeof hcl->headers.hostname) {
+			return (false);
+		}
+
+		memcpy(hcl->headers.hostname, uri, len);
+		hcl->headers.hostname[len] = '\0';
+
+		if (path == NULL) {
+			strcpy(hcl->headers.rawuri, "/");
+			return (true);
+		}
+
+		uri = path;
+	}
+
+	if (*uri != '/' || strlen(uri) >= sizeof hcl->headers.rawuri) {
+		return (false);
+	}
+
+	strcpy(hcl->headers.rawuri, uri);
+
+	return (true);
+}
+
+/*
+ * The headers and the body, into hcl/dh. The body is charged to the
+ * memory budget before it is read; 'held' is what was taken of it,
+ * for the caller to give back, whatever the outcome.
+ */
+static bool
+djbu_request_rest(djbu_conn_t *c, httpsrv_client_t *hcl, djb_headers_t *dh,
+		  unsigned int *held, unsigned int *code);
+static bool
+djbu_request_rest(djbu_conn_t *c, httpsrv_client_t *hcl, djb_headers_t *dh,
+		  unsigned int *held, unsigned int *code) {
+	char		*line, *body = NULL;
+	const char	*v;
+	bool		chunked = false;
+	size_t		len;
+
+	*held = 0;
+	*code = 400;
+
+	while ((line = djbu_line(c)) != NULL && *line != '\0') {
+		if ((v = djbu_value(line, "Host")) != NULL) {
+			/* The proxy form of the URI takes precedence */
+			if (hcl->headers.hostname[0] == '\0') {
+				snprintf(hcl->headers.hostname,
+					 sizeof hcl->headers.hostname, "%s", v);
+			}
+		} else if ((v = djbu_value(line, "Content-Length")) != NULL) {
+			hcl->headers.content_length = strtoull(v, NULL, 10);
+		} else if ((v = djbu_value(line, "Content-Type")) != NULL) {
+			snprintf(hcl->headers.content_type,
+				 sizeof hcl->headers.content_type, "%s", v);
+		} else if ((v = djbu_value(line, "Transfer-Encoding")) != NULL) {
+			chunked = (strcasestr(v, "chunked") != NULL);
+		} else if ((v = djbu_value(line, "Connection")) != NULL) {
+			c->close = (strcasecmp(v, "close") == 0);
+		} else {
+			djb_header(hcl, dh, line);
+		}
+	}
+
+	if (line == NULL || hcl->headers.hostname[0] == '\0') {
+		return (false);
+	}
+
+	if (chunked) {
+		body = djbu_chunked(c, &len, held, code);
+		if (body == NULL) {
+			return (false);
+		}
+
+		hcl->headers.content_length = len;
+	} else if (hcl->headers.content_length > DJBU_BODY_MAX) {
+		*code = 413;
+		return (false);
+	} else if (hcl->headers.content_length > 0) {
+		/* Charged before it is read, not after */
+		if (!djb_mem_reserve(hcl->headers.content_length)) {
+			*code = 503;
+			return (false);
+		}
+		*held = hcl->headers.content_length;
+	}
+
+	/* Read the body completely, it goes inline to the plugin */
+	if (hcl->headers.content_length > 0) {
+		if (httpsrv_readbody_alloc(hcl, 0, 0) < 0) {
+			*code = 500;
+			free(body);
+			return (false);
+		}
+
+		if (body != NULL) {
+			memcpy(hcl->readbody, body, hcl->headers.content_length);
+		} else if (!djbu_read(c, hcl->readbody,
+				      hcl->headers.content_length)) {
+			return (false);
+		}
+
+		hcl->readbody_off = hcl->headers.content_length;
+	}
+
+	free(body);
+
+	return (true);
+}
+
+/*
+ * Read the next request and queue it; afterwards either it is out
+ * (sent, c is no longer ours) or c->out has the answer. False when the
+ * connection is done.
+ */
+static bool
+djbu_request(djbu_conn_t *c, bool *sent);
+static bool
+djbu_request(djbu_conn_t *c, bool *sent) {
+	httpsrv_client_t	*hcl;
+	djb_headers_t		*dh;
+	char			*line;
+	unsigned int		code, held;
+
+	*sent = false;
+
+	/* Empty lines between requests are fine */
+	while ((line = djbu_line(c)) != NULL && *line == '\0') {
+		/* Skip */
+	}
+
+	if (line == NULL) {
+		return (false);
+	}
+
+	hcl = httpsrv_newcl(l_hs);
+	if (hcl == NULL) {
+		djbu_reply(c, 503, "Service Unavailable");
+		return (true);
+	}
+
+	dh = djb_create_userdata(hcl);
+	if (dh == NULL) {
+		httpsrv_client_destroy(hcl);
+		djbu_reply(c, 503, "Service Unavailable");
+		return (true);
+	}
+
+	if (!djbu_request_line(hcl, line)) {
+		httpsrv_client_destroy(hcl);
+		djbu_reply(c, 400, "Bad Request");
+		return (true);
+	}
+
+	if (!djbu_request_rest(c, hcl, dh, &held, &code)) {
+		djb_mem_release(held);
+		httpsrv_client_destroy(hcl);
+		djbu_reply(c, code, code == 413 ? "Payload Too Large" :
+				    code == 500 ? "Internal Server Error" :
+				    code == 503 ? "Service Unavailable" :
+						  "Bad Request");
+		return (true);
+	}
+
+	/* Answered through djbu_answer(), it holds a reference */
+	dh->push = djbu_answer;
+	dh->push_data = c;
+	dh->flow = c->flow;
+	dh->circuit = c->circuit;
+
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l_requests, 1, __ATOMIC_RELAXED);
+
+	/* The request takes over the charge for its body */
+	djb_mem_release(held);
+
+	/* Refused (503) or not, djbu_answer() gets called, maybe already */
+	*sent = true;
+	djb_proxy_local(hcl, dh);
+
+	return (true);
+}
+
+/* Serve a connection that is readable or answered (pool thread) */
+static void
+djbu_serve(djbu_conn_t *c);
+static void
+djbu_serve(djbu_conn_t *c) {
+	char	*out;
+	bool	ok, sent;
+
+	for (;;) {
+		if (c->answered) {
+			out = c->out;
+			c->out = NULL;
+			c->answered = false;
+
+			if (out == NULL) {
+				break;
+			}
+
+			ok = djbu_write(c->fd, out, c->out_len);
+			free(out);
+
+			if (!ok || c->close) {
+				break;
+			}
+
+			/* Nothing buffered: wait for the next request */
+			if (c->off == c->len) {
+				djbu_watch(c);
+				return;
+			}
+		}
+
+		if (!thread_keep_running() || !djbu_request(c, &sent)) {
+			break;
+		}
+
+		/* Its answer brings it back */
+		if (sent) {
+			return;
+		}
+	}
+
+	djbu_close(c);
+}
+
+static void *
+djbu_worker(void UNUSED *arg);
+static void *
+djbu_worker(void UNUSED *arg) {
+	djbu_conn_t *c;
+
+	while (thread_keep_running()) {
+		thread_setmessage("Waiting");
+
+		c = djbu_next();
+		if (c == NULL) {
+			continue;
+		}
+
+		thread_setmessage("unix connection %" PRIu64,
+				  (uint64_t)(c->flow & ~DJBU_FLOW));
+		djbu_serve(c);
+
+		/* Served another one */
+		thread_serve();
+	}
+
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+/* A new connection, polled from now on; false when refused */
+static bool
+djbu_accept(uint64_t serial);
+static bool
+djbu_accept(uint64_t serial) {
+	djbu_conn_t	*c;
+	int		fd;
+
+	fd = accept(l_fd, NULL, NULL);
+	if (fd == -1) {
+		if (errno != EINTR && errno != EAGAIN) {
+			log_wrn("unix: accept failed: %s", strerror(errno));
+		}
+		return (false);
+	}
+
+	/* Not for StegoTorus or any other child; waits are poll()s */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	if (__atomic_load_n(&l_conns, __ATOMIC_RELAXED) >= DJBU_CONNS_MAX) {
+		log_wrn("unix: %u connections open, refusing another",
+			DJBU_CONNS_MAX);
+		close(fd);
+		return (false);
+	}
+
+	c = mcalloc(sizeof *c, "djbu_conn_t");
+	if (c == NULL) {
+		log_crt("No memory for unix connection");
+		close(fd);
+		return (false);
+	}
+
+	c->fd = fd;
+	c->flow = DJBU_FLOW | serial;
+	c->refs = 1;
+
+	__atomic_add_fetch(&l_accepted, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l_conns, 1, __ATOMIC_RELAXED);
+
+	djbu_watch(c);
+
+	return (true);
+}
+
+static void *
+djbu_thread(void UNUSED *arg);
+static void *
+djbu_thread(void UNUSED *arg) {
+	djbu_conn_t	*c, *back;
+	uint64_t	serial = 0;
+	unsigned int	n = 0, i, j;
+	char		drain[64];
+
+	while (thread_keep_running()) {
+		/* The ones the pool is done with for now */
+		mutex_lock(l_mutex);
+		back = l_back;
+		l_back = NULL;
+		mutex_unlock(l_mutex);
+
+		for (c = back; c != NULL; c = back) {
+			back = c->next;
+			l_watch[n++] = c;
+		}
+
+		l_pfd[0].fd = l_fd;
+		l_pfd[1].fd = l_wake[0];
+		for (i = 0; i < n; i++) {
+			l_pfd[2 + i].fd = l_watch[i]->fd;
+		}
+
+		for (i = 0; i < 2 + n; i++) {
+			l_pfd[i].events = POLLIN;
+			l_pfd[i].revents = 0;
+		}
+
+		/* Wake up now and then to notice a shutdown */
+		if (poll(l_pfd, 2 + n, DJBU_POLL_MS) <= 0) {
+			continue;
+		}
+
+		if (l_pfd[1].revents != 0) {
+			while (read(l_wake[0], drain, sizeof drain) > 0) {
+				/* Only the wakeup counts */
+			}
+		}
+
+		/* Readable, or gone: to the pool */
+		for (i = j = 0; i < n; i++) {
+			if (l_pfd[2 + i].revents != 0) {
+				djbu_queue(l_watch[i]);
+			} else {
+				l_watch[j++] = l_watch[i];
+			}
+		}
+		n = j;
+
+		if ((l_pfd[0].revents & POLLIN) && djbu_accept(serial + 1)) {
+			serial++;
+		}
+	}
+
+	/* The pool stops too, these never get another request */
+	mutex_lock(l_mutex);
+	back = l_back;
+	l_back = NULL;
+	mutex_unlock(l_mutex);
+
+	for (c = back; c != NULL; c = back) {
+		back = c->next;
+		l_watch[n++] = c;
+	}
+
+	for (i = 0; i < n; i++) {
+		djbu_close(l_watch[i]);
+	}
+
+	return (NULL);
+}
+
+#endif /* DJB_HTTPSRV_FD */
+
+bool
+djbu_init(httpsrv_t *hs, unsigned int threads, bool stegotorus) {
+	struct sockaddr_un	sun;
+	struct stat		st;
+	const char		*path;
+	unsigned int		i;
+
+	/* Only when asked for */
+	path = getenv("DJB_UNIX");
+	if (path == NULL || strlen(path) == 0) {
+		return (true);
+	}
+
+	if (strlen(path) >= sizeof sun.sun_path) {
+		log_err("DJB_UNIX path %s is too long", path);
+		return (false);
+	}
+
+	memzero(&sun, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	/* A socket left behind by a previous run, nothing else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	l_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (l_fd == -1) {
+		log_err("unix: socket failed: %s", strerror(errno));
+		return (false);
+	}
+
+	fcntl(l_fd, F_SETFD, FD_CLOEXEC);
+
+	/* Only for us (and StegoTorus, which runs as us) */
+	if (bind(l_fd, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+	    chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+	    listen(l_fd, DJBU_BACKLOG) == -1) {
+		log_err("unix: could not listen on %s: %s",
+			path, strerror(errno));
+		close(l_fd);
+		l_fd = -1;
+		return (false);
+	}
+
+	l_path = mstrdup(path, "djbu_path");
+	if (l_path == NULL) {
+		log_crt("No memory for unix socket path");
+		djbu_exit();
+		return (false);
+	}
+
+	/* At least one, or nothing would ever be served */
+	if (threads == 0) {
+		threads = 1;
+	}
+
+#ifdef DJB_HTTPSRV_FD
+	(void)hs;
+
+	/* httpsrv owns the socket from here on */
+	l_srv = (httpsrv_t *)mcalloc(sizeof *l_srv, "httpsrv_t");
+	if (l_srv == NULL) {
+		log_crt("No memory for unix HTTP server");
+		djbu_exit();
+		return (false);
+	}
+
+	if (!djb_serve_fd(l_srv, l_fd, threads)) {
+		log_err("unix: could not serve on %s", path);
+		mfree(l_srv, sizeof *l_srv, "httpsrv_t");
+		l_srv = NULL;
+		djbu_exit();
+		return (false);
+	}
+
+	i = threads;
+#else
+	l_hs = hs;
+
+	/* Non-blocking: a full pipe already wakes the listener */
+	if (pipe(l_wake) == -1) {
+		log_err("unix: pipe failed: %s", strerror(errno));
+		djbu_exit();
+		return (false);
+	}
+
+	for (i = 0; i < lengthof(l_wake); i++) {
+		fcntl(l_wake[i], F_SETFD, FD_CLOEXEC);
+		fcntl(l_wake[i], F_SETFL, O_NONBLOCK);
+	}
+
+	mutex_init(l_mutex);
+	cond_init(l_cond);
+	l_init = true;
+
+	/* Those started go with thread_stopall(), then djbu_exit() */
+	for (i = 0; i < threads; i++) {
+		if (!thread_add("DJBUnixPool", &djbu_worker, NULL)) {
+			log_err("Could not create unix pool thread");
+			break;
+		}
+	}
+
+	if (i == 0 || !thread_add("DJBUnix", &djbu_thread, NULL)) {
+		log_err("Could not create unix socket thread");
+		return (false);
+	}
+#endif
+
+	l_stegotorus = stegotorus;
+
+	log_inf("Listening on unix:%s (%u threads)%s", path, i,
+		stegotorus ? ", for StegoTorus" : "");
+
+	return (true);
+}
+
+/* The threads stopped already */
+void
+djbu_exit(void) {
+#ifdef DJB_HTTPSRV_FD
+	if (l_srv != NULL) {
+		/* Closes l_fd too, when it got that far */
+		httpsrv_exit(l_srv);
+		mfree(l_srv, sizeof *l_srv, "httpsrv_t");
+		l_srv = NULL;
+		l_fd = -1;
+	}
+#else
+	djbu_conn_t *c;
+
+	if (l_init) {
+		/* Never served again */
+		while ((c = l_work_head) != NULL) {
+			l_work_head = c->next;
+			djbu_close(c);
+		}
+		l_work_tail = NULL;
+
+		cond_destroy(l_cond);
+		mutex_destroy(l_mutex);
+		l_init = false;
+	}
+
+	if (l_wake[0] != -1) {
+		close(l_wake[0]);
+		close(l_wake[1]);
+		l_wake[0] = l_wake[1] = -1;
+	}
+#endif
+
+	l_stegotorus = false;
+
+	if (l_fd != -1) {
+		close(l_fd);
+		l_fd = -1;
+	}
+
+	if (l_path != NULL) {
+		unlink(l_path);
+		mfreestrdup(l_path, "djbu_path");
+		l_path = NULL;
+	}
+}
+
+const char *
+djbu_path(void) {
+	return (l_fd != -1 ? l_path : NULL);
+}
+
+/* Only when asked for (DJB_UNIX_STEGOTORUS), StegoTorus has to know it */
+const char *
+djbu_stegotorus_path(void) {
+	return (l_stegotorus ? djbu_path() : NULL);
+}
+
+/* False when httpsrv serves the socket: it keeps no numbers for us */
+bool
+djbu_stats(unsigned int *conns, uint64_t *accepted, uint64_t *requests) {
+#ifdef DJB_HTTPSRV_FD
+	*conns = 0;
+	*accepted = *requests = 0;
+	return (false);
+#else
+	*conns = __atomic_load_n(&l_conns, __ATOMIC_RELAXED);
+	*accepted = __atomic_load_n(&l_accepted, __ATOMIC_RELAXED);
+	*requests = __atomic_load_n(&l_requests, __ATOMIC_RELAXED);
+	return (true);
+#endif
+}
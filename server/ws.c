@@ -0,0 +1,871 @@
+#include "djb.h"
+
+#include <fcntl.h>
+#include <poll.h>
+
+/*
+ * WebSocket channel between the plugin and djb (RFC 6455)
+ *
+ * A circuit opens /ws/<circuit>/<window>/ once and then gets its
+ * requests and returns the answers as messages on that connection,
+ * instead of a /next/ (or /pull/ + /push/) round trip per request.
+ *
+ * Every message (binary frames) is:
+ *
+ *   u8 type		1 = request (djb -> plugin), 2 = response
+ *   u8 nfields
+ *   nfields times:	u8 id, u16 length (network order), the bytes
+ *   the body		everything that follows
+ *
+ * The fields carry what the DJB headers of a pull/push carry (see
+ * djbw_field_t); requests and responses are matched by the SeqNo.
+ *
+ * The channel keeps up to <window> requests in flight: it parks that
+ * many pullers at the start, and another one for every response that
+ * comes back (see djb_ws_open() and djb_ws_message()).
+ *
+ * Each channel has a thread of its own that reads the messages. The
+ * connection stays parked (keephandling) after the handshake, thus its
+ * connset neither reads nor closes it while the thread owns it; the
+ * thread hands it back with djb_hangup() and the connset closes it.
+ * Whichever thread pairs a request only queues its frame on the channel
+ * (under the channel mutex) and wakes the channel thread, which writes
+ * the queue out between reads, as far as the socket takes it. When the
+ * channel goes away, djb_close() of its connection reschedules what was
+ * outstanding on it.
+ */
+
+/* Largest message we accept */
+#define DJBW_MSG_MAX		(16 * 1024 * 1024)
+
+/* Requests in flight per channel, unless the URL says otherwise */
+#define DJBW_WINDOW		4
+#define DJBW_WINDOW_MAX		32
+
+/* How often a waiting reader checks whether it should stop */
+#define DJBW_POLL_MS		1000
+
+/* A channel is given up when the plugin does not read for this long */
+#define DJBW_WRITE_WAIT_MS	30000
+
+/* Frame opcodes */
+#define DJBW_OP_CONT		0x0
+#define DJBW_OP_TEXT		0x1
+#define DJBW_OP_BINARY		0x2
+#define DJBW_OP_CLOSE		0x8
+#define DJBW_OP_PING		0x9
+#define DJBW_OP_PONG		0xa
+
+static const char djbw_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/* A frame waiting to be written, 'off' bytes of it are */
+typedef struct djbw_out {
+	struct djbw_out		*next;
+	size_t			len;
+	size_t			off;		/* Channel thread only */
+	char			data[];
+} djbw_out_t;
+
+/* Counters (atomic) */
+static unsigned int l_open = 0;		/* Channels open now */
+static uint64_t l_opened = 0;		/* Channels opened */
+static uint64_t l_msgs_in = 0;		/* Responses received */
+static uint64_t l_msgs_out = 0;		/* Requests sent */
+
+/*
+ * SHA-1, only for the Sec-WebSocket-Accept of the handshake
+ */
+#define DJBW_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void
+djbw_sha1_block(uint32_t h[5], const uint8_t *p);
+static void
+djbw_sha1_block(uint32_t h[5], const uint8_t *p) {
+	uint32_t	w[80], a, b, c, d, e, f, k, t;
+	unsigned int	i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[i * 4] << 24) |
+		       ((uint32_t)p[i * 4 + 1] << 16) |
+		       ((uint32_t)p[i * 4 + 2] << 8) |
+		       (uint32_t)p[i * 4 + 3];
+	}
+
+	for (; i < 80; i++) {
+		t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+		w[i] = DJBW_ROL(t, 1);
+	}
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = DJBW_ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = DJBW_ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+static void
+djbw_sha1(const char *data, size_t len, uint8_t out[20]);
+static void
+djbw_sha1(const char *data, size_t len, uint8_t out[20]) {
+	uint32_t	h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+				 0x10325476, 0xc3d2e1f0 };
+	uint8_t		blk[64];
+	uint64_t	bits = (uint64_t)len * 8;
+	size_t		i, n;
+
+	for (i = 0; i + sizeof blk <= len; i += sizeof blk) {
+		djbw_sha1_block(h, (const uint8_t *)&data[i]);
+	}
+
+	/* The rest, a 1 bit, zeroes and the length in bits */
+	n = len - i;
+	memcpy(blk, &data[i], n);
+	blk[n++] = 0x80;
+
+	if (n > 56) {
+		memset(&blk[n], 0, sizeof blk - n);
+		djbw_sha1_block(h, blk);
+		n = 0;
+	}
+
+	memset(&blk[n], 0, 56 - n);
+	for (i = 0; i < 8; i++) {
+		blk[56 + i] = (uint8_t)(bits >> (56 - (i * 8)));
+	}
+	djbw_sha1_block(h, blk);
+
+	for (i = 0; i < 20; i++) {
+		out[i] = (uint8_t)(h[i / 4] >> (24 - ((i % 4) * 8)));
+	}
+}
+
+/* The Sec-WebSocket-Accept for a key (malloc'd) */
+static char *
+djbw_accept_key(const char *key);
+static char *
+djbw_accept_key(const char *key) {
+	char	buf[128];
+	uint8_t	digest[20];
+	int	len;
+
+	len = snprintf(buf, sizeof buf, "%s%s", key, djbw_guid);
+	if (len < 0 || (size_t)len >= sizeof buf) {
+		return (NULL);
+	}
+
+	djbw_sha1(buf, len, digest);
+
+	return (djb_base64_encode((const char *)digest, sizeof digest));
+}
+
+void
+djbw_get(djbw_t *ws) {
+	__atomic_add_fetch(&ws->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+djbw_put(djbw_t *ws) {
+	if (ws == NULL ||
+	    __atomic_sub_fetch(&ws->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	/* A native channel's client is ours (see nm.c) */
+	if (ws->native) {
+		httpsrv_client_destroy(ws->hcl);
+	} else {
+		if (ws->wake[0] != -1) {
+			close(ws->wake[0]);
+		}
+		if (ws->wake[1] != -1) {
+			close(ws->wake[1]);
+		}
+	}
+
+	mutex_destroy(ws->mutex);
+	mfree(ws, sizeof *ws, "djbw_t");
+}
+
+bool
+djbw_closed(djbw_t *ws) {
+	return (__atomic_load_n(&ws->closed, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Write what the socket takes of the queue (channel thread); 'pending'
+ * when some is left. False when the channel is broken: an error, or
+ * the plugin did not read for DJBW_WRITE_WAIT_MS.
+ */
+static bool
+djbw_flush(djbw_t *ws, bool *pending);
+static bool
+djbw_flush(djbw_t *ws, bool *pending) {
+	djbw_out_t	*o;
+	ssize_t		n;
+	uint64_t	since;
+
+	for (;;) {
+		mutex_lock(ws->mutex);
+		o = ws->out;
+		mutex_unlock(ws->mutex);
+
+		*pending = (o != NULL);
+		if (o == NULL) {
+			return (true);
+		}
+
+		n = write(ws->fd, &o->data[o->off], o->len - o->off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0 && errno == EAGAIN) {
+			since = __atomic_load_n(&ws->out_progress,
+						__ATOMIC_RELAXED);
+			if (djbx_now() - since <
+			    (uint64_t)DJBW_WRITE_WAIT_MS * 1000) {
+				return (true);
+			}
+
+			log_wrn("ws " HCL_ID " write stalled", ws->hcl_id);
+			return (false);
+		}
+
+		if (n <= 0) {
+			log_wrn("ws " HCL_ID " write failed: %s",
+				ws->hcl_id, n < 0 ? strerror(errno) : "EOF");
+			return (false);
+		}
+
+		__atomic_store_n(&ws->out_progress, djbx_now(),
+				 __ATOMIC_RELAXED);
+
+		o->off += n;
+		if (o->off < o->len) {
+			continue;
+		}
+
+		/* Done with it; writers only ever append */
+		mutex_lock(ws->mutex);
+		ws->out = o->next;
+		if (ws->out == NULL) {
+			ws->out_last = &ws->out;
+		}
+		mutex_unlock(ws->mutex);
+
+		free(o);
+	}
+}
+
+/*
+ * Queue one (unfragmented, unmasked) frame for the channel thread:
+ * 'hdr' and 'body' together form the payload. False when the channel
+ * is closed or there is no memory.
+ */
+static bool
+djbw_frame(djbw_t *ws, unsigned int op, const char *hdr, size_t hlen,
+	   const char *body, size_t blen);
+static bool
+djbw_frame(djbw_t *ws, unsigned int op, const char *hdr, size_t hlen,
+	   const char *body, size_t blen) {
+	djbw_out_t	*o;
+	char		*fh;
+	uint64_t	len = hlen + blen;
+	size_t		fl, i;
+	bool		ok, wake;
+
+	o = malloc(sizeof *o + 10 + len);
+	if (o == NULL) {
+		log_crt("No memory for a ws frame");
+		return (false);
+	}
+
+	fh = o->data;
+	fh[0] = (char)(0x80 | op);
+
+	if (len < 126) {
+		fh[1] = (char)len;
+		fl = 2;
+	} else if (len <= 0xffff) {
+		fh[1] = 126;
+		fh[2] = (char)(len >> 8);
+		fh[3] = (char)len;
+		fl = 4;
+	} else {
+		fh[1] = 127;
+		for (i = 0; i < 8; i++) {
+			fh[2 + i] = (char)(len >> (56 - (i * 8)));
+		}
+		fl = 10;
+	}
+
+	if (hlen > 0) {
+		memcpy(&o->data[fl], hdr, hlen);
+	}
+	if (blen > 0) {
+		memcpy(&o->data[fl + hlen], body, blen);
+	}
+
+	o->next = NULL;
+	o->len = fl + len;
+	o->off = 0;
+
+	mutex_lock(ws->mutex);
+	ok = !djbw_closed(ws);
+	wake = ok && ws->out == NULL;
+	if (ok) {
+		/* The plugin has to read from now on */
+		if (wake) {
+			__atomic_store_n(&ws->out_progress, djbx_now(),
+					 __ATOMIC_RELAXED);
+		}
+		*ws->out_last = o;
+		ws->out_last = &o->next;
+	}
+	mutex_unlock(ws->mutex);
+
+	if (!ok) {
+		free(o);
+		return (false);
+	}
+
+	/* It polls for writability itself while the queue is not empty */
+	if (wake && write(ws->wake[1], "w", 1) == -1 && errno != EAGAIN) {
+		log_wrn("ws " HCL_ID " wake failed: %s",
+			ws->hcl_id, strerror(errno));
+	}
+
+	return (true);
+}
+
+bool
+djbw_send(djbw_t *ws, djbw_msg_t *msg) {
+	char		*hdr;
+	size_t		hlen = 2, len, o;
+	unsigned int	i, n = 0;
+	bool		ok;
+
+	/* Not a WebSocket after all (see nm.c) */
+	if (ws->native) {
+		return (djbn_send(ws, msg));
+	}
+
+	for (i = 1; i < DJBW_FIELDS; i++) {
+		if (msg->field[i] == NULL) {
+			continue;
+		}
+
+		len = strlen(msg->field[i]);
+		if (len > 0xffff) {
+			log_wrn("ws " HCL_ID " field %u too long (%zu)",
+				ws->hcl_id, i, len);
+			return (false);
+		}
+
+		hlen += 3 + len;
+		n++;
+	}
+
+	hdr = malloc(hlen);
+	if (hdr == NULL) {
+		log_crt("No memory for a ws message");
+		return (false);
+	}
+
+	hdr[0] = (char)msg->type;
+	hdr[1] = (char)n;
+	o = 2;
+
+	for (i = 1; i < DJBW_FIELDS; i++) {
+		if (msg->field[i] == NULL) {
+			continue;
+		}
+
+		len = strlen(msg->field[i]);
+		hdr[o++] = (char)i;
+		hdr[o++] = (char)(len >> 8);
+		hdr[o++] = (char)len;
+		memcpy(&hdr[o], msg->field[i], len);
+		o += len;
+	}
+
+	ok = djbw_frame(ws, DJBW_OP_BINARY, hdr, hlen,
+			msg->body, msg->body_len);
+	free(hdr);
+
+	if (ok) {
+		__atomic_add_fetch(&l_msgs_out, 1, __ATOMIC_RELAXED);
+	}
+
+	return (ok);
+}
+
+/*
+ * Read exactly len bytes, writing out what gets queued meanwhile;
+ * false on EOF, error or shutdown
+ */
+static bool
+djbw_read(djbw_t *ws, void *buf, size_t len);
+static bool
+djbw_read(djbw_t *ws, void *buf, size_t len) {
+	struct pollfd	pfd[2];
+	char		*b = buf, drain[64];
+	ssize_t		n;
+	bool		pending;
+
+	while (len > 0) {
+		if (!djbw_flush(ws, &pending)) {
+			return (false);
+		}
+
+		/* What httpsrv has buffered already goes first */
+		n = conn_take(&ws->hcl->conn, b, len);
+		if (n <= 0) {
+			n = read(ws->fd, b, len);
+		}
+
+		if (n > 0) {
+			b += n;
+			len -= n;
+			continue;
+		}
+
+		if (n == 0) {
+			log_dbg("ws " HCL_ID " closed by the plugin",
+				ws->hcl_id);
+			return (false);
+		}
+
+		if (errno != EAGAIN && errno != EINTR) {
+			log_wrn("ws " HCL_ID " read failed: %s",
+				ws->hcl_id, strerror(errno));
+			return (false);
+		}
+
+		/* Wake up for frames, and now and then to notice a shutdown */
+		pfd[0].fd = ws->fd;
+		pfd[0].events = POLLIN | (pending ? POLLOUT : 0);
+		pfd[0].revents = 0;
+		pfd[1].fd = ws->wake[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if (poll(pfd, 2, DJBW_POLL_MS) > 0 &&
+		    (pfd[1].revents & POLLIN) != 0) {
+			while (read(ws->wake[0], drain, sizeof drain) > 0) {
+				/* Empty it */
+			}
+		}
+
+		if (!thread_keep_running() || djbw_closed(ws)) {
+			return (false);
+		}
+
+		/* Meanwhile, park the pullers that were refused again */
+		djb_ws_retry(ws);
+	}
+
+	return (true);
+}
+
+/* One frame header; the payload length and mask follow it */
+static bool
+djbw_frame_head(djbw_t *ws, unsigned int *op, bool *fin, uint64_t *len,
+		uint8_t mask[4]);
+static bool
+djbw_frame_head(djbw_t *ws, unsigned int *op, bool *fin, uint64_t *len,
+		uint8_t mask[4]) {
+	uint8_t		h[8];
+	unsigned int	i;
+
+	if (!djbw_read(ws, h, 2)) {
+		return (false);
+	}
+
+	*fin = (h[0] & 0x80) != 0;
+	*op = h[0] & 0x0f;
+	*len = h[1] & 0x7f;
+
+	/* What a client sends is always masked */
+	if ((h[1] & 0x80) == 0) {
+		log_wrn("ws " HCL_ID " unmasked frame", ws->hcl_id);
+		return (false);
+	}
+
+	if (*len == 126) {
+		if (!djbw_read(ws, h, 2)) {
+			return (false);
+		}
+		*len = ((uint64_t)h[0] << 8) | h[1];
+
+	} else if (*len == 127) {
+		if (!djbw_read(ws, h, 8)) {
+			return (false);
+		}
+		for (*len = 0, i = 0; i < 8; i++) {
+			*len = (*len << 8) | h[i];
+		}
+	}
+
+	return (djbw_read(ws, mask, 4));
+}
+
+static bool
+djbw_payload(djbw_t *ws, char *buf, uint64_t len, const uint8_t mask[4]);
+static bool
+djbw_payload(djbw_t *ws, char *buf, uint64_t len, const uint8_t mask[4]) {
+	uint64_t i;
+
+	if (!djbw_read(ws, buf, len)) {
+		return (false);
+	}
+
+	for (i = 0; i < len; i++) {
+		buf[i] ^= mask[i % 4];
+	}
+
+	return (true);
+}
+
+/*
+ * The next complete data message (malloc'd, *len bytes); control
+ * frames on the way are answered. NULL when the channel is done.
+ */
+static char *
+djbw_recv(djbw_t *ws, size_t *len);
+static char *
+djbw_recv(djbw_t *ws, size_t *len) {
+	char		*msg = NULL, *m, ctl[125];
+	size_t		mlen = 0;
+	uint64_t	plen;
+	uint8_t		mask[4];
+	unsigned int	op;
+	bool		fin;
+
+	while (djbw_frame_head(ws, &op, &fin, &plen, mask)) {
+		/* Control frames: short, never fragmented */
+		if (op >= DJBW_OP_CLOSE) {
+			if (!fin || plen > sizeof ctl ||
+			    !djbw_payload(ws, ctl, plen, mask)) {
+				break;
+			}
+
+			if (op == DJBW_OP_PING) {
+				djbw_frame(ws, DJBW_OP_PONG, ctl, plen, NULL, 0);
+				continue;
+			}
+
+			if (op == DJBW_OP_CLOSE) {
+				/* Echo the status code and be done */
+				djbw_frame(ws, DJBW_OP_CLOSE, ctl,
+					   plen >= 2 ? 2 : 0, NULL, 0);
+				break;
+			}
+
+			/* Pongs and the unknown are ignored */
+			continue;
+		}
+
+		/* A continuation needs a start, a start no message pending */
+		if ((op == DJBW_OP_CONT) != (msg != NULL) ||
+		    (op != DJBW_OP_CONT && op != DJBW_OP_TEXT &&
+		     op != DJBW_OP_BINARY)) {
+			log_wrn("ws " HCL_ID " unexpected frame %u",
+				ws->hcl_id, op);
+			break;
+		}
+
+		if (plen > DJBW_MSG_MAX - mlen) {
+			log_wrn("ws " HCL_ID " message exceeds %u bytes",
+				ws->hcl_id, DJBW_MSG_MAX);
+			break;
+		}
+
+		m = realloc(msg, mlen + plen + 1);
+		if (m == NULL) {
+			log_crt("No memory for a ws message");
+			break;
+		}
+		msg = m;
+
+		if (!djbw_payload(ws, &msg[mlen], plen, mask)) {
+			break;
+		}
+		mlen += plen;
+
+		if (fin) {
+			*len = mlen;
+			return (msg);
+		}
+	}
+
+	free(msg);
+	return (NULL);
+}
+
+/*
+ * Parse a message into its fields (NUL terminated, in 'scratch');
+ * the body points into buf
+ */
+static bool
+djbw_parse(char *buf, size_t len, djbw_msg_t *msg, char *scratch,
+	   size_t size);
+static bool
+djbw_parse(char *buf, size_t len, djbw_msg_t *msg, char *scratch,
+	   size_t size) {
+	size_t		o = 2, s = 0, flen;
+	unsigned int	i, n, id;
+
+	memzero(msg, sizeof *msg);
+
+	if (len < 2) {
+		return (false);
+	}
+
+	msg->type = (uint8_t)buf[0];
+	n = (uint8_t)buf[1];
+
+	for (i = 0; i < n; i++) {
+		if (len - o < 3) {
+			return (false);
+		}
+
+		id = (uint8_t)buf[o];
+		flen = ((size_t)(uint8_t)buf[o + 1] << 8) |
+		       (uint8_t)buf[o + 2];
+		o += 3;
+
+		if (len - o < flen || size - s < flen + 1) {
+			return (false);
+		}
+
+		/* Unknown fields are skipped */
+		if (id > 0 && id < DJBW_FIELDS) {
+			memcpy(&scratch[s], &buf[o], flen);
+			scratch[s + flen] = '\0';
+			msg->field[id] = &scratch[s];
+			s += flen + 1;
+		}
+
+		o += flen;
+	}
+
+	msg->body = &buf[o];
+	msg->body_len = len - o;
+
+	return (true);
+}
+
+static void *
+djbw_thread(void *arg);
+static void *
+djbw_thread(void *arg) {
+	djbw_t		*ws = (djbw_t *)arg;
+	djbw_msg_t	msg;
+	djbw_out_t	*out, *o;
+	char		*buf, scratch[DJB_HDR_MAX];
+	size_t		len;
+	bool		pending;
+
+	thread_setmessage("ws " HCL_ID " circuit %u",
+			  ws->hcl_id, ws->circuit);
+
+	/* Ready for the first requests */
+	djb_ws_open(ws);
+
+	while ((buf = djbw_recv(ws, &len)) != NULL) {
+		if (djbw_parse(buf, len, &msg, scratch, sizeof scratch)) {
+			__atomic_add_fetch(&l_msgs_in, 1, __ATOMIC_RELAXED);
+			djb_ws_message(ws, &msg);
+		} else {
+			log_wrn("ws " HCL_ID " malformed message",
+				ws->hcl_id);
+		}
+
+		free(buf);
+	}
+
+	log_dbg("ws " HCL_ID " done", ws->hcl_id);
+
+	/* What the socket still takes, the echoed close for one */
+	djbw_flush(ws, &pending);
+
+	/* Writers stop here, djb_close() reschedules what is outstanding */
+	mutex_lock(ws->mutex);
+	__atomic_store_n(&ws->closed, true, __ATOMIC_RELEASE);
+	out = ws->out;
+	ws->out = NULL;
+	ws->out_last = &ws->out;
+	mutex_unlock(ws->mutex);
+
+	while (out != NULL) {
+		o = out;
+		out = o->next;
+		free(o);
+	}
+
+	/* Its connset thread closes it */
+	djb_hangup(ws->hcl);
+
+	__atomic_sub_fetch(&l_open, 1, __ATOMIC_RELAXED);
+	djbw_put(ws);
+
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+/* The handshake is answered, the connection is ours from here */
+static void
+djbw_post(httpsrv_client_t *hcl);
+static void
+djbw_post(httpsrv_client_t *hcl) {
+	djb_headers_t	*dh = httpsrv_get_userdata(hcl);
+	djbw_t		*ws;
+	char		*accept;
+	unsigned int	circuit = 0, window = 0, i;
+
+	if (dh == NULL) {
+		djb_error(hcl, 500, "No state for connection");
+		return;
+	}
+
+	/* /ws/<circuit>/<window>/ */
+	sscanf(hcl->headers.uri, "/ws/%u/%u", &circuit, &window);
+	if (window == 0) {
+		window = DJBW_WINDOW;
+	} else if (window > DJBW_WINDOW_MAX) {
+		window = DJBW_WINDOW_MAX;
+	}
+
+	accept = djbw_accept_key(dh->wskey);
+	ws = mcalloc(sizeof *ws, "djbw_t");
+	if (accept == NULL || ws == NULL) {
+		free(accept);
+		if (ws != NULL) {
+			mfree(ws, sizeof *ws, "djbw_t");
+		}
+		djb_error(hcl, 500, "Out of memory");
+		return;
+	}
+
+	mutex_init(ws->mutex);
+	ws->out_last = &ws->out;
+	ws->wake[0] = ws->wake[1] = -1;
+	ws->hcl = hcl;
+	ws->hcl_id = hcl->id;
+	ws->fd = conn_fd(&hcl->conn);
+	ws->circuit = circuit;
+	ws->window = window;
+	ws->refs = 1;
+
+	httpsrv_answer(hcl, 101, "Switching Protocols", NULL);
+	conn_addheaderf(&hcl->conn, "Upgrade: websocket");
+	conn_addheaderf(&hcl->conn, "Connection: Upgrade");
+	conn_addheaderf(&hcl->conn, "Sec-WebSocket-Accept: %s", accept);
+	free(accept);
+
+	if (!conn_flush(&hcl->conn)) {
+		log_wrn("ws " HCL_ID " handshake failed", hcl->id);
+		djbw_put(ws);
+		httpsrv_close(hcl);
+		return;
+	}
+
+	/* Non-blocking: a full pipe already wakes the thread */
+	if (pipe(ws->wake) == -1) {
+		log_err("ws " HCL_ID " pipe failed: %s",
+			hcl->id, strerror(errno));
+		ws->wake[0] = ws->wake[1] = -1;
+		djbw_put(ws);
+		httpsrv_close(hcl);
+		return;
+	}
+
+	for (i = 0; i < lengthof(ws->wake); i++) {
+		fcntl(ws->wake[i], F_SETFD, FD_CLOEXEC);
+		fcntl(ws->wake[i], F_SETFL, O_NONBLOCK);
+	}
+
+	__atomic_add_fetch(&l_open, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&l_opened, 1, __ATOMIC_RELAXED);
+
+	if (!thread_add("DJBWebSocket", &djbw_thread, ws)) {
+		log_err("Could not create ws thread for " HCL_ID, hcl->id);
+		__atomic_sub_fetch(&l_open, 1, __ATOMIC_RELAXED);
+		djbw_put(ws);
+		httpsrv_close(hcl);
+		return;
+	}
+
+	log_inf("ws " HCL_ID " open for circuit %u, window %u",
+		hcl->id, circuit, window);
+}
+
+/* /ws/ API request: the WebSocket handshake */
+bool
+djbw_handle(httpsrv_client_t *hcl, djb_headers_t *dh) {
+	if (dh == NULL ||
+	    strcasecmp(dh->upgrade, "websocket") != 0 ||
+	    strlen(dh->wskey) == 0) {
+		/* The plugin falls back to pull/push */
+		djb_error(hcl, 400, "WebSocket upgrade required");
+		return (false);
+	}
+
+	if (strcmp(dh->wsversion, "13") != 0) {
+		httpsrv_answer(hcl, 426, "Upgrade Required", NULL);
+		conn_addheaderf(&hcl->conn, "Sec-WebSocket-Version: 13");
+		httpsrv_done(hcl);
+		return (false);
+	}
+
+	/* Like a pull, it is taken care of once the request is handled */
+	hcl->keephandling = true;
+	djb_posthandle(hcl, djbw_post);
+
+	return (true);
+}
+
+unsigned int
+djbw_open(void) {
+	return (__atomic_load_n(&l_open, __ATOMIC_RELAXED));
+}
+
+void
+djbw_stats(unsigned int *channels, uint64_t *opened, uint64_t *in,
+	   uint64_t *out) {
+	*channels = djbw_open();
+	*opened = __atomic_load_n(&l_opened, __ATOMIC_RELAXED);
+	*in = __atomic_load_n(&l_msgs_in, __ATOMIC_RELAXED);
+	*out = __atomic_load_n(&l_msgs_out, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,31 @@
+#ifndef TEST_H
+#define TEST_H 1
+
+/*
+ * Minimal unit test support
+ *
+ * Each test program includes the module it tests (thus its static
+ * functions are in reach too), checks with TEST_CHECK() and ends main()
+ * with TEST_DONE(), which makes it fail when any check did.
+ */
+
+#include <stdio.h>
+
+static unsigned int t_checks = 0;
+static unsigned int t_failed = 0;
+
+#define TEST_CHECK(cond)						\
+	do {								\
+		t_checks++;						\
+		if (!(cond)) {						\
+			t_failed++;					\
+			fprintf(stderr, "%s:%u: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+		}							\
+	} while (0)
+
+#define TEST_DONE(name)							\
+	(printf("* Test %-8s %u checks, %u failed\n",			\
+		name, t_checks, t_failed), t_failed == 0 ? 0 : 1)
+
+#endif /* TEST_H */
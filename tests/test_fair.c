@@ -0,0 +1,147 @@
+#include "../server/fair.c"
+#include "test.h"
+
+/* Tests of the fair queue (fair.c) */
+
+#define TF_REQS		64
+
+static djb_req_t	t_req[TF_REQS];
+
+typedef struct {
+	uint64_t	key;
+	unsigned int	depth;
+	uint64_t	bytes;
+	uint64_t	served;
+	bool		found;
+} t_flow_t;
+
+static void
+t_list_cb(void *cbdata, uint64_t key, unsigned int depth, uint64_t deficit,
+	  uint64_t bytes, uint64_t served);
+static void
+t_list_cb(void *cbdata, uint64_t key, unsigned int depth,
+	  uint64_t UNUSED deficit, uint64_t bytes, uint64_t served) {
+	t_flow_t *fl = (t_flow_t *)cbdata;
+
+	if (key != fl->key) {
+		return;
+	}
+
+	fl->found = true;
+	fl->depth = depth;
+	fl->bytes = bytes;
+	fl->served = served;
+}
+
+static t_flow_t *
+t_flow(djbf_t *f, uint64_t key, t_flow_t *fl);
+static t_flow_t *
+t_flow(djbf_t *f, uint64_t key, t_flow_t *fl) {
+	memzero(fl, sizeof *fl);
+	fl->key = key;
+	djbf_list(f, t_list_cb, fl);
+
+	return (fl);
+}
+
+/* Flow 1 gets t_req[0..], flow 2 t_req[TF_REQS / 2..] */
+static uint64_t
+t_key(djb_req_t *r);
+static uint64_t
+t_key(djb_req_t *r) {
+	return (r < &t_req[TF_REQS / 2] ? 1 : 2);
+}
+
+int
+main(void) {
+	djbf_t		f;
+	djb_req_t	*r;
+	uint64_t	bytes[3] = { 0, 0, 0 }, last = 0;
+	unsigned int	i, alternate = 0;
+	t_flow_t	fl, now;
+
+	TEST_CHECK(djbf_init(&f, 100, 8));
+	TEST_CHECK(djbf_pop(&f) == NULL);
+
+	/* One flow: first in, first out */
+	for (i = 0; i < 3; i++) {
+		TEST_CHECK(djbf_push(&f, &t_req[i], 1, 10, false));
+	}
+	TEST_CHECK(djbf_depth(&f) == 3);
+	for (i = 0; i < 3; i++) {
+		TEST_CHECK(djbf_pop(&f) == &t_req[i]);
+	}
+	TEST_CHECK(djbf_pop(&f) == NULL);
+	TEST_CHECK(djbf_depth(&f) == 0);
+
+	/* Bounded, but what is put back always fits */
+	for (i = 0; i < 8; i++) {
+		TEST_CHECK(djbf_push(&f, &t_req[i], 1, 10, false));
+	}
+	TEST_CHECK(!djbf_push(&f, &t_req[8], 1, 10, false));
+
+	/* Put back: first again, and not charged twice */
+	t_flow(&f, 1, &fl);
+	r = djbf_pop(&f);
+	TEST_CHECK(r == &t_req[0]);
+	TEST_CHECK(djbf_push(&f, r, 1, 10, true));
+	TEST_CHECK(djbf_depth(&f) == 8);
+	TEST_CHECK(t_flow(&f, 1, &now)->bytes == fl.bytes);
+	TEST_CHECK(t_flow(&f, 1, &now)->served == fl.served);
+	TEST_CHECK(djbf_pop(&f) == &t_req[0]);
+
+	while (djbf_pop(&f) != NULL) {
+		/* Drain */
+	}
+
+	/* Two flows of equal requests take turns */
+	for (i = 0; i < 8; i++) {
+		TEST_CHECK(djbf_push(&f, &t_req[i], 1, 100, false));
+	}
+	f.max = 0;
+	for (i = 0; i < 8; i++) {
+		TEST_CHECK(djbf_push(&f, &t_req[(TF_REQS / 2) + i], 2, 100,
+				     false));
+	}
+	while ((r = djbf_pop(&f)) != NULL) {
+		if (last != 0 && t_key(r) != last) {
+			alternate++;
+		}
+		last = t_key(r);
+	}
+	TEST_CHECK(alternate == 15);
+
+	/*
+	 * Requests twice as large: half as many, the same bytes. The
+	 * shares are compared while both flows still have requests.
+	 */
+	for (i = 0; i < TF_REQS / 2; i++) {
+		TEST_CHECK(djbf_push(&f, &t_req[i], 1, 200, false));
+		TEST_CHECK(djbf_push(&f, &t_req[(TF_REQS / 2) + i], 2, 100,
+				     false));
+	}
+	for (i = 0; i < TF_REQS / 2; i++) {
+		r = djbf_pop(&f);
+		bytes[t_key(r)] += t_key(r) == 1 ? 200 : 100;
+	}
+	TEST_CHECK(bytes[1] + 200 >= bytes[2] && bytes[2] + 200 >= bytes[1]);
+
+	/* Forgotten with requests queued: released once drained */
+	djbf_forget(&f, 1);
+	TEST_CHECK(t_flow(&f, 1, &now)->found);
+	while (djbf_pop(&f) != NULL) {
+		/* Drain */
+	}
+	TEST_CHECK(!t_flow(&f, 1, &now)->found);
+	TEST_CHECK(f.nflows == 1);
+
+	/* Forgotten when empty: released right away */
+	djbf_forget(&f, 2);
+	TEST_CHECK(!t_flow(&f, 2, &now)->found);
+	TEST_CHECK(f.nflows == 0);
+	TEST_CHECK(djbf_depth(&f) == 0);
+
+	djbf_exit(&f);
+
+	return (TEST_DONE("fair"));
+}
@@ -0,0 +1,113 @@
+#include "../server/hist.c"
+#include "test.h"
+
+#include <pthread.h>
+
+/* Tests of the latency histograms (hist.c) */
+
+#define TH_THREADS	4
+#define TH_RECORDS	100000		/* Per thread */
+
+static void *
+t_recorder(void *arg);
+static void *
+t_recorder(void *arg) {
+	djbh_t		*h = (djbh_t *)arg;
+	uint64_t	v;
+
+	for (v = 0; v < TH_RECORDS; v++) {
+		djbh_record(h, v);
+	}
+
+	return (NULL);
+}
+
+int
+main(void) {
+	pthread_t	thr[TH_THREADS];
+	djbh_summary_t	s;
+	djbh_t		*h;
+	uint64_t	v, hi;
+	unsigned int	i, prev = 0;
+	bool		exact = true, mono = true, near = true;
+
+	/* Exact below 2 * DJBH_SUB */
+	for (v = 0; v < 2 * DJBH_SUB; v++) {
+		if (djbh_index(v) != v || djbh_value(djbh_index(v)) != v) {
+			exact = false;
+		}
+	}
+	TEST_CHECK(exact);
+
+	/* Above: ordered, and within 1/DJBH_SUB of the value */
+	for (v = 2 * DJBH_SUB; v < ((uint64_t)1 << 24); v += (v >> 7) + 1) {
+		i = djbh_index(v);
+		hi = djbh_value(i);
+
+		if (i < prev) {
+			mono = false;
+		}
+		prev = i;
+
+		if (hi < v || hi - v > v / DJBH_SUB) {
+			near = false;
+		}
+	}
+	TEST_CHECK(mono);
+	TEST_CHECK(near);
+
+	/* Clamped into the last bucket */
+	TEST_CHECK(djbh_index(UINT64_MAX) < DJBH_BUCKETS);
+	TEST_CHECK(djbh_index(UINT64_MAX) ==
+		   djbh_index(((uint64_t)1 << DJBH_MAX_BITS) - 1));
+
+	h = djbh_create();
+	TEST_CHECK(h != NULL);
+
+	/* Nothing yet */
+	djbh_summary(h, DJBH_NOW, &s);
+	TEST_CHECK(s.count == 0 && s.p50 == 0 && s.max == 0);
+
+	/* Percentiles within a bucket of the truth */
+	for (v = 1; v <= 1000; v++) {
+		djbh_record(h, v);
+	}
+	djbh_summary(h, DJBH_NOW, &s);
+	TEST_CHECK(s.count == 1000);
+	TEST_CHECK(s.p50 >= 500 && s.p50 <= 500 + (500 / DJBH_SUB));
+	TEST_CHECK(s.p90 >= 900 && s.p90 <= 900 + (900 / DJBH_SUB));
+	TEST_CHECK(s.p99 >= 990 && s.p99 <= 990 + (990 / DJBH_SUB));
+	TEST_CHECK(s.p999 >= 999 && s.max >= 1000);
+	TEST_CHECK(s.max <= 1000 + (1000 / DJBH_SUB));
+	TEST_CHECK(s.p50 <= s.p90 && s.p90 <= s.p99 && s.p99 <= s.p999);
+
+	/* Rotating closes the interval, everything is kept */
+	djbh_rotate(h);
+	djbh_summary(h, DJBH_NOW, &s);
+	TEST_CHECK(s.count == 0);
+	djbh_summary(h, DJBH_LAST, &s);
+	TEST_CHECK(s.count == 1000);
+	djbh_summary(h, DJBH_ALL, &s);
+	TEST_CHECK(s.count == 1000);
+
+	djbh_record(h, 7);
+	djbh_rotate(h);
+	djbh_summary(h, DJBH_LAST, &s);
+	TEST_CHECK(s.count == 1 && s.max == 7);
+	djbh_summary(h, DJBH_ALL, &s);
+	TEST_CHECK(s.count == 1001);
+
+	/* Nothing lost when recorded concurrently */
+	for (i = 0; i < TH_THREADS; i++) {
+		TEST_CHECK(pthread_create(&thr[i], NULL, t_recorder, h) == 0);
+	}
+	for (i = 0; i < TH_THREADS; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	djbh_summary(h, DJBH_NOW, &s);
+	TEST_CHECK(s.count == TH_THREADS * TH_RECORDS);
+
+	djbh_free(h);
+
+	return (TEST_DONE("hist"));
+}
@@ -0,0 +1,224 @@
+#include "../server/queue.c"
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/* Tests of the lock-free MPMC queue (queue.c) */
+
+#define TQ_SLOTS	8
+#define TQ_THREADS	4		/* Producers, and as many consumers */
+#define TQ_ITEMS	10000		/* Per producer */
+#define TQ_TOTAL	(TQ_THREADS * TQ_ITEMS)
+
+static httpsrv_client_t	t_hcl[TQ_SLOTS];
+static djb_req_t	t_req[TQ_TOTAL];
+static djbq_t		t_q;
+
+/* What the consumers saw, and how often */
+static unsigned int	t_seen[TQ_TOTAL];
+static unsigned int	t_taken = 0;
+static bool		t_order = true;
+
+static bool		t_named = true;
+
+static void
+t_list_cb(void *cbdata, uint64_t id, uint64_t reqid, const char *host,
+	  const char *request);
+static void
+t_list_cb(void *cbdata, uint64_t id, uint64_t reqid, const char *host,
+	  const char *request) {
+	uint64_t	*sum = (uint64_t *)cbdata;
+	char		want[32];
+
+	*sum += (id * 1000) + reqid;
+
+	/* The copies, the long request line cut short */
+	snprintf(want, sizeof want, "host%" PRIu64, id);
+	if (strcmp(host, want) != 0 ||
+	    strlen(request) != DJBQ_REQUEST_LEN - 1 ||
+	    request[0] != 'G' || request[DJBQ_REQUEST_LEN - 2] != 'x') {
+		t_named = false;
+	}
+}
+
+static bool
+t_pred_no(djb_req_t *r);
+static bool
+t_pred_no(djb_req_t UNUSED *r) {
+	return (false);
+}
+
+static bool
+t_pred_yes(djb_req_t *r);
+static bool
+t_pred_yes(djb_req_t UNUSED *r) {
+	return (true);
+}
+
+static void
+t_single(void);
+static void
+t_single(void) {
+	djbq_t		q;
+	uint64_t	sum = 0;
+	unsigned int	i, round;
+
+	/* Rounded up to a power of two */
+	TEST_CHECK(djbq_init(&q, TQ_SLOTS - 3));
+	TEST_CHECK(q.mask == TQ_SLOTS - 1);
+
+	for (i = 0; i < TQ_SLOTS; i++) {
+		t_hcl[i].id = i + 1;
+		t_hcl[i].reqid = i;
+		t_req[i].hcl = &t_hcl[i];
+		snprintf(t_hcl[i].headers.hostname,
+			 sizeof t_hcl[i].headers.hostname, "host%u", i + 1);
+		memset(t_hcl[i].the_request, 'x',
+		       sizeof t_hcl[i].the_request - 1);
+		t_hcl[i].the_request[0] = 'G';
+	}
+
+	/* Empty */
+	TEST_CHECK(djbq_trypop(&q) == NULL);
+	TEST_CHECK(djbq_depth(&q) == 0);
+
+	/* Fills up, then refuses */
+	for (i = 0; i < TQ_SLOTS; i++) {
+		TEST_CHECK(djbq_push(&q, &t_req[i]));
+	}
+	TEST_CHECK(!djbq_push(&q, &t_req[0]));
+	TEST_CHECK(djbq_depth(&q) == TQ_SLOTS);
+
+	/* Lists all, from the copies in the slots */
+	TEST_CHECK(djbq_list(&q, t_list_cb, &sum) == TQ_SLOTS);
+	TEST_CHECK(sum == (1000 * (TQ_SLOTS * (TQ_SLOTS + 1) / 2)) +
+			  (TQ_SLOTS * (TQ_SLOTS - 1) / 2));
+	TEST_CHECK(t_named);
+
+	/* First in, first out */
+	for (i = 0; i < TQ_SLOTS; i++) {
+		TEST_CHECK(djbq_trypop(&q) == &t_req[i]);
+	}
+	TEST_CHECK(djbq_trypop(&q) == NULL);
+	TEST_CHECK(djbq_depth(&q) == 0);
+
+	/* Stays in order while the positions wrap around the ring */
+	for (round = 0; round < 100; round++) {
+		for (i = 0; i < 3; i++) {
+			TEST_CHECK(djbq_push(&q, &t_req[(round + i) % TQ_SLOTS]));
+		}
+		for (i = 0; i < 3; i++) {
+			TEST_CHECK(djbq_trypop(&q) ==
+				   &t_req[(round + i) % TQ_SLOTS]);
+		}
+	}
+
+	/* The head only goes when the predicate agrees */
+	TEST_CHECK(djbq_push(&q, &t_req[1]));
+	TEST_CHECK(djbq_push(&q, &t_req[2]));
+	TEST_CHECK(djbq_trypop_if(&q, t_pred_no) == NULL);
+	TEST_CHECK(djbq_depth(&q) == 2);
+	TEST_CHECK(djbq_trypop_if(&q, t_pred_yes) == &t_req[1]);
+	TEST_CHECK(djbq_trypop(&q) == &t_req[2]);
+	TEST_CHECK(djbq_trypop_if(&q, t_pred_yes) == NULL);
+
+	djbq_exit(&q);
+}
+
+static void *
+t_producer(void *arg);
+static void *
+t_producer(void *arg) {
+	unsigned int i, p = (unsigned int)(uintptr_t)arg;
+
+	for (i = 0; i < TQ_ITEMS; i++) {
+		/* Full: let the consumers catch up */
+		while (!djbq_push(&t_q, &t_req[(p * TQ_ITEMS) + i])) {
+			sched_yield();
+		}
+	}
+
+	return (NULL);
+}
+
+static void *
+t_consumer(void *arg);
+static void *
+t_consumer(void UNUSED *arg) {
+	unsigned int	last[TQ_THREADS], n, p, i;
+	djb_req_t	*r;
+
+	for (p = 0; p < TQ_THREADS; p++) {
+		last[p] = 0;
+	}
+
+	while (__atomic_load_n(&t_taken, __ATOMIC_ACQUIRE) < TQ_TOTAL) {
+		r = djbq_trypop(&t_q);
+		if (r == NULL) {
+			sched_yield();
+			continue;
+		}
+
+		n = (unsigned int)(r - t_req);
+		__atomic_add_fetch(&t_seen[n], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&t_taken, 1, __ATOMIC_RELEASE);
+
+		/* What one producer pushed comes out in its order */
+		p = n / TQ_ITEMS;
+		i = (n % TQ_ITEMS) + 1;
+		if (i <= last[p]) {
+			__atomic_store_n(&t_order, false, __ATOMIC_RELAXED);
+		}
+		last[p] = i;
+	}
+
+	return (NULL);
+}
+
+static void
+t_threads(void);
+static void
+t_threads(void) {
+	pthread_t	prod[TQ_THREADS], cons[TQ_THREADS];
+	unsigned int	i, once = 0;
+
+	TEST_CHECK(djbq_init(&t_q, TQ_SLOTS));
+
+	for (i = 0; i < TQ_TOTAL; i++) {
+		t_req[i].hcl = &t_hcl[0];
+	}
+
+	for (i = 0; i < TQ_THREADS; i++) {
+		TEST_CHECK(pthread_create(&cons[i], NULL, t_consumer,
+					  NULL) == 0);
+		TEST_CHECK(pthread_create(&prod[i], NULL, t_producer,
+					  (void *)(uintptr_t)i) == 0);
+	}
+
+	for (i = 0; i < TQ_THREADS; i++) {
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], NULL);
+	}
+
+	/* Every request exactly once */
+	for (i = 0; i < TQ_TOTAL; i++) {
+		if (t_seen[i] == 1) {
+			once++;
+		}
+	}
+
+	TEST_CHECK(once == TQ_TOTAL);
+	TEST_CHECK(t_order);
+	TEST_CHECK(djbq_depth(&t_q) == 0);
+
+	djbq_exit(&t_q);
+}
+
+int
+main(void) {
+	t_single();
+	t_threads();
+
+	return (TEST_DONE("queue"));
+}
@@ -0,0 +1,157 @@
+#include "../server/slab.c"
+#include "test.h"
+
+#include <pthread.h>
+
+/* Tests of the slab pools (slab.c) */
+
+#define TS_OBJS		200
+#define TS_THREADS	4
+
+static djbs_pool_t	*t_pool;
+static void		*t_obj[TS_OBJS];
+
+/* Objects on the shared free list of the pool */
+static unsigned int
+t_pool_free(djbs_pool_t *p);
+static unsigned int
+t_pool_free(djbs_pool_t *p) {
+	djbs_obj_t	*o;
+	unsigned int	n = 0;
+
+	mutex_lock(p->mutex);
+	for (o = p->free; o != NULL; o = o->next) {
+		n++;
+	}
+	mutex_unlock(p->mutex);
+
+	return (n);
+}
+
+/* Every object is in use, in our cache or in the pool */
+static bool
+t_accounted(djbs_pool_t *p);
+static bool
+t_accounted(djbs_pool_t *p) {
+	unsigned int	inuse, total;
+	size_t		size;
+
+	djbs_stats(p, &inuse, &total, &size);
+
+	return (total == inuse + t_pool_free(p) +
+			 l_cache[p - l_pools].count);
+}
+
+/* Allocates, frees what another thread allocated, then ends */
+static void *
+t_worker(void *arg);
+static void *
+t_worker(void *arg) {
+	unsigned int	i, w = (unsigned int)(uintptr_t)arg;
+	void		*mine[TS_OBJS / TS_THREADS];
+
+	for (i = 0; i < lengthof(mine); i++) {
+		mine[i] = djbs_alloc(t_pool);
+	}
+
+	for (i = 0; i < lengthof(mine); i++) {
+		djbs_free(t_pool, mine[i]);
+	}
+
+	/* The ones main() handed us */
+	for (i = w; i < TS_OBJS; i += TS_THREADS) {
+		djbs_free(t_pool, t_obj[i]);
+	}
+
+	djbs_thread_exit();
+
+	return (NULL);
+}
+
+int
+main(void) {
+	pthread_t	thr[TS_THREADS];
+	djbs_pool_t	*small;
+	unsigned int	inuse, total, i, j;
+	size_t		size;
+	bool		distinct = true, zeroed = true;
+	char		*c;
+
+	/* Sizes are aligned, and at least hold the free list link */
+	t_pool = djbs_create("test_obj", 20);
+	small = djbs_create("test_small", 1);
+	TEST_CHECK(t_pool != NULL && small != NULL);
+
+	djbs_stats(t_pool, &inuse, &total, &size);
+	TEST_CHECK(size == 32);
+	djbs_stats(small, &inuse, &total, &size);
+	TEST_CHECK(size == 16);
+
+	/* Distinct objects, grown a slab at a time */
+	for (i = 0; i < TS_OBJS; i++) {
+		t_obj[i] = djbs_alloc(t_pool);
+		TEST_CHECK(t_obj[i] != NULL);
+		memset(t_obj[i], 0xa5, 20);
+	}
+
+	for (i = 0; i < TS_OBJS && distinct; i++) {
+		for (j = i + 1; j < TS_OBJS; j++) {
+			if (t_obj[i] == t_obj[j]) {
+				distinct = false;
+				break;
+			}
+		}
+	}
+	TEST_CHECK(distinct);
+
+	djbs_stats(t_pool, &inuse, &total, &size);
+	TEST_CHECK(inuse == TS_OBJS);
+	TEST_CHECK(total >= TS_OBJS && total % DJBS_SLAB_OBJS == 0);
+	TEST_CHECK(t_accounted(t_pool));
+
+	/* Freed and taken again: handed out cleared */
+	for (i = 0; i < 10; i++) {
+		djbs_free(t_pool, t_obj[i]);
+	}
+	for (i = 0; i < 10; i++) {
+		t_obj[i] = djbs_alloc(t_pool);
+		for (c = t_obj[i]; c < (char *)t_obj[i] + 32; c++) {
+			if (*c != 0) {
+				zeroed = false;
+			}
+		}
+	}
+	TEST_CHECK(zeroed);
+
+	/* Our cache never holds more than its limit */
+	for (i = 0; i < TS_OBJS; i++) {
+		djbs_free(t_pool, t_obj[i]);
+	}
+	TEST_CHECK(l_cache[t_pool - l_pools].count <= DJBS_CACHE_MAX);
+	TEST_CHECK(t_accounted(t_pool));
+
+	/* Threads that end give back what they cached */
+	for (i = 0; i < TS_OBJS; i++) {
+		t_obj[i] = djbs_alloc(t_pool);
+	}
+
+	for (i = 0; i < TS_THREADS; i++) {
+		TEST_CHECK(pthread_create(&thr[i], NULL, t_worker,
+					  (void *)(uintptr_t)i) == 0);
+	}
+	for (i = 0; i < TS_THREADS; i++) {
+		pthread_join(thr[i], NULL);
+	}
+
+	djbs_stats(t_pool, &inuse, &total, &size);
+	TEST_CHECK(inuse == 0);
+	TEST_CHECK(t_accounted(t_pool));
+
+	djbs_thread_exit();
+	TEST_CHECK(t_pool_free(t_pool) == total);
+
+	djbs_exit();
+	TEST_CHECK(l_npools == 0);
+
+	return (TEST_DONE("slab"));
+}
@@ -0,0 +1,134 @@
+#include "../server/timer.c"
+#include "test.h"
+
+/*
+ * Tests of the timer wheel (timer.c)
+ *
+ * The wheel is driven by hand, tick by tick, instead of by djbt_thread,
+ * thus every deadline can be checked to the tick.
+ */
+
+typedef struct {
+	djbt_timer_t	timer;
+	unsigned int	fired;
+	uint64_t	at;		/* Tick it fired at */
+	unsigned int	again;		/* Re-arm this many ms, 0 = not */
+	bool		cancel;		/* Cancel itself when firing */
+} t_timer_t;
+
+static void
+t_fire(void *data);
+static void
+t_fire(void *data) {
+	t_timer_t *t = (t_timer_t *)data;
+
+	t->fired++;
+	t->at = l_wheel.now;
+
+	if (t->again > 0) {
+		djbt_arm(&t->timer, t->again, t_fire, t);
+	}
+
+	/* Must not wait for itself */
+	if (t->cancel) {
+		TEST_CHECK(!djbt_cancel(&t->timer));
+	}
+}
+
+static void
+t_advance(uint64_t ticks);
+static void
+t_advance(uint64_t ticks) {
+	mutex_lock(l_wheel.mutex);
+	while (ticks-- > 0) {
+		djbt_tick();
+	}
+	mutex_unlock(l_wheel.mutex);
+}
+
+/* Arm at 'ticks' from now, check that it fires at exactly that tick */
+static void
+t_deadline(uint64_t ticks);
+static void
+t_deadline(uint64_t ticks) {
+	t_timer_t	t;
+	uint64_t	want;
+
+	memzero(&t, sizeof t);
+
+	/* djbt_arm() adds one: never the slot being run */
+	want = l_wheel.now + ticks;
+	djbt_arm(&t.timer, (unsigned int)((ticks - 1) * DJBT_TICK_MS),
+		 t_fire, &t);
+
+	t_advance(ticks - 1);
+	TEST_CHECK(t.fired == 0);
+
+	t_advance(1);
+	TEST_CHECK(t.fired == 1);
+	TEST_CHECK(t.at == want);
+	TEST_CHECK(djbt_armed() == 0);
+}
+
+int
+main(void) {
+	t_timer_t	a, b;
+	unsigned int	i;
+
+	TEST_CHECK(djbt_init());
+
+	/* Level 0, and each level it has to cascade down from */
+	t_deadline(1);
+	t_deadline(3);
+	t_deadline(DJBT_SLOTS - 1);
+	t_deadline(DJBT_SLOTS);
+	t_deadline(DJBT_SLOTS + 5);
+	t_deadline(((uint64_t)1 << (DJBT_BITS * 2)) + 77);
+	t_deadline(((uint64_t)1 << (DJBT_BITS * 3)) + 4321);
+
+	/* Same again, now from a position that is not aligned */
+	t_advance(13);
+	t_deadline(DJBT_SLOTS + 5);
+	t_deadline(((uint64_t)1 << (DJBT_BITS * 2)) + 1);
+
+	/* Cancelled: never fires */
+	memzero(&a, sizeof a);
+	djbt_arm(&a.timer, 5 * DJBT_TICK_MS, t_fire, &a);
+	TEST_CHECK(djbt_armed() == 1);
+	TEST_CHECK(djbt_cancel(&a.timer));
+	TEST_CHECK(!djbt_cancel(&a.timer));
+	TEST_CHECK(djbt_armed() == 0);
+	t_advance(10);
+	TEST_CHECK(a.fired == 0);
+
+	/* Armed again: only the last deadline counts */
+	memzero(&a, sizeof a);
+	djbt_arm(&a.timer, 50 * DJBT_TICK_MS, t_fire, &a);
+	djbt_arm(&a.timer, 2 * DJBT_TICK_MS, t_fire, &a);
+	TEST_CHECK(djbt_armed() == 1);
+	t_advance(100);
+	TEST_CHECK(a.fired == 1);
+
+	/* A callback can arm its own timer again */
+	memzero(&a, sizeof a);
+	a.again = 4 * DJBT_TICK_MS;
+	djbt_arm(&a.timer, 4 * DJBT_TICK_MS, t_fire, &a);
+	for (i = 1; i <= 10; i++) {
+		t_advance(5);
+		TEST_CHECK(a.fired == i);
+	}
+	TEST_CHECK(djbt_cancel(&a.timer));
+
+	/* ... and cancel itself without waiting for itself */
+	memzero(&b, sizeof b);
+	b.cancel = true;
+	djbt_arm(&b.timer, 0, t_fire, &b);
+	t_advance(1);
+	TEST_CHECK(b.fired == 1);
+
+	TEST_CHECK(djbt_armed() == 0);
+
+	djbt_exit();
+
+	return (TEST_DONE("timer"));
+}